@@ -236,6 +236,8 @@ do { \
 long long util_get_bytes(const char *str);
 void util_print_bytes(long long bytes, int bracket);
 int util_srand(void);
+int util_write_sparse(int fd, const void *buf, size_t len);
+int util_fill_holes(int fd, off_t offs, void *buf, size_t len);
 char *mtd_find_dev_node(const char *id);
 
 /*
@@ -10,6 +10,14 @@
 /* Return a 32-bit CRC of the contents of the buffer */
 extern uint32_t mtd_crc32(uint32_t val, const void *ss, int len);
 
+/*
+ * The portable implementations 'mtd_crc32()' may use, and the name of the one
+ * it actually uses. These are only interesting for testing and benchmarking.
+ */
+extern uint32_t mtd_crc32_bytewise(uint32_t val, const void *ss, int len);
+extern uint32_t mtd_crc32_slice8(uint32_t val, const void *ss, int len);
+extern const char *mtd_crc32_impl(void);
+
 static inline uint32_t crc32(uint32_t val, const void *ss, int len)
 {
 	return mtd_crc32(val, ss, len);
@@ -33,5 +33,13 @@ void fec_encode_linear(struct fec_parms *code, unsigned char *src,
 int fec_decode(struct fec_parms *code, unsigned char *data[],
 	       int i[], int sz);
 
+/* Name of the multiply-accumulate kernel used for encoding and decoding,
+ * e.g. "avx2", "neon" or "scalar" */
+const char *fec_kernel(void);
+
+/* Use the portable kernel even if a SIMD one is available (for testing
+ * and benchmarking) */
+void fec_force_scalar(int force);
+
 #endif /* LIBFEC_H */
 
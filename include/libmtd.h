@@ -71,6 +71,8 @@ struct mtd_info
  * @region_cnt: count of additional erase regions
  * @writable: zero if the device is read-only
  * @bb_allowed: non-zero if the MTD device may have bad eraseblocks
+ * @emulated: non-zero if the MTD device is emulated on a regular file, see
+ *            'mtd_get_dev_info()'
  */
 struct mtd_dev_info
 {
@@ -90,6 +92,7 @@ struct mtd_dev_info
 	int region_cnt;
 	unsigned int writable:1;
 	unsigned int bb_allowed:1;
+	unsigned int emulated:1;
 };
 
 /**
@@ -137,9 +140,27 @@ int mtd_get_info(libmtd_t desc, struct mtd_info *info);
  * node file and saves this information in the @mtd object. Returns %0 in case
  * of success and %-1 in case of failure. If MTD subsystem is not present in the
  * system, or the MTD device does not exist, errno is set to @ENODEV.
+ *
+ * If @node is a "file:<path>" string, or if the "MTD_EMU" environment variable
+ * is set and @node is a regular file, the MTD device is emulated on top of that
+ * file, with the geometry given by "MTD_EMU" (see lib/libmtd_emu.c). Use
+ * 'mtd_open_node()' to open such nodes. When "MTD_EMU" is set,
+ * 'libmtd_open()' also succeeds if the MTD subsystem is not present.
  */
 int mtd_get_dev_info(libmtd_t desc, const char *node, struct mtd_dev_info *mtd);
 
+/**
+ * mtd_open_node - open an MTD device node.
+ * @node: path of the MTD device node
+ * @flags: flags to pass to 'open()'
+ *
+ * This function is identical to 'open()' except that it also accepts the
+ * emulated MTD device nodes 'mtd_get_dev_info()' accepts, and creates their
+ * file the same way if the "size" emulator option is set. Returns the file
+ * descriptor in case of success and %-1 in case of failure.
+ */
+int mtd_open_node(const char *node, int flags);
+
 /**
  * mtd_get_dev_info1 - get information about an MTD device.
  * @desc: MTD library descriptor
@@ -162,6 +183,50 @@ int mtd_get_dev_info1(libmtd_t desc, int mtd_num, struct mtd_dev_info *mtd);
  */
 int mtd_get_dev_info2(libmtd_t desc, const char *name, struct mtd_dev_info *mtd);
 
+/**
+ * struct mtd_snapshot - information about all MTD devices.
+ * @info: general MTD information
+ * @devs: information about the @info.mtd_dev_cnt MTD devices, ordered by
+ *        device number
+ */
+struct mtd_snapshot
+{
+	struct mtd_info info;
+	struct mtd_dev_info *devs;
+};
+
+/**
+ * mtd_get_snapshot - get information about all MTD devices.
+ * @desc: MTD library descriptor
+ *
+ * This function reads the sysfs attributes of all MTD devices in one pass and
+ * caches the result in the library descriptor, so that further calls return
+ * the cached snapshot without accessing sysfs. Use 'mtd_refresh_snapshot()' or
+ * 'mtd_invalidate_snapshot()' when MTD devices may have been added or
+ * removed. Returns a pointer to the snapshot, which stays valid until it is
+ * invalidated or the library is closed, in case of success and %NULL in case
+ * of failure.
+ */
+const struct mtd_snapshot *mtd_get_snapshot(libmtd_t desc);
+
+/**
+ * mtd_refresh_snapshot - re-read information about all MTD devices.
+ * @desc: MTD library descriptor
+ *
+ * This function is identical to 'mtd_get_snapshot()' except that it drops the
+ * cached snapshot first.
+ */
+const struct mtd_snapshot *mtd_refresh_snapshot(libmtd_t desc);
+
+/**
+ * mtd_invalidate_snapshot - drop the cached MTD snapshot.
+ * @desc: MTD library descriptor
+ *
+ * The snapshot is freed and the next 'mtd_get_snapshot()' call reads sysfs
+ * again.
+ */
+void mtd_invalidate_snapshot(libmtd_t desc);
+
 /**
  * mtd_lock - lock eraseblocks.
  * @desc: MTD library descriptor
@@ -298,7 +363,8 @@ int mtd_mark_bad(const struct mtd_dev_info *mtd, int fd, int eb);
  *
  * This function reads @len bytes of data from eraseblock @eb and offset @offs
  * of the MTD device defined by @mtd and stores the read data at buffer @buf.
- * Returns %0 in case of success and %-1 in case of failure.
+ * The file offset of @fd is neither used nor changed, so @fd may be shared by
+ * several threads. Returns %0 in case of success and %-1 in case of failure.
  */
 int mtd_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
 	     void *buf, int len);
@@ -317,8 +383,9 @@ int mtd_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
  * @mode: write mode (e.g., %MTD_OOB_PLACE, %MTD_OOB_RAW)
  *
  * This function writes @len bytes of data to eraseblock @eb and offset @offs
- * of the MTD device defined by @mtd. Returns %0 in case of success and %-1 in
- * case of failure.
+ * of the MTD device defined by @mtd. Like 'mtd_read()', data is written
+ * without using the file offset of @fd. Returns %0 in case of success and %-1
+ * in case of failure.
  *
  * Can only write to a single page at a time if writing to OOB.
  */
@@ -326,6 +393,59 @@ int mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb,
 	      int offs, void *data, int len, void *oob, int ooblen,
 	      uint8_t mode);
 
+/**
+ * struct mtd_io_req - an I/O request for 'mtd_read_batch()' and
+ *                     'mtd_write_batch()'.
+ * @eb: eraseblock to read from or write to
+ * @offs: offset within the eraseblock
+ * @buf: data buffer
+ * @len: how many bytes to read or write
+ * @err: set to %0 if the request succeeded, or to the errno value it failed
+ *       with otherwise
+ */
+struct mtd_io_req {
+	int eb;
+	int offs;
+	void *buf;
+	int len;
+	int err;
+};
+
+/**
+ * mtd_read_batch - execute a batch of read requests.
+ * @mtd: MTD device description object
+ * @fd: MTD device node file descriptor
+ * @reqs: the requests
+ * @cnt: count of requests
+ * @jobs: how many requests may be in flight at the same time
+ *
+ * This function executes the read requests @reqs like 'mtd_read()' does,
+ * using up to @jobs threads, so that MTD drivers and controllers which can
+ * handle several requests at once are kept busy. The requests are started in
+ * order, but may complete in any order. All requests are executed even if
+ * some of them fail. Returns %0 if all requests succeeded and %-1 otherwise,
+ * in which case the @err fields of @reqs tell which requests failed.
+ */
+int mtd_read_batch(const struct mtd_dev_info *mtd, int fd,
+		   struct mtd_io_req *reqs, int cnt, int jobs);
+
+/**
+ * mtd_write_batch - execute a batch of write requests.
+ * @desc: MTD library descriptor
+ * @mtd: MTD device description object
+ * @fd: MTD device node file descriptor
+ * @reqs: the requests
+ * @cnt: count of requests
+ * @jobs: how many requests may be in flight at the same time
+ *
+ * Same as 'mtd_read_batch()', but the requests are written like 'mtd_write()'
+ * does without OOB data. Note, NAND pages of an eraseblock have to be written
+ * in order, so requests for the same eraseblock should not be spread over
+ * several threads; use one request per eraseblock instead.
+ */
+int mtd_write_batch(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+		    struct mtd_io_req *reqs, int cnt, int jobs);
+
 /**
  * mtd_read_oob - read out-of-band area.
  * @desc: MTD library descriptor
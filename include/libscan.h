@@ -72,6 +72,8 @@ enum
  * @vid_hdr_offs: volume ID header offset from the found EC headers (%-1 means
  *                undefined)
  * @data_offs: data offset from the found EC headers (%-1 means undefined)
+ * @image_seq: image sequence number from the first found EC header (only
+ *             valid if @vid_hdr_offs is defined)
  */
 struct ubi_scan_info
 {
@@ -85,6 +87,7 @@ struct ubi_scan_info
 	int good_cnt;
 	int vid_hdr_offs;
 	int data_offs;
+	uint32_t image_seq;
 };
 
 struct mtd_dev_info;
@@ -100,6 +103,55 @@ struct mtd_dev_info;
 int ubi_scan(struct mtd_dev_info *mtd, int fd, struct ubi_scan_info **info,
 	     int verbose);
 
+/**
+ * ubi_scan_fast - scan an MTD device using several threads.
+ * @mtd: information about the MTD device to scan
+ * @fd: MTD device node file descriptor
+ * @info: the result of the scanning is returned here
+ * @verbose: verbose mode, same as for 'ubi_scan()'
+ * @jobs: how many threads to use
+ *
+ * Same as 'ubi_scan()', but the bad eraseblock checks and the EC header reads
+ * are spread over @jobs threads using positional reads, and the results are
+ * accounted afterwards. The result is the same as with 'ubi_scan()', which is
+ * used if @jobs is not greater than %1.
+ */
+int ubi_scan_fast(struct mtd_dev_info *mtd, int fd,
+		  struct ubi_scan_info **info, int verbose, int jobs);
+
+/**
+ * ubi_scan_cache_load - load scanning information from a cache file.
+ * @mtd: information about the MTD device
+ * @fd: MTD device node file descriptor
+ * @path: the cache file
+ * @info: the scanning information is returned here
+ *
+ * This function loads the scanning information saved by
+ * 'ubi_scan_cache_save()'. The cache is only used if it was saved for an MTD
+ * device with the same name and geometry, is not corrupted and still matches
+ * the device: all eraseblocks are checked for being bad, and the EC headers of
+ * a sample of the eraseblocks are read and compared to the cache. The check
+ * cannot catch every change of the device, so the cache should only be used if
+ * nothing but the tool which saved it writes to the device. Returns %1 if the
+ * cache was loaded, %0 if it does not exist or cannot be used, and %-1 in case
+ * of failure.
+ */
+int ubi_scan_cache_load(const struct mtd_dev_info *mtd, int fd,
+			const char *path, struct ubi_scan_info **info);
+
+/**
+ * ubi_scan_cache_save - save scanning information to a cache file.
+ * @mtd: information about the MTD device
+ * @path: the cache file
+ * @si: the scanning information to save
+ *
+ * Saves the erase counters (including the bad eraseblocks), the UBI headers
+ * offsets and the image sequence number of @si. Returns zero in case of
+ * success and %-1 in case of failure.
+ */
+int ubi_scan_cache_save(const struct mtd_dev_info *mtd, const char *path,
+			const struct ubi_scan_info *si);
+
 /**
  * ubi_scan_free - free scanning information.
  * @si: scanning information to free
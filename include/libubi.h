@@ -408,6 +408,53 @@ int ubi_get_vol_info1(libubi_t desc, int dev_num, int vol_id,
 int ubi_get_vol_info1_nm(libubi_t desc, int dev_num, const char *name,
 			 struct ubi_vol_info *info);
 
+/**
+ * struct ubi_snapshot - information about all UBI devices and volumes.
+ * @info: general UBI information
+ * @devs: information about the @info.dev_count UBI devices, ordered by device
+ *        number
+ * @vols: @vols[i] holds the @devs[i].vol_count volumes of UBI device @devs[i],
+ *        ordered by volume ID
+ */
+struct ubi_snapshot
+{
+	struct ubi_info info;
+	struct ubi_dev_info *devs;
+	struct ubi_vol_info **vols;
+};
+
+/**
+ * ubi_get_snapshot - get information about all UBI devices and volumes.
+ * @desc: UBI library descriptor
+ *
+ * This function reads the sysfs attributes of all UBI devices and volumes in
+ * one pass and caches the result in the library descriptor, so that further
+ * calls return the cached snapshot without accessing sysfs. Use
+ * 'ubi_refresh_snapshot()' or 'ubi_invalidate_snapshot()' when the UBI
+ * configuration may have changed. Returns a pointer to the snapshot, which
+ * stays valid until it is invalidated or the library is closed, in case of
+ * success and %NULL in case of failure.
+ */
+const struct ubi_snapshot *ubi_get_snapshot(libubi_t desc);
+
+/**
+ * ubi_refresh_snapshot - re-read information about all UBI devices and volumes.
+ * @desc: UBI library descriptor
+ *
+ * This function is identical to 'ubi_get_snapshot()' except that it drops the
+ * cached snapshot first.
+ */
+const struct ubi_snapshot *ubi_refresh_snapshot(libubi_t desc);
+
+/**
+ * ubi_invalidate_snapshot - drop the cached UBI snapshot.
+ * @desc: UBI library descriptor
+ *
+ * The snapshot is freed and the next 'ubi_get_snapshot()' call reads sysfs
+ * again.
+ */
+void ubi_invalidate_snapshot(libubi_t desc);
+
 /**
  * ubi_vol_block_create - create a block device on top of an UBI volume.
  * @fd: volume character device file descriptor
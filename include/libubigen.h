@@ -42,6 +42,8 @@ extern "C" {
  * @vtbl_size: volume table size
  * @max_volumes: maximum amount of volumes
  * @image_seq: UBI image sequence number
+ * @sparse: leave holes instead of erased (0xFF) blocks in the output file and
+ *          treat holes in input files as erased data
  */
 struct ubigen_info
 {
@@ -54,6 +56,7 @@ struct ubigen_info
 	int vtbl_size;
 	int max_volumes;
 	uint32_t image_seq;
+	int sparse;
 };
 
 /**
@@ -165,11 +168,34 @@ int ubigen_add_volume(const struct ubigen_info *ui,
  * This function reads the contents of the volume from the input file @in and
  * writes the UBI volume to the output file @out. Returns zero on success and
  * %-1 on failure.
+ *
+ * The input file is mapped and written with 'ubigen_write_volume_buf()' if
+ * possible, otherwise it is read a batch of LEBs at a time. If @ui->sparse is
+ * set, holes in @in are read as 0xFF bytes.
  */
 int ubigen_write_volume(const struct ubigen_info *ui,
 			const struct ubigen_vol_info *vi, long long ec,
 			long long bytes, int in, int out);
 
+/**
+ * ubigen_write_volume_buf - write UBI volume from a memory buffer.
+ * @ui: libubigen information
+ * @vi: volume information
+ * @ec: erase counter value to put to EC headers
+ * @buf: the contents of the volume
+ * @bytes: volume size in bytes
+ * @out: output file descriptor
+ *
+ * Same as 'ubigen_write_volume()', but the contents of the volume are taken
+ * from @buf. The data is not copied, each PEB is written as separate headers,
+ * data and padding parts with a large batch of PEBs per 'writev()' call.
+ * In sparse mode each PEB is assembled and written with 'util_write_sparse()'
+ * instead. Returns zero on success and %-1 on failure.
+ */
+int ubigen_write_volume_buf(const struct ubigen_info *ui,
+			    const struct ubigen_vol_info *vi, long long ec,
+			    const void *buf, long long bytes, int out);
+
 /**
  * ubigen_write_layout_vol - write UBI layout volume
  * @ui: libubigen information
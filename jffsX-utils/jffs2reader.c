@@ -74,6 +74,7 @@ BUGS:
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <dirent.h>
 #ifdef WITH_ZLIB
 #include <zlib.h>
@@ -108,11 +109,47 @@ struct dir {
 	char name[256];
 };
 
+/* a node of the image, lists of them are kept sorted by version */
+struct node_ref {
+	struct node_ref *next;
+	union jffs2_node_union *n;
+	uint32_t version;
+};
+
+struct node_list {
+	struct node_ref *head;
+	struct node_ref *tail;
+};
+
+/* everything the index knows about one inode number */
+struct inode_info {
+	struct inode_info *next;	/* hash chain */
+	uint32_t ino;
+	struct node_list nodes;		/* inode nodes of this inode */
+	struct node_list dirents;	/* dirent nodes of this directory */
+	struct jffs2_raw_dirent *dirent;	/* latest dirent pointing here */
+};
+
+/* latest dirent for a parent inode and name pair */
+struct name_info {
+	struct name_info *next;		/* hash chain */
+	struct jffs2_raw_dirent *d;
+};
+
+/* the filesystem image and the index built by scanning it once */
+struct image {
+	char *o;
+	size_t size;
+	uint32_t hash_mask;
+	struct inode_info **inodes;
+	struct name_info **names;
+};
+
 int target_endian = __BYTE_ORDER;
 
-static struct jffs2_raw_inode *find_raw_inode(char *, size_t, uint32_t);
+static struct jffs2_raw_inode *find_raw_inode(struct image *, uint32_t);
 
-static void lsdir(char *, size_t, const char *, int, int);
+static void lsdir(struct image *, const char *, int, int);
 
 /* writes file node into buffer, to the proper position. */
 /* reading all valid nodes in version order reconstructs the file. */
@@ -161,85 +198,6 @@ static void putblock(char *b, size_t bsize, size_t * rsize,
 	*rsize = je32_to_cpu(n->isize);
 }
 
-/* adds/removes directory node into dir struct. */
-/* reading all valid nodes in version order reconstructs the directory. */
-
-/*
-   dd      - directory struct being processed
-   n       - node
-
-   return value: directory struct value replacing dd
- */
-
-static struct dir *putdir(struct dir *dd, struct jffs2_raw_dirent *n)
-{
-	struct dir *o, *d, *p;
-
-	o = dd;
-
-	if (je32_to_cpu(n->ino)) {
-		if (dd == NULL) {
-			d = xmalloc(sizeof(struct dir));
-			d->type = n->type;
-			memcpy(d->name, n->name, n->nsize);
-			d->nsize = n->nsize;
-			d->ino = je32_to_cpu(n->ino);
-			d->next = NULL;
-
-			return d;
-		}
-
-		while (1) {
-			if (n->nsize == dd->nsize &&
-					!memcmp(n->name, dd->name, n->nsize)) {
-				dd->type = n->type;
-				dd->ino = je32_to_cpu(n->ino);
-
-				return o;
-			}
-
-			if (dd->next == NULL) {
-				dd->next = xmalloc(sizeof(struct dir));
-				dd->next->type = n->type;
-				memcpy(dd->next->name, n->name, n->nsize);
-				dd->next->nsize = n->nsize;
-				dd->next->ino = je32_to_cpu(n->ino);
-				dd->next->next = NULL;
-
-				return o;
-			}
-
-			dd = dd->next;
-		}
-	} else {
-		if (dd == NULL)
-			return NULL;
-
-		if (n->nsize == dd->nsize && !memcmp(n->name, dd->name, n->nsize)) {
-			d = dd->next;
-			free(dd);
-			return d;
-		}
-
-		while (1) {
-			p = dd;
-			dd = dd->next;
-
-			if (dd == NULL)
-				return o;
-
-			if (n->nsize == dd->nsize &&
-					!memcmp(n->name, dd->name, n->nsize)) {
-				p->next = dd->next;
-				free(dd);
-
-				return o;
-			}
-		}
-	}
-}
-
-
 #define TYPEINDEX(mode) (((mode) >> 12) & 0x0f)
 #define TYPECHAR(mode)  ("0pcCd?bB-?l?s???" [TYPEINDEX(mode)])
 
@@ -288,7 +246,7 @@ static const char *mode_string(int mode)
    d       - dir struct
  */
 
-static void printdir(char *o, size_t size, struct dir *d, const char *path,
+static void printdir(struct image *img, struct dir *d, const char *path,
 					 int recurse, int want_ctime)
 {
 	char m;
@@ -335,7 +293,7 @@ static void printdir(char *o, size_t size, struct dir *d, const char *path,
 			default:
 				m = '?';
 		}
-		ri = find_raw_inode(o, size, d->ino);
+		ri = find_raw_inode(img, d->ino);
 		if (!ri) {
 			warnmsg("bug: raw_inode missing!");
 			d = d->next;
@@ -350,11 +308,11 @@ static void printdir(char *o, size_t size, struct dir *d, const char *path,
 				1, je16_to_cpu(ri->uid), je16_to_cpu(ri->gid));
 		if ( d->type==DT_BLK || d->type==DT_CHR ) {
 			dev_t rdev;
-			size_t devsize;
+			size_t devsize = 0;
 			putblock((char*)&rdev, sizeof(rdev), &devsize, ri);
 			printf("%4d, %3d ", major(rdev), minor(rdev));
 		} else {
-			printf("%9ld ", (long)je32_to_cpu(ri->dsize));
+			printf("%9ld ", (long)je32_to_cpu(ri->isize));
 		}
 		d->name[d->nsize]='\0';
 		if (want_ctime) {
@@ -367,7 +325,7 @@ static void printdir(char *o, size_t size, struct dir *d, const char *path,
 		printf("%s/%s%c", path, d->name, m);
 		if (d->type == DT_LNK) {
 			char symbuf[1024];
-			size_t symsize;
+			size_t symsize = 0;
 			putblock(symbuf, sizeof(symbuf), &symsize, ri);
 			symbuf[symsize] = 0;
 			printf(" -> %s", symbuf);
@@ -378,7 +336,7 @@ static void printdir(char *o, size_t size, struct dir *d, const char *path,
 			char *tmp;
 			tmp = xmalloc(BUFSIZ);
 			sprintf(tmp, "%s/%s", path, d->name);
-			lsdir(o, size, tmp, recurse, want_ctime);	/* Go recursive */
+			lsdir(img, tmp, recurse, want_ctime);	/* Go recursive */
 			free(tmp);
 		}
 
@@ -403,226 +361,239 @@ static void freedir(struct dir *d)
 	}
 }
 
-/* collects directory/file nodes in version order. */
+/* adds a node to a list, keeping it sorted by version */
 
 /*
-   f       - file flag.
-   if zero, collect file, compare ino to inode
-   otherwise, collect directory, compare ino to parent inode
-   o       - filesystem image pointer
-   size    - size of filesystem image
-   ino     - inode to compare against. see f.
-
-   return value: a jffs2_raw_inode that corresponds the the specified
-   inode, or NULL
+   l       - node list
+   n       - node
+   version - version of the node
  */
 
-static struct jffs2_raw_inode *find_raw_inode(char *o, size_t size,
-											  uint32_t ino)
+static void add_node_ref(struct node_list *l, union jffs2_node_union *n,
+		uint32_t version)
 {
-	/* aligned! */
-	union jffs2_node_union *n;
-	union jffs2_node_union *e = (union jffs2_node_union *) (o + size);
-	union jffs2_node_union *lr;	/* last block position */
-	union jffs2_node_union *mp = NULL;	/* minimum position */
+	struct node_ref *r, **pp;
 
-	uint32_t vmin, vmint, vmaxt, vmax, vcur, v;
+	r = xmalloc(sizeof(struct node_ref));
+	r->n = n;
+	r->version = version;
 
-	vmin = 0;					/* next to read */
-	vmax = ~((uint32_t) 0);		/* last to read */
-	vmint = ~((uint32_t) 0);
-	vmaxt = 0;					/* found maximum */
-	vcur = 0;					/* XXX what is smallest version number used? */
-	/* too low version number can easily result excess log rereading */
+	/* nodes are mostly written in version order, so usually append */
+	if (l->tail == NULL || l->tail->version <= version) {
+		r->next = NULL;
+		if (l->tail)
+			l->tail->next = r;
+		else
+			l->head = r;
+		l->tail = r;
+		return;
+	}
 
-	n = (union jffs2_node_union *) o;
-	lr = n;
+	for (pp = &l->head; (*pp)->version <= version; pp = &(*pp)->next)
+		;
+	r->next = *pp;
+	*pp = r;
+}
 
-	do {
-		while (n < e && je16_to_cpu(n->u.magic) != JFFS2_MAGIC_BITMASK)
-			ADD_BYTES(n, 4);
+static void free_node_list(struct node_list *l)
+{
+	struct node_ref *r, *t;
 
-		if (n < e && je16_to_cpu(n->u.magic) == JFFS2_MAGIC_BITMASK) {
-			if (je16_to_cpu(n->u.nodetype) == JFFS2_NODETYPE_INODE &&
-				je32_to_cpu(n->i.ino) == ino && (v = je32_to_cpu(n->i.version)) > vcur) {
-				/* XXX crc check */
+	for (r = l->head; r != NULL; r = t) {
+		t = r->next;
+		free(r);
+	}
+}
 
-				if (vmaxt < v)
-					vmaxt = v;
-				if (vmint > v) {
-					vmint = v;
-					mp = n;
-				}
+/* looks up the index entry of an inode */
 
-				if (v == (vcur + 1))
-					return (&(n->i));
-			}
+/*
+   img     - filesystem image
+   ino     - inode number
+   create  - if non-zero, create the entry if there is none
+
+   return value: index entry, or NULL
+ */
 
-			ADD_BYTES(n, ((je32_to_cpu(n->u.totlen) + 3) & ~3));
-		} else
-			n = (union jffs2_node_union *) o;	/* we're at the end, rewind to the beginning */
+static struct inode_info *get_inode(struct image *img, uint32_t ino,
+		int create)
+{
+	struct inode_info **head = &img->inodes[ino & img->hash_mask];
+	struct inode_info *ii;
 
-		if (lr == n) {			/* whole loop since last read */
-			vmax = vmaxt;
-			vmin = vmint;
-			vmint = ~((uint32_t) 0);
+	for (ii = *head; ii != NULL; ii = ii->next)
+		if (ii->ino == ino)
+			return ii;
 
-			if (vcur < vmax && vcur < vmin)
-				return (&(mp->i));
-		}
-	} while (vcur < vmax);
+	if (!create)
+		return NULL;
 
-	return NULL;
+	ii = xzalloc(sizeof(struct inode_info));
+	ii->ino = ino;
+	ii->next = *head;
+	*head = ii;
+	return ii;
 }
 
-/* collects dir struct for selected inode */
+static uint32_t name_hash(uint32_t pino, const char *name, uint8_t nsize)
+{
+	uint32_t h = 2166136261U ^ pino;
+	int i;
 
-/*
-   o       - filesystem image pointer
-   size    - size of filesystem image
-   pino    - inode of the specified directory
-   d       - input directory structure
+	for (i = 0; i < nsize; i++)
+		h = (h ^ (unsigned char)name[i]) * 16777619U;
+	return h;
+}
 
-   return value: result directory structure, replaces d.
+/* records a dirent in the name and inode indexes, if it is the latest one */
+
+/*
+   img     - filesystem image
+   d       - dirent node
  */
 
-static struct dir *collectdir(char *o, size_t size, uint32_t ino, struct dir *d)
+static void add_dirent(struct image *img, struct jffs2_raw_dirent *d)
 {
-	/* aligned! */
-	union jffs2_node_union *n;
-	union jffs2_node_union *e = (union jffs2_node_union *) (o + size);
-	union jffs2_node_union *lr;	/* last block position */
-	union jffs2_node_union *mp = NULL;	/* minimum position */
-
-	uint32_t vmin, vmint, vmaxt, vmax, vcur, v;
+	uint32_t pino = je32_to_cpu(d->pino), ino = je32_to_cpu(d->ino);
+	uint32_t v = je32_to_cpu(d->version);
+	struct name_info **head, *ni;
+	struct inode_info *ii;
+
+	head = &img->names[name_hash(pino, (char *) d->name, d->nsize) &
+		img->hash_mask];
+	for (ni = *head; ni != NULL; ni = ni->next) {
+		if (je32_to_cpu(ni->d->pino) == pino &&
+				ni->d->nsize == d->nsize &&
+				!memcmp(ni->d->name, d->name, d->nsize))
+			break;
+	}
+	if (ni == NULL) {
+		ni = xmalloc(sizeof(struct name_info));
+		ni->d = d;
+		ni->next = *head;
+		*head = ni;
+	} else if (je32_to_cpu(ni->d->version) < v)
+		ni->d = d;
+
+	if (ino) {
+		ii = get_inode(img, ino, 1);
+		if (ii->dirent == NULL || je32_to_cpu(ii->dirent->version) < v)
+			ii->dirent = d;
+	}
+}
 
-	vmin = 0;					/* next to read */
-	vmax = ~((uint32_t) 0);		/* last to read */
-	vmint = ~((uint32_t) 0);
-	vmaxt = 0;					/* found maximum */
-	vcur = 0;					/* XXX what is smallest version number used? */
-	/* too low version number can easily result excess log rereading */
+/* scans the image once and builds the index */
 
-	n = (union jffs2_node_union *) o;
-	lr = n;
+/*
+   img     - filesystem image, o and size must be set
+ */
 
-	do {
-		while (n < e && je16_to_cpu(n->u.magic) != JFFS2_MAGIC_BITMASK)
+static void scan_image(struct image *img)
+{
+	/* aligned! */
+	union jffs2_node_union *n = (union jffs2_node_union *) img->o;
+	union jffs2_node_union *e =
+		(union jffs2_node_union *) (img->o + img->size);
+	size_t left, totlen;
+	uint32_t buckets = 256;
+
+	/* roughly one bucket per page worth of image */
+	while (buckets < img->size / 4096 && buckets < (1U << 24))
+		buckets <<= 1;
+	img->hash_mask = buckets - 1;
+	img->inodes = xcalloc(buckets, sizeof(struct inode_info *));
+	img->names = xcalloc(buckets, sizeof(struct name_info *));
+
+	while (n < e) {
+		left = (char *) e - (char *) n;
+		if (left < sizeof(struct jffs2_unknown_node) ||
+				je16_to_cpu(n->u.magic) != JFFS2_MAGIC_BITMASK) {
 			ADD_BYTES(n, 4);
+			continue;
+		}
 
-		if (n < e && je16_to_cpu(n->u.magic) == JFFS2_MAGIC_BITMASK) {
-			if (je16_to_cpu(n->u.nodetype) == JFFS2_NODETYPE_DIRENT &&
-				je32_to_cpu(n->d.pino) == ino && (v = je32_to_cpu(n->d.version)) > vcur) {
-				/* XXX crc check */
-
-				if (vmaxt < v)
-					vmaxt = v;
-				if (vmint > v) {
-					vmint = v;
-					mp = n;
-				}
-
-				if (v == (vcur + 1)) {
-					d = putdir(d, &(n->d));
-
-					lr = n;
-					vcur++;
-					vmint = ~((uint32_t) 0);
-				}
-			}
-
-			ADD_BYTES(n, ((je32_to_cpu(n->u.totlen) + 3) & ~3));
-		} else
-			n = (union jffs2_node_union *) o;	/* we're at the end, rewind to the beginning */
-
-		if (lr == n) {			/* whole loop since last read */
-			vmax = vmaxt;
-			vmin = vmint;
-			vmint = ~((uint32_t) 0);
-
-			if (vcur < vmax && vcur < vmin) {
-				d = putdir(d, &(mp->d));
+		totlen = je32_to_cpu(n->u.totlen);
+		if (totlen < sizeof(struct jffs2_unknown_node) || totlen > left) {
+			ADD_BYTES(n, 4);
+			continue;
+		}
 
-				lr = n =
-					(union jffs2_node_union *) (((char *) mp) +
-							((je32_to_cpu(mp->u.totlen) + 3) & ~3));
+		/* XXX crc check */
+		switch (je16_to_cpu(n->u.nodetype)) {
+			case JFFS2_NODETYPE_INODE:
+				if (totlen < sizeof(struct jffs2_raw_inode))
+					break;
+				add_node_ref(&get_inode(img, je32_to_cpu(n->i.ino), 1)->nodes,
+						n, je32_to_cpu(n->i.version));
+				break;
 
-				vcur = vmin;
-			}
+			case JFFS2_NODETYPE_DIRENT:
+				/* nsize is only within the image if the header is */
+				if (totlen < sizeof(struct jffs2_raw_dirent) ||
+						totlen < sizeof(struct jffs2_raw_dirent) + n->d.nsize)
+					break;
+				add_node_ref(&get_inode(img, je32_to_cpu(n->d.pino), 1)->dirents,
+						n, je32_to_cpu(n->d.version));
+				add_dirent(img, &n->d);
+				break;
 		}
-	} while (vcur < vmax);
 
-	return d;
+		ADD_BYTES(n, ((totlen + 3) & ~3));
+	}
 }
 
-
-
-/* resolve dirent based on criteria */
+/* frees the index */
 
 /*
-   o       - filesystem image pointer
-   size    - size of filesystem image
-   ino     - if zero, ignore,
-   otherwise compare against dirent inode
-   pino    - if zero, ingore,
-   otherwise compare against parent inode
-   and use name and nsize as extra criteria
-   name    - name of wanted dirent, used if pino!=0
-   nsize   - length of name of wanted dirent, used if pino!=0
-
-   return value: pointer to relevant dirent structure in
-   filesystem image or NULL
+   img     - filesystem image
  */
 
-static struct jffs2_raw_dirent *resolvedirent(char *o, size_t size,
-		uint32_t ino, uint32_t pino,
-		char *name, uint8_t nsize)
+static void free_index(struct image *img)
 {
-	/* aligned! */
-	union jffs2_node_union *n;
-	union jffs2_node_union *e = (union jffs2_node_union *) (o + size);
-
-	struct jffs2_raw_dirent *dd = NULL;
-
-	uint32_t vmax, v;
+	struct inode_info *ii, *it;
+	struct name_info *ni, *nt;
+	uint32_t i;
+
+	for (i = 0; i <= img->hash_mask; i++) {
+		for (ii = img->inodes[i]; ii != NULL; ii = it) {
+			it = ii->next;
+			free_node_list(&ii->nodes);
+			free_node_list(&ii->dirents);
+			free(ii);
+		}
+		for (ni = img->names[i]; ni != NULL; ni = nt) {
+			nt = ni->next;
+			free(ni);
+		}
+	}
+	free(img->inodes);
+	free(img->names);
+}
 
-	if (!pino && ino <= 1)
-		return dd;
+/* finds the latest inode node of an inode */
 
-	vmax = 0;
+/*
+   img     - filesystem image
+   ino     - inode number
 
-	n = (union jffs2_node_union *) o;
+   return value: the jffs2_raw_inode with the highest version of the
+   specified inode, or NULL
+ */
 
-	do {
-		while (n < e && je16_to_cpu(n->u.magic) != JFFS2_MAGIC_BITMASK)
-			ADD_BYTES(n, 4);
+static struct jffs2_raw_inode *find_raw_inode(struct image *img, uint32_t ino)
+{
+	struct inode_info *ii = get_inode(img, ino, 0);
 
-		if (n < e && je16_to_cpu(n->u.magic) == JFFS2_MAGIC_BITMASK) {
-			if (je16_to_cpu(n->u.nodetype) == JFFS2_NODETYPE_DIRENT &&
-					(!ino || je32_to_cpu(n->d.ino) == ino) &&
-					(v = je32_to_cpu(n->d.version)) > vmax &&
-					(!pino || (je32_to_cpu(n->d.pino) == pino &&
-							   nsize == n->d.nsize &&
-							   !memcmp(name, n->d.name, nsize)))) {
-				/* XXX crc check */
-
-				if (vmax < v) {
-					vmax = v;
-					dd = &(n->d);
-				}
-			}
+	if (ii == NULL || ii->nodes.tail == NULL)
+		return NULL;
 
-			ADD_BYTES(n, ((je32_to_cpu(n->u.totlen) + 3) & ~3));
-		} else
-			return dd;
-	} while (1);
+	return &(ii->nodes.tail->n->i);
 }
 
 /* resolve name under certain parent inode to dirent */
 
 /*
-   o       - filesystem image pointer
-   size    - size of filesystem image
+   img     - filesystem image
    pino    - requested parent inode
    name    - name of wanted dirent
    nsize   - length of name of wanted dirent
@@ -631,26 +602,81 @@ static struct jffs2_raw_dirent *resolvedirent(char *o, size_t size,
    filesystem image or NULL
  */
 
-static struct jffs2_raw_dirent *resolvename(char *o, size_t size, uint32_t pino,
+static struct jffs2_raw_dirent *resolvename(struct image *img, uint32_t pino,
 		char *name, uint8_t nsize)
 {
-	return resolvedirent(o, size, 0, pino, name, nsize);
+	struct name_info *ni;
+
+	if (!pino)
+		return NULL;
+
+	ni = img->names[name_hash(pino, name, nsize) & img->hash_mask];
+	for (; ni != NULL; ni = ni->next) {
+		if (je32_to_cpu(ni->d->pino) == pino && ni->d->nsize == nsize &&
+				!memcmp(ni->d->name, name, nsize))
+			return ni->d;
+	}
+
+	return NULL;
 }
 
 /* resolve inode to dirent */
 
 /*
-   o       - filesystem image pointer
-   size    - size of filesystem image
+   img     - filesystem image
    ino     - compare against dirent inode
 
    return value: pointer to relevant dirent structure in
    filesystem image or NULL
  */
 
-static struct jffs2_raw_dirent *resolveinode(char *o, size_t size, uint32_t ino)
+static struct jffs2_raw_dirent *resolveinode(struct image *img, uint32_t ino)
 {
-	return resolvedirent(o, size, ino, 0, NULL, 0);
+	struct inode_info *ii;
+
+	if (ino <= 1)
+		return NULL;
+
+	ii = get_inode(img, ino, 0);
+	return ii != NULL ? ii->dirent : NULL;
+}
+
+/* collects dir struct for selected inode */
+/* an entry is listed if its dirent is the latest one for its name. */
+
+/*
+   img     - filesystem image
+   ino     - inode of the specified directory
+
+   return value: directory structure, entries in version order.
+ */
+
+static struct dir *collectdir(struct image *img, uint32_t ino)
+{
+	struct inode_info *ii = get_inode(img, ino, 0);
+	struct dir *d = NULL, **tail = &d;
+	struct jffs2_raw_dirent *n;
+	struct node_ref *r;
+
+	if (ii == NULL)
+		return NULL;
+
+	for (r = ii->dirents.head; r != NULL; r = r->next) {
+		n = &(r->n->d);
+		if (!je32_to_cpu(n->ino) ||
+				resolvename(img, ino, (char *) n->name, n->nsize) != n)
+			continue;
+
+		*tail = xmalloc(sizeof(struct dir));
+		(*tail)->type = n->type;
+		memcpy((*tail)->name, n->name, n->nsize);
+		(*tail)->nsize = n->nsize;
+		(*tail)->ino = je32_to_cpu(n->ino);
+		(*tail)->next = NULL;
+		tail = &(*tail)->next;
+	}
+
+	return d;
 }
 
 /* resolve slash-style path into dirent and inode.
@@ -659,8 +685,7 @@ static struct jffs2_raw_dirent *resolveinode(char *o, size_t size, uint32_t ino)
  */
 
 /*
-   o       - filesystem image pointer
-   size    - size of filesystem image
+   img     - filesystem image
    ino     - root inode, used if path is relative
    p       - path to be resolved
    inos    - result inode, zero if failure
@@ -671,7 +696,7 @@ static struct jffs2_raw_dirent *resolveinode(char *o, size_t size, uint32_t ino)
    (return value is NULL), but it has inode (*inos=1)
  */
 
-static struct jffs2_raw_dirent *resolvepath0(char *o, size_t size, uint32_t ino,
+static struct jffs2_raw_dirent *resolvepath0(struct image *img, uint32_t ino,
 		const char *p, uint32_t * inos, int recc)
 {
 	struct jffs2_raw_dirent *dir = NULL;
@@ -684,7 +709,7 @@ static struct jffs2_raw_dirent *resolvepath0(char *o, size_t size, uint32_t ino,
 	char *path, *pp;
 
 	char symbuf[1024];
-	size_t symsize;
+	size_t symsize = 0;
 
 	if (recc > 16) {
 		/* probably symlink loop */
@@ -700,7 +725,7 @@ static struct jffs2_raw_dirent *resolvepath0(char *o, size_t size, uint32_t ino,
 	}
 
 	if (ino > 1) {
-		dir = resolveinode(o, size, ino);
+		dir = resolveinode(img, ino);
 
 		ino = DIRENT_INO(dir);
 	}
@@ -721,14 +746,14 @@ static struct jffs2_raw_dirent *resolvepath0(char *o, size_t size, uint32_t ino,
 				ino = 1;
 				dir = NULL;
 			} else {
-				dir = resolveinode(o, size, DIRENT_PINO(dir));
+				dir = resolveinode(img, DIRENT_PINO(dir));
 				ino = DIRENT_INO(dir);
 			}
 
 			continue;
 		}
 
-		dir = resolvename(o, size, ino, path, (uint8_t) strlen(path));
+		dir = resolvename(img, ino, path, (uint8_t) strlen(path));
 
 		if (DIRENT_INO(dir) == 0 ||
 				(next != NULL &&
@@ -742,14 +767,20 @@ static struct jffs2_raw_dirent *resolvepath0(char *o, size_t size, uint32_t ino,
 
 		if (dir->type == DT_LNK) {
 			struct jffs2_raw_inode *ri;
-			ri = find_raw_inode(o, size, DIRENT_INO(dir));
+			ri = find_raw_inode(img, DIRENT_INO(dir));
+			if (ri == NULL) {
+				free(pp);
+
+				*inos = 0;
+				return NULL;
+			}
 			putblock(symbuf, sizeof(symbuf), &symsize, ri);
 			symbuf[symsize] = 0;
 
 			tino = ino;
 			ino = 0;
 
-			dir = resolvepath0(o, size, tino, symbuf, &ino, ++recc);
+			dir = resolvepath0(img, tino, symbuf, &ino, ++recc);
 
 			if (dir != NULL && next != NULL &&
 					!(dir->type == DT_DIR || dir->type == DT_LNK)) {
@@ -776,8 +807,7 @@ static struct jffs2_raw_dirent *resolvepath0(char *o, size_t size, uint32_t ino,
  */
 
 /*
-   o       - filesystem image pointer
-   size    - size of filesystem image
+   img     - filesystem image
    ino     - root inode, used if path is relative
    p       - path to be resolved
    inos    - result inode, zero if failure
@@ -787,58 +817,58 @@ static struct jffs2_raw_dirent *resolvepath0(char *o, size_t size, uint32_t ino,
    (return value is NULL), but it has inode (*inos=1)
  */
 
-static struct jffs2_raw_dirent *resolvepath(char *o, size_t size, uint32_t ino,
+static struct jffs2_raw_dirent *resolvepath(struct image *img, uint32_t ino,
 		const char *p, uint32_t * inos)
 {
-	return resolvepath0(o, size, ino, p, inos, 0);
+	return resolvepath0(img, ino, p, inos, 0);
 }
 
 /* lists files on directory specified by path */
 
 /*
-   o       - filesystem image pointer
-   size    - size of filesystem image
+   img     - filesystem image
    p       - path to be resolved
  */
 
-static void lsdir(char *o, size_t size, const char *path, int recurse,
+static void lsdir(struct image *img, const char *path, int recurse,
 				  int want_ctime)
 {
 	struct jffs2_raw_dirent *dd;
-	struct dir *d = NULL;
+	struct dir *d;
 
 	uint32_t ino;
 
-	dd = resolvepath(o, size, 1, path, &ino);
+	dd = resolvepath(img, 1, path, &ino);
 
 	if (ino == 0 ||
 			(dd == NULL && ino == 0) || (dd != NULL && dd->type != DT_DIR))
 		errmsg_die("%s: No such file or directory", path);
 
-	d = collectdir(o, size, ino, d);
-	printdir(o, size, d, path, recurse, want_ctime);
+	d = collectdir(img, ino);
+	printdir(img, d, path, recurse, want_ctime);
 	freedir(d);
 }
 
 /* writes file specified by path to the buffer */
+/* all inode nodes of the file are applied in version order. */
 
 /*
-   o       - filesystem image pointer
-   size    - size of filesystem image
+   img     - filesystem image
    p       - path to be resolved
    b       - file buffer
    bsize   - file buffer size
    rsize   - file result size
  */
 
-static void catfile(char *o, size_t size, char *path, char *b, size_t bsize,
+static void catfile(struct image *img, char *path, char *b, size_t bsize,
 					size_t * rsize)
 {
 	struct jffs2_raw_dirent *dd;
-	struct jffs2_raw_inode *ri;
+	struct inode_info *ii;
+	struct node_ref *r;
 	uint32_t ino;
 
-	dd = resolvepath(o, size, 1, path, &ino);
+	dd = resolvepath(img, 1, path, &ino);
 
 	if (ino == 0)
 		errmsg_die("%s: No such file or directory", path);
@@ -846,8 +876,13 @@ static void catfile(char *o, size_t size, char *path, char *b, size_t bsize,
 	if (dd == NULL || dd->type != DT_REG)
 		errmsg_die("%s: Not a regular file", path);
 
-	ri = find_raw_inode(o, size, ino);
-	putblock(b, bsize, rsize, ri);
+	ii = get_inode(img, ino, 0);
+	if (ii == NULL || ii->nodes.head == NULL)
+		errmsg_die("%s: inode %u missing", path, ino);
+
+	*rsize = 0;
+	for (r = ii->nodes.head; r != NULL; r = r->next)
+		putblock(b, bsize, rsize, &(r->n->i));
 
 	write_nocheck(1, b, *rsize);
 }
@@ -862,7 +897,8 @@ int main(int argc, char **argv)
 	char *scratch, *dir = NULL, *file = NULL;
 	size_t ssize = 0;
 
-	char *buf;
+	struct image img;
+	int mapped = 1;
 
 	while ((opt = getopt_long(argc, argv, short_opt, long_opt, &c)) > 0) {
 		switch (opt) {
@@ -896,25 +932,39 @@ int main(int argc, char **argv)
 	if (fstat(fd, &st))
 		sys_errmsg_die("%s", argv[optind]);
 
-	buf = xmalloc((size_t) st.st_size);
+	memset(&img, 0, sizeof(img));
+	img.size = st.st_size;
 
-	if (read(fd, buf, st.st_size) != (ssize_t) st.st_size)
-		sys_errmsg_die("%s", argv[optind]);
+	img.o = mmap(NULL, img.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (img.o == MAP_FAILED) {
+		/* e.g. an empty file, or something which cannot be mapped */
+		mapped = 0;
+		img.o = xmalloc(img.size);
+
+		if (read(fd, img.o, img.size) != (ssize_t) img.size)
+			sys_errmsg_die("%s", argv[optind]);
+	}
+
+	scan_image(&img);
 
 	if (dir)
-		lsdir(buf, st.st_size, dir, recurse, want_ctime);
+		lsdir(&img, dir, recurse, want_ctime);
 
 	if (file) {
 		scratch = xmalloc(SCRATCH_SIZE);
 
-		catfile(buf, st.st_size, file, scratch, SCRATCH_SIZE, &ssize);
+		catfile(&img, file, scratch, SCRATCH_SIZE, &ssize);
 		free(scratch);
 	}
 
 	if (!dir && !file)
-		lsdir(buf, st.st_size, "/", 1, want_ctime);
-
-
-	free(buf);
+		lsdir(&img, "/", 1, want_ctime);
+
+	free_index(&img);
+	if (mapped)
+		munmap(img.o, img.size);
+	else
+		free(img.o);
+	close(fd);
 	exit(EXIT_SUCCESS);
 }
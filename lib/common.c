@@ -27,6 +27,7 @@
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
@@ -166,6 +167,147 @@ int util_srand(void)
 	return 0;
 }
 
+/*
+ * Write @len bytes at the current position of @fd. Returns zero on success
+ * and %-1 on failure.
+ */
+static int write_run(int fd, const unsigned char *buf, size_t len)
+{
+	while (len) {
+		ssize_t l = write(fd, buf, len);
+
+		if (l < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += l;
+		len -= l;
+	}
+
+	return 0;
+}
+
+/**
+ * util_write_sparse - write a buffer leaving holes for erased blocks.
+ * @fd: file descriptor to write to
+ * @buf: data to write
+ * @len: how many bytes to write
+ *
+ * This helper function writes @buf at the current file position of @fd, but
+ * instead of writing file system blocks which contain only 0xFF bytes it
+ * seeks over them, so that they end up as holes in the output file. Blocks
+ * which are inside the already existing part of the file are punched out
+ * instead, or written normally if the file system cannot punch holes. The
+ * file is extended if the buffer ends with a hole.
+ *
+ * Note, holes read back as zeroes, so the file is only usable as-is by
+ * tools which treat holes as erased flash. Returns zero in case of success
+ * and %-1 in case of failure.
+ */
+int util_write_sparse(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf, *run = buf;
+	struct stat st;
+	off_t pos, end;
+	size_t blk, n;
+	int hole = 0;
+
+	if (fstat(fd, &st))
+		return -1;
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos == -1)
+		return -1;
+
+	blk = st.st_blksize > 0 ? st.st_blksize : 4096;
+	end = pos + len;
+
+	while (len) {
+		n = blk - pos % blk;
+		if (n > len)
+			n = len;
+
+		hole = n == blk &&
+		       buffer_check_pattern((unsigned char *)p, n, 0xFF);
+		if (hole && pos < st.st_size &&
+		    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      pos, n))
+			hole = 0;
+
+		if (hole) {
+			if (write_run(fd, run, p - run))
+				return -1;
+			if (lseek(fd, pos + n, SEEK_SET) == -1)
+				return -1;
+			run = p + n;
+		}
+
+		p += n;
+		pos += n;
+		len -= n;
+	}
+
+	if (write_run(fd, run, p - run))
+		return -1;
+	if (hole && end > st.st_size && ftruncate(fd, end))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * util_fill_holes - replace the holes of a file by 0xFF bytes.
+ * @fd: file descriptor the data was read from
+ * @offs: file offset @buf was read from
+ * @buf: buffer with the data
+ * @len: length of @buf
+ *
+ * This is the counterpart of 'util_write_sparse()': it finds the holes of
+ * @fd within the range @offs to @offs + @len and fills the corresponding
+ * parts of @buf with 0xFF bytes. Files which are not seekable or which live
+ * on file systems not reporting holes are left alone. The file position of
+ * @fd is preserved. Returns zero in case of success and %-1 in case of
+ * failure.
+ */
+int util_fill_holes(int fd, off_t offs, void *buf, size_t len)
+{
+	off_t cur, pos = offs, end = offs + len, data, hole;
+	int ret = 0;
+
+	cur = lseek(fd, 0, SEEK_CUR);
+	if (cur == -1)
+		return errno == ESPIPE ? 0 : -1;
+
+	while (pos < end) {
+		hole = lseek(fd, pos, SEEK_HOLE);
+		if (hole == -1) {
+			if (errno != ENXIO && errno != EINVAL)
+				ret = -1;
+			break;
+		}
+		if (hole >= end)
+			break;
+
+		data = lseek(fd, hole, SEEK_DATA);
+		if (data == -1) {
+			if (errno != ENXIO) {
+				ret = -1;
+				break;
+			}
+			data = end;
+		}
+		if (data > end)
+			data = end;
+
+		memset(buf + (hole - offs), 0xFF, data - hole);
+		pos = data;
+	}
+
+	if (lseek(fd, cur, SEEK_SET) == -1)
+		ret = -1;
+	return ret;
+}
+
 /**
  * mtd_find_dev_node - Find the device node for an MTD
  * @id:  Identifier for the MTD. this can be the device node itself, or
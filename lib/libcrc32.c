@@ -35,11 +35,32 @@
  *      hardware you could probably optimize the shift in assembler by
  *      using byte-swap instructions
  *      polynomial $edb88320
+ *
+ *  Besides the byte-at-a-time table-driven implementation there is a
+ *  slice-by-8 one which processes 8 bytes per iteration using 8 tables
+ *  derived from the first one, and folding implementations which use the
+ *  carry-less multiplication instructions (PCLMULQDQ) on x86 or the CRC32
+ *  instructions on ARMv8. The fastest implementation supported by the CPU is
+ *  selected when the program starts. All of them compute the same CRC.
  */
 
 #include <stdint.h>
+#include <string.h>
+#include <endian.h>
 #include "crc32.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_PCLMUL
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#define CRC32_ARMV8
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 static const uint32_t crc32_table[256] = {
 	0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
 	0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
@@ -95,7 +116,10 @@ static const uint32_t crc32_table[256] = {
 	0x2d02ef8dL
 };
 
-uint32_t mtd_crc32(uint32_t val, const void *ss, int len)
+/* Slice-by-8 tables, crc32_slice_table[0] is a copy of crc32_table */
+static uint32_t crc32_slice_table[8][256];
+
+uint32_t mtd_crc32_bytewise(uint32_t val, const void *ss, int len)
 {
 	const unsigned char *s = ss;
 
@@ -103,3 +127,186 @@ uint32_t mtd_crc32(uint32_t val, const void *ss, int len)
 		val = crc32_table[(val ^ *s++) & 0xff] ^ (val >> 8);
 	return val;
 }
+
+uint32_t mtd_crc32_slice8(uint32_t val, const void *ss, int len)
+{
+	const uint32_t (*t)[256] = (const uint32_t (*)[256])crc32_slice_table;
+	const unsigned char *s = ss;
+	uint32_t one, two;
+
+	while (len > 0 && ((uintptr_t)s & 7)) {
+		val = t[0][(val ^ *s++) & 0xff] ^ (val >> 8);
+		len -= 1;
+	}
+
+	while (len >= 8) {
+		memcpy(&one, s, 4);
+		memcpy(&two, s + 4, 4);
+		one = le32toh(one) ^ val;
+		two = le32toh(two);
+		val = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^
+		      t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+		      t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^
+		      t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+		s += 8;
+		len -= 8;
+	}
+
+	while (--len >= 0)
+		val = t[0][(val ^ *s++) & 0xff] ^ (val >> 8);
+	return val;
+}
+
+#ifdef CRC32_PCLMUL
+/*
+ * Fold 128 bits of @x by 128 or 512 bits forward (depending on @k) and add the
+ * next 128 bits of data @d.
+ */
+__attribute__((target("sse4.1,pclmul")))
+static inline __m128i fold128(__m128i x, __m128i k, __m128i d)
+{
+	__m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+	__m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+
+	return _mm_xor_si128(_mm_xor_si128(lo, hi), d);
+}
+
+/*
+ * The algorithm and the constants are those of the Linux kernel
+ * crc32-pclmul implementation, see "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction" by Intel.
+ */
+__attribute__((target("sse4.1,pclmul")))
+static uint32_t crc32_pclmul(uint32_t val, const void *ss, int len)
+{
+	const __m128i r2r1 = _mm_set_epi64x(0x1c6e41596, 0x154442bd4);
+	const __m128i r4r3 = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0);
+	const __m128i r5 = _mm_set_epi64x(0, 0x163cd6124);
+	const __m128i rupoly = _mm_set_epi64x(0x1f7011641, 0x1db710641);
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+	const unsigned char *s = ss;
+	__m128i x1, x2, x3, x4, t;
+
+	if (len < 64)
+		return mtd_crc32_slice8(val, ss, len);
+
+	x1 = _mm_loadu_si128((const __m128i *)s);
+	x2 = _mm_loadu_si128((const __m128i *)(s + 16));
+	x3 = _mm_loadu_si128((const __m128i *)(s + 32));
+	x4 = _mm_loadu_si128((const __m128i *)(s + 48));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(val));
+	s += 64;
+	len -= 64;
+
+	/* Fold 512 bits at a time */
+	while (len >= 64) {
+		x1 = fold128(x1, r2r1, _mm_loadu_si128((const __m128i *)s));
+		x2 = fold128(x2, r2r1,
+			     _mm_loadu_si128((const __m128i *)(s + 16)));
+		x3 = fold128(x3, r2r1,
+			     _mm_loadu_si128((const __m128i *)(s + 32)));
+		x4 = fold128(x4, r2r1,
+			     _mm_loadu_si128((const __m128i *)(s + 48)));
+		s += 64;
+		len -= 64;
+	}
+
+	/* Fold the 4 lanes into one, then 128 bits at a time */
+	x1 = fold128(x1, r4r3, x2);
+	x1 = fold128(x1, r4r3, x3);
+	x1 = fold128(x1, r4r3, x4);
+	while (len >= 16) {
+		x1 = fold128(x1, r4r3, _mm_loadu_si128((const __m128i *)s));
+		s += 16;
+		len -= 16;
+	}
+
+	/* Fold 128 bits to 64, then to 32 */
+	t = _mm_clmulepi64_si128(r4r3, x1, 0x01);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+	t = _mm_srli_si128(x1, 4);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), r5, 0x00);
+	x1 = _mm_xor_si128(x1, t);
+
+	/* Barrett reduction */
+	t = x1;
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), rupoly, 0x10);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), rupoly, 0x00);
+	x1 = _mm_xor_si128(x1, t);
+	val = _mm_extract_epi32(x1, 1);
+
+	return mtd_crc32_slice8(val, s, len);
+}
+#endif
+
+#ifdef CRC32_ARMV8
+__attribute__((target("arch=armv8-a+crc")))
+static uint32_t crc32_armv8(uint32_t val, const void *ss, int len)
+{
+	const unsigned char *s = ss;
+	uint64_t d;
+
+	while (len > 0 && ((uintptr_t)s & 7)) {
+		val = __crc32b(val, *s++);
+		len -= 1;
+	}
+
+	while (len >= 8) {
+		memcpy(&d, s, 8);
+		val = __crc32d(val, d);
+		s += 8;
+		len -= 8;
+	}
+
+	while (--len >= 0)
+		val = __crc32b(val, *s++);
+	return val;
+}
+#endif
+
+static uint32_t (*crc32_impl)(uint32_t val, const void *ss, int len) =
+							mtd_crc32_bytewise;
+static const char *crc32_impl_name = "bytewise";
+
+__attribute__((constructor))
+static void crc32_init(void)
+{
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc32_slice_table[0][i] = crc32_table[i];
+		for (j = 1; j < 8; j++) {
+			uint32_t v = crc32_slice_table[j - 1][i];
+
+			crc32_slice_table[j][i] = crc32_table[v & 0xff] ^
+						  (v >> 8);
+		}
+	}
+	crc32_impl = mtd_crc32_slice8;
+	crc32_impl_name = "slice-by-8";
+
+#ifdef CRC32_PCLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1")) {
+		crc32_impl = crc32_pclmul;
+		crc32_impl_name = "pclmul";
+	}
+#endif
+#ifdef CRC32_ARMV8
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		crc32_impl = crc32_armv8;
+		crc32_impl_name = "armv8-crc";
+	}
+#endif
+}
+
+const char *mtd_crc32_impl(void)
+{
+	return crc32_impl_name;
+}
+
+uint32_t mtd_crc32(uint32_t val, const void *ss, int len)
+{
+	return crc32_impl(val, ss, len);
+}
@@ -47,6 +47,17 @@
 #include <string.h>
 #include "libfec.h"
 
+#if (GF_BITS <= 8) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define FEC_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#if (GF_BITS <= 8) && defined(__GNUC__) && defined(__aarch64__)
+#define FEC_NEON
+#include <arm_neon.h>
+#endif
+
 /*
  * stuff used for testing purposes only
  */
@@ -183,6 +194,14 @@ static gf gf_mul_table[GF_SIZE + 1][GF_SIZE + 1];
 #define GF_MULC0(c) __gf_mulc_ = gf_mul_table[c]
 #define GF_ADDMULC(dst, x) dst ^= __gf_mulc_[x]
 
+/*
+ * Split-nibble tables for the SIMD kernels: since multiplication is
+ * linear, c*x = c*(x & 0x0f) ^ c*(x & 0xf0), and each half is a lookup
+ * in a 16 entry table, which fits in a vector register.
+ */
+static gf gf_mul_lo[GF_SIZE + 1][16];
+static gf gf_mul_hi[GF_SIZE + 1][16];
+
 static void
 init_mul_table(void)
 {
@@ -193,6 +212,12 @@ init_mul_table(void)
 
     for (j=0; j< GF_SIZE+1; j++)
 	    gf_mul_table[0][j] = gf_mul_table[j][0] = 0;
+
+    for (i=0; i< GF_SIZE+1; i++)
+	for (j=0; j< 16; j++) {
+	    gf_mul_lo[i][j] = gf_mul_table[i][j] ;
+	    gf_mul_hi[i][j] = gf_mul_table[i][j << 4] ;
+	}
 }
 #else	/* GF_BITS > 8 */
 static inline gf
@@ -322,7 +347,7 @@ generate_gf(void)
 
 #define UNROLL 16 /* 1, 4, 8, 16 */
 static void
-addmul1(gf *dst1, gf *src1, gf c, int sz)
+addmul1_scalar(gf *dst1, gf *src1, gf c, int sz)
 {
     USE_GF_MULC ;
     register gf *dst = dst1, *src = src1 ;
@@ -359,6 +384,113 @@ addmul1(gf *dst1, gf *src1, gf c, int sz)
 	GF_ADDMULC( *dst , *src );
 }
 
+#ifdef FEC_X86_SIMD
+/*
+ * The SIMD kernels process as many whole vectors as possible and return
+ * the number of bytes done, the rest is left to addmul1_scalar().
+ */
+__attribute__((target("ssse3")))
+static int
+addmul_ssse3(gf *dst, gf *src, gf c, int sz)
+{
+    const __m128i lo = _mm_loadu_si128((const __m128i *)gf_mul_lo[c]);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)gf_mul_hi[c]);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i x, d, l, h;
+    int i;
+
+    for (i = 0; i + 16 <= sz; i += 16) {
+	x = _mm_loadu_si128((const __m128i *)(src + i));
+	d = _mm_loadu_si128((const __m128i *)(dst + i));
+	l = _mm_shuffle_epi8(lo, _mm_and_si128(x, mask));
+	h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask));
+	d = _mm_xor_si128(d, _mm_xor_si128(l, h));
+	_mm_storeu_si128((__m128i *)(dst + i), d);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int
+addmul_avx2(gf *dst, gf *src, gf c, int sz)
+{
+    const __m256i lo = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *)gf_mul_lo[c]));
+    const __m256i hi = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *)gf_mul_hi[c]));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    __m256i x, d, l, h;
+    int i;
+
+    for (i = 0; i + 32 <= sz; i += 32) {
+	x = _mm256_loadu_si256((const __m256i *)(src + i));
+	d = _mm256_loadu_si256((const __m256i *)(dst + i));
+	l = _mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask));
+	h = _mm256_shuffle_epi8(hi,
+			_mm256_and_si256(_mm256_srli_epi64(x, 4), mask));
+	d = _mm256_xor_si256(d, _mm256_xor_si256(l, h));
+	_mm256_storeu_si256((__m256i *)(dst + i), d);
+    }
+    return i;
+}
+#endif
+
+#ifdef FEC_NEON
+static int
+addmul_neon(gf *dst, gf *src, gf c, int sz)
+{
+    const uint8x16_t lo = vld1q_u8(gf_mul_lo[c]);
+    const uint8x16_t hi = vld1q_u8(gf_mul_hi[c]);
+    const uint8x16_t mask = vdupq_n_u8(0x0f);
+    uint8x16_t x, d;
+    int i;
+
+    for (i = 0; i + 16 <= sz; i += 16) {
+	x = vld1q_u8(src + i);
+	d = vld1q_u8(dst + i);
+	d = veorq_u8(d, vqtbl1q_u8(lo, vandq_u8(x, mask)));
+	d = veorq_u8(d, vqtbl1q_u8(hi, vshrq_n_u8(x, 4)));
+	vst1q_u8(dst + i, d);
+    }
+    return i;
+}
+#endif
+
+/* The SIMD kernel picked by init_fec(), if any */
+static int (*addmul_simd)(gf *dst, gf *src, gf c, int sz) ;
+static const char *addmul_simd_name ;
+static int addmul_force_scalar ;
+
+static void
+addmul1(gf *dst, gf *src, gf c, int sz)
+{
+    int done = 0 ;
+
+    if (addmul_simd && !addmul_force_scalar)
+	done = addmul_simd(dst, src, c, sz) ;
+    if (done < sz)
+	addmul1_scalar(dst + done, src + done, c, sz - done) ;
+}
+
+static void
+init_addmul(void)
+{
+#ifdef FEC_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	addmul_simd = addmul_avx2 ;
+	addmul_simd_name = "avx2" ;
+    } else if (__builtin_cpu_supports("ssse3")) {
+	addmul_simd = addmul_ssse3 ;
+	addmul_simd_name = "ssse3" ;
+    }
+#endif
+#ifdef FEC_NEON
+    addmul_simd = addmul_neon ;
+    addmul_simd_name = "neon" ;
+#endif
+}
+
 /*
  * computes C = AB where A is n*k, B is k*m, C is n*m
  */
@@ -612,9 +744,27 @@ init_fec(void)
     init_mul_table();
     TOCK(ticks[0]);
     DDB(fprintf(stderr, "init_mul_table took %ldus\n", ticks[0]);)
+    init_addmul();
     fec_initialized = 1 ;
 }
 
+const char *
+fec_kernel(void)
+{
+    if (fec_initialized == 0)
+	init_fec();
+
+    if (addmul_simd && !addmul_force_scalar)
+	return addmul_simd_name ;
+    return "scalar" ;
+}
+
+void
+fec_force_scalar(int force)
+{
+    addmul_force_scalar = force ;
+}
+
 /*
  * This section contains the proper FEC encoding/decoding routines.
  * The encoding matrix is computed starting with a Vandermonde matrix,
@@ -608,6 +608,312 @@ static int sysfs_is_supported(struct libmtd *lib)
 	return 1;
 }
 
+/*
+ * The below functions read sysfs attribute files relative to an open sysfs
+ * directory. They are used for taking MTD snapshots, which read many files of
+ * the same few directories, so there is no need to compose and resolve the
+ * full path of every file.
+ */
+
+static int read_data_at(int dirfd, const char *name, char *buf, int buf_len)
+{
+	int fd, rd;
+
+	fd = openat(dirfd, name, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	/* A sysfs attribute is returned by a single read */
+	rd = read(fd, buf, buf_len);
+	if (rd == -1) {
+		sys_errmsg("cannot read \"%s\"", name);
+		goto out_error;
+	}
+	if (rd == buf_len) {
+		errmsg("contents of \"%s\" is too long", name);
+		errno = EINVAL;
+		goto out_error;
+	}
+	buf[rd] = '\0';
+
+	if (close(fd))
+		return sys_errmsg("close failed on \"%s\"", name);
+
+	return rd;
+
+out_error:
+	close(fd);
+	return -1;
+}
+
+static int read_ll_at(int dirfd, const char *name, const char *fmt,
+		      long long *value)
+{
+	char buf[50];
+
+	if (read_data_at(dirfd, name, buf, sizeof(buf)) < 0)
+		return -1;
+
+	if (sscanf(buf, fmt, value) != 1 || *value < 0) {
+		errmsg("cannot read non-negative integer from \"%s\"", name);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int read_int_at(int dirfd, const char *name, const char *fmt,
+		       int *value)
+{
+	long long res;
+
+	if (read_ll_at(dirfd, name, fmt, &res))
+		return -1;
+
+	if (res > INT_MAX) {
+		errmsg("value %lld read from \"%s\" is too large", res, name);
+		errno = EINVAL;
+		return -1;
+	}
+
+	*value = res;
+	return 0;
+}
+
+static int read_str_at(int dirfd, const char *name, char *buf, int buf_len)
+{
+	int ret;
+
+	ret = read_data_at(dirfd, name, buf, buf_len);
+	if (ret <= 0)
+		return -1;
+
+	buf[ret - 1] = '\0';
+	return 0;
+}
+
+static int snapshot_dev(int sysfs_fd, int mtd_num, struct mtd_dev_info *mtd)
+{
+	char dir[32], buf[50];
+	int fd, flags, err = -1;
+
+	sprintf(dir, MTD_NAME_PATT, mtd_num);
+	fd = openat(sysfs_fd, dir, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return -1;
+
+	mtd->mtd_num = mtd_num;
+	if (read_data_at(fd, MTD_DEV, buf, sizeof(buf)) < 0)
+		goto out;
+	if (sscanf(buf, "%d:%d\n", &mtd->major, &mtd->minor) != 2) {
+		errmsg("\"%s\" does not have major:minor format", MTD_DEV);
+		errno = EINVAL;
+		goto out;
+	}
+
+	if (read_str_at(fd, MTD_NAME, (char *)mtd->name, MTD_NAME_MAX + 1) ||
+	    read_str_at(fd, MTD_TYPE, (char *)mtd->type_str, MTD_TYPE_MAX + 1) ||
+	    read_int_at(fd, MTD_EB_SIZE, "%lld\n", &mtd->eb_size) ||
+	    read_ll_at(fd, MTD_SIZE, "%lld\n", &mtd->size) ||
+	    read_int_at(fd, MTD_MIN_IO_SIZE, "%lld\n", &mtd->min_io_size) ||
+	    read_int_at(fd, MTD_SUBPAGE_SIZE, "%lld\n", &mtd->subpage_size) ||
+	    read_int_at(fd, MTD_OOB_SIZE, "%lld\n", &mtd->oob_size))
+		goto out;
+
+	/* See 'mtd_get_dev_info1()' */
+	if (read_int_at(fd, MTD_OOBAVAIL, "%lld\n", &mtd->oobavail)) {
+		mtd->oobavail = legacy_get_mtd_oobavail1(mtd_num);
+		if (mtd->oobavail < 0)
+			mtd->oobavail = 0;
+	}
+
+	if (read_int_at(fd, MTD_REGION_CNT, "%lld\n", &mtd->region_cnt) ||
+	    read_int_at(fd, MTD_FLAGS, "%llx\n", &flags))
+		goto out;
+
+	mtd->writable = !!(flags & MTD_WRITEABLE);
+	if ((flags & MTD_NO_ERASE) && (mtd->eb_size == 0))
+		mtd->eb_cnt = 1;
+	else
+		mtd->eb_cnt = mtd->size / mtd->eb_size;
+	mtd->type = type_str2int(mtd->type_str);
+	mtd->bb_allowed = !!(mtd->type == MTD_NANDFLASH ||
+				mtd->type == MTD_MLCNANDFLASH);
+	err = 0;
+out:
+	close(fd);
+	return err;
+}
+
+static int cmp_int(const void *l, const void *r)
+{
+	int a = *(const int *)l, b = *(const int *)r;
+
+	return a < b ? -1 : a > b;
+}
+
+static void free_snapshot(struct mtd_snapshot *snap)
+{
+	if (!snap)
+		return;
+
+	free(snap->devs);
+	free(snap);
+}
+
+/* Without sysfs, fall back to the per-device functions */
+static struct mtd_snapshot *take_legacy_snapshot(struct libmtd *lib,
+						 struct mtd_snapshot *snap)
+{
+	struct mtd_info *info = &snap->info;
+	int i, cnt = 0;
+
+	if (mtd_get_info(lib, info))
+		goto out_free;
+
+	snap->devs = calloc(info->mtd_dev_cnt + 1, sizeof(struct mtd_dev_info));
+	if (!snap->devs) {
+		sys_errmsg("cannot allocate memory");
+		goto out_free;
+	}
+
+	for (i = info->lowest_mtd_num; i <= info->highest_mtd_num; i++) {
+		if (!mtd_dev_present(lib, i))
+			continue;
+		if (cnt == info->mtd_dev_cnt)
+			break;
+		if (mtd_get_dev_info1(lib, i, &snap->devs[cnt]))
+			goto out_free;
+		cnt += 1;
+	}
+	info->mtd_dev_cnt = cnt;
+
+	return snap;
+
+out_free:
+	free_snapshot(snap);
+	return NULL;
+}
+
+static struct mtd_snapshot *take_snapshot(struct libmtd *lib)
+{
+	DIR *sysfs_mtd;
+	struct dirent *dirent;
+	struct mtd_snapshot *snap;
+	struct mtd_info *info;
+	int *nums = NULL, *tmp, cnt = 0, max = 0, sysfs_fd, i;
+
+	snap = calloc(1, sizeof(struct mtd_snapshot));
+	if (!snap) {
+		sys_errmsg("cannot allocate memory");
+		return NULL;
+	}
+	info = &snap->info;
+
+	if (!lib->sysfs_supported)
+		return take_legacy_snapshot(lib, snap);
+
+	info->sysfs_supported = 1;
+
+	sysfs_mtd = opendir(lib->sysfs_mtd);
+	if (!sysfs_mtd) {
+		sys_errmsg("cannot open \"%s\"", lib->sysfs_mtd);
+		goto out_free;
+	}
+	sysfs_fd = dirfd(sysfs_mtd);
+
+	while (1) {
+		int mtd_num;
+		char tmp_buf[256];
+
+		errno = 0;
+		dirent = readdir(sysfs_mtd);
+		if (!dirent)
+			break;
+
+		if (sscanf(dirent->d_name, MTD_NAME_PATT"%s",
+			   &mtd_num, tmp_buf) != 1)
+			continue;
+
+		if (cnt == max) {
+			max = max ? max * 2 : 16;
+			tmp = realloc(nums, max * sizeof(int));
+			if (!tmp) {
+				sys_errmsg("cannot allocate memory");
+				goto out_close;
+			}
+			nums = tmp;
+		}
+		nums[cnt++] = mtd_num;
+	}
+
+	if (errno) {
+		sys_errmsg("readdir failed on \"%s\"", lib->sysfs_mtd);
+		goto out_close;
+	}
+
+	qsort(nums, cnt, sizeof(int), cmp_int);
+
+	snap->devs = calloc(cnt + 1, sizeof(struct mtd_dev_info));
+	if (!snap->devs) {
+		sys_errmsg("cannot allocate memory");
+		goto out_close;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		struct mtd_dev_info *mtd = &snap->devs[info->mtd_dev_cnt];
+
+		if (snapshot_dev(sysfs_fd, nums[i], mtd)) {
+			/* The device may have been removed meanwhile */
+			if (errno == ENOENT) {
+				memset(mtd, 0, sizeof(struct mtd_dev_info));
+				continue;
+			}
+			goto out_close;
+		}
+
+		if (!info->mtd_dev_cnt)
+			info->lowest_mtd_num = mtd->mtd_num;
+		info->highest_mtd_num = mtd->mtd_num;
+		info->mtd_dev_cnt += 1;
+	}
+
+	free(nums);
+	closedir(sysfs_mtd);
+	return snap;
+
+out_close:
+	free(nums);
+	closedir(sysfs_mtd);
+out_free:
+	free_snapshot(snap);
+	return NULL;
+}
+
+const struct mtd_snapshot *mtd_get_snapshot(libmtd_t desc)
+{
+	struct libmtd *lib = (struct libmtd *)desc;
+
+	if (!lib->snap)
+		lib->snap = take_snapshot(lib);
+	return lib->snap;
+}
+
+const struct mtd_snapshot *mtd_refresh_snapshot(libmtd_t desc)
+{
+	mtd_invalidate_snapshot(desc);
+	return mtd_get_snapshot(desc);
+}
+
+void mtd_invalidate_snapshot(libmtd_t desc)
+{
+	struct libmtd *lib = (struct libmtd *)desc;
+
+	free_snapshot(lib->snap);
+	lib->snap = NULL;
+}
+
 libmtd_t libmtd_open(void)
 {
 	struct libmtd *lib;
@@ -634,7 +940,7 @@ libmtd_t libmtd_open(void)
 		free(lib->mtd_name);
 		lib->mtd_name = lib->mtd = lib->sysfs_mtd = NULL;
 
-		if (!legacy_procfs_is_supported()) {
+		if (!legacy_procfs_is_supported() && !emu_enabled()) {
 			free(lib);
 			lib = NULL;
 		}
@@ -693,6 +999,7 @@ void libmtd_close(libmtd_t desc)
 {
 	struct libmtd *lib = (struct libmtd *)desc;
 
+	free_snapshot(lib->snap);
 	free(lib->mtd_flags);
 	free(lib->mtd_region_cnt);
 	free(lib->mtd_oob_size);
@@ -731,8 +1038,12 @@ int mtd_get_info(libmtd_t desc, struct mtd_info *info)
 
 	memset(info, 0, sizeof(struct mtd_info));
 
-	if (!lib->sysfs_supported)
+	if (!lib->sysfs_supported) {
+		/* No MTD subsystem, only emulated devices, see 'libmtd_open()' */
+		if (emu_enabled() && !legacy_procfs_is_supported())
+			return 0;
 		return legacy_mtd_get_info(info);
+	}
 
 	info->sysfs_supported = 1;
 
@@ -858,8 +1169,13 @@ int mtd_get_dev_info1(libmtd_t desc, int mtd_num, struct mtd_dev_info *mtd)
 int mtd_get_dev_info(libmtd_t desc, const char *node, struct mtd_dev_info *mtd)
 {
 	int mtd_num;
+	const char *path;
 	struct libmtd *lib = (struct libmtd *)desc;
 
+	path = emu_node_path(node);
+	if (path)
+		return emu_get_dev_info(path, mtd);
+
 	if (!lib->sysfs_supported)
 		return legacy_get_dev_info(node, mtd);
 
@@ -883,6 +1199,15 @@ int mtd_get_dev_info2(libmtd_t desc, const char *name, struct mtd_dev_info *mtd)
 	return mtd_get_dev_info1(desc, mtd_num, mtd);
 }
 
+int mtd_open_node(const char *node, int flags)
+{
+	const char *path = emu_node_path(node);
+
+	if (path)
+		return emu_open_node(path, flags);
+	return open(node, flags);
+}
+
 static inline int mtd_ioctl_error(const struct mtd_dev_info *mtd, int eb,
 				  const char *sreq)
 {
@@ -917,6 +1242,11 @@ static int mtd_xlock(const struct mtd_dev_info *mtd, int fd, int eb,
 			return ret;
 	}
 
+	if (mtd->emulated) {
+		errno = EOPNOTSUPP;
+		return mtd_ioctl_error(mtd, eb, sreq);
+	}
+
 	ei.start = eb * mtd->eb_size;
 	ei.length = mtd->eb_size * blocks;
 
@@ -961,6 +1291,9 @@ int mtd_erase_multi(libmtd_t desc, const struct mtd_dev_info *mtd,
 	if (ret)
 		return ret;
 
+	if (mtd->emulated)
+		return emu_erase(mtd, fd, eb, blocks);
+
 	ei64.start = (__u64)eb * mtd->eb_size;
 	ei64.length = (__u64)mtd->eb_size * blocks;
 
@@ -1026,6 +1359,11 @@ int mtd_is_locked(const struct mtd_dev_info *mtd, int fd, int eb)
 	int ret;
 	erase_info_t ei;
 
+	if (mtd->emulated) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
 	ei.start = eb * mtd->eb_size;
 	ei.length = mtd->eb_size;
 
@@ -1130,6 +1468,9 @@ int mtd_is_bad(const struct mtd_dev_info *mtd, int fd, int eb)
 	if (!mtd->bb_allowed)
 		return 0;
 
+	if (mtd->emulated)
+		return emu_is_bad(mtd, fd, eb);
+
 	seek = (loff_t)eb * mtd->eb_size;
 	ret = ioctl(fd, MEMGETBADBLOCK, &seek);
 	if (ret == -1)
@@ -1151,6 +1492,9 @@ int mtd_mark_bad(const struct mtd_dev_info *mtd, int fd, int eb)
 	if (ret)
 		return ret;
 
+	if (mtd->emulated)
+		return emu_mark_bad(mtd, fd, eb);
+
 	seek = (loff_t)eb * mtd->eb_size;
 	ret = ioctl(fd, MEMSETBADBLOCK, &seek);
 	if (ret == -1)
@@ -1175,20 +1519,25 @@ int mtd_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
 		return -1;
 	}
 
-	/* Seek to the beginning of the eraseblock */
+	/*
+	 * Positional reads do not touch the file offset, so @fd may be shared
+	 * by several threads.
+	 */
 	seek = (off_t)eb * mtd->eb_size + offs;
-	if (lseek(fd, seek, SEEK_SET) != seek)
-		return sys_errmsg("cannot seek mtd%d to offset %lld",
-				  mtd->mtd_num, (long long)seek);
-
 	while (rd < len) {
-		ret = read(fd, buf + rd, len - rd);
-		if (ret < 0)
+		ret = pread(fd, buf + rd, len - rd, seek + rd);
+		/* An emulated device file may have been truncated */
+		if (ret == 0)
+			errno = EIO;
+		if (ret <= 0)
 			return sys_errmsg("cannot read %d bytes from mtd%d (eraseblock %d, offset %d)",
 					  len - rd, mtd->mtd_num, eb, offs + rd);
 		rd += ret;
 	}
 
+	if (mtd->emulated)
+		emu_read(mtd, offs, len);
+
 	return 0;
 }
 
@@ -1261,6 +1610,10 @@ int mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb,
 		return -1;
 	}
 
+	if (mtd->emulated)
+		return emu_write(mtd, fd, eb, offs, data, len, oob, ooblen,
+				 mode);
+
 	/* Calculate seek address */
 	seek = (off_t)eb * mtd->eb_size + offs;
 
@@ -1286,11 +1639,7 @@ int mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb,
 			return sys_errmsg("cannot write to OOB");
 	}
 	if (data) {
-		/* Seek to the beginning of the eraseblock */
-		if (lseek(fd, seek, SEEK_SET) != seek)
-			return sys_errmsg("cannot seek mtd%d to offset %lld",
-					mtd->mtd_num, (long long)seek);
-		ret = write(fd, data, len);
+		ret = pwrite(fd, data, len, seek);
 		if (ret != len)
 			return sys_errmsg("cannot write %d bytes to mtd%d "
 					  "(eraseblock %d, offset %d)",
@@ -1337,6 +1686,10 @@ static int do_oob_op(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
 		return -1;
 	}
 
+	if (mtd->emulated)
+		return emu_oob_op(mtd, fd, start, length, data,
+				  cmd64 == MEMWRITEOOB64);
+
 	oob64.start = start;
 	oob64.length = length;
 	oob64.usr_ptr = (uint64_t)(unsigned long)data;
@@ -1400,6 +1753,9 @@ int mtd_probe_node(libmtd_t desc, const char *node)
 	int i, mjr, mnr;
 	struct libmtd *lib = (struct libmtd *)desc;
 
+	if (emu_node_path(node))
+		return 1;
+
 	if (stat(node, &st))
 		return sys_errmsg("cannot get information about \"%s\"", node);
 
@@ -0,0 +1,132 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * This file is part of the MTD library. Implements batches of read and write
+ * requests, executed by several threads. It lives in its own file so that
+ * only the users of the batch functions have to link against pthreads.
+ */
+
+#define PROGRAM_NAME "libmtd"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <libmtd.h>
+#include "common.h"
+
+struct mtd_batch {
+	libmtd_t desc;
+	const struct mtd_dev_info *mtd;
+	int fd;
+	int write;
+	struct mtd_io_req *reqs;
+	int cnt;
+	int next;
+	int failed;
+	pthread_mutex_t lock;
+};
+
+static void do_req(struct mtd_batch *b, struct mtd_io_req *req)
+{
+	int err;
+
+	if (b->write)
+		err = mtd_write(b->desc, b->mtd, b->fd, req->eb, req->offs,
+				req->buf, req->len, NULL, 0, 0);
+	else
+		err = mtd_read(b->mtd, b->fd, req->eb, req->offs, req->buf,
+			       req->len);
+
+	req->err = err ? errno : 0;
+}
+
+static void *batch_thread(void *arg)
+{
+	struct mtd_batch *b = arg;
+	struct mtd_io_req *req;
+
+	while (1) {
+		pthread_mutex_lock(&b->lock);
+		req = b->next < b->cnt ? &b->reqs[b->next++] : NULL;
+		pthread_mutex_unlock(&b->lock);
+		if (!req)
+			break;
+
+		do_req(b, req);
+		if (req->err) {
+			pthread_mutex_lock(&b->lock);
+			b->failed = 1;
+			pthread_mutex_unlock(&b->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Run the requests of @b using up to @jobs threads, the calling one included.
+ * If fewer threads can be created, the ones there are do all the work.
+ */
+static int run_batch(struct mtd_batch *b, int jobs)
+{
+	pthread_t *threads = NULL;
+	int i = 0;
+
+	if (jobs > b->cnt)
+		jobs = b->cnt;
+	if (jobs > 1)
+		threads = malloc((jobs - 1) * sizeof(pthread_t));
+
+	pthread_mutex_init(&b->lock, NULL);
+	if (threads)
+		for (; i < jobs - 1; i++)
+			if (pthread_create(&threads[i], NULL, batch_thread, b))
+				break;
+
+	batch_thread(b);
+
+	while (i--)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&b->lock);
+	free(threads);
+
+	return b->failed ? -1 : 0;
+}
+
+int mtd_read_batch(const struct mtd_dev_info *mtd, int fd,
+		   struct mtd_io_req *reqs, int cnt, int jobs)
+{
+	struct mtd_batch b = {
+		.mtd = mtd,
+		.fd = fd,
+		.reqs = reqs,
+		.cnt = cnt,
+	};
+
+	return run_batch(&b, jobs);
+}
+
+int mtd_write_batch(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+		    struct mtd_io_req *reqs, int cnt, int jobs)
+{
+	struct mtd_batch b = {
+		.desc = desc,
+		.mtd = mtd,
+		.fd = fd,
+		.write = 1,
+		.reqs = reqs,
+		.cnt = cnt,
+	};
+
+	return run_batch(&b, jobs);
+}
@@ -0,0 +1,769 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * This file is part of the MTD library. Implements MTD devices emulated on top
+ * of regular files, so that the MTD tools can be run and profiled on systems
+ * without MTD hardware or the nandsim kernel module.
+ *
+ * The contents of the emulated device is the file itself. The OOB area of a
+ * NAND device is kept in the "<file>.oob" side file, which also holds the bad
+ * eraseblock markers: like on real NAND, an eraseblock is bad if the first OOB
+ * byte of its first page is not 0xFF. Erasing sets the data and the OOB area to
+ * 0xFF and programming can only clear bits.
+ *
+ * The device geometry and the timing are taken from the "MTD_EMU" environment
+ * variable, a comma-separated list of "option=value" pairs:
+ *
+ * type=nand|mlc-nand|nor     flash type (default "nand")
+ * eb_size=<bytes>            eraseblock size (default 128KiB, NOR 64KiB)
+ * page_size=<bytes>          min. I/O unit size (default 2KiB, NOR 1)
+ * subpage_size=<bytes>       sub-page size (default page size)
+ * oob_size=<bytes>           OOB size per page (default 64, NOR 0)
+ * oobavail=<bytes>           free OOB bytes per page, placed at the end of the
+ *                            OOB area (default half the OOB)
+ * size=<bytes>               create or grow the file to this size
+ * bad=<eb>[:<eb>...]         eraseblocks to mark bad
+ * read_us, write_us=<usec>   delay per page read or programmed
+ * erase_us=<usec>            delay per eraseblock erased
+ */
+
+#define PROGRAM_NAME "libmtd"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <mtd/mtd-user.h>
+
+#include <libmtd.h>
+#include "libmtd_int.h"
+#include "common.h"
+
+#define EMU_ENV        "MTD_EMU"
+#define EMU_PREFIX     "file:"
+#define EMU_OOB_SUFFIX ".oob"
+#define EMU_MAX_FILES  16
+
+/**
+ * struct emu_config - emulated MTD device configuration.
+ * @type_str: flash type string
+ * @type: flash type (%MTD_NANDFLASH, etc)
+ * @eb_size: eraseblock size
+ * @min_io_size: minimum input/output unit size
+ * @subpage_size: sub-page size
+ * @oob_size: OOB size per page
+ * @oobavail: free OOB size per page
+ * @size: minimum size of the emulated device, zero to use the file size
+ * @bad: eraseblocks to mark bad
+ * @bad_cnt: count of elements in @bad
+ * @read_us: page read time in microseconds
+ * @write_us: page program time in microseconds
+ * @erase_us: eraseblock erase time in microseconds
+ */
+struct emu_config {
+	const char *type_str;
+	int type;
+	int eb_size;
+	int min_io_size;
+	int subpage_size;
+	int oob_size;
+	int oobavail;
+	long long size;
+	int *bad;
+	int bad_cnt;
+	int read_us;
+	int write_us;
+	int erase_us;
+};
+
+/*
+ * The OOB side files of the emulated devices, looked up by the device number
+ * and inode of the emulated device file. Entries are only added by
+ * 'emu_get_dev_info()', so the I/O functions may run in several threads.
+ */
+struct emu_file {
+	dev_t dev;
+	ino_t ino;
+	int oob_fd;
+};
+
+static struct emu_config cfg;
+static int cfg_parsed;
+static struct emu_file files[EMU_MAX_FILES];
+static int file_cnt;
+
+static int parse_int(const char *opt, const char *val, int bytes, int *res)
+{
+	long long num;
+	char *endp;
+
+	if (bytes)
+		num = util_get_bytes(val);
+	else {
+		num = strtoll(val, &endp, 0);
+		if (*val == '\0' || *endp != '\0')
+			num = -1;
+	}
+
+	if (num < 0 || num > INT_MAX) {
+		errmsg("bad value \"%s\" of \"%s\" in %s", val, opt, EMU_ENV);
+		errno = EINVAL;
+		return -1;
+	}
+
+	*res = num;
+	return 0;
+}
+
+static int parse_bad(char *val)
+{
+	char *eb, *saveptr;
+	int *tmp;
+
+	for (eb = strtok_r(val, ":", &saveptr); eb;
+	     eb = strtok_r(NULL, ":", &saveptr)) {
+		tmp = realloc(cfg.bad, (cfg.bad_cnt + 1) * sizeof(int));
+		if (!tmp)
+			return sys_errmsg("cannot allocate memory");
+		cfg.bad = tmp;
+
+		if (parse_int("bad", eb, 0, &cfg.bad[cfg.bad_cnt]))
+			return -1;
+		cfg.bad_cnt += 1;
+	}
+
+	return 0;
+}
+
+static int parse_option(char *opt)
+{
+	char *val = strchr(opt, '=');
+
+	if (!val) {
+		errmsg("bad option \"%s\" in %s", opt, EMU_ENV);
+		errno = EINVAL;
+		return -1;
+	}
+	*val++ = '\0';
+
+	if (!strcmp(opt, "type")) {
+		if (!strcmp(val, "nand")) {
+			cfg.type_str = "nand";
+			cfg.type = MTD_NANDFLASH;
+		} else if (!strcmp(val, "mlc-nand")) {
+			cfg.type_str = "mlc-nand";
+			cfg.type = MTD_MLCNANDFLASH;
+		} else if (!strcmp(val, "nor")) {
+			cfg.type_str = "nor";
+			cfg.type = MTD_NORFLASH;
+		} else {
+			errmsg("unsupported flash type \"%s\" in %s",
+			       val, EMU_ENV);
+			errno = EINVAL;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (!strcmp(opt, "bad"))
+		return parse_bad(val);
+
+	if (!strcmp(opt, "size")) {
+		cfg.size = util_get_bytes(val);
+		if (cfg.size < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (!strcmp(opt, "eb_size"))
+		return parse_int(opt, val, 1, &cfg.eb_size);
+	if (!strcmp(opt, "page_size"))
+		return parse_int(opt, val, 1, &cfg.min_io_size);
+	if (!strcmp(opt, "subpage_size"))
+		return parse_int(opt, val, 1, &cfg.subpage_size);
+	if (!strcmp(opt, "oob_size"))
+		return parse_int(opt, val, 1, &cfg.oob_size);
+	if (!strcmp(opt, "oobavail"))
+		return parse_int(opt, val, 1, &cfg.oobavail);
+	if (!strcmp(opt, "read_us"))
+		return parse_int(opt, val, 0, &cfg.read_us);
+	if (!strcmp(opt, "write_us"))
+		return parse_int(opt, val, 0, &cfg.write_us);
+	if (!strcmp(opt, "erase_us"))
+		return parse_int(opt, val, 0, &cfg.erase_us);
+
+	errmsg("unknown option \"%s\" in %s", opt, EMU_ENV);
+	errno = EINVAL;
+	return -1;
+}
+
+static int parse_config(void)
+{
+	char *env, *str, *opt, *saveptr;
+	int nor, err = 0;
+
+	if (cfg_parsed)
+		return 0;
+
+	cfg.type_str = "nand";
+	cfg.type = MTD_NANDFLASH;
+	cfg.eb_size = cfg.min_io_size = cfg.subpage_size = -1;
+	cfg.oob_size = cfg.oobavail = -1;
+
+	env = getenv(EMU_ENV);
+	if (env) {
+		str = strdup(env);
+		if (!str)
+			return sys_errmsg("cannot allocate memory");
+
+		for (opt = strtok_r(str, ",", &saveptr); opt && !err;
+		     opt = strtok_r(NULL, ",", &saveptr))
+			err = parse_option(opt);
+		free(str);
+		if (err)
+			return -1;
+	}
+
+	nor = cfg.type == MTD_NORFLASH;
+	if (cfg.eb_size == -1)
+		cfg.eb_size = nor ? 64 * 1024 : 128 * 1024;
+	if (cfg.min_io_size == -1)
+		cfg.min_io_size = nor ? 1 : 2048;
+	if (cfg.subpage_size == -1)
+		cfg.subpage_size = cfg.min_io_size;
+	if (cfg.oob_size == -1)
+		cfg.oob_size = nor ? 0 : 64;
+	if (cfg.oobavail == -1)
+		cfg.oobavail = cfg.oob_size / 2;
+
+	if (cfg.min_io_size <= 0 || cfg.subpage_size <= 0 ||
+	    (cfg.min_io_size & (cfg.min_io_size - 1)) ||
+	    cfg.min_io_size % cfg.subpage_size ||
+	    cfg.eb_size < cfg.min_io_size || cfg.eb_size % cfg.min_io_size) {
+		errmsg("bad geometry in %s: eraseblock %d, page %d, sub-page %d",
+		       EMU_ENV, cfg.eb_size, cfg.min_io_size, cfg.subpage_size);
+		errno = EINVAL;
+		return -1;
+	}
+	/* The first OOB byte is the bad block marker, it is never free */
+	if (cfg.oobavail > (cfg.oob_size ? cfg.oob_size - 1 : 0) ||
+	    (nor && cfg.oob_size)) {
+		errmsg("bad OOB size %d (%d free) in %s",
+		       cfg.oob_size, cfg.oobavail, EMU_ENV);
+		errno = EINVAL;
+		return -1;
+	}
+
+	cfg_parsed = 1;
+	return 0;
+}
+
+int emu_enabled(void)
+{
+	return getenv(EMU_ENV) != NULL;
+}
+
+const char *emu_node_path(const char *node)
+{
+	struct stat st;
+
+	if (!strncmp(node, EMU_PREFIX, strlen(EMU_PREFIX)))
+		return node + strlen(EMU_PREFIX);
+
+	if (emu_enabled() && !stat(node, &st) && S_ISREG(st.st_mode))
+		return node;
+
+	return NULL;
+}
+
+/* Fill @fd with 0xFF bytes from offset @from up to offset @to */
+static int fill_ff(int fd, const char *file, off_t from, off_t to)
+{
+	char buf[4096];
+	ssize_t ret;
+
+	memset(buf, 0xFF, sizeof(buf));
+	while (from < to) {
+		size_t len = sizeof(buf);
+
+		if ((off_t)len > to - from)
+			len = to - from;
+
+		ret = pwrite(fd, buf, len, from);
+		if (ret <= 0)
+			return sys_errmsg("cannot write to \"%s\"", file);
+		from += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Grow the regular file @fd to the size given by the "size" option, filling it
+ * with 0xFF bytes. @st is the state of the file and is updated.
+ */
+static int grow_file(int fd, const char *path, struct stat *st)
+{
+	if (cfg.size <= st->st_size)
+		return 0;
+
+	if (fill_ff(fd, path, st->st_size, cfg.size))
+		return -1;
+	st->st_size = cfg.size;
+	return 0;
+}
+
+static int open_oob_file(const char *path, int flags, long long eb_cnt)
+{
+	char file[strlen(path) + sizeof(EMU_OOB_SUFFIX)];
+	long long pages = eb_cnt * (cfg.eb_size / cfg.min_io_size);
+	struct stat st;
+	int fd, i;
+
+	sprintf(file, "%s" EMU_OOB_SUFFIX, path);
+	fd = open(file, flags | O_CLOEXEC | (flags == O_RDWR ? O_CREAT : 0),
+		  0644);
+	if (fd == -1)
+		return sys_errmsg("cannot open \"%s\"", file);
+
+	if (fstat(fd, &st)) {
+		sys_errmsg("cannot stat \"%s\"", file);
+		goto out_close;
+	}
+
+	if (flags != O_RDWR) {
+		if (st.st_size < pages * cfg.oob_size) {
+			errmsg("\"%s\" is too short", file);
+			errno = EINVAL;
+			goto out_close;
+		}
+		return fd;
+	}
+
+	if (fill_ff(fd, file, st.st_size, pages * cfg.oob_size))
+		goto out_close;
+
+	for (i = 0; i < cfg.bad_cnt; i++) {
+		off_t offs;
+
+		if (cfg.bad[i] >= eb_cnt) {
+			errmsg("bad eraseblock %d is out of range, \"%s\" has %lld eraseblocks",
+			       cfg.bad[i], path, eb_cnt);
+			errno = EINVAL;
+			goto out_close;
+		}
+
+		offs = (off_t)cfg.bad[i] * (cfg.eb_size / cfg.min_io_size) *
+		       cfg.oob_size;
+		if (pwrite(fd, "", 1, offs) != 1) {
+			sys_errmsg("cannot write to \"%s\"", file);
+			goto out_close;
+		}
+	}
+
+	return fd;
+
+out_close:
+	close(fd);
+	return -1;
+}
+
+static int register_file(const struct stat *st, int oob_fd)
+{
+	int i;
+
+	for (i = 0; i < file_cnt; i++) {
+		if (files[i].dev == st->st_dev && files[i].ino == st->st_ino) {
+			if (files[i].oob_fd != -1)
+				close(files[i].oob_fd);
+			files[i].oob_fd = oob_fd;
+			return 0;
+		}
+	}
+
+	if (file_cnt == EMU_MAX_FILES) {
+		errmsg("too many emulated MTD devices, the maximum is %d",
+		       EMU_MAX_FILES);
+		errno = EMFILE;
+		return -1;
+	}
+
+	files[file_cnt].dev = st->st_dev;
+	files[file_cnt].ino = st->st_ino;
+	files[file_cnt].oob_fd = oob_fd;
+	file_cnt += 1;
+	return 0;
+}
+
+int emu_get_dev_info(const char *path, struct mtd_dev_info *mtd)
+{
+	int fd, oob_fd = -1, flags = O_RDWR;
+	const char *name;
+	struct stat st;
+	long long eb_cnt;
+
+	memset(mtd, 0, sizeof(struct mtd_dev_info));
+	if (parse_config())
+		return -1;
+
+	fd = open(path, O_RDWR | O_CLOEXEC | (cfg.size ? O_CREAT : 0), 0644);
+	if (fd == -1 && (errno == EACCES || errno == EROFS)) {
+		flags = O_RDONLY;
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd == -1)
+		return sys_errmsg("cannot open \"%s\"", path);
+
+	if (fstat(fd, &st)) {
+		sys_errmsg("cannot stat \"%s\"", path);
+		goto out_close;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		errmsg("\"%s\" is not a regular file", path);
+		errno = EINVAL;
+		goto out_close;
+	}
+
+	if (flags == O_RDWR && grow_file(fd, path, &st))
+		goto out_close;
+
+	if (st.st_size == 0 || st.st_size % cfg.eb_size) {
+		errmsg("size of \"%s\" (%lld bytes) is not a multiple of the eraseblock size %d",
+		       path, (long long)st.st_size, cfg.eb_size);
+		errno = EINVAL;
+		goto out_close;
+	}
+
+	eb_cnt = st.st_size / cfg.eb_size;
+	if (eb_cnt > INT_MAX) {
+		errmsg("\"%s\" is too large", path);
+		errno = EINVAL;
+		goto out_close;
+	}
+
+	if (cfg.oob_size) {
+		oob_fd = open_oob_file(path, flags, eb_cnt);
+		if (oob_fd == -1)
+			goto out_close;
+	}
+
+	if (register_file(&st, oob_fd))
+		goto out_close;
+	close(fd);
+
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+
+	mtd->mtd_num = -1;
+	mtd->type = cfg.type;
+	strcpy((char *)mtd->type_str, cfg.type_str);
+	strncpy((char *)mtd->name, name, MTD_NAME_MAX);
+	mtd->size = st.st_size;
+	mtd->eb_cnt = eb_cnt;
+	mtd->eb_size = cfg.eb_size;
+	mtd->min_io_size = cfg.min_io_size;
+	mtd->subpage_size = cfg.subpage_size;
+	mtd->oob_size = cfg.oob_size;
+	mtd->oobavail = cfg.oobavail;
+	mtd->writable = flags == O_RDWR;
+	mtd->bb_allowed = cfg.type != MTD_NORFLASH;
+	mtd->emulated = 1;
+	return 0;
+
+out_close:
+	if (oob_fd != -1)
+		close(oob_fd);
+	close(fd);
+	return -1;
+}
+
+/*
+ * Open the file of an emulated device. Like 'emu_get_dev_info()', create it
+ * and grow it to the size given by the "size" option if it is opened for
+ * writing, so that the order of the two calls does not matter.
+ */
+int emu_open_node(const char *path, int flags)
+{
+	struct stat st;
+	int fd, err;
+
+	if (parse_config())
+		return -1;
+
+	if (!cfg.size || (flags & O_ACCMODE) == O_RDONLY)
+		return open(path, flags);
+
+	fd = open(path, flags | O_CREAT, 0644);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &st)) {
+		err = errno;
+		goto out_close;
+	}
+
+	if (S_ISREG(st.st_mode) && grow_file(fd, path, &st)) {
+		err = errno;
+		goto out_close;
+	}
+
+	return fd;
+
+out_close:
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+/* Find the OOB side file of the emulated device open as @fd */
+static int find_oob_fd(const struct mtd_dev_info *mtd, int fd)
+{
+	struct stat st;
+	int i;
+
+	if (!mtd->oob_size) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if (fstat(fd, &st))
+		return sys_errmsg("cannot stat emulated mtd device fd %d", fd);
+
+	for (i = 0; i < file_cnt; i++)
+		if (files[i].dev == st.st_dev && files[i].ino == st.st_ino)
+			return files[i].oob_fd;
+
+	errmsg("fd %d is not an emulated mtd device", fd);
+	errno = EINVAL;
+	return -1;
+}
+
+static void delay(int us, int cnt)
+{
+	long long total = (long long)us * cnt;
+	struct timespec ts;
+
+	if (total <= 0)
+		return;
+
+	ts.tv_sec = total / 1000000;
+	ts.tv_nsec = (total % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+static int pages(const struct mtd_dev_info *mtd, int offs, int len)
+{
+	if (len <= 0)
+		return 0;
+	return (offs + len - 1) / mtd->min_io_size - offs / mtd->min_io_size + 1;
+}
+
+/*
+ * Program @len bytes of @buf at offset @offs of @fd. Like flash, programming
+ * can only change bits from one to zero.
+ */
+static int program(int fd, const void *buf, int len, off_t offs)
+{
+	const uint8_t *src = buf;
+	uint8_t *old;
+	int i, ret = -1;
+
+	old = malloc(len);
+	if (!old) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (pread(fd, old, len, offs) != len)
+		goto out;
+
+	for (i = 0; i < len; i++)
+		old[i] &= src[i];
+
+	if (pwrite(fd, old, len, offs) == len)
+		ret = 0;
+out:
+	free(old);
+	return ret;
+}
+
+static off_t oob_offs(const struct mtd_dev_info *mtd, int eb, int page)
+{
+	return ((off_t)eb * (mtd->eb_size / mtd->min_io_size) + page) *
+	       mtd->oob_size;
+}
+
+int emu_erase(const struct mtd_dev_info *mtd, int fd, int eb, int blocks)
+{
+	int ofd = -1, ret, i;
+	void *buf;
+
+	if (mtd->oob_size) {
+		ofd = find_oob_fd(mtd, fd);
+		if (ofd == -1)
+			return -1;
+	}
+
+	for (i = eb; i < eb + blocks; i++) {
+		ret = emu_is_bad(mtd, fd, i);
+		if (ret < 0)
+			return -1;
+		if (ret) {
+			errmsg("cannot erase bad eraseblock %d (emulated mtd \"%s\")",
+			       i, mtd->name);
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	buf = malloc(mtd->eb_size);
+	if (!buf)
+		return sys_errmsg("cannot allocate %d bytes of memory",
+				  mtd->eb_size);
+	memset(buf, 0xFF, mtd->eb_size);
+
+	for (i = eb; i < eb + blocks; i++) {
+		int oob_len = mtd->eb_size / mtd->min_io_size * mtd->oob_size;
+
+		ret = pwrite(fd, buf, mtd->eb_size, (off_t)i * mtd->eb_size);
+		if (ret == mtd->eb_size && ofd != -1)
+			ret = pwrite(ofd, buf, oob_len, oob_offs(mtd, i, 0)) ==
+			      oob_len ? mtd->eb_size : -1;
+		if (ret != mtd->eb_size) {
+			sys_errmsg("cannot erase eraseblock %d (emulated mtd \"%s\")",
+				   i, mtd->name);
+			free(buf);
+			return -1;
+		}
+	}
+
+	free(buf);
+	delay(cfg.erase_us, blocks);
+	return 0;
+}
+
+int emu_is_bad(const struct mtd_dev_info *mtd, int fd, int eb)
+{
+	int ofd;
+	uint8_t bbm;
+
+	if (!mtd->bb_allowed)
+		return 0;
+
+	ofd = find_oob_fd(mtd, fd);
+	if (ofd == -1)
+		return -1;
+
+	if (pread(ofd, &bbm, 1, oob_offs(mtd, eb, 0)) != 1)
+		return sys_errmsg("cannot read bad block marker of eraseblock %d",
+				  eb);
+	return bbm != 0xFF;
+}
+
+int emu_mark_bad(const struct mtd_dev_info *mtd, int fd, int eb)
+{
+	int ofd;
+
+	ofd = find_oob_fd(mtd, fd);
+	if (ofd == -1)
+		return -1;
+
+	if (pwrite(ofd, "", 1, oob_offs(mtd, eb, 0)) != 1)
+		return sys_errmsg("cannot mark eraseblock %d bad", eb);
+	return 0;
+}
+
+void emu_read(const struct mtd_dev_info *mtd, int offs, int len)
+{
+	delay(cfg.read_us, pages(mtd, offs, len));
+}
+
+int emu_write(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	      void *data, int len, void *oob, int ooblen, uint8_t mode)
+{
+	off_t seek = (off_t)eb * mtd->eb_size + offs;
+
+	/*
+	 * There is no ECC layout to place the OOB data around: raw and placed
+	 * OOB data is stored from the start of the OOB area of the page, and
+	 * the free bytes of %MTD_OPS_AUTO_OOB are the last @oobavail bytes, so
+	 * that they never cover the bad block marker.
+	 */
+	if (oob) {
+		int ofd = find_oob_fd(mtd, fd), max = mtd->oob_size;
+		off_t pos = oob_offs(mtd, eb, offs / mtd->min_io_size);
+
+		if (ofd == -1)
+			return -1;
+		if (mode == MTD_OPS_AUTO_OOB) {
+			max = mtd->oobavail;
+			pos += mtd->oob_size - mtd->oobavail;
+		}
+		if (ooblen > max) {
+			errmsg("OOB length %d is larger than the %s size %d",
+			       ooblen, mode == MTD_OPS_AUTO_OOB ?
+			       "free OOB" : "OOB", max);
+			errno = EINVAL;
+			return -1;
+		}
+		if (program(ofd, oob, ooblen, pos))
+			return sys_errmsg("cannot write to OOB");
+	}
+
+	if (data && program(fd, data, len, seek))
+		return sys_errmsg("cannot write %d bytes to emulated mtd \"%s\" (eraseblock %d, offset %d)",
+				  len, mtd->name, eb, offs);
+
+	delay(cfg.write_us, pages(mtd, offs, len));
+	return 0;
+}
+
+int emu_oob_op(const struct mtd_dev_info *mtd, int fd, uint64_t start,
+	       uint64_t length, void *data, int write)
+{
+	int ofd, page_offs;
+	off_t offs;
+
+	ofd = find_oob_fd(mtd, fd);
+	if (ofd == -1)
+		return -1;
+
+	/* Like the kernel, do not let the access run into the next page */
+	page_offs = start & (mtd->min_io_size - 1);
+	if (page_offs + length > (uint64_t)mtd->oob_size) {
+		errmsg("cannot access %llu OOB bytes at offset %d of the OOB area, emulated mtd \"%s\" OOB size is %d bytes",
+		       (unsigned long long)length, page_offs, mtd->name,
+		       mtd->oob_size);
+		errno = EINVAL;
+		return -1;
+	}
+	offs = (off_t)(start / mtd->min_io_size) * mtd->oob_size + page_offs;
+
+	if (write) {
+		if (program(ofd, data, length, offs))
+			return sys_errmsg("cannot write OOB of emulated mtd \"%s\", offset %llu",
+					  mtd->name, (unsigned long long)start);
+	} else if (pread(ofd, data, length, offs) != (ssize_t)length)
+		return sys_errmsg("cannot read OOB of emulated mtd \"%s\", offset %llu",
+				  mtd->name, (unsigned long long)start);
+
+	return 0;
+}
@@ -72,6 +72,7 @@ extern "C" {
  *                 %MEMREADOOB64, %MEMWRITEOOB64 MTD device ioctls are
  *                 supported, %OFFS64_IOCTLS_NOT_SUPPORTED if not, and
  *                 %OFFS64_IOCTLS_UNKNOWN if it is not known yet;
+ * @snap: cached MTD snapshot, see 'mtd_get_snapshot()'
  *
  *  Note, we cannot find out whether 64-bit ioctls are supported by MTD when we
  *  are initializing the library, because this requires an MTD device node.
@@ -99,6 +100,7 @@ struct libmtd
 	char *mtd_flags;
 	unsigned int sysfs_supported:1;
 	unsigned int offs64_ioctls:2;
+	struct mtd_snapshot *snap;
 };
 
 int legacy_procfs_is_supported(void);
@@ -110,6 +112,19 @@ int legacy_get_dev_info2(const char *name, struct mtd_dev_info *mtd);
 int legacy_get_mtd_oobavail(const char *node);
 int legacy_get_mtd_oobavail1(int mtd_num);
 
+int emu_enabled(void);
+const char *emu_node_path(const char *node);
+int emu_get_dev_info(const char *path, struct mtd_dev_info *mtd);
+int emu_open_node(const char *path, int flags);
+int emu_erase(const struct mtd_dev_info *mtd, int fd, int eb, int blocks);
+int emu_is_bad(const struct mtd_dev_info *mtd, int fd, int eb);
+int emu_mark_bad(const struct mtd_dev_info *mtd, int fd, int eb);
+void emu_read(const struct mtd_dev_info *mtd, int offs, int len);
+int emu_write(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	      void *data, int len, void *oob, int ooblen, uint8_t mode);
+int emu_oob_op(const struct mtd_dev_info *mtd, int fd, uint64_t start,
+	       uint64_t length, void *data, int write);
+
 #ifdef __cplusplus
 }
 #endif
@@ -28,6 +28,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #include <mtd_swab.h>
 #include <mtd/ubi-media.h>
@@ -48,173 +50,598 @@ static int all_ff(const void *buf, int len)
 	return 1;
 }
 
-int ubi_scan(struct mtd_dev_info *mtd, int fd, struct ubi_scan_info **info,
-	     int verbose)
+/*
+ * Account eraseblock @eb in @si. @bad tells whether it is bad, otherwise @ech
+ * is its EC header. Returns zero in case of success and %-1 in case of
+ * failure.
+ */
+static int scan_eb(const struct mtd_dev_info *mtd, struct ubi_scan_info *si,
+		   int eb, int bad, const struct ubi_ec_hdr *ech, int v, int pr)
+{
+	uint32_t crc;
+	unsigned long long ec;
+
+	if (v) {
+		normsg_cont("scanning eraseblock %d", eb);
+		fflush(stdout);
+	}
+	if (pr) {
+		printf("\r" PROGRAM_NAME ": scanning eraseblock %d -- %2lld %% complete  ",
+		       eb, (long long)(eb + 1) * 100 / mtd->eb_cnt);
+		fflush(stdout);
+	}
+
+	if (bad) {
+		si->bad_cnt += 1;
+		si->ec[eb] = EB_BAD;
+		if (v)
+			printf(": bad\n");
+		return 0;
+	}
+
+	if (be32_to_cpu(ech->magic) != UBI_EC_HDR_MAGIC) {
+		if (all_ff(ech, sizeof(struct ubi_ec_hdr))) {
+			si->empty_cnt += 1;
+			si->ec[eb] = EB_EMPTY;
+			if (v)
+				printf(": empty\n");
+		} else {
+			si->alien_cnt += 1;
+			si->ec[eb] = EB_ALIEN;
+			if (v)
+				printf(": alien\n");
+		}
+		return 0;
+	}
+
+	crc = mtd_crc32(UBI_CRC32_INIT, ech, UBI_EC_HDR_SIZE_CRC);
+	if (be32_to_cpu(ech->hdr_crc) != crc) {
+		si->corrupted_cnt += 1;
+		si->ec[eb] = EB_CORRUPTED;
+		if (v)
+			printf(": bad CRC %#08x, should be %#08x\n",
+			       crc, be32_to_cpu(ech->hdr_crc));
+		return 0;
+	}
+
+	ec = be64_to_cpu(ech->ec);
+	if (ec > EC_MAX) {
+		if (pr)
+			printf("\n");
+		errmsg("erase counter in EB %d is %llu, while this "
+		       "program expects them to be less than %u",
+		       eb, ec, EC_MAX);
+		return -1;
+	}
+
+	if (si->vid_hdr_offs == -1) {
+		si->vid_hdr_offs = be32_to_cpu(ech->vid_hdr_offset);
+		si->data_offs = be32_to_cpu(ech->data_offset);
+		si->image_seq = be32_to_cpu(ech->image_seq);
+		if (si->data_offs % mtd->min_io_size) {
+			if (pr)
+				printf("\n");
+			if (v)
+				printf(": corrupted because of the below\n");
+			warnmsg("bad data offset %d at eraseblock %d (n"
+				"of multiple of min. I/O unit size %d)",
+				si->data_offs, eb, mtd->min_io_size);
+			warnmsg("treat eraseblock %d as corrupted", eb);
+			si->corrupted_cnt += 1;
+			si->ec[eb] = EB_CORRUPTED;
+			return 0;
+
+		}
+	} else {
+		if ((int)be32_to_cpu(ech->vid_hdr_offset) != si->vid_hdr_offs) {
+			if (pr)
+				printf("\n");
+			if (v)
+				printf(": corrupted because of the below\n");
+			warnmsg("inconsistent VID header offset: was "
+				"%d, but is %d in eraseblock %d",
+				si->vid_hdr_offs,
+				be32_to_cpu(ech->vid_hdr_offset), eb);
+			warnmsg("treat eraseblock %d as corrupted", eb);
+			si->corrupted_cnt += 1;
+			si->ec[eb] = EB_CORRUPTED;
+			return 0;
+		}
+		if ((int)be32_to_cpu(ech->data_offset) != si->data_offs) {
+			if (pr)
+				printf("\n");
+			if (v)
+				printf(": corrupted because of the below\n");
+			warnmsg("inconsistent data offset: was %d, but"
+				" is %d in eraseblock %d",
+				si->data_offs,
+				be32_to_cpu(ech->data_offset), eb);
+			warnmsg("treat eraseblock %d as corrupted", eb);
+			si->corrupted_cnt += 1;
+			si->ec[eb] = EB_CORRUPTED;
+			return 0;
+		}
+	}
+
+	si->ok_cnt += 1;
+	si->ec[eb] = ec;
+	if (v)
+		printf(": OK, erase counter %u\n", si->ec[eb]);
+	return 0;
+}
+
+static struct ubi_scan_info *scan_alloc(const struct mtd_dev_info *mtd)
 {
-	int eb, v = (verbose == 2), pr = (verbose == 1);
 	struct ubi_scan_info *si;
-	unsigned long long sum = 0;
 
 	si = calloc(1, sizeof(struct ubi_scan_info));
-	if (!si)
-		return sys_errmsg("cannot allocate %zd bytes of memory",
-				  sizeof(struct ubi_scan_info));
+	if (!si) {
+		sys_errmsg("cannot allocate %zd bytes of memory",
+			   sizeof(struct ubi_scan_info));
+		return NULL;
+	}
 
 	si->ec = calloc(mtd->eb_cnt, sizeof(uint32_t));
 	if (!si->ec) {
 		sys_errmsg("cannot allocate %zd bytes of memory",
 			   sizeof(struct ubi_scan_info));
-		goto out_si;
+		free(si);
+		return NULL;
 	}
 
 	si->vid_hdr_offs = si->data_offs = -1;
+	return si;
+}
+
+/* Calculate the mean erase counter and the count of good eraseblocks */
+static void scan_finish(const struct mtd_dev_info *mtd,
+			struct ubi_scan_info *si, int v)
+{
+	unsigned long long sum = 0;
+	int eb;
+
+	if (si->ok_cnt != 0) {
+		for (eb = 0; eb < mtd->eb_cnt; eb++) {
+			if (si->ec[eb] > EC_MAX)
+				continue;
+			sum += si->ec[eb];
+		}
+		si->mean_ec = sum / si->ok_cnt;
+	}
+
+	si->good_cnt = mtd->eb_cnt - si->bad_cnt;
+	verbose(v, "finished, mean EC %lld, %d OK, %d corrupted, %d empty, %d "
+		"alien, bad %d", si->mean_ec, si->ok_cnt, si->corrupted_cnt,
+		si->empty_cnt, si->alien_cnt, si->bad_cnt);
+}
+
+int ubi_scan(struct mtd_dev_info *mtd, int fd, struct ubi_scan_info **info,
+	     int verbose)
+{
+	int eb, v = (verbose == 2), pr = (verbose == 1);
+	struct ubi_scan_info *si;
+
+	si = scan_alloc(mtd);
+	if (!si)
+		return -1;
 
 	verbose(v, "start scanning eraseblocks 0-%d", mtd->eb_cnt);
 	for (eb = 0; eb < mtd->eb_cnt; eb++) {
 		int ret;
-		uint32_t crc;
 		struct ubi_ec_hdr ech;
-		unsigned long long ec;
-
-		if (v) {
-			normsg_cont("scanning eraseblock %d", eb);
-			fflush(stdout);
-		}
-		if (pr) {
-			printf("\r" PROGRAM_NAME ": scanning eraseblock %d -- %2lld %% complete  ",
-			       eb, (long long)(eb + 1) * 100 / mtd->eb_cnt);
-			fflush(stdout);
-		}
 
 		ret = mtd_is_bad(mtd, fd, eb);
 		if (ret == -1)
 			goto out_ec;
-		if (ret) {
-			si->bad_cnt += 1;
-			si->ec[eb] = EB_BAD;
-			if (v)
-				printf(": bad\n");
-			continue;
+
+		if (!ret) {
+			ret = mtd_read(mtd, fd, eb, 0, &ech,
+				       sizeof(struct ubi_ec_hdr));
+			if (ret < 0)
+				goto out_ec;
 		}
 
-		ret = mtd_read(mtd, fd, eb, 0, &ech, sizeof(struct ubi_ec_hdr));
-		if (ret < 0)
+		if (scan_eb(mtd, si, eb, ret, &ech, v, pr))
 			goto out_ec;
+	}
 
-		if (be32_to_cpu(ech.magic) != UBI_EC_HDR_MAGIC) {
-			if (all_ff(&ech, sizeof(struct ubi_ec_hdr))) {
-				si->empty_cnt += 1;
-				si->ec[eb] = EB_EMPTY;
-				if (v)
-					printf(": empty\n");
-			} else {
-				si->alien_cnt += 1;
-				si->ec[eb] = EB_ALIEN;
-				if (v)
-					printf(": alien\n");
-			}
-			continue;
-		}
+	scan_finish(mtd, si, v);
+	*info = si;
+	if (pr)
+		printf("\n");
+	return 0;
 
-		crc = mtd_crc32(UBI_CRC32_INIT, &ech, UBI_EC_HDR_SIZE_CRC);
-		if (be32_to_cpu(ech.hdr_crc) != crc) {
-			si->corrupted_cnt += 1;
-			si->ec[eb] = EB_CORRUPTED;
-			if (v)
-				printf(": bad CRC %#08x, should be %#08x\n",
-				       crc, be32_to_cpu(ech.hdr_crc));
-			continue;
-		}
+out_ec:
+	ubi_scan_free(si);
+	*info = NULL;
+	return -1;
+}
 
-		ec = be64_to_cpu(ech.ec);
-		if (ec > EC_MAX) {
-			if (pr)
-				printf("\n");
-			errmsg("erase counter in EB %d is %llu, while this "
-			       "program expects them to be less than %u",
-			       eb, ec, EC_MAX);
-			goto out_ec;
-		}
+/*
+ * How many eraseblocks a thread of 'ubi_scan_fast()' takes at a time.
+ */
+#define SCAN_CHUNK_EBS 32
 
-		if (si->vid_hdr_offs == -1) {
-			si->vid_hdr_offs = be32_to_cpu(ech.vid_hdr_offset);
-			si->data_offs = be32_to_cpu(ech.data_offset);
-			if (si->data_offs % mtd->min_io_size) {
-				if (pr)
-					printf("\n");
-				if (v)
-					printf(": corrupted because of the below\n");
-				warnmsg("bad data offset %d at eraseblock %d (n"
-					"of multiple of min. I/O unit size %d)",
-					si->data_offs, eb, mtd->min_io_size);
-				warnmsg("treat eraseblock %d as corrupted", eb);
-				si->corrupted_cnt += 1;
-				si->ec[eb] = EB_CORRUPTED;
-				continue;
+/*
+ * State shared by the threads of 'ubi_scan_fast()'.
+ *
+ * @next: the next eraseblock to read
+ * @failed: a thread failed, the others have to stop
+ * @bad: which eraseblocks are bad
+ * @echs: the EC headers of the good eraseblocks
+ */
+struct scan_threads {
+	const struct mtd_dev_info *mtd;
+	int fd;
+	pthread_mutex_t lock;
+	int next;
+	int failed;
+	char *bad;
+	struct ubi_ec_hdr *echs;
+};
 
-			}
-		} else {
-			if ((int)be32_to_cpu(ech.vid_hdr_offset) != si->vid_hdr_offs) {
-				if (pr)
-					printf("\n");
-				if (v)
-					printf(": corrupted because of the below\n");
-				warnmsg("inconsistent VID header offset: was "
-					"%d, but is %d in eraseblock %d",
-					si->vid_hdr_offs,
-					be32_to_cpu(ech.vid_hdr_offset), eb);
-				warnmsg("treat eraseblock %d as corrupted", eb);
-				si->corrupted_cnt += 1;
-				si->ec[eb] = EB_CORRUPTED;
+static int read_ech(const struct mtd_dev_info *mtd, int fd, int eb,
+		    struct ubi_ec_hdr *ech)
+{
+	off_t offs = (off_t)eb * mtd->eb_size;
+	size_t rd = 0;
+
+	while (rd < sizeof(*ech)) {
+		ssize_t ret = pread(fd, (char *)ech + rd, sizeof(*ech) - rd,
+				    offs + rd);
+
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
 				continue;
+			if (!ret)
+				errno = EIO;
+			return sys_errmsg("cannot read %zd bytes from mtd%d (eraseblock %d, offset %zd)",
+					  sizeof(*ech) - rd, mtd->mtd_num, eb, rd);
+		}
+		rd += ret;
+	}
+
+	return 0;
+}
+
+static void *scan_thread(void *arg)
+{
+	struct scan_threads *st = arg;
+	int eb, first, last, ret;
+
+	while (1) {
+		pthread_mutex_lock(&st->lock);
+		first = st->next;
+		st->next += SCAN_CHUNK_EBS;
+		ret = st->failed;
+		pthread_mutex_unlock(&st->lock);
+
+		if (ret || first >= st->mtd->eb_cnt)
+			break;
+
+		last = first + SCAN_CHUNK_EBS;
+		if (last > st->mtd->eb_cnt)
+			last = st->mtd->eb_cnt;
+
+		for (eb = first; eb < last; eb++) {
+			ret = mtd_is_bad(st->mtd, st->fd, eb);
+			if (ret == 0)
+				ret = read_ech(st->mtd, st->fd, eb, &st->echs[eb]);
+			else if (ret > 0) {
+				st->bad[eb] = 1;
+				ret = 0;
 			}
-			if ((int)be32_to_cpu(ech.data_offset) != si->data_offs) {
-				if (pr)
-					printf("\n");
-				if (v)
-					printf(": corrupted because of the below\n");
-				warnmsg("inconsistent data offset: was %d, but"
-					" is %d in eraseblock %d",
-					si->data_offs,
-					be32_to_cpu(ech.data_offset), eb);
-				warnmsg("treat eraseblock %d as corrupted", eb);
-				si->corrupted_cnt += 1;
-				si->ec[eb] = EB_CORRUPTED;
-				continue;
+
+			if (ret) {
+				pthread_mutex_lock(&st->lock);
+				st->failed = 1;
+				pthread_mutex_unlock(&st->lock);
+				return NULL;
 			}
 		}
+	}
 
-		si->ok_cnt += 1;
-		si->ec[eb] = ec;
-		if (v)
-			printf(": OK, erase counter %u\n", si->ec[eb]);
+	return NULL;
+}
+
+int ubi_scan_fast(struct mtd_dev_info *mtd, int fd,
+		  struct ubi_scan_info **info, int verbose, int jobs)
+{
+	int eb, i, err, v = (verbose == 2), pr = (verbose == 1);
+	struct ubi_scan_info *si;
+	struct scan_threads st;
+	pthread_t *threads;
+
+	if (jobs <= 1)
+		return ubi_scan(mtd, fd, info, verbose);
+
+	si = scan_alloc(mtd);
+	if (!si)
+		return -1;
+
+	memset(&st, 0, sizeof(st));
+	st.mtd = mtd;
+	st.fd = fd;
+	st.bad = calloc(mtd->eb_cnt, 1);
+	st.echs = malloc((size_t)mtd->eb_cnt * sizeof(struct ubi_ec_hdr));
+	threads = calloc(jobs, sizeof(pthread_t));
+	if (!st.bad || !st.echs || !threads) {
+		sys_errmsg("cannot allocate %zd bytes of memory",
+			   mtd->eb_cnt * (sizeof(struct ubi_ec_hdr) + 1));
+		goto out_free;
 	}
+	pthread_mutex_init(&st.lock, NULL);
 
-	if (si->ok_cnt != 0) {
-		/* Calculate mean erase counter */
-		for (eb = 0; eb < mtd->eb_cnt; eb++) {
-			if (si->ec[eb] > EC_MAX)
-				continue;
-			sum += si->ec[eb];
+	verbose(v, "start scanning eraseblocks 0-%d using %d threads",
+		mtd->eb_cnt, jobs);
+	for (i = 0; i < jobs; i++) {
+		err = pthread_create(&threads[i], NULL, scan_thread, &st);
+		if (err) {
+			errno = err;
+			sys_errmsg("cannot create scanning thread");
+			pthread_mutex_lock(&st.lock);
+			st.failed = 1;
+			pthread_mutex_unlock(&st.lock);
+			break;
 		}
-		si->mean_ec = sum / si->ok_cnt;
 	}
+	while (i--)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&st.lock);
+	if (st.failed)
+		goto out_free;
 
-	si->good_cnt = mtd->eb_cnt - si->bad_cnt;
-	verbose(v, "finished, mean EC %lld, %d OK, %d corrupted, %d empty, %d "
-		"alien, bad %d", si->mean_ec, si->ok_cnt, si->corrupted_cnt,
-		si->empty_cnt, si->alien_cnt, si->bad_cnt);
+	for (eb = 0; eb < mtd->eb_cnt; eb++)
+		if (scan_eb(mtd, si, eb, st.bad[eb], &st.echs[eb], v, pr))
+			goto out_free;
 
-	*info = si;
+	scan_finish(mtd, si, v);
 	if (pr)
 		printf("\n");
+
+	free(threads);
+	free(st.echs);
+	free(st.bad);
+	*info = si;
 	return 0;
 
-out_ec:
-	free(si->ec);
-out_si:
-	free(si);
+out_free:
+	free(threads);
+	free(st.echs);
+	free(st.bad);
+	ubi_scan_free(si);
+	*info = NULL;
+	return -1;
+}
+
+#define SCAN_CACHE_MAGIC   0x55425343 /* "UBSC" */
+#define SCAN_CACHE_VERSION 1
+
+/*
+ * Header of the scan cache file, followed by the erase counter table. The
+ * cache is only used for the MTD device with the same name and geometry.
+ */
+struct scan_cache_hdr {
+	uint32_t magic;
+	uint32_t version;
+	char name[MTD_NAME_MAX + 1];
+	int32_t type;
+	int64_t size;
+	int32_t eb_cnt;
+	int32_t eb_size;
+	int32_t min_io_size;
+	int32_t subpage_size;
+	int32_t vid_hdr_offs;
+	int32_t data_offs;
+	uint32_t image_seq;
+	uint32_t crc;
+};
+
+static void scan_cache_key(const struct mtd_dev_info *mtd,
+			   struct scan_cache_hdr *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = SCAN_CACHE_MAGIC;
+	hdr->version = SCAN_CACHE_VERSION;
+	memcpy(hdr->name, mtd->name, sizeof(hdr->name));
+	hdr->type = mtd->type;
+	hdr->size = mtd->size;
+	hdr->eb_cnt = mtd->eb_cnt;
+	hdr->eb_size = mtd->eb_size;
+	hdr->min_io_size = mtd->min_io_size;
+	hdr->subpage_size = mtd->subpage_size;
+}
+
+static uint32_t scan_cache_crc(const struct scan_cache_hdr *hdr,
+			       const uint32_t *ec, int eb_cnt)
+{
+	uint32_t crc;
+
+	crc = mtd_crc32(UBI_CRC32_INIT, hdr, offsetof(struct scan_cache_hdr, crc));
+	return mtd_crc32(crc, ec, eb_cnt * sizeof(uint32_t));
+}
+
+/*
+ * How many EC headers 'ubi_scan_cache_load()' reads back to check that the
+ * cache still matches the device.
+ */
+#define SCAN_CACHE_SAMPLES 64
+
+/*
+ * Check that the erase counter or status @ec the cache has for eraseblock @eb
+ * matches its EC header @ech on the flash. The header is classified like
+ * 'scan_eb()' does, with the UBI headers offsets and the image sequence number
+ * of the cache header @hdr. Returns %1 if it matches and %0 if not.
+ */
+static int scan_cache_check_ech(const struct scan_cache_hdr *hdr, uint32_t ec,
+				const struct ubi_ec_hdr *ech)
+{
+	if (be32_to_cpu(ech->magic) != UBI_EC_HDR_MAGIC) {
+		if (all_ff(ech, sizeof(struct ubi_ec_hdr)))
+			return ec == EB_EMPTY;
+		return ec == EB_ALIEN;
+	}
+
+	if (be32_to_cpu(ech->hdr_crc) !=
+	    mtd_crc32(UBI_CRC32_INIT, ech, UBI_EC_HDR_SIZE_CRC))
+		return ec == EB_CORRUPTED;
+
+	if ((int)be32_to_cpu(ech->vid_hdr_offset) != hdr->vid_hdr_offs ||
+	    (int)be32_to_cpu(ech->data_offset) != hdr->data_offs)
+		return ec == EB_CORRUPTED;
+
+	return be64_to_cpu(ech->ec) == ec &&
+	       be32_to_cpu(ech->image_seq) == hdr->image_seq;
+}
+
+/*
+ * Check that the cache still describes the device: the bad eraseblocks must be
+ * the same, and so must be the EC headers of a sample of the eraseblocks.
+ * This catches the blocks which went bad at run-time and the devices which
+ * were written to (e.g. attached to UBI) after the cache was saved. Returns
+ * %1 if the cache matches, %0 if not and %-1 in case of failure.
+ */
+static int scan_cache_check(const struct mtd_dev_info *mtd, int fd,
+			    const struct scan_cache_hdr *hdr, const uint32_t *ec)
+{
+	struct ubi_ec_hdr ech;
+	int eb, i, ret;
+
+	for (eb = 0; eb < mtd->eb_cnt; eb++) {
+		ret = mtd_is_bad(mtd, fd, eb);
+		if (ret < 0)
+			return -1;
+		if (ret != (ec[eb] == EB_BAD))
+			return 0;
+	}
+
+	for (i = 0; i < SCAN_CACHE_SAMPLES && i < mtd->eb_cnt; i++) {
+		if (mtd->eb_cnt > SCAN_CACHE_SAMPLES)
+			eb = (long long)i * mtd->eb_cnt / SCAN_CACHE_SAMPLES;
+		else
+			eb = i;
+		if (ec[eb] == EB_BAD)
+			continue;
+
+		if (read_ech(mtd, fd, eb, &ech))
+			return -1;
+		if (!scan_cache_check_ech(hdr, ec[eb], &ech))
+			return 0;
+	}
+
+	return 1;
+}
+
+int ubi_scan_cache_load(const struct mtd_dev_info *mtd, int fd,
+			const char *path, struct ubi_scan_info **info)
+{
+	struct scan_cache_hdr hdr, key;
+	struct ubi_scan_info *si;
+	size_t ec_size = mtd->eb_cnt * sizeof(uint32_t);
+	int cache_fd, eb, ret;
+
 	*info = NULL;
+	cache_fd = open(path, O_RDONLY);
+	if (cache_fd == -1)
+		return 0;
+
+	si = scan_alloc(mtd);
+	if (!si) {
+		close(cache_fd);
+		return -1;
+	}
+
+	scan_cache_key(mtd, &key);
+	if (read(cache_fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(&hdr, &key, offsetof(struct scan_cache_hdr, vid_hdr_offs)) ||
+	    read(cache_fd, si->ec, ec_size) != (ssize_t)ec_size ||
+	    scan_cache_crc(&hdr, si->ec, mtd->eb_cnt) != hdr.crc) {
+		close(cache_fd);
+		ubi_scan_free(si);
+		return 0;
+	}
+	close(cache_fd);
+
+	ret = scan_cache_check(mtd, fd, &hdr, si->ec);
+	if (ret != 1) {
+		ubi_scan_free(si);
+		return ret;
+	}
+
+	si->vid_hdr_offs = hdr.vid_hdr_offs;
+	si->data_offs = hdr.data_offs;
+	si->image_seq = hdr.image_seq;
+
+	for (eb = 0; eb < mtd->eb_cnt; eb++) {
+		switch (si->ec[eb]) {
+		case EB_BAD:
+			si->bad_cnt += 1;
+			break;
+		case EB_EMPTY:
+			si->empty_cnt += 1;
+			break;
+		case EB_CORRUPTED:
+			si->corrupted_cnt += 1;
+			break;
+		case EB_ALIEN:
+			si->alien_cnt += 1;
+			break;
+		default:
+			si->ok_cnt += 1;
+		}
+	}
+	scan_finish(mtd, si, 0);
+
+	*info = si;
+	return 1;
+}
+
+int ubi_scan_cache_save(const struct mtd_dev_info *mtd, const char *path,
+			const struct ubi_scan_info *si)
+{
+	struct scan_cache_hdr hdr;
+	size_t ec_size = mtd->eb_cnt * sizeof(uint32_t);
+	char *tmp;
+	int fd;
+
+	scan_cache_key(mtd, &hdr);
+	hdr.vid_hdr_offs = si->vid_hdr_offs;
+	hdr.data_offs = si->data_offs;
+	hdr.image_seq = si->image_seq;
+	hdr.crc = scan_cache_crc(&hdr, si->ec, mtd->eb_cnt);
+
+	/* Write a temporary file and rename it, so the cache is never torn */
+	tmp = malloc(strlen(path) + 5);
+	if (!tmp)
+		return sys_errmsg("cannot allocate memory");
+	sprintf(tmp, "%s.tmp", path);
+
+	fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd == -1) {
+		sys_errmsg("cannot create \"%s\"", tmp);
+		goto out_free;
+	}
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, si->ec, ec_size) != (ssize_t)ec_size || fsync(fd)) {
+		sys_errmsg("cannot write \"%s\"", tmp);
+		close(fd);
+		goto out_unlink;
+	}
+	close(fd);
+
+	if (rename(tmp, path)) {
+		sys_errmsg("cannot rename \"%s\" to \"%s\"", tmp, path);
+		goto out_unlink;
+	}
+
+	free(tmp);
+	return 0;
+
+out_unlink:
+	unlink(tmp);
+out_free:
+	free(tmp);
 	return -1;
 }
 
@@ -517,6 +517,379 @@ int mtd_num2ubi_dev(libubi_t desc, int mtd_num, int *dev_num)
 	return -1;
 }
 
+/*
+ * The below functions read sysfs attribute files relative to an open sysfs
+ * directory. They are used for taking UBI snapshots, which read many files of
+ * the same few directories, so there is no need to compose and resolve the
+ * full path of every file.
+ */
+
+static int read_data_at(int dirfd, const char *name, char *buf, int buf_len)
+{
+	int fd, rd;
+
+	fd = openat(dirfd, name, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	/* A sysfs attribute is returned by a single read */
+	rd = read(fd, buf, buf_len);
+	if (rd == -1) {
+		sys_errmsg("cannot read \"%s\"", name);
+		goto out_error;
+	}
+	if (rd == buf_len) {
+		errmsg("contents of \"%s\" is too long", name);
+		errno = EINVAL;
+		goto out_error;
+	}
+	buf[rd] = '\0';
+
+	if (close(fd))
+		return sys_errmsg("close failed on \"%s\"", name);
+
+	return rd;
+
+out_error:
+	close(fd);
+	return -1;
+}
+
+static int read_ll_at(int dirfd, const char *name, long long *value)
+{
+	char buf[50];
+
+	if (read_data_at(dirfd, name, buf, sizeof(buf)) < 0)
+		return -1;
+
+	if (sscanf(buf, "%lld\n", value) != 1 || *value < 0) {
+		errmsg("cannot read non-negative integer from \"%s\"", name);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int read_int_at(int dirfd, const char *name, int *value)
+{
+	long long res;
+
+	if (read_ll_at(dirfd, name, &res))
+		return -1;
+
+	if (res > INT_MAX) {
+		errmsg("value %lld read from \"%s\" is too large", res, name);
+		errno = EINVAL;
+		return -1;
+	}
+
+	*value = res;
+	return 0;
+}
+
+static int read_major_at(int dirfd, const char *name, int *major, int *minor)
+{
+	char buf[50];
+
+	if (read_data_at(dirfd, name, buf, sizeof(buf)) < 0)
+		return -1;
+
+	if (sscanf(buf, "%d:%d\n", major, minor) != 2 ||
+	    *major < 0 || *minor < 0) {
+		errno = EINVAL;
+		return errmsg("\"%s\" does not have major:minor format", name);
+	}
+
+	return 0;
+}
+
+static int snapshot_dev(int sysfs_fd, int dev_num, struct ubi_dev_info *info)
+{
+	char dir[32];
+	int fd, err = -1;
+
+	sprintf(dir, UBI_DEV_NAME_PATT, dev_num);
+	fd = openat(sysfs_fd, dir, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return -1;
+
+	info->dev_num = dev_num;
+	if (read_major_at(fd, DEV_DEV, &info->major, &info->minor) ||
+	    read_int_at(fd, DEV_MTD_NUM, &info->mtd_num) ||
+	    read_int_at(fd, DEV_AVAIL_EBS, &info->avail_lebs) ||
+	    read_int_at(fd, DEV_TOTAL_EBS, &info->total_lebs) ||
+	    read_int_at(fd, DEV_BAD_COUNT, &info->bad_count) ||
+	    read_int_at(fd, DEV_EB_SIZE, &info->leb_size) ||
+	    read_int_at(fd, DEV_MAX_RSVD, &info->bad_rsvd) ||
+	    read_ll_at(fd, DEV_MAX_EC, &info->max_ec) ||
+	    read_int_at(fd, DEV_MAX_VOLS, &info->max_vol_count) ||
+	    read_int_at(fd, DEV_MIN_IO_SIZE, &info->min_io_size))
+		goto out;
+
+	info->avail_bytes = (long long)info->avail_lebs * info->leb_size;
+	info->total_bytes = (long long)info->total_lebs * info->leb_size;
+	err = 0;
+out:
+	close(fd);
+	return err;
+}
+
+static int snapshot_vol(int sysfs_fd, int dev_num, int vol_id,
+			struct ubi_vol_info *info)
+{
+	char dir[32], buf[UBI_VOL_NAME_MAX + 2];
+	int fd, ret, err = -1;
+
+	sprintf(dir, UBI_VOL_NAME_PATT, dev_num, vol_id);
+	fd = openat(sysfs_fd, dir, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return -1;
+
+	info->dev_num = dev_num;
+	info->vol_id = vol_id;
+	if (read_major_at(fd, VOL_DEV, &info->major, &info->minor))
+		goto out;
+
+	if (read_data_at(fd, VOL_TYPE, buf, sizeof(buf)) < 0)
+		goto out;
+	if (!strcmp(buf, "static\n"))
+		info->type = UBI_STATIC_VOLUME;
+	else if (!strcmp(buf, "dynamic\n"))
+		info->type = UBI_DYNAMIC_VOLUME;
+	else {
+		errmsg("bad value at \"%s\"", buf);
+		errno = EINVAL;
+		goto out;
+	}
+
+	if (read_int_at(fd, VOL_ALIGNMENT, &info->alignment) ||
+	    read_ll_at(fd, VOL_DATA_BYTES, &info->data_bytes) ||
+	    read_int_at(fd, VOL_RSVD_EBS, &info->rsvd_lebs) ||
+	    read_int_at(fd, VOL_EB_SIZE, &info->leb_size) ||
+	    read_int_at(fd, VOL_CORRUPTED, &info->corrupted))
+		goto out;
+	info->rsvd_bytes = (long long)info->leb_size * info->rsvd_lebs;
+
+	ret = read_data_at(fd, VOL_NAME, buf, sizeof(buf));
+	if (ret <= 0)
+		goto out;
+	buf[ret - 1] = '\0';
+	strcpy(info->name, buf);
+	err = 0;
+out:
+	close(fd);
+	return err;
+}
+
+/* A UBI device (@vol_id is %-1) or volume directory found in sysfs */
+struct snapshot_ent {
+	int dev_num;
+	int vol_id;
+};
+
+static int cmp_snapshot_ent(const void *l, const void *r)
+{
+	const struct snapshot_ent *a = l, *b = r;
+
+	if (a->dev_num != b->dev_num)
+		return a->dev_num < b->dev_num ? -1 : 1;
+	if (a->vol_id != b->vol_id)
+		return a->vol_id < b->vol_id ? -1 : 1;
+	return 0;
+}
+
+static void free_snapshot(struct ubi_snapshot *snap)
+{
+	int i;
+
+	if (!snap)
+		return;
+
+	for (i = 0; i < snap->info.dev_count; i++)
+		free(snap->vols[i]);
+	free(snap->vols);
+	free(snap->devs);
+	free(snap);
+}
+
+static int list_snapshot_ents(struct libubi *lib, DIR *sysfs_ubi,
+			      struct snapshot_ent **ents, int *dev_cnt)
+{
+	struct dirent *dirent;
+	struct snapshot_ent ent, *tmp;
+	int cnt = 0, max = 0, ret;
+	char tmp_buf[256];
+
+	*ents = NULL;
+	*dev_cnt = 0;
+	while (1) {
+		errno = 0;
+		dirent = readdir(sysfs_ubi);
+		if (!dirent)
+			break;
+
+		ret = sscanf(dirent->d_name, UBI_VOL_NAME_PATT"%s",
+			     &ent.dev_num, &ent.vol_id, tmp_buf);
+		if (ret != 2) {
+			ret = sscanf(dirent->d_name, UBI_DEV_NAME_PATT"%s",
+				     &ent.dev_num, tmp_buf);
+			if (ret != 1)
+				continue;
+			ent.vol_id = -1;
+			*dev_cnt += 1;
+		}
+
+		if (cnt == max) {
+			max = max ? max * 2 : 16;
+			tmp = realloc(*ents, max * sizeof(ent));
+			if (!tmp) {
+				sys_errmsg("cannot allocate memory");
+				goto out_free;
+			}
+			*ents = tmp;
+		}
+		(*ents)[cnt++] = ent;
+	}
+
+	if (errno) {
+		sys_errmsg("readdir failed on \"%s\"", lib->sysfs_ubi);
+		goto out_free;
+	}
+
+	qsort(*ents, cnt, sizeof(ent), cmp_snapshot_ent);
+	return cnt;
+
+out_free:
+	free(*ents);
+	*ents = NULL;
+	return -1;
+}
+
+static struct ubi_snapshot *take_snapshot(struct libubi *lib)
+{
+	DIR *sysfs_ubi;
+	struct ubi_snapshot *snap;
+	struct ubi_info *info;
+	struct snapshot_ent *ents = NULL;
+	int cnt, dev_cnt, sysfs_fd, i, j, k;
+
+	snap = calloc(1, sizeof(struct ubi_snapshot));
+	if (!snap) {
+		sys_errmsg("cannot allocate memory");
+		return NULL;
+	}
+	info = &snap->info;
+
+	/* See 'ubi_get_info()' */
+	if (read_major(lib->ctrl_dev, &info->ctrl_major, &info->ctrl_minor))
+		info->ctrl_major = info->ctrl_minor = -1;
+
+	sysfs_ubi = opendir(lib->sysfs_ubi);
+	if (!sysfs_ubi) {
+		sys_errmsg("cannot open \"%s\"", lib->sysfs_ubi);
+		goto out_free;
+	}
+	sysfs_fd = dirfd(sysfs_ubi);
+
+	if (read_int_at(sysfs_fd, UBI_VER, &info->version))
+		goto out_close;
+
+	cnt = list_snapshot_ents(lib, sysfs_ubi, &ents, &dev_cnt);
+	if (cnt < 0)
+		goto out_close;
+
+	snap->devs = calloc(dev_cnt + 1, sizeof(struct ubi_dev_info));
+	snap->vols = calloc(dev_cnt + 1, sizeof(struct ubi_vol_info *));
+	if (!snap->devs || !snap->vols) {
+		sys_errmsg("cannot allocate memory");
+		goto out_close;
+	}
+
+	for (i = 0; i < cnt; i = j) {
+		struct ubi_dev_info *dev = &snap->devs[info->dev_count];
+		struct ubi_vol_info *vols = NULL;
+
+		/* Entries @i to @j - 1 belong to the same UBI device */
+		for (j = i + 1; j < cnt && ents[j].dev_num == ents[i].dev_num; j++)
+			;
+
+		/* Skip volumes of a device which is not there */
+		if (ents[i].vol_id != -1)
+			continue;
+
+		if (snapshot_dev(sysfs_fd, ents[i].dev_num, dev)) {
+			/* The device may have been removed meanwhile */
+			if (errno == ENOENT)
+				continue;
+			goto out_close;
+		}
+
+		if (j - i > 1) {
+			vols = calloc(j - i - 1, sizeof(struct ubi_vol_info));
+			if (!vols) {
+				sys_errmsg("cannot allocate memory");
+				goto out_close;
+			}
+		}
+
+		if (!info->dev_count)
+			info->lowest_dev_num = dev->dev_num;
+		info->highest_dev_num = dev->dev_num;
+		snap->vols[info->dev_count++] = vols;
+
+		for (k = i + 1; k < j; k++) {
+			struct ubi_vol_info *vol = &vols[dev->vol_count];
+
+			if (snapshot_vol(sysfs_fd, ents[k].dev_num,
+					 ents[k].vol_id, vol)) {
+				if (errno == ENOENT)
+					continue;
+				goto out_close;
+			}
+
+			if (!dev->vol_count)
+				dev->lowest_vol_id = vol->vol_id;
+			dev->highest_vol_id = vol->vol_id;
+			dev->vol_count += 1;
+		}
+	}
+
+	free(ents);
+	closedir(sysfs_ubi);
+	return snap;
+
+out_close:
+	free(ents);
+	closedir(sysfs_ubi);
+out_free:
+	free_snapshot(snap);
+	return NULL;
+}
+
+const struct ubi_snapshot *ubi_get_snapshot(libubi_t desc)
+{
+	struct libubi *lib = (struct libubi *)desc;
+
+	if (!lib->snap)
+		lib->snap = take_snapshot(lib);
+	return lib->snap;
+}
+
+const struct ubi_snapshot *ubi_refresh_snapshot(libubi_t desc)
+{
+	ubi_invalidate_snapshot(desc);
+	return ubi_get_snapshot(desc);
+}
+
+void ubi_invalidate_snapshot(libubi_t desc)
+{
+	struct libubi *lib = (struct libubi *)desc;
+
+	free_snapshot(lib->snap);
+	lib->snap = NULL;
+}
+
 libubi_t libubi_open(void)
 {
 	int fd, version;
@@ -653,6 +1026,7 @@ void libubi_close(libubi_t desc)
 {
 	struct libubi *lib = (struct libubi *)desc;
 
+	free_snapshot(lib->snap);
 	free(lib->vol_name);
 	free(lib->vol_corrupted);
 	free(lib->vol_eb_size);
@@ -96,6 +96,7 @@ extern "C" {
  * @vol_eb_size: volume eraseblock size sysfs path pattern
  * @vol_corrupted: volume corruption flag sysfs path pattern
  * @vol_name: volume name sysfs path pattern
+ * @snap: cached UBI snapshot, see 'ubi_get_snapshot()'
  */
 struct libubi
 {
@@ -125,6 +126,7 @@ struct libubi
 	char *vol_corrupted;
 	char *vol_name;
 	char *vol_max_count;
+	struct ubi_snapshot *snap;
 };
 
 #ifdef __cplusplus
@@ -30,6 +30,8 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include <mtd/ubi-media.h>
 #include <mtd_swab.h>
@@ -37,6 +39,12 @@
 #include <crc32.h>
 #include "common.h"
 
+/*
+ * How many PEBs are written by one writev() call. Each PEB takes up to 3
+ * iovecs: the headers, the data and the 0xFF padding.
+ */
+#define UBIGEN_BATCH_PEBS 64
+
 void ubigen_info_init(struct ubigen_info *ui, int peb_size, int min_io_size,
 		      int subpage_size, int vid_hdr_offs, int ubi_ver,
 		      uint32_t image_seq)
@@ -56,6 +64,7 @@ void ubigen_info_init(struct ubigen_info *ui, int peb_size, int min_io_size,
 	ui->leb_size = peb_size - ui->data_offs;
 	ui->ubi_ver = ubi_ver;
 	ui->image_seq = image_seq;
+	ui->sparse = 0;
 
 	ui->max_volumes = ui->leb_size / UBI_VTBL_RECORD_SIZE;
 	if (ui->max_volumes > UBI_MAX_VOLUMES)
@@ -168,13 +177,9 @@ void ubigen_init_vid_hdr(const struct ubigen_info *ui,
 	hdr->hdr_crc = cpu_to_be32(crc);
 }
 
-int ubigen_write_volume(const struct ubigen_info *ui,
-			const struct ubigen_vol_info *vi, long long ec,
-			long long bytes, int in, int out)
+static int check_volume(const struct ubigen_info *ui,
+			const struct ubigen_vol_info *vi)
 {
-	int len = vi->usable_leb_size, rd, lnum = 0;
-	char *inbuf, *outbuf;
-
 	if (vi->id >= ui->max_volumes) {
 		errmsg("too high volume id %d, max. volumes is %d",
 		       vi->id, ui->max_volumes);
@@ -189,69 +194,254 @@ int ubigen_write_volume(const struct ubigen_info *ui,
 		return -1;
 	}
 
-	inbuf = malloc(ui->leb_size);
-	if (!inbuf)
-		return sys_errmsg("cannot allocate %d bytes of memory",
-				  ui->leb_size);
-	outbuf = malloc(ui->peb_size);
-	if (!outbuf) {
-		sys_errmsg("cannot allocate %d bytes of memory", ui->peb_size);
+	return 0;
+}
+
+/* Write all of @iov, retrying after short writes */
+static int writev_all(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t ret;
+
+	while (cnt) {
+		ret = writev(fd, iov, cnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		while (cnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov += 1;
+			cnt -= 1;
+		}
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Assemble a PEB from its @cnt iovecs in @peb and write it, leaving holes for
+ * the erased blocks.
+ */
+static int write_sparse_peb(int fd, const struct iovec *iov, int cnt, char *peb)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		memcpy(peb + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+
+	return util_write_sparse(fd, peb, len);
+}
+
+/*
+ * Write the PEBs holding @bytes bytes of volume data from @buf, starting with
+ * LEB @lnum. The headers are built in a buffer, while the data is written
+ * straight from @buf, a batch of PEBs per writev() call.
+ */
+static int write_pebs(const struct ubigen_info *ui,
+		      const struct ubigen_vol_info *vi, long long ec,
+		      const char *buf, long long bytes, int lnum, int out)
+{
+	struct iovec iov[UBIGEN_BATCH_PEBS * 3];
+	char *hdrs, *pad, *peb = NULL;
+	int i, n, len, err = -1;
+
+	hdrs = malloc((size_t)ui->data_offs * UBIGEN_BATCH_PEBS);
+	pad = malloc(ui->peb_size);
+	if (ui->sparse)
+		peb = malloc(ui->peb_size);
+	if (!hdrs || !pad || (ui->sparse && !peb)) {
+		sys_errmsg("cannot allocate %d bytes of memory",
+			   ui->data_offs * UBIGEN_BATCH_PEBS + ui->peb_size * 2);
 		goto out_free;
 	}
 
-	memset(outbuf, 0xFF, ui->data_offs);
-	ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)outbuf, ec);
+	/* The EC header is the same for all PEBs, only the VID header varies */
+	memset(pad, 0xFF, ui->peb_size);
+	memset(hdrs, 0xFF, ui->data_offs);
+	ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)hdrs, ec);
+	for (i = 1; i < UBIGEN_BATCH_PEBS; i++)
+		memcpy(hdrs + i * ui->data_offs, hdrs, ui->data_offs);
 
 	while (bytes) {
-		int l;
-		struct ubi_vid_hdr *vid_hdr;
-
-		if (bytes < len)
-			len = bytes;
-		bytes -= len;
+		n = 0;
+		for (i = 0; i < UBIGEN_BATCH_PEBS && bytes; i++) {
+			char *hdr = hdrs + i * ui->data_offs;
+			struct ubi_vid_hdr *vid_hdr;
+
+			len = vi->usable_leb_size;
+			if (bytes < len)
+				len = bytes;
+
+			vid_hdr = (struct ubi_vid_hdr *)(hdr + ui->vid_hdr_offs);
+			ubigen_init_vid_hdr(ui, vi, vid_hdr, lnum, buf, len);
+
+			iov[n].iov_base = hdr;
+			iov[n++].iov_len = ui->data_offs;
+			iov[n].iov_base = (void *)buf;
+			iov[n++].iov_len = len;
+			if (ui->data_offs + len < ui->peb_size) {
+				iov[n].iov_base = pad;
+				iov[n++].iov_len = ui->peb_size - ui->data_offs - len;
+			}
 
-		l = len;
-		do {
-			rd = read(in, inbuf + len - l, l);
-			if (rd != l) {
-				sys_errmsg("cannot read %d bytes from the input file", l);
-				goto out_free1;
+			buf += len;
+			bytes -= len;
+			lnum += 1;
+
+			if (peb) {
+				if (write_sparse_peb(out, iov, n, peb)) {
+					sys_errmsg("cannot write PEB %d to the output file",
+						   lnum - 1);
+					goto out_free;
+				}
+				n = 0;
 			}
+		}
+
+		if (n && writev_all(out, iov, n)) {
+			sys_errmsg("cannot write %d PEBs to the output file", i);
+			goto out_free;
+		}
+	}
+
+	err = 0;
+
+out_free:
+	free(peb);
+	free(pad);
+	free(hdrs);
+	return err;
+}
+
+int ubigen_write_volume_buf(const struct ubigen_info *ui,
+			    const struct ubigen_vol_info *vi, long long ec,
+			    const void *buf, long long bytes, int out)
+{
+	if (check_volume(ui, vi))
+		return -1;
+
+	return write_pebs(ui, vi, ec, buf, bytes, 0, out);
+}
+
+/*
+ * Fallback for inputs which cannot be mapped (pipes and the like): read a
+ * batch of LEBs at a time.
+ */
+static int write_volume_read(const struct ubigen_info *ui,
+			     const struct ubigen_vol_info *vi, long long ec,
+			     long long bytes, int in, int out)
+{
+	long long len, batch = (long long)vi->usable_leb_size * UBIGEN_BATCH_PEBS;
+	int rd, lnum = 0, err = -1;
+	char *inbuf;
 
-			l -= rd;
-		} while (l);
+	inbuf = malloc(batch);
+	if (!inbuf)
+		return sys_errmsg("cannot allocate %lld bytes of memory", batch);
+
+	while (bytes) {
+		off_t pos = ui->sparse ? lseek(in, 0, SEEK_CUR) : -1;
 
-		vid_hdr = (struct ubi_vid_hdr *)(&outbuf[ui->vid_hdr_offs]);
-		ubigen_init_vid_hdr(ui, vi, vid_hdr, lnum, inbuf, len);
+		len = bytes < batch ? bytes : batch;
 
-		memcpy(outbuf + ui->data_offs, inbuf, len);
-		memset(outbuf + ui->data_offs + len, 0xFF,
-		       ui->peb_size - ui->data_offs - len);
+		for (rd = 0; rd < len; ) {
+			ssize_t ret = read(in, inbuf + rd, len - rd);
+
+			if (ret <= 0) {
+				sys_errmsg("cannot read %lld bytes from the input file",
+					   len - rd);
+				goto out_free;
+			}
+			rd += ret;
+		}
 
-		if (write(out, outbuf, ui->peb_size) != ui->peb_size) {
-			sys_errmsg("cannot write %d bytes to the output file", ui->peb_size);
-			goto out_free1;
+		if (pos != -1 && util_fill_holes(in, pos, inbuf, len)) {
+			sys_errmsg("cannot find the holes of the input file");
+			goto out_free;
 		}
 
-		lnum += 1;
+		if (write_pebs(ui, vi, ec, inbuf, len, lnum, out))
+			goto out_free;
+
+		bytes -= len;
+		lnum += UBIGEN_BATCH_PEBS;
 	}
 
-	free(outbuf);
-	free(inbuf);
-	return 0;
+	err = 0;
 
-out_free1:
-	free(outbuf);
 out_free:
 	free(inbuf);
-	return -1;
+	return err;
+}
+
+int ubigen_write_volume(const struct ubigen_info *ui,
+			const struct ubigen_vol_info *vi, long long ec,
+			long long bytes, int in, int out)
+{
+	off_t pos, map_offs;
+	long page = sysconf(_SC_PAGESIZE);
+	char *map;
+	int err;
+
+	if (check_volume(ui, vi))
+		return -1;
+	if (!bytes)
+		return 0;
+
+	pos = lseek(in, 0, SEEK_CUR);
+	if (pos == -1)
+		return write_volume_read(ui, vi, ec, bytes, in, out);
+
+	/*
+	 * mmap() needs a page aligned offset. In sparse mode the holes are
+	 * filled in the private mapping, which only copies the hole pages.
+	 */
+	map_offs = pos & ~((off_t)page - 1);
+	map = mmap(NULL, bytes + (pos - map_offs),
+		   ui->sparse ? PROT_READ | PROT_WRITE : PROT_READ,
+		   MAP_PRIVATE, in, map_offs);
+	if (map == MAP_FAILED)
+		return write_volume_read(ui, vi, ec, bytes, in, out);
+
+	madvise(map, bytes + (pos - map_offs), MADV_SEQUENTIAL);
+	if (ui->sparse &&
+	    util_fill_holes(in, pos, map + (pos - map_offs), bytes)) {
+		sys_errmsg("cannot find the holes of the input file");
+		err = -1;
+	} else
+		err = write_pebs(ui, vi, ec, map + (pos - map_offs), bytes, 0,
+				 out);
+	munmap(map, bytes + (pos - map_offs));
+
+	/* Leave the input where reading it would have */
+	if (!err && lseek(in, pos + bytes, SEEK_SET) == -1)
+		return sys_errmsg("cannot seek the input file");
+
+	return err;
+}
+
+static int write_layout_peb(const struct ubigen_info *ui, const char *buf,
+			    int fd)
+{
+	if (ui->sparse)
+		return util_write_sparse(fd, buf, ui->peb_size);
+
+	return write(fd, buf, ui->peb_size) == ui->peb_size ? 0 : -1;
 }
 
 int ubigen_write_layout_vol(const struct ubigen_info *ui, int peb1, int peb2,
 			    long long ec1, long long ec2,
 			    struct ubi_vtbl_record *vtbl, int fd)
 {
-	int ret;
 	struct ubigen_vol_info vi;
 	char *outbuf;
 	struct ubi_vid_hdr *vid_hdr;
@@ -287,8 +477,7 @@ int ubigen_write_layout_vol(const struct ubigen_info *ui, int peb1, int peb2,
 
 	ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)outbuf, ec1);
 	ubigen_init_vid_hdr(ui, &vi, vid_hdr, 0, NULL, 0);
-	ret = write(fd, outbuf, ui->peb_size);
-	if (ret != ui->peb_size) {
+	if (write_layout_peb(ui, outbuf, fd)) {
 		sys_errmsg("cannot write %d bytes", ui->peb_size);
 		goto out_free;
 	}
@@ -300,8 +489,7 @@ int ubigen_write_layout_vol(const struct ubigen_info *ui, int peb1, int peb2,
 	}
 	ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)outbuf, ec2);
 	ubigen_init_vid_hdr(ui, &vi, vid_hdr, 1, NULL, 0);
-	ret = write(fd, outbuf, ui->peb_size);
-	if (ret != ui->peb_size) {
+	if (write_layout_peb(ui, outbuf, fd)) {
 		sys_errmsg("cannot write %d bytes", ui->peb_size);
 		goto out_free;
 	}
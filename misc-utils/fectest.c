@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -15,7 +16,9 @@
 #define NR_PKTS ((ERASE_SIZE + PKT_SIZE - 1) / PKT_SIZE)
 #define DROPS 8
 
-int main(void)
+#define BENCH_ROUNDS 64
+
+static int decode_test(void)
 {
 	int i, j;
 	unsigned char buf[NR_PKTS * PKT_SIZE];
@@ -87,6 +90,115 @@ int main(void)
 		exit(1);
 	}
 
-	printf("Decoded in %ld.%06lds\n", (long)now.tv_sec, (long)now.tv_usec);
+	printf("Decoded in %ld.%06lds (%s)\n", (long)now.tv_sec,
+	       (long)now.tv_usec, fec_kernel());
+	for (i=0; i < NR_PKTS + DROPS; i++)
+		free(pkt[i]);
+	fec_free(fec);
+	return 0;
+}
+
+static double elapsed(const struct timespec *then, const struct timespec *now)
+{
+	return (now->tv_sec - then->tv_sec) +
+	       (now->tv_nsec - then->tv_nsec) / 1e9;
+}
+
+/*
+ * Measure the encoding of all the n - k redundant packets of a block of k
+ * data packets, and the decoding of a block where as many data packets as
+ * possible were replaced by redundant ones. Both are reported in MB/s of
+ * data packets processed.
+ */
+static void bench(int k, int n)
+{
+	int i, r, lost = (n - k < k) ? n - k : k;
+	unsigned char *data = malloc((size_t)n * PKT_SIZE);
+	unsigned char *rcvd = malloc((size_t)k * PKT_SIZE);
+	unsigned char *srcs[k], *pkt[k];
+	int pktnr[k];
+	struct fec_parms *fec;
+	struct timespec then, now;
+	double enc = 0, dec = 0;
+
+	if (!data || !rcvd) {
+		printf("out of memory\n");
+		exit(1);
+	}
+	fec = fec_new(k, n);
+	if (!fec) {
+		printf("fec_init() failed\n");
+		exit(1);
+	}
+
+	for (i = 0; i < k * PKT_SIZE; i++)
+		data[i] = rand();
+	for (i = 0; i < k; i++)
+		srcs[i] = data + i * PKT_SIZE;
+
+	clock_gettime(CLOCK_MONOTONIC, &then);
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		for (i = k; i < n; i++)
+			fec_encode(fec, srcs, data + i * PKT_SIZE, i,
+				   PKT_SIZE);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	enc = elapsed(&then, &now);
+
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		/* Packets 0..lost-1 are lost, use the redundant ones instead */
+		for (i = 0; i < k; i++) {
+			pktnr[i] = i < lost ? k + i : i;
+			pkt[i] = rcvd + i * PKT_SIZE;
+			memcpy(pkt[i], data + pktnr[i] * PKT_SIZE, PKT_SIZE);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &then);
+		if (fec_decode(fec, pkt, pktnr, PKT_SIZE)) {
+			printf("Decode failed\n");
+			exit(1);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		dec += elapsed(&then, &now);
+
+		for (i = 0; i < k; i++)
+			if (memcmp(pkt[i], srcs[i], PKT_SIZE)) {
+				printf("Compare failed\n");
+				exit(1);
+			}
+	}
+
+	printf("%-8s k %3d n %3d: encode %8.1f MB/s, decode %8.1f MB/s (%d lost)\n",
+	       fec_kernel(), k, n,
+	       (double)k * PKT_SIZE * BENCH_ROUNDS / enc / 1e6,
+	       (double)k * PKT_SIZE * BENCH_ROUNDS / dec / 1e6, lost);
+
+	fec_free(fec);
+	free(rcvd);
+	free(data);
+}
+
+int main(void)
+{
+	static const int params[][2] = {
+		{ 8, 10 }, { 16, 20 }, { 32, 40 },
+		{ NR_PKTS, NR_PKTS + DROPS }, { 128, 160 }, { 200, 255 },
+	};
+	int i;
+
+	/* Check both the portable and the SIMD kernel, if there is one */
+	fec_force_scalar(1);
+	if (decode_test())
+		return 1;
+	fec_force_scalar(0);
+	if (decode_test())
+		return 1;
+
+	for (i = 0; i < (int)(sizeof(params) / sizeof(params[0])); i++) {
+		fec_force_scalar(1);
+		bench(params[i][0], params[i][1]);
+		fec_force_scalar(0);
+		if (strcmp(fec_kernel(), "scalar"))
+			bench(params[i][0], params[i][1]);
+	}
 	return 0;
 }
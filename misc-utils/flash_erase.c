@@ -204,7 +204,7 @@ int main(int argc, char *argv[])
 	if (mtd_desc == NULL)
 		return errmsg("can't initialize libmtd");
 
-	if ((fd = open(mtd_device, O_RDWR)) < 0)
+	if ((fd = mtd_open_node(mtd_device, O_RDWR)) < 0)
 		return sys_errmsg("%s", mtd_device);
 
 	if (mtd_get_dev_info(mtd_desc, mtd_device, &mtd) < 0)
@@ -107,7 +107,9 @@ static NORETURN void showusage(bool error)
 			"\n"
 			"   -h | --help           Show this help message\n"
 			"   -v | --verbose        Show progress reports\n"
-			"   -p | --partition      Only copy different block from file to device\n"
+			"   -p | --partition      Only copy different block from file to device,\n"
+			"                         verifying each block right after writing it;\n"
+			"                         on NOR flash, blank blocks are not erased\n"
 			"   -A | --erase-all      Erases the whole device regardless of the image size\n"
 			"   -l | --wr-last=bytes  Write the first [bytes] last\n"
 			"   -V | --version        Show version information and exit\n"
@@ -203,6 +205,15 @@ static void safe_memerase (int fd,const char *device,struct erase_info_user *era
 	}
 }
 
+static bool is_blank (const unsigned char *buf,size_t len)
+{
+	while (len--)
+		if (*buf++ != 0xff)
+			return false;
+
+	return true;
+}
+
 /******************************************************************************/
 
 static int dev_fd = -1,fil_fd = -1;
@@ -492,6 +503,7 @@ DIFF_BLOCKS:
 	written = 0;
 	unsigned long current_dev_block = 0;
 	int diffBlock = 0;
+	int blankBlock = 0;
 	int blocks = erase.length / mtd.erasesize;
 	erase.length = mtd.erasesize;
 
@@ -512,9 +524,15 @@ DIFF_BLOCKS:
 		if (memcmp (src,dest,i))
 		{
 			diffBlock++;
-			/* erase block */
-			safe_lseek(dev_fd, current_dev_block, SEEK_SET, device);
-			safe_memerase(dev_fd,device,&erase);
+			/*
+			 * erase block, unless all of it was read and is blank; only on
+			 * NOR, as an all-0xff NAND page may still have been programmed
+			 * (e.g. its OOB), and must not be programmed again unerased
+			 */
+			if (mtd.type == MTD_NORFLASH && i == mtd.erasesize && is_blank (dest,i))
+				blankBlock++;
+			else
+				safe_memerase(dev_fd,device,&erase);
 
 			/* write to device */
 			safe_lseek(dev_fd, current_dev_block, SEEK_SET, device);
@@ -535,7 +553,7 @@ DIFF_BLOCKS:
 		size -= i;
 	}
 
-	log_verbose ("\ndiff blocks: %d\n", diffBlock);
+	log_verbose ("\ndiff blocks: %d (%d already erased)\n", diffBlock, blankBlock);
 
 	exit (EXIT_SUCCESS);
 }
@@ -106,73 +106,56 @@ out_ll:
 	return (all < bll) ? -1 : ((all > bll) ? 1 : 0);
 }
 
-static int scan_ubi_device(libubi_t lib_ubi, struct ubi_node *dev)
+static void scan_ubi_device(const struct ubi_vol_info *vols,
+			    struct ubi_node *dev)
 {
-	int lo = dev->info.lowest_vol_id, hi = dev->info.highest_vol_id;
-	int i, idx = 0, dev_num = dev->info.dev_num;
-	struct ubi_vol_info vol_info;
+	int count = dev->info.vol_count;
 
-	if (!dev->info.vol_count)
-		return 0;
+	if (!count)
+		return;
 
-	dev->vol_info = xcalloc(dev->info.vol_count, sizeof(dev->vol_info[0]));
-
-	for (i = lo; i <= hi; ++i) {
-		if (ubi_get_vol_info1(lib_ubi, dev_num, i, &vol_info)) {
-			if (errno == ENOENT)
-				continue;
-			perror("ubi_get_vol_info1");
-			return -1;
-		}
-
-		dev->vol_info[idx++] = vol_info;
-	}
+	dev->vol_info = xcalloc(count, sizeof(dev->vol_info[0]));
+	memcpy(dev->vol_info, vols, count * sizeof(dev->vol_info[0]));
 
 	if (sort_by)
-		qsort(dev->vol_info, idx, sizeof(vol_info), compare_ubi_vol);
-	return 0;
+		qsort(dev->vol_info, count, sizeof(dev->vol_info[0]),
+		      compare_ubi_vol);
 }
 
 int scan_ubi(libubi_t lib_ubi)
 {
-	struct ubi_dev_info dev_info;
-	struct ubi_info info;
+	const struct ubi_snapshot *snap;
+	const struct ubi_dev_info *dev_info;
 	int i, j;
 
-	if (ubi_get_info(lib_ubi, &info))
+	snap = ubi_get_snapshot(lib_ubi);
+	if (!snap)
 		return -1;
 
-	if (!info.dev_count)
+	if (!snap->info.dev_count)
 		return 0;
 
-	ubi_dev = xcalloc(info.dev_count, sizeof(ubi_dev[0]));
+	ubi_dev = xcalloc(snap->info.dev_count, sizeof(ubi_dev[0]));
 
-	for (i = info.lowest_dev_num; i <= info.highest_dev_num; ++i) {
-		if (!ubi_dev_present(lib_ubi, i))
-			continue;
-
-		if (ubi_get_dev_info1(lib_ubi, i, &dev_info)) {
-			perror("ubi_get_dev_info1");
-			return -1;
-		}
+	for (i = 0; i < snap->info.dev_count; ++i) {
+		dev_info = &snap->devs[i];
 
 		for (j = 0; j < num_mtd_devices; ++j) {
-			if (mtd_dev[j].info.mtd_num == dev_info.mtd_num)
+			if (mtd_dev[j].info.mtd_num == dev_info->mtd_num)
 				break;
 		}
 
 		if (j == num_mtd_devices) {
 			fprintf(stderr, "Cannot find mtd device %d referred to "
-				"by ubi device %d\n", dev_info.mtd_num,
-				dev_info.dev_num);
+				"by ubi device %d\n", dev_info->mtd_num,
+				dev_info->dev_num);
 			return -1;
 		}
 
-		ubi_dev[num_ubi_devices].info = dev_info;
+		ubi_dev[num_ubi_devices].info = *dev_info;
 		mtd_dev[j].ubi = ubi_dev + num_ubi_devices;
 
-		if (scan_ubi_device(lib_ubi, ubi_dev + num_ubi_devices))
-			return -1;
+		scan_ubi_device(snap->vols[i], ubi_dev + num_ubi_devices);
 
 		++num_ubi_devices;
 	}
@@ -181,31 +164,22 @@ int scan_ubi(libubi_t lib_ubi)
 
 int scan_mtd(libmtd_t lib_mtd)
 {
-	struct mtd_dev_info dev_info;
-	struct mtd_info info;
-	int i, idx = 0;
+	const struct mtd_snapshot *snap;
+	int i;
 
-	if (mtd_get_info(lib_mtd, &info))
+	snap = mtd_get_snapshot(lib_mtd);
+	if (!snap)
 		return -1;
 
-	if (!info.mtd_dev_cnt)
+	if (!snap->info.mtd_dev_cnt)
 		return 0;
 
-	mtd_dev = xcalloc(info.mtd_dev_cnt, sizeof(mtd_dev[0]));
-
-	for (i = info.lowest_mtd_num; i <= info.highest_mtd_num; ++i) {
-		if (!mtd_dev_present(lib_mtd, i))
-			continue;
+	mtd_dev = xcalloc(snap->info.mtd_dev_cnt, sizeof(mtd_dev[0]));
 
-		if (mtd_get_dev_info1(lib_mtd, i, &dev_info)) {
-			perror("mtd_get_dev_info1");
-			return -1;
-		}
-
-		memcpy(&(mtd_dev[idx++].info), &dev_info, sizeof(dev_info));
-	}
+	for (i = 0; i < snap->info.mtd_dev_cnt; ++i)
+		memcpy(&mtd_dev[i].info, &snap->devs[i], sizeof(snap->devs[i]));
 
-	num_mtd_devices = idx;
+	num_mtd_devices = snap->info.mtd_dev_cnt;
 
 	if (sort_by)
 		qsort(mtd_dev, num_mtd_devices, sizeof(*mtd_dev), compare_mtd);
@@ -2,6 +2,9 @@
 
 #define PKT_SIZE 2820
 
+/* Most packets sent or received with one system call */
+#define PKT_BATCH 32
+
 struct image_pkt_hdr {
 	uint32_t resend;
 	uint32_t totcrc;
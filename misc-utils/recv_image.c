@@ -11,6 +11,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -32,36 +34,444 @@ struct eraseblock {
 	int nr_pkts;
 	int *pkt_indices;
 	uint32_t crc;
+	/* Packets received and queued, protected by seen_lock */
+	unsigned char *seen;
+	int queued;
+	int complete;
 };
 
+/*
+ * Receiving, decoding and writing to flash run in three threads, so that the
+ * socket keeps being drained while the flash is being programmed or erased:
+ *
+ * - the main thread receives and checks packets, and queues them to
+ * - the flash writer, which stores them on flash as they come. Once it has
+ *   enough packets for a block, it reads them back and queues them to
+ * - the decoder, which runs fec_decode() and checks the block CRC, and
+ *   queues the decoded block back to the flash writer, which writes it in
+ *   place of the packets.
+ *
+ * Storing packets goes first, so that the receiver is not held up: decoded
+ * blocks wait in the done queue, and are only written once all packets are
+ * stored or when the flash writer runs out of block buffers. There are at
+ * most DECODE_BUFS block buffers (plus the decoder's own), handed around
+ * between the threads, so the memory use does not depend on the image size.
+ * The decode and done queues can hold all buffers, so the decoder never waits
+ * for the flash writer and the threads cannot deadlock.
+ */
+#define FLASH_QUEUE_LEN 1024
+#define DECODE_BUFS 32
+
+struct decode_work {
+	int block_nr;
+	unsigned char *buf;
+};
+
+struct queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *items;
+	size_t item_size;
+	int size;
+	int head;
+	int count;
+};
+
+static int flfd, sock;
+static int file_mode;
+static struct mtd_info_user meminfo;
+static loff_t mtdoffset;
+static struct fec_parms *fec;
+static struct eraseblock *eraseblocks;
+static int nr_blocks, pkts_per_block, nr_pkts;
+static struct queue flash_q, decode_q, done_q;
+static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
+static int done, wake_pipe[2];
+
+/* Block buffers not in use, only used by the flash writer */
+static unsigned char *free_bufs[DECODE_BUFS];
+static int nr_free_bufs;
+
+/* Updated by the flash writer and the decoder only, times in µs */
+static int total_pkts, ignored_pkts, duplicates;
+static int blocks_written;
+static unsigned long fec_time, flash_time, crc_time, rflash_time, erase_time;
+
+static void queue_init(struct queue *q, int size, size_t item_size)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->items = malloc(size * item_size);
+	if (!q->items) {
+		fprintf(stderr, "No memory for work queue\n");
+		exit(1);
+	}
+	q->item_size = item_size;
+	q->size = size;
+	q->head = q->count = 0;
+}
+
+static void queue_push(struct queue *q, const void *item)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->size)
+		pthread_cond_wait(&q->cond, &q->lock);
+	memcpy(q->items + ((q->head + q->count) % q->size) * q->item_size,
+	       item, q->item_size);
+	q->count++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_pop(struct queue *q, void *item)
+{
+	pthread_mutex_lock(&q->lock);
+	while (!q->count)
+		pthread_cond_wait(&q->cond, &q->lock);
+	memcpy(item, q->items + q->head * q->item_size, q->item_size);
+	q->head = (q->head + 1) % q->size;
+	q->count--;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static long usecs_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return now.tv_usec - start->tv_usec +
+		(now.tv_sec - start->tv_sec) * 1000000;
+}
+
+/* Move @block_nr to the next good eraseblock after a failed write */
+static void relocate_block(int block_nr)
+{
+	if (mtdoffset >= meminfo.size) {
+		fprintf(stderr, "Run out of space on flash\n");
+		exit(1);
+	}
+	while (ioctl(flfd, MEMGETBADBLOCK, &mtdoffset) > 0) {
+		printf("Skipping flash bad block at %08x\n", (uint32_t)mtdoffset);
+		mtdoffset += meminfo.erasesize;
+		if (mtdoffset >= meminfo.size) {
+			fprintf(stderr, "Run out of space on flash\n");
+			exit(1);
+		}
+	}
+	eraseblocks[block_nr].flash_offset = mtdoffset;
+}
+
+static void write_decoded(void);
+
+/* All packets of @block_nr are stored: read them back for the decoder */
+static void block_complete(int block_nr)
+{
+	struct decode_work w;
+	struct timeval start;
+	ssize_t rwlen;
+
+	pthread_mutex_lock(&seen_lock);
+	eraseblocks[block_nr].complete = 1;
+	pthread_mutex_unlock(&seen_lock);
+
+	/* Make room by writing out the blocks which are already decoded */
+	while (!nr_free_bufs)
+		write_decoded();
+
+	w.block_nr = block_nr;
+	w.buf = free_bufs[--nr_free_bufs];
+
+	gettimeofday(&start, NULL);
+	eraseblocks[block_nr].flash_offset -= meminfo.erasesize;
+	rwlen = pread(flfd, w.buf, meminfo.erasesize, eraseblocks[block_nr].flash_offset);
+	rflash_time += usecs_since(&start);
+	if (rwlen < 0) {
+		perror("read");
+		/* Argh. Perhaps we could go back and try again, but if the flash is
+		   going to fail to read back what we write to it, and the whole point
+		   in this program is to write to it, what's the point? */
+		fprintf(stderr, "Packets we wrote to flash seem to be unreadable. Aborting\n");
+		exit(1);
+	}
+
+	memcpy(w.buf + meminfo.erasesize, eraseblocks[block_nr].wbuf,
+	       eraseblocks[block_nr].wbuf_ofs);
+
+	queue_push(&decode_q, &w);
+}
+
+static void store_pkt(int block_nr, struct image_pkt *thispkt)
+{
+	struct timeval start;
+	int i;
+
+	/* The receiver filters these out, except when it raced with us */
+	if (eraseblocks[block_nr].nr_pkts >= pkts_per_block) {
+		/* We have a block which we didn't really need */
+		eraseblocks[block_nr].nr_pkts++;
+		ignored_pkts++;
+		return;
+	}
+	for (i=0; i<eraseblocks[block_nr].nr_pkts; i++) {
+		if (eraseblocks[block_nr].pkt_indices[i] == ntohs(thispkt->hdr.pkt_nr)) {
+			/* Received again after relocate_block() */
+			pthread_mutex_lock(&seen_lock);
+			eraseblocks[block_nr].queued--;
+			pthread_mutex_unlock(&seen_lock);
+			duplicates++;
+			return;
+		}
+	}
+
+ pkt_again:
+	eraseblocks[block_nr].pkt_indices[eraseblocks[block_nr].nr_pkts++] =
+		ntohs(thispkt->hdr.pkt_nr);
+	total_pkts++;
+
+	if (eraseblocks[block_nr].wbuf_ofs + PKT_SIZE < WBUF_SIZE) {
+		/* New packet doesn't full the wbuf */
+		memcpy(eraseblocks[block_nr].wbuf + eraseblocks[block_nr].wbuf_ofs,
+		       thispkt->data, PKT_SIZE);
+		eraseblocks[block_nr].wbuf_ofs += PKT_SIZE;
+	} else {
+		int fits = WBUF_SIZE - eraseblocks[block_nr].wbuf_ofs;
+		ssize_t wrotelen;
+		static int faked = 1;
+
+		memcpy(eraseblocks[block_nr].wbuf + eraseblocks[block_nr].wbuf_ofs,
+		       thispkt->data, fits);
+		gettimeofday(&start, NULL);
+		wrotelen = pwrite(flfd, eraseblocks[block_nr].wbuf, WBUF_SIZE,
+				  eraseblocks[block_nr].flash_offset);
+		flash_time += usecs_since(&start);
+
+		if (wrotelen < WBUF_SIZE || (block_nr == 5 && eraseblocks[block_nr].nr_pkts == 5 && !faked)) {
+			faked = 1;
+			if (wrotelen < 0)
+				perror("\npacket write");
+			else
+				fprintf(stderr, "\nshort write of packet wbuf\n");
+
+			if (!file_mode) {
+				struct erase_info_user erase;
+				/* FIXME: Perhaps we should store pkt crcs and try
+				   to recover data from the offending eraseblock */
+
+				/* We have increased nr_pkts but not yet flash_offset */
+				erase.start = eraseblocks[block_nr].flash_offset &
+					~(meminfo.erasesize - 1);
+				erase.length = meminfo.erasesize;
+
+				printf("Will erase at %08x len %08x (bad write was at %08x)\n",
+				       erase.start, erase.length, eraseblocks[block_nr].flash_offset);
+				if (ioctl(flfd, MEMERASE, &erase)) {
+					perror("MEMERASE");
+					exit(1);
+				}
+				relocate_block(block_nr);
+				printf("Block #%d will now be at %08lx\n", block_nr, (long)mtdoffset);
+
+				/* Have the lost packets received again */
+				pthread_mutex_lock(&seen_lock);
+				memset(eraseblocks[block_nr].seen, 0, nr_pkts);
+				eraseblocks[block_nr].seen[ntohs(thispkt->hdr.pkt_nr)] = 1;
+				eraseblocks[block_nr].queued -= eraseblocks[block_nr].nr_pkts - 1;
+				pthread_mutex_unlock(&seen_lock);
+
+				total_pkts -= eraseblocks[block_nr].nr_pkts;
+				eraseblocks[block_nr].nr_pkts = 0;
+				eraseblocks[block_nr].wbuf_ofs = 0;
+				mtdoffset += meminfo.erasesize;
+				goto pkt_again;
+			}
+			else /* Usually nothing we can do in file mode */
+				exit(1);
+		}
+		eraseblocks[block_nr].flash_offset += WBUF_SIZE;
+		/* Copy the remainder into the wbuf */
+		memcpy(eraseblocks[block_nr].wbuf, &thispkt->data[fits], PKT_SIZE - fits);
+		eraseblocks[block_nr].wbuf_ofs = PKT_SIZE - fits;
+	}
+
+	if (eraseblocks[block_nr].nr_pkts == pkts_per_block) {
+		eraseblocks[block_nr].crc = ntohl(thispkt->hdr.block_crc);
+		block_complete(block_nr);
+
+		if (total_pkts == nr_blocks * pkts_per_block) {
+			/* Wake up the receiver */
+			__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+			if (write(wake_pipe[1], "", 1) != 1) {
+				perror("write wake pipe");
+				exit(1);
+			}
+		}
+	}
+}
+
+/* Write a decoded block in place of the packets it was decoded from */
+static void write_block(int block_nr, unsigned char *decode_buf)
+{
+	struct timeval start;
+	ssize_t rwlen;
+
+	gettimeofday(&start, NULL);
+	if (!file_mode) {
+		struct erase_info_user erase;
+
+		erase.start = eraseblocks[block_nr].flash_offset;
+		erase.length = meminfo.erasesize;
+
+		if (ioctl(flfd, MEMERASE, &erase)) {
+			perror("MEMERASE");
+			/* This block has dirty data on it. If the erase failed, we're screwed */
+			fprintf(stderr, "Erase to clean FEC data from flash failed. Aborting\n");
+			exit(1);
+		}
+		erase_time += usecs_since(&start);
+		gettimeofday(&start, NULL);
+	}
+ write_again:
+	rwlen = pwrite(flfd, decode_buf, meminfo.erasesize, eraseblocks[block_nr].flash_offset);
+	if (rwlen < meminfo.erasesize) {
+		if (rwlen < 0) {
+			perror("\ndecoded data write");
+		} else
+			fprintf(stderr, "\nshort write of decoded data\n");
+
+		if (!file_mode) {
+			struct erase_info_user erase;
+			erase.start = eraseblocks[block_nr].flash_offset;
+			erase.length = meminfo.erasesize;
+
+			printf("Erasing failed block at %08x\n",
+			       eraseblocks[block_nr].flash_offset);
+
+			if (ioctl(flfd, MEMERASE, &erase)) {
+				perror("MEMERASE");
+				exit(1);
+			}
+			relocate_block(block_nr);
+			printf("Will try again at %08lx...", (long)mtdoffset);
+			mtdoffset += meminfo.erasesize;
+
+			goto write_again;
+		}
+		else /* Usually nothing we can do in file mode */
+			exit(1);
+	}
+	flash_time += usecs_since(&start);
+
+	/* Only report once the receiver stopped printing its progress */
+	if (__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		printf("\rwrote image block %08x (%d pkts)    ",
+		       block_nr * meminfo.erasesize, eraseblocks[block_nr].nr_pkts);
+		fflush(stdout);
+	}
+}
+
+/* Write the next decoded block and take its buffer back */
+static void write_decoded(void)
+{
+	struct decode_work w;
+
+	queue_pop(&done_q, &w);
+	write_block(w.block_nr, w.buf);
+	free_bufs[nr_free_bufs++] = w.buf;
+	__atomic_add_fetch(&blocks_written, 1, __ATOMIC_RELAXED);
+}
+
+static void *flash_thread(void *arg)
+{
+	struct image_pkt pkt;
+
+	/* Only this thread sets @done */
+	while (!done) {
+		queue_pop(&flash_q, &pkt);
+		store_pkt(ntohl(pkt.hdr.block_nr), &pkt);
+	}
+
+	while (blocks_written < nr_blocks)
+		write_decoded();
+
+	return arg;
+}
+
+static void *decode_thread(void *arg)
+{
+	unsigned char **src_pkts, *decoded, *tmp;
+	struct timeval start;
+	struct decode_work w;
+	int n, i;
+
+	src_pkts = malloc(sizeof(unsigned char *) * pkts_per_block);
+	decoded = malloc(pkts_per_block * PKT_SIZE);
+	if (!src_pkts || !decoded) {
+		fprintf(stderr, "No memory for decode buffers\n");
+		exit(1);
+	}
+
+	for (n = 0; n < nr_blocks; n++) {
+		queue_pop(&decode_q, &w);
+
+		for (i=0; i < pkts_per_block; i++)
+			src_pkts[i] = &w.buf[i * PKT_SIZE];
+
+		gettimeofday(&start, NULL);
+		if (fec_decode(fec, src_pkts, eraseblocks[w.block_nr].pkt_indices, PKT_SIZE)) {
+			/* Eep. This cannot happen */
+			printf("The world is broken. fec_decode() returned error\n");
+			exit(1);
+		}
+		fec_time += usecs_since(&start);
+
+		for (i=0; i < pkts_per_block; i++)
+			memcpy(&decoded[i*PKT_SIZE], src_pkts[i], PKT_SIZE);
+
+		/* Paranoia */
+		gettimeofday(&start, NULL);
+		if (mtd_crc32(-1, decoded, meminfo.erasesize) != eraseblocks[w.block_nr].crc) {
+			printf("\nCRC mismatch for block #%d: want %08x got %08x\n",
+			       w.block_nr, eraseblocks[w.block_nr].crc,
+			       mtd_crc32(-1, decoded, meminfo.erasesize));
+			exit(1);
+		}
+		crc_time += usecs_since(&start);
+
+		/* Hand the decoded block over and keep the packets buffer */
+		tmp = w.buf;
+		w.buf = decoded;
+		decoded = tmp;
+		queue_push(&done_q, &w);
+	}
+
+	free(decoded);
+	free(src_pkts);
+	return arg;
+}
+
 int main(int argc, char **argv)
 {
 	struct addrinfo *ai;
 	struct addrinfo hints;
 	struct addrinfo *runp;
 	int ret;
-	int sock;
 	ssize_t len;
-	int flfd;
-	struct mtd_info_user meminfo;
-	unsigned char *eb_buf, *decode_buf, **src_pkts;
-	int nr_blocks = 0;
-	int pkts_per_block;
+	struct image_pkt *pkts, *thispkt;
+	struct mmsghdr msgs[PKT_BATCH];
+	struct iovec iovs[PKT_BATCH];
+	struct pollfd pfds[2];
+	pthread_t flash_tid, decode_tid;
+	unsigned long rx_pkts = 0, rx_calls = 0, max_batch = 0;
+	int nr_rcvd, j;
 	int block_nr = -1;
 	uint32_t image_crc = 0;
-	int total_pkts = 0;
-	int ignored_pkts = 0;
-	loff_t mtdoffset = 0;
+	int queued_pkts = 0, rx_ignored = 0, rx_duplicates = 0;
 	int badcrcs = 0;
-	int duplicates = 0;
-	int file_mode = 0;
-	struct fec_parms *fec = NULL;
 	int i;
-	struct eraseblock *eraseblocks = NULL;
-	uint32_t start_seq = 0;
-	struct timeval start, now;
-	unsigned long fec_time = 0, flash_time = 0, crc_time = 0,
-		rflash_time = 0, erase_time = 0, net_time = 0;
+	uint32_t start_seq = 0, last_seq = 0, used_seq = 0;
+	struct timeval start;
+	unsigned long net_time = 0;
 
 	if (argc != 4) {
 		fprintf(stderr, "usage: %s <host> <port> <mtddev>\n",
@@ -96,18 +506,6 @@ int main(int argc, char **argv)
 
 	pkts_per_block = (meminfo.erasesize + PKT_SIZE - 1) / PKT_SIZE;
 
-	eb_buf = malloc(pkts_per_block * PKT_SIZE);
-	decode_buf = malloc(pkts_per_block * PKT_SIZE);
-	if (!eb_buf && !decode_buf) {
-		fprintf(stderr, "No memory for eraseblock buffer\n");
-		exit(1);
-	}
-	src_pkts = malloc(sizeof(unsigned char *) * pkts_per_block);
-	if (!src_pkts) {
-		fprintf(stderr, "No memory for decode packet pointers\n");
-		exit(1);
-	}
-
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_flags = AI_ADDRCONFIG;
 	hints.ai_socktype = SOCK_DGRAM;
@@ -157,329 +555,233 @@ int main(int argc, char **argv)
 	if (!runp)
 		exit(1);
 
-	while (1) {
-		struct image_pkt thispkt;
-
-		len = read(sock, &thispkt, sizeof(thispkt));
-
-		if (len < 0) {
-			perror("read socket");
-			break;
-		}
-		if (len < sizeof(thispkt)) {
-			fprintf(stderr, "Wrong length %zd bytes (expected %zu)\n",
-				len, sizeof(thispkt));
-			continue;
-		}
-		if (!eraseblocks) {
-			image_crc = thispkt.hdr.totcrc;
-			start_seq = ntohl(thispkt.hdr.pkt_sequence);
-
-			if (meminfo.erasesize != ntohl(thispkt.hdr.blocksize)) {
-				fprintf(stderr, "Erasesize mismatch (0x%x not 0x%x)\n",
-					ntohl(thispkt.hdr.blocksize), meminfo.erasesize);
-				exit(1);
-			}
-			nr_blocks = ntohl(thispkt.hdr.nr_blocks);
+	/* The sender makes up for lost time with bursts of up to 10ms */
+	i = 2 * 1024 * 1024;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &i, sizeof(i)))
+		perror("SO_RCVBUF");
 
-			fec = fec_new(pkts_per_block, ntohs(thispkt.hdr.nr_pkts));
+	pkts = malloc(PKT_BATCH * sizeof(*pkts));
+	if (!pkts) {
+		fprintf(stderr, "No memory for packet buffers\n");
+		exit(1);
+	}
+	memset(msgs, 0, sizeof(msgs));
+	for (j = 0; j < PKT_BATCH; j++) {
+		iovs[j].iov_base = &pkts[j];
+		iovs[j].iov_len = sizeof(*pkts);
+		msgs[j].msg_hdr.msg_iov = &iovs[j];
+		msgs[j].msg_hdr.msg_iovlen = 1;
+	}
 
-			eraseblocks = malloc(nr_blocks * sizeof(*eraseblocks));
-			if (!eraseblocks) {
-				fprintf(stderr, "No memory for block map\n");
-				exit(1);
-			}
-			for (i = 0; i < nr_blocks; i++) {
-				eraseblocks[i].pkt_indices = malloc(sizeof(int) * pkts_per_block);
-				if (!eraseblocks[i].pkt_indices) {
-					fprintf(stderr, "Failed to allocate packet indices\n");
-					exit(1);
-				}
-				eraseblocks[i].nr_pkts = 0;
-				if (!file_mode) {
-					if (mtdoffset >= meminfo.size) {
-						fprintf(stderr, "Run out of space on flash\n");
-						exit(1);
-					}
-#if 1 /* Deliberately use bad blocks... test write failures */
-					while (ioctl(flfd, MEMGETBADBLOCK, &mtdoffset) > 0) {
-						printf("Skipping flash bad block at %08x\n", (uint32_t)mtdoffset);
-						mtdoffset += meminfo.erasesize;
-					}
-#endif
-				}
-				eraseblocks[i].flash_offset = mtdoffset;
-				mtdoffset += meminfo.erasesize;
-				eraseblocks[i].wbuf_ofs = 0;
-			}
-			gettimeofday(&start, NULL);
-		}
-		if (image_crc != thispkt.hdr.totcrc) {
-			fprintf(stderr, "\nImage CRC changed from 0x%x to 0x%x. Aborting\n",
-				ntohl(image_crc), ntohl(thispkt.hdr.totcrc));
+	/* The flash writer wakes us up through the pipe once it is done */
+	if (pipe(wake_pipe)) {
+		perror("pipe");
+		exit(1);
+	}
+	pfds[0].fd = sock;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = wake_pipe[0];
+	pfds[1].events = POLLIN;
+
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
 			exit(1);
 		}
+		if (pfds[1].revents)
+			break;
 
-		block_nr = ntohl(thispkt.hdr.block_nr);
-		if (block_nr >= nr_blocks) {
-			fprintf(stderr, "\nErroneous block_nr %d (> %d)\n",
-				block_nr, nr_blocks);
+		nr_rcvd = recvmmsg(sock, msgs, PKT_BATCH,
+				   MSG_WAITFORONE | MSG_DONTWAIT, NULL);
+		if (nr_rcvd < 0 && errno == ENOSYS) {
+			len = recv(sock, &pkts[0], sizeof(*pkts), MSG_DONTWAIT);
+			msgs[0].msg_len = len;
+			nr_rcvd = len < 0 ? -1 : 1;
+		}
+		if (nr_rcvd < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			perror("read socket");
 			exit(1);
 		}
-		for (i=0; i<eraseblocks[block_nr].nr_pkts; i++) {
-			if (eraseblocks[block_nr].pkt_indices[i] == ntohs(thispkt.hdr.pkt_nr)) {
-//				printf("Discarding duplicate packet at %08x pkt %d\n",
-//				       block_nr * meminfo.erasesize, eraseblocks[block_nr].pkt_indices[i]);
-				duplicates++;
-				break;
+		rx_calls++;
+		rx_pkts += nr_rcvd;
+		if (nr_rcvd > max_batch)
+			max_batch = nr_rcvd;
+
+		for (j = 0; j < nr_rcvd; j++) {
+			thispkt = &pkts[j];
+			len = msgs[j].msg_len;
+
+			if (len < sizeof(*thispkt)) {
+				fprintf(stderr, "Wrong length %zd bytes (expected %zu)\n",
+					len, sizeof(*thispkt));
+				continue;
 			}
-		}
-		if (i < eraseblocks[block_nr].nr_pkts) {
-			continue;
-		}
+			if (!eraseblocks) {
+				image_crc = thispkt->hdr.totcrc;
+				start_seq = ntohl(thispkt->hdr.pkt_sequence);
 
-		if (eraseblocks[block_nr].nr_pkts >= pkts_per_block) {
-			/* We have a block which we didn't really need */
-			eraseblocks[block_nr].nr_pkts++;
-			ignored_pkts++;
-			continue;
-		}
+				if (meminfo.erasesize != ntohl(thispkt->hdr.blocksize)) {
+					fprintf(stderr, "Erasesize mismatch (0x%x not 0x%x)\n",
+						ntohl(thispkt->hdr.blocksize), meminfo.erasesize);
+					exit(1);
+				}
+				nr_blocks = ntohl(thispkt->hdr.nr_blocks);
+				nr_pkts = ntohs(thispkt->hdr.nr_pkts);
 
-		if (mtd_crc32(-1, thispkt.data, PKT_SIZE) != ntohl(thispkt.hdr.thiscrc)) {
-			printf("\nDiscard %08x pkt %d with bad CRC (%08x not %08x)\n",
-			       block_nr * meminfo.erasesize, ntohs(thispkt.hdr.pkt_nr),
-			       mtd_crc32(-1, thispkt.data, PKT_SIZE),
-			       ntohl(thispkt.hdr.thiscrc));
-			badcrcs++;
-			continue;
-		}
-	pkt_again:
-		eraseblocks[block_nr].pkt_indices[eraseblocks[block_nr].nr_pkts++] =
-			ntohs(thispkt.hdr.pkt_nr);
-		total_pkts++;
-		if (!(total_pkts % 50) || total_pkts == pkts_per_block * nr_blocks) {
-			uint32_t pkts_sent = ntohl(thispkt.hdr.pkt_sequence) - start_seq + 1;
-			long time_msec;
-			gettimeofday(&now, NULL);
-
-			time_msec = ((now.tv_usec - start.tv_usec) / 1000) +
-				(now.tv_sec - start.tv_sec) * 1000;
-
-			printf("\rReceived %d/%d (%d%%) in %lds @%ldKiB/s, %d lost (%d%%), %d dup/xs    ",
-			       total_pkts, nr_blocks * pkts_per_block,
-			       total_pkts * 100 / nr_blocks / pkts_per_block,
-			       time_msec / 1000,
-			       total_pkts * PKT_SIZE / 1024 * 1000 / time_msec,
-			       pkts_sent - total_pkts - duplicates - ignored_pkts,
-			       (pkts_sent - total_pkts - duplicates - ignored_pkts) * 100 / pkts_sent,
-			       duplicates + ignored_pkts);
-			fflush(stdout);
-		}
+				fec = fec_new(pkts_per_block, nr_pkts);
 
-		if (eraseblocks[block_nr].wbuf_ofs + PKT_SIZE < WBUF_SIZE) {
-			/* New packet doesn't full the wbuf */
-			memcpy(eraseblocks[block_nr].wbuf + eraseblocks[block_nr].wbuf_ofs,
-			       thispkt.data, PKT_SIZE);
-			eraseblocks[block_nr].wbuf_ofs += PKT_SIZE;
-		} else {
-			int fits = WBUF_SIZE - eraseblocks[block_nr].wbuf_ofs;
-			ssize_t wrotelen;
-			static int faked = 1;
-
-			memcpy(eraseblocks[block_nr].wbuf + eraseblocks[block_nr].wbuf_ofs,
-			       thispkt.data, fits);
-			wrotelen = pwrite(flfd, eraseblocks[block_nr].wbuf, WBUF_SIZE,
-					  eraseblocks[block_nr].flash_offset);
-
-			if (wrotelen < WBUF_SIZE || (block_nr == 5 && eraseblocks[block_nr].nr_pkts == 5 && !faked)) {
-				faked = 1;
-				if (wrotelen < 0)
-					perror("\npacket write");
-				else
-					fprintf(stderr, "\nshort write of packet wbuf\n");
-
-				if (!file_mode) {
-					struct erase_info_user erase;
-					/* FIXME: Perhaps we should store pkt crcs and try
-					   to recover data from the offending eraseblock */
-
-					/* We have increased nr_pkts but not yet flash_offset */
-					erase.start = eraseblocks[block_nr].flash_offset &
-						~(meminfo.erasesize - 1);
-					erase.length = meminfo.erasesize;
-
-					printf("Will erase at %08x len %08x (bad write was at %08x)\n",
-					       erase.start, erase.length, eraseblocks[block_nr].flash_offset);
-					if (ioctl(flfd, MEMERASE, &erase)) {
-						perror("MEMERASE");
-						exit(1);
-					}
-					if (mtdoffset >= meminfo.size) {
-						fprintf(stderr, "Run out of space on flash\n");
+				eraseblocks = malloc(nr_blocks * sizeof(*eraseblocks));
+				if (!eraseblocks) {
+					fprintf(stderr, "No memory for block map\n");
+					exit(1);
+				}
+				for (i = 0; i < nr_blocks; i++) {
+					eraseblocks[i].pkt_indices = malloc(sizeof(int) * pkts_per_block);
+					eraseblocks[i].seen = calloc(nr_pkts, 1);
+					if (!eraseblocks[i].pkt_indices || !eraseblocks[i].seen) {
+						fprintf(stderr, "Failed to allocate packet indices\n");
 						exit(1);
 					}
-					while (ioctl(flfd, MEMGETBADBLOCK, &mtdoffset) > 0) {
-						printf("Skipping flash bad block at %08x\n", (uint32_t)mtdoffset);
-						mtdoffset += meminfo.erasesize;
+					eraseblocks[i].nr_pkts = 0;
+					eraseblocks[i].queued = 0;
+					eraseblocks[i].complete = 0;
+					if (!file_mode) {
 						if (mtdoffset >= meminfo.size) {
 							fprintf(stderr, "Run out of space on flash\n");
 							exit(1);
 						}
+#if 1 /* Deliberately use bad blocks... test write failures */
+						while (ioctl(flfd, MEMGETBADBLOCK, &mtdoffset) > 0) {
+							printf("Skipping flash bad block at %08x\n", (uint32_t)mtdoffset);
+							mtdoffset += meminfo.erasesize;
+						}
+#endif
 					}
-					eraseblocks[block_nr].flash_offset = mtdoffset;
-					printf("Block #%d will now be at %08lx\n", block_nr, (long)mtdoffset);
-					total_pkts -= eraseblocks[block_nr].nr_pkts;
-					eraseblocks[block_nr].nr_pkts = 0;
-					eraseblocks[block_nr].wbuf_ofs = 0;
+					eraseblocks[i].flash_offset = mtdoffset;
 					mtdoffset += meminfo.erasesize;
-					goto pkt_again;
+					eraseblocks[i].wbuf_ofs = 0;
 				}
-				else /* Usually nothing we can do in file mode */
-					exit(1);
-			}
-			eraseblocks[block_nr].flash_offset += WBUF_SIZE;
-			/* Copy the remainder into the wbuf */
-			memcpy(eraseblocks[block_nr].wbuf, &thispkt.data[fits], PKT_SIZE - fits);
-			eraseblocks[block_nr].wbuf_ofs = PKT_SIZE - fits;
-		}
-
-		if (eraseblocks[block_nr].nr_pkts == pkts_per_block) {
-			eraseblocks[block_nr].crc = ntohl(thispkt.hdr.block_crc);
-
-			if (total_pkts == nr_blocks * pkts_per_block)
-				break;
-		}
-	}
-	printf("\n");
-	gettimeofday(&now, NULL);
-	net_time = (now.tv_usec - start.tv_usec) / 1000;
-	net_time += (now.tv_sec - start.tv_sec) * 1000;
-	close(sock);
-	for (block_nr = 0; block_nr < nr_blocks; block_nr++) {
-		ssize_t rwlen;
-		gettimeofday(&start, NULL);
-		eraseblocks[block_nr].flash_offset -= meminfo.erasesize;
-		rwlen = pread(flfd, eb_buf, meminfo.erasesize, eraseblocks[block_nr].flash_offset);
-
-		gettimeofday(&now, NULL);
-		rflash_time += (now.tv_usec - start.tv_usec) / 1000;
-		rflash_time += (now.tv_sec - start.tv_sec) * 1000;
-		if (rwlen < 0) {
-			perror("read");
-			/* Argh. Perhaps we could go back and try again, but if the flash is
-			   going to fail to read back what we write to it, and the whole point
-			   in this program is to write to it, what's the point? */
-			fprintf(stderr, "Packets we wrote to flash seem to be unreadable. Aborting\n");
-			exit(1);
-		}
-
-		memcpy(eb_buf + meminfo.erasesize, eraseblocks[block_nr].wbuf,
-		       eraseblocks[block_nr].wbuf_ofs);
-
-		for (i=0; i < pkts_per_block; i++)
-			src_pkts[i] = &eb_buf[i * PKT_SIZE];
-
-		gettimeofday(&start, NULL);
-		if (fec_decode(fec, src_pkts, eraseblocks[block_nr].pkt_indices, PKT_SIZE)) {
-			/* Eep. This cannot happen */
-			printf("The world is broken. fec_decode() returned error\n");
-			exit(1);
-		}
-		gettimeofday(&now, NULL);
-		fec_time += (now.tv_usec - start.tv_usec) / 1000;
-		fec_time += (now.tv_sec - start.tv_sec) * 1000;
-
-		for (i=0; i < pkts_per_block; i++)
-			memcpy(&decode_buf[i*PKT_SIZE], src_pkts[i], PKT_SIZE);
-
-		/* Paranoia */
-		gettimeofday(&start, NULL);
-		if (mtd_crc32(-1, decode_buf, meminfo.erasesize) != eraseblocks[block_nr].crc) {
-			printf("\nCRC mismatch for block #%d: want %08x got %08x\n",
-			       block_nr, eraseblocks[block_nr].crc,
-			       mtd_crc32(-1, decode_buf, meminfo.erasesize));
-			exit(1);
-		}
-		gettimeofday(&now, NULL);
-		crc_time += (now.tv_usec - start.tv_usec) / 1000;
-		crc_time += (now.tv_sec - start.tv_sec) * 1000;
-		start = now;
-
-		if (!file_mode) {
-			struct erase_info_user erase;
-
-			erase.start = eraseblocks[block_nr].flash_offset;
-			erase.length = meminfo.erasesize;
-
-			printf("\rErasing block at %08x...", erase.start);
-
-			if (ioctl(flfd, MEMERASE, &erase)) {
-				perror("MEMERASE");
-				/* This block has dirty data on it. If the erase failed, we're screwed */
-				fprintf(stderr, "Erase to clean FEC data from flash failed. Aborting\n");
-				exit(1);
-			}
-			gettimeofday(&now, NULL);
-			erase_time += (now.tv_usec - start.tv_usec) / 1000;
-			erase_time += (now.tv_sec - start.tv_sec) * 1000;
-			start = now;
-		}
-		else printf("\r");
-	write_again:
-		rwlen = pwrite(flfd, decode_buf, meminfo.erasesize, eraseblocks[block_nr].flash_offset);
-		if (rwlen < meminfo.erasesize) {
-			if (rwlen < 0) {
-				perror("\ndecoded data write");
-			} else
-				fprintf(stderr, "\nshort write of decoded data\n");
 
-			if (!file_mode) {
-				struct erase_info_user erase;
-				erase.start = eraseblocks[block_nr].flash_offset;
-				erase.length = meminfo.erasesize;
-
-				printf("Erasing failed block at %08x\n",
-				       eraseblocks[block_nr].flash_offset);
-
-				if (ioctl(flfd, MEMERASE, &erase)) {
-					perror("MEMERASE");
-					exit(1);
-				}
-				if (mtdoffset >= meminfo.size) {
-					fprintf(stderr, "Run out of space on flash\n");
-					exit(1);
-				}
-				while (ioctl(flfd, MEMGETBADBLOCK, &mtdoffset) > 0) {
-					printf("Skipping flash bad block at %08x\n", (uint32_t)mtdoffset);
-					mtdoffset += meminfo.erasesize;
-					if (mtdoffset >= meminfo.size) {
-						fprintf(stderr, "Run out of space on flash\n");
+				nr_free_bufs = nr_blocks < DECODE_BUFS ? nr_blocks : DECODE_BUFS;
+				for (i = 0; i < nr_free_bufs; i++) {
+					free_bufs[i] = malloc(pkts_per_block * PKT_SIZE);
+					if (!free_bufs[i]) {
+						fprintf(stderr, "No memory for eraseblock buffers\n");
 						exit(1);
 					}
 				}
-				printf("Will try again at %08lx...", (long)mtdoffset);
-				eraseblocks[block_nr].flash_offset = mtdoffset;
 
-				goto write_again;
+				queue_init(&flash_q, FLASH_QUEUE_LEN, sizeof(struct image_pkt));
+				queue_init(&decode_q, nr_free_bufs, sizeof(struct decode_work));
+				queue_init(&done_q, nr_free_bufs, sizeof(struct decode_work));
+				if (pthread_create(&flash_tid, NULL, flash_thread, NULL) ||
+				    pthread_create(&decode_tid, NULL, decode_thread, NULL)) {
+					fprintf(stderr, "Failed to start threads\n");
+					exit(1);
+				}
+				gettimeofday(&start, NULL);
 			}
-			else /* Usually nothing we can do in file mode */
+			if (image_crc != thispkt->hdr.totcrc) {
+				fprintf(stderr, "\nImage CRC changed from 0x%x to 0x%x. Aborting\n",
+					ntohl(image_crc), ntohl(thispkt->hdr.totcrc));
 				exit(1);
-		}
-		gettimeofday(&now, NULL);
-		flash_time += (now.tv_usec - start.tv_usec) / 1000;
-		flash_time += (now.tv_sec - start.tv_sec) * 1000;
+			}
 
-		printf("wrote image block %08x (%d pkts)    ",
-		       block_nr * meminfo.erasesize, eraseblocks[block_nr].nr_pkts);
-		fflush(stdout);
+			block_nr = ntohl(thispkt->hdr.block_nr);
+			if (block_nr >= nr_blocks) {
+				fprintf(stderr, "\nErroneous block_nr %d (> %d)\n",
+					block_nr, nr_blocks);
+				exit(1);
+			}
+			if (ntohs(thispkt->hdr.pkt_nr) >= nr_pkts) {
+				fprintf(stderr, "\nErroneous pkt_nr %d (> %d)\n",
+					ntohs(thispkt->hdr.pkt_nr), nr_pkts);
+				exit(1);
+			}
+			last_seq = ntohl(thispkt->hdr.pkt_sequence);
+
+			pthread_mutex_lock(&seen_lock);
+			if (eraseblocks[block_nr].complete ||
+			    eraseblocks[block_nr].queued >= pkts_per_block) {
+				/* We have a block which we didn't really need */
+				rx_ignored++;
+				pthread_mutex_unlock(&seen_lock);
+				continue;
+			}
+			if (eraseblocks[block_nr].seen[ntohs(thispkt->hdr.pkt_nr)]) {
+				rx_duplicates++;
+				pthread_mutex_unlock(&seen_lock);
+				continue;
+			}
+			pthread_mutex_unlock(&seen_lock);
+
+			if (mtd_crc32(-1, thispkt->data, PKT_SIZE) != ntohl(thispkt->hdr.thiscrc)) {
+				printf("\nDiscard %08x pkt %d with bad CRC (%08x not %08x)\n",
+				       block_nr * meminfo.erasesize, ntohs(thispkt->hdr.pkt_nr),
+				       mtd_crc32(-1, thispkt->data, PKT_SIZE),
+				       ntohl(thispkt->hdr.thiscrc));
+				badcrcs++;
+				continue;
+			}
+
+			pthread_mutex_lock(&seen_lock);
+			eraseblocks[block_nr].seen[ntohs(thispkt->hdr.pkt_nr)] = 1;
+			eraseblocks[block_nr].queued++;
+			pthread_mutex_unlock(&seen_lock);
+
+			queue_push(&flash_q, thispkt);
+			queued_pkts++;
+			used_seq = last_seq;
+
+			if (!(queued_pkts % 50)) {
+				uint32_t pkts_sent = last_seq - start_seq + 1;
+				long time_msec = usecs_since(&start) / 1000;
+				int lost = pkts_sent - queued_pkts - rx_duplicates - rx_ignored;
+				int stored = __atomic_load_n(&total_pkts, __ATOMIC_RELAXED);
+
+				printf("\rReceived %d/%d (%d%%) in %lds @%ldKiB/s, %d lost (%d%%), %d dup/xs, %d blocks written    ",
+				       stored, nr_blocks * pkts_per_block,
+				       stored * 100 / nr_blocks / pkts_per_block,
+				       time_msec / 1000,
+				       queued_pkts * PKT_SIZE / 1024 * 1000 / (time_msec ? : 1),
+				       lost, lost * 100 / pkts_sent,
+				       rx_duplicates + rx_ignored,
+				       __atomic_load_n(&blocks_written, __ATOMIC_RELAXED));
+				fflush(stdout);
+			}
+		}
 	}
+	net_time = usecs_since(&start) / 1000;
+
+	pthread_join(flash_tid, NULL);
+	pthread_join(decode_tid, NULL);
+	for (i = 0; i < nr_free_bufs; i++)
+		free(free_bufs[i]);
+	close(wake_pipe[0]);
+	close(wake_pipe[1]);
+	close(sock);
 	close(flfd);
-	printf("Net rx   %ld.%03lds\n", net_time / 1000, net_time % 1000);
-	printf("flash rd %ld.%03lds\n", rflash_time / 1000, rflash_time % 1000);
-	printf("FEC time %ld.%03lds\n", fec_time / 1000, fec_time % 1000);
-	printf("CRC time %ld.%03lds\n", crc_time / 1000, crc_time % 1000);
-	printf("flash wr %ld.%03lds\n", flash_time / 1000, flash_time % 1000);
-	printf("flash er %ld.%03lds\n", erase_time / 1000, erase_time % 1000);
+
+	printf("\n");
+	printf("Net rx   %ld.%03lds, %lu pkts (%lu pkts/s) in %lu calls, batch avg %lu max %lu\n",
+	       net_time / 1000, net_time % 1000, rx_pkts,
+	       rx_pkts * 1000 / (net_time ? : 1), rx_calls,
+	       rx_pkts / (rx_calls ? : 1), max_batch);
+	/* Count up to the last packet used, not to when we stopped listening */
+	printf("Carousel rounds %d.%02d (%u pkts sent, %d stored, %d dup/xs)\n",
+	       (used_seq - start_seq + 1) / (nr_blocks * nr_pkts),
+	       (used_seq - start_seq + 1) % (nr_blocks * nr_pkts) * 100 / (nr_blocks * nr_pkts),
+	       used_seq - start_seq + 1, total_pkts,
+	       rx_duplicates + rx_ignored + duplicates + ignored_pkts);
+	printf("flash rd %ld.%03lds\n", rflash_time / 1000000, rflash_time / 1000 % 1000);
+	printf("FEC time %ld.%03lds\n", fec_time / 1000000, fec_time / 1000 % 1000);
+	printf("CRC time %ld.%03lds\n", crc_time / 1000000, crc_time / 1000 % 1000);
+	printf("flash wr %ld.%03lds\n", flash_time / 1000000, flash_time / 1000 % 1000);
+	printf("flash er %ld.%03lds\n", erase_time / 1000000, erase_time / 1000 % 1000);
 
 	return 0;
 }
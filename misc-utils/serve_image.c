@@ -15,6 +15,8 @@
 #include <sys/mman.h>
 #include <netinet/in.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include <crc32.h>
 #include <inttypes.h>
 
@@ -28,6 +30,316 @@ int pkt_delay;
 
 #undef RANDOMDROP
 
+/*
+ * Token bucket pacing the transmission. Tokens are bytes scaled by
+ * NSEC_PER_SEC, so that they can be refilled with nanosecond resolution
+ * without rounding. Sending late leaves tokens in the bucket, which makes up
+ * for the lost time, but only up to @depth: past that we slip.
+ */
+#define NSEC_PER_SEC 1000000000ULL
+
+struct pacer {
+	uint64_t rate;
+	uint64_t depth;
+	uint64_t tokens;
+	uint64_t last;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void pacer_init(struct pacer *p, uint64_t rate, uint64_t depth)
+{
+	p->rate = rate;
+	p->depth = depth * NSEC_PER_SEC;
+	p->tokens = 0;
+	p->last = now_ns();
+}
+
+/* Wait until @bytes may be sent, and take them from the bucket */
+static void pacer_wait(struct pacer *p, uint64_t bytes)
+{
+	uint64_t need = bytes * NSEC_PER_SEC, now;
+	struct timespec ts;
+
+	while (1) {
+		now = now_ns();
+		if (now - p->last > p->depth / p->rate)
+			p->tokens = p->depth;
+		else
+			p->tokens += (now - p->last) * p->rate;
+		if (p->tokens > p->depth)
+			p->tokens = p->depth;
+		p->last = now;
+
+		if (p->tokens >= need)
+			break;
+
+		now += (need - p->tokens + p->rate - 1) / p->rate;
+		ts.tv_sec = now / NSEC_PER_SEC;
+		ts.tv_nsec = now % NSEC_PER_SEC;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+	p->tokens -= need;
+}
+
+/*
+ * The packets of a block never change, but computing a parity packet costs
+ * as much as reading the whole block. With -p they are all computed once, in
+ * parallel, together with the CRC of every packet, so that each cycle only
+ * copies memory to the socket. With -c they are kept in a file which is
+ * reused as long as the image does not change.
+ *
+ * Cache file layout, in host byte order: the header, padded to a page, the
+ * CRCs of all packets, padded to a page, then the parity packets, in both
+ * cases block after block. The magic is written last, once all of it is on
+ * disk.
+ */
+#define PARITY_MAGIC   0x50434546 /* "FECP" */
+#define PARITY_VERSION 1
+#define PARITY_ALIGN   4096
+
+struct parity_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t image_size;
+	uint32_t totcrc;
+	uint32_t blocksize;
+	uint32_t pkt_size;
+	uint32_t data_pkts;
+	uint32_t nr_pkts;
+	uint32_t padding;
+};
+
+struct parity {
+	struct fec_parms *fec;
+	unsigned char *image;
+	unsigned char *last_block;
+	uint32_t erasesize;
+	int nr_blocks;
+	int k, n;
+	int nr_threads;
+	uint32_t *crcs;
+	unsigned char *pkts;
+	void *map;
+	size_t map_size;
+};
+
+struct parity_worker {
+	struct parity *par;
+	int first;
+	pthread_t thread;
+};
+
+static unsigned char *block_data(const struct parity *par, int block_nr)
+{
+	if (block_nr == par->nr_blocks - 1)
+		return par->last_block;
+	return par->image + (size_t)par->erasesize * block_nr;
+}
+
+static unsigned char *pkt_data(const struct parity *par, int block_nr,
+			       int pkt_nr)
+{
+	if (pkt_nr < par->k)
+		return block_data(par, block_nr) + pkt_nr * PKT_SIZE;
+	return par->pkts + ((size_t)block_nr * (par->n - par->k) +
+			    pkt_nr - par->k) * PKT_SIZE;
+}
+
+static void *parity_thread(void *arg)
+{
+	struct parity_worker *w = arg;
+	struct parity *par = w->par;
+	unsigned char *data;
+	int block_nr, pkt_nr;
+
+	for (block_nr = w->first; block_nr < par->nr_blocks;
+	     block_nr += par->nr_threads) {
+		for (pkt_nr = 0; pkt_nr < par->n; pkt_nr++) {
+			data = pkt_data(par, block_nr, pkt_nr);
+			if (pkt_nr >= par->k)
+				fec_encode_linear(par->fec,
+						  block_data(par, block_nr),
+						  data, pkt_nr, PKT_SIZE);
+			par->crcs[block_nr * par->n + pkt_nr] =
+				mtd_crc32(-1, data, PKT_SIZE);
+		}
+	}
+
+	return NULL;
+}
+
+static void parity_compute(struct parity *par)
+{
+	struct parity_worker *workers;
+	int i, err;
+
+	workers = calloc(par->nr_threads, sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "Failed to allocate parity workers\n");
+		exit(1);
+	}
+
+	for (i = 0; i < par->nr_threads; i++) {
+		workers[i].par = par;
+		workers[i].first = i;
+		if (i == 0)
+			continue;
+		err = pthread_create(&workers[i].thread, NULL, parity_thread,
+				     &workers[i]);
+		if (err) {
+			fprintf(stderr, "Cannot create parity thread: %s\n",
+				strerror(err));
+			exit(1);
+		}
+	}
+	parity_thread(&workers[0]);
+	for (i = 1; i < par->nr_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	free(workers);
+}
+
+static int parity_valid(const struct parity_hdr *hdr,
+			const struct parity_hdr *want)
+{
+	return !memcmp(hdr, want, sizeof(*hdr));
+}
+
+/*
+ * Set up the parity packets and CRCs of @par, from the cache file @cache if
+ * it matches the image, computing them (and filling the cache) otherwise.
+ */
+static void parity_setup(struct parity *par, const char *cache,
+			 uint64_t image_size, uint32_t totcrc)
+{
+	size_t crcs_size, pkts_size;
+	struct parity_hdr want;
+	struct timeval start, end;
+	struct stat st;
+	int fd = -1;
+
+	crcs_size = (size_t)par->nr_blocks * par->n * sizeof(uint32_t);
+	crcs_size = (crcs_size + PARITY_ALIGN - 1) & ~(PARITY_ALIGN - 1);
+	pkts_size = (size_t)par->nr_blocks * (par->n - par->k) * PKT_SIZE;
+	par->map_size = PARITY_ALIGN + crcs_size + pkts_size;
+
+	memset(&want, 0, sizeof(want));
+	want.magic = PARITY_MAGIC;
+	want.version = PARITY_VERSION;
+	want.image_size = image_size;
+	want.totcrc = totcrc;
+	want.blocksize = par->erasesize;
+	want.pkt_size = PKT_SIZE;
+	want.data_pkts = par->k;
+	want.nr_pkts = par->n;
+
+	if (cache) {
+		fd = open(cache, O_RDWR | O_CREAT, 0644);
+		if (fd < 0 || fstat(fd, &st)) {
+			perror(cache);
+			exit(1);
+		}
+		if (st.st_size != par->map_size &&
+		    (ftruncate(fd, 0) || ftruncate(fd, par->map_size))) {
+			perror("ftruncate");
+			exit(1);
+		}
+		par->map = mmap(NULL, par->map_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+	} else {
+		par->map = mmap(NULL, par->map_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (par->map == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	par->crcs = (uint32_t *)((char *)par->map + PARITY_ALIGN);
+	par->pkts = (unsigned char *)par->map + PARITY_ALIGN + crcs_size;
+
+	if (cache && parity_valid(par->map, &want)) {
+		printf("Using parity packets from %s\n", cache);
+		close(fd);
+		return;
+	}
+
+	printf("Computing parity packets with %d threads....", par->nr_threads);
+	fflush(stdout);
+	gettimeofday(&start, NULL);
+
+	/* Invalidate the cache first, in case we are interrupted */
+	memset(par->map, 0, sizeof(want));
+	parity_compute(par);
+
+	gettimeofday(&end, NULL);
+	printf(" %ldms\n", (end.tv_sec - start.tv_sec) * 1000 +
+	       (end.tv_usec - start.tv_usec) / 1000);
+
+	if (cache) {
+		if (msync(par->map, par->map_size, MS_SYNC)) {
+			perror("msync");
+			exit(1);
+		}
+		memcpy(par->map, &want, sizeof(want));
+		if (msync(par->map, PARITY_ALIGN, MS_SYNC)) {
+			perror("msync");
+			exit(1);
+		}
+		close(fd);
+	}
+}
+
+struct tx_stats {
+	unsigned long pkts;
+	unsigned long calls;
+	unsigned long errors;
+	unsigned long max_batch;
+};
+
+static int writeerrors;
+
+/*
+ * Send @cnt queued packets with as few system calls as the socket allows.
+ * A packet which could not be sent is dropped, like a packet lost in the
+ * network would be.
+ */
+static void send_batch(int sock, struct mmsghdr *msgs, int cnt,
+		       struct tx_stats *stats)
+{
+	int sent = 0, ret;
+
+	while (sent < cnt) {
+		ret = sendmmsg(sock, msgs + sent, cnt - sent, 0);
+		if (ret < 0 && errno == ENOSYS)
+			ret = writev(sock, msgs[sent].msg_hdr.msg_iov,
+				     msgs[sent].msg_hdr.msg_iovlen) < 0 ? -1 : 1;
+		stats->calls++;
+		if (ret < 0) {
+			perror("sendmmsg");
+			stats->errors++;
+			writeerrors++;
+			if (writeerrors > 10) {
+				fprintf(stderr, "Too many consecutive write errors\n");
+				exit(1);
+			}
+			sent++;
+			continue;
+		}
+		writeerrors = 0;
+		stats->pkts += ret;
+		if (ret > stats->max_batch)
+			stats->max_batch = ret;
+		sent += ret;
+	}
+}
+
 int main(int argc, char **argv)
 {
 	struct addrinfo *ai;
@@ -35,40 +347,93 @@ int main(int argc, char **argv)
 	struct addrinfo *runp;
 	int ret;
 	int sock;
-	struct image_pkt pktbuf;
+	struct image_pkt pktbuf, *pkts;
+	struct mmsghdr msgs[PKT_BATCH];
+	struct iovec iovs[2 * PKT_BATCH];
+	struct parity par;
+	const char *cache = NULL;
+	int precompute = 0, opt;
+	struct pacer pacer;
+	struct tx_stats stats;
+	int batch_pkts, nr_queued = 0;
 	int rfd;
 	struct stat st;
-	int writeerrors = 0;
 	uint32_t erasesize;
 	unsigned char *image, *blockptr = NULL;
 	uint32_t block_nr, pkt_nr;
 	int nr_blocks;
-	struct timeval then, now, nextpkt;
+	int i;
+	struct timeval then, now;
 	long time_msecs;
 	int pkts_per_block;
 	int total_pkts_per_block;
 	struct fec_parms *fec;
 	unsigned char *last_block;
 	uint32_t *block_crcs;
-	long tosleep;
 	uint32_t sequence = 0;
 
+	memset(&par, 0, sizeof(par));
+	par.nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (par.nr_threads < 1)
+		par.nr_threads = 1;
+
+	while ((opt = getopt(argc, argv, "pc:j:")) != -1) {
+		switch (opt) {
+		case 'c':
+			cache = optarg;
+			/* fall through */
+		case 'p':
+			precompute = 1;
+			break;
+		case 'j':
+			par.nr_threads = atoi(optarg);
+			if (par.nr_threads < 1 || par.nr_threads > 256) {
+				fprintf(stderr, "Bogus thread count %s\n", optarg);
+				exit(1);
+			}
+			break;
+		default:
+			argc = 0;
+			break;
+		}
+	}
+	/* Keep the positional arguments at argv[1] onwards */
+	if (argc) {
+		argc -= optind - 1;
+		argv += optind - 1;
+	}
+
 	if (argc == 6) {
 		tx_rate = atol(argv[5]) * 1024;
-		if (tx_rate < PKT_SIZE || tx_rate > 20000000) {
+		if (tx_rate < PKT_SIZE || tx_rate > 128000000) {
 			fprintf(stderr, "Bogus TX rate %d KiB/s\n", tx_rate);
 			exit(1);
 		}
 		argc = 5;
 	}
 	if (argc != 5) {
-		fprintf(stderr, "usage: %s <host> <port> <image> <erasesize> [<tx_rate>]\n",
+		fprintf(stderr, "usage: %s [-p] [-c <cache>] [-j <threads>] <host> <port> <image> <erasesize> [<tx_rate>]\n"
+			"  -p            compute all parity packets before sending\n"
+			"  -c <cache>    keep them in file <cache> (implies -p)\n"
+			"  -j <threads>  threads computing them (default: CPU count)\n",
 			PROGRAM_NAME);
 		exit(1);
 	}
 	pkt_delay = (sizeof(pktbuf) * 1000000) / tx_rate;
+
+	/*
+	 * Send as many packets at once as go out in a millisecond, so that
+	 * slow links do not get bursts but fast ones do not cost a system call
+	 * per packet.
+	 */
+	batch_pkts = tx_rate / 1000 / sizeof(pktbuf);
+	if (batch_pkts < 1)
+		batch_pkts = 1;
+	if (batch_pkts > PKT_BATCH)
+		batch_pkts = PKT_BATCH;
 	printf("Inter-packet delay (avg): %dµs\n", pkt_delay);
-	printf("Transmit rate: %d KiB/s\n", tx_rate / 1024);
+	printf("Transmit rate: %d KiB/s, %d pkts per batch\n",
+	       tx_rate / 1024, batch_pkts);
 
 	erasesize = atol(argv[4]);
 	if (!erasesize) {
@@ -160,6 +525,22 @@ int main(int argc, char **argv)
 	pktbuf.hdr.thislen = htonl(PKT_SIZE);
 	pktbuf.hdr.nr_pkts = htons(total_pkts_per_block);
 
+	pkts = malloc(PKT_BATCH * sizeof(*pkts));
+	if (!pkts) {
+		fprintf(stderr, "Failed to allocate packet buffers\n");
+		exit(1);
+	}
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < PKT_BATCH; i++) {
+		pkts[i].hdr = pktbuf.hdr;
+		iovs[2 * i].iov_base = &pkts[i].hdr;
+		iovs[2 * i].iov_len = sizeof(pktbuf.hdr);
+		iovs[2 * i + 1].iov_base = pkts[i].data;
+		iovs[2 * i + 1].iov_len = PKT_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iovs[2 * i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
 	printf("%08x\n", ntohl(pktbuf.hdr.totcrc));
 	printf("Checking block CRCs....");
 	fflush(stdout);
@@ -170,13 +551,32 @@ int main(int argc, char **argv)
 		block_crcs[block_nr] = mtd_crc32(-1, image + (block_nr * erasesize), erasesize);
 	}
 
-	printf("\nImage size %ld KiB (0x%08lx). %d blocks at %d pkts/block\n"
+	printf("\n");
+
+	if (precompute) {
+		par.fec = fec;
+		par.image = image;
+		par.last_block = last_block;
+		par.erasesize = erasesize;
+		par.nr_blocks = nr_blocks;
+		par.k = pkts_per_block;
+		par.n = total_pkts_per_block;
+		parity_setup(&par, cache, st.st_size, ntohl(pktbuf.hdr.totcrc));
+	}
+
+	printf("Image size %ld KiB (0x%08lx). %d blocks at %d pkts/block\n"
 	       "Estimated transmit time per cycle: %ds\n",
 	       (long)st.st_size / 1024, (long) st.st_size,
 	       nr_blocks, pkts_per_block,
 	       nr_blocks * pkts_per_block * pkt_delay / 1000000);
 	gettimeofday(&then, NULL);
-	nextpkt = then;
+	/*
+	 * Let up to 10ms of lost time be made up for, which covers scheduling
+	 * latencies without bursting more than receivers can buffer.
+	 */
+	pacer_init(&pacer, tx_rate,
+		   max_t(int, tx_rate / 100, 2 * batch_pkts * sizeof(pktbuf)));
+	memset(&stats, 0, sizeof(stats));
 
 #ifdef RANDOMDROP
 	srand((unsigned)then.tv_usec);
@@ -193,11 +593,17 @@ int main(int argc, char **argv)
 			printf("\n%ld KiB sent in %ldms (%ld KiB/s)\n",
 			       amt_sent / 1024, time_msecs,
 			       amt_sent / 1024 * 1000 / time_msecs);
+			printf("%lu pkts (%lu pkts/s) in %lu calls, batch avg %lu max %lu, %lu send errors\n",
+			       stats.pkts, stats.pkts * 1000 / time_msecs,
+			       stats.calls, stats.pkts / (stats.calls ? : 1),
+			       stats.max_batch, stats.errors);
+			memset(&stats, 0, sizeof(stats));
 			then = now;
 		}
 
 		for (block_nr = 0; block_nr < nr_blocks; block_nr++) {
 
+			struct image_pkt *pkt = &pkts[nr_queued];
 			int actualpkt;
 
 			/* Calculating the redundant FEC blocks is expensive;
@@ -215,19 +621,37 @@ int main(int argc, char **argv)
 			if (block_nr == nr_blocks - 1)
 				blockptr = last_block;
 
-			fec_encode_linear(fec, blockptr, pktbuf.data, actualpkt, PKT_SIZE);
+			if (precompute) {
+				iovs[2 * nr_queued + 1].iov_base =
+					pkt_data(&par, block_nr, actualpkt);
+				pkt->hdr.thiscrc = htonl(par.crcs[block_nr * total_pkts_per_block + actualpkt]);
+			} else {
+				fec_encode_linear(fec, blockptr, pkt->data, actualpkt, PKT_SIZE);
+				pkt->hdr.thiscrc = htonl(mtd_crc32(-1, pkt->data, PKT_SIZE));
+			}
+			pkt->hdr.block_crc = htonl(block_crcs[block_nr]);
+			pkt->hdr.block_nr = htonl(block_nr);
+			pkt->hdr.pkt_nr = htons(actualpkt);
+			pkt->hdr.pkt_sequence = htonl(sequence++);
+
+#ifdef RANDOMDROP
+			if ((rand() % 1000) < 20) {
+				printf("\nDropping packet %d of block %08x\n", pkt_nr+1, block_nr * erasesize);
+				continue;
+			}
+#endif
+			if (++nr_queued < batch_pkts)
+				continue;
 
-			pktbuf.hdr.thiscrc = htonl(mtd_crc32(-1, pktbuf.data, PKT_SIZE));
-			pktbuf.hdr.block_crc = htonl(block_crcs[block_nr]);
-			pktbuf.hdr.block_nr = htonl(block_nr);
-			pktbuf.hdr.pkt_nr = htons(actualpkt);
-			pktbuf.hdr.pkt_sequence = htonl(sequence++);
+			pacer_wait(&pacer, nr_queued * sizeof(pktbuf));
+			send_batch(sock, msgs, nr_queued, &stats);
+			nr_queued = 0;
 
 			printf("\rSending data block %08x packet %3d/%d",
 			       block_nr * erasesize,
 			       pkt_nr, total_pkts_per_block);
 
-			if (pkt_nr && !block_nr) {
+			if (pkt_nr && block_nr < batch_pkts) {
 				unsigned long amt_sent = pkt_nr * nr_blocks * sizeof(pktbuf);
 
 				gettimeofday(&now, NULL);
@@ -235,67 +659,14 @@ int main(int argc, char **argv)
 				time_msecs = (now.tv_sec - then.tv_sec) * 1000;
 				time_msecs += ((int)(now.tv_usec - then.tv_usec)) / 1000;
 				printf("    (%ld KiB/s)    ",
-				       amt_sent / 1024 * 1000 / time_msecs);
+				       amt_sent / 1024 * 1000 / (time_msecs ? : 1));
 			}
 
 			fflush(stdout);
-
-#ifdef RANDOMDROP
-			if ((rand() % 1000) < 20) {
-				printf("\nDropping packet %d of block %08x\n", pkt_nr+1, block_nr * erasesize);
-				continue;
-			}
-#endif
-			gettimeofday(&now, NULL);
-#if 1
-			tosleep = nextpkt.tv_usec - now.tv_usec +
-				(1000000 * (nextpkt.tv_sec - now.tv_sec));
-
-			/* We need hrtimers for this to actually work */
-			if (tosleep > 0) {
-				struct timespec req;
-
-				req.tv_nsec = (tosleep % 1000000) * 1000;
-				req.tv_sec = tosleep / 1000000;
-
-				nanosleep(&req, NULL);
-			}
-#else
-			while (now.tv_sec < nextpkt.tv_sec ||
-				 (now.tv_sec == nextpkt.tv_sec &&
-				  now.tv_usec < nextpkt.tv_usec)) {
-				gettimeofday(&now, NULL);
-			}
-#endif
-			nextpkt.tv_usec += pkt_delay;
-			if (nextpkt.tv_usec >= 1000000) {
-				nextpkt.tv_sec += nextpkt.tv_usec / 1000000;
-				nextpkt.tv_usec %= 1000000;
-			}
-
-			/* If the time for the next packet has already
-			   passed (by some margin), then we've lost time
-			   Adjust our expected timings accordingly. If
-			   we're only a little way behind, don't slip yet */
-			if (now.tv_usec > (now.tv_usec + (5 * pkt_delay) +
-					1000000 * (nextpkt.tv_sec - now.tv_sec))) {
-				nextpkt = now;
-			}
-
-			if (write(sock, &pktbuf, sizeof(pktbuf)) < 0) {
-				perror("write");
-				writeerrors++;
-				if (writeerrors > 10) {
-					fprintf(stderr, "Too many consecutive write errors\n");
-					exit(1);
-				}
-			} else
-				writeerrors = 0;
-
-
-
 		}
 	}
+	if (par.map)
+		munmap(par.map, par.map_size);
 	munmap(image, st.st_size);
 	close(rfd);
 	close(sock);
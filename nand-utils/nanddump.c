@@ -365,7 +365,7 @@ int main(int argc, char * const argv[])
 		return errmsg("can't initialize libmtd");
 
 	/* Open MTD device */
-	if ((fd = open(mtddev, O_RDONLY)) == -1) {
+	if ((fd = mtd_open_node(mtddev, O_RDONLY)) == -1) {
 		perror(mtddev);
 		exit(EXIT_FAILURE);
 	}
@@ -285,7 +285,7 @@ int main(int argc, char * const argv[])
 	process_options(argc, argv);
 
 	/* Open the device */
-	if ((fd = open(mtd_device, O_RDWR)) == -1)
+	if ((fd = mtd_open_node(mtd_device, O_RDWR)) == -1)
 		sys_errmsg_die("%s", mtd_device);
 
 	mtd_desc = libmtd_open();
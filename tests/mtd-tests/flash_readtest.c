@@ -250,7 +250,7 @@ int main(int argc, char **argv)
 	iobuf = xmalloc(mtd.eb_size);
 	iobuf1 = xmalloc(mtd.eb_size);
 
-	if ((fd = open(mtddev, O_RDWR)) == -1) {
+	if ((fd = mtd_open_node(mtddev, O_RDWR)) == -1) {
 		perror(mtddev);
 		status = EXIT_FAILURE;
 		goto out;
@@ -49,6 +49,7 @@ static libmtd_t mtd_desc;
 static int fd;
 
 static int npages = 1;
+static int jobs = 0;
 static int peb=-1, count=-1, skip=-1, flags=0, speb=-1;
 static bool continuous = false;
 static struct timespec start, finish;
@@ -63,6 +64,7 @@ static const struct option options[] = {
 	{ "skip", required_argument, NULL, 's' },
 	{ "sec-peb", required_argument, NULL, 'k' },
 	{ "continuous", no_argument, NULL, 'C' },
+	{ "jobs", required_argument, NULL, 'j' },
 	{ NULL, 0, NULL, 0 },
 };
 
@@ -77,7 +79,8 @@ static NORETURN void usage(int status)
 	"  -s, --skip <num>    Number of blocks to skip\n"
 	"  -d, --destructive   Run destructive (erase and write speed) tests\n"
 	"  -k, --sec-peb <num> Start of secondary block to measure RWW latency (requires -d)\n"
-	"  -C, --continuous    Increase the number of consecutive pages gradually\n",
+	"  -C, --continuous    Increase the number of consecutive pages gradually\n"
+	"  -j, --jobs <num>    Also test eraseblock speed with <num> requests in flight\n",
 	status==EXIT_SUCCESS ? stdout : stderr);
 	exit(status);
 }
@@ -101,7 +104,7 @@ static void process_options(int argc, char **argv)
 	int c;
 
 	while (1) {
-		c = getopt_long(argc, argv, "hb:c:s:dk:C", options, NULL);
+		c = getopt_long(argc, argv, "hb:c:s:dk:Cj:", options, NULL);
 		if (c == -1)
 			break;
 
@@ -144,6 +147,13 @@ static void process_options(int argc, char **argv)
 		case 'C':
 			continuous = true;
 			break;
+		case 'j':
+			if (jobs > 0)
+				goto failmulti;
+			jobs = read_num(c, optarg);
+			if (jobs <= 0)
+				goto failarg;
+			break;
 		default:
 			exit(EXIT_FAILURE);
 		}
@@ -194,6 +204,36 @@ static int read_eraseblock(int ebnum)
 	return err;
 }
 
+/*
+ * Read or write all good eraseblocks as one batch with @jobs requests in
+ * flight. All requests share @iobuf, the data read is thrown away anyway.
+ */
+static int batch_eraseblocks(int write)
+{
+	struct mtd_io_req *reqs;
+	int i, n = 0, err;
+
+	reqs = xcalloc(goodebcnt, sizeof(*reqs));
+	for (i = 0; i < count; ++i) {
+		if (bbt[i])
+			continue;
+		reqs[n].eb = peb + i * (skip + 1);
+		reqs[n].buf = iobuf;
+		reqs[n++].len = mtd.eb_size;
+	}
+
+	if (write)
+		err = mtd_write_batch(mtd_desc, &mtd, fd, reqs, n, jobs);
+	else
+		err = mtd_read_batch(&mtd, fd, reqs, n, jobs);
+	if (err)
+		fprintf(stderr, "Error %s eraseblocks in a batch!\n",
+			write ? "writing" : "reading");
+
+	free(reqs);
+	return err;
+}
+
 static int write_eraseblock_by_page(int ebnum)
 {
 	void *buf = iobuf;
@@ -399,7 +439,7 @@ int main(int argc, char **argv)
 	iobuf = xmalloc(mtd.eb_size);
 	bbt = xzalloc(count);
 
-	if ((fd = open(mtddev, O_RDWR)) == -1) {
+	if ((fd = mtd_open_node(mtddev, O_RDWR)) == -1) {
 		perror(mtddev);
 		goto outfree;
 	}
@@ -430,6 +470,36 @@ int main(int argc, char **argv)
 	TIME_OP_PER_PEB(read_eraseblock, 1);
 	printf("eraseblock read speed is %ld KiB/s\n", speed);
 
+	/* Write and read all eraseblocks with several requests in flight */
+	if (jobs > 0) {
+		if (flags & DESTRUCTIVE) {
+			err = erase_good_eraseblocks(peb, count, skip);
+			if (err)
+				goto out;
+
+			printf("testing eraseblock write speed with %d jobs\n",
+			       jobs);
+			start_timing(&start);
+			err = batch_eraseblocks(1);
+			if (err)
+				goto out;
+			stop_timing(&finish);
+			speed = calc_speed(&start, &finish, 1);
+			printf("%d jobs eraseblock write speed is %ld KiB/s\n",
+			       jobs, speed);
+		}
+
+		printf("testing eraseblock read speed with %d jobs\n", jobs);
+		start_timing(&start);
+		err = batch_eraseblocks(0);
+		if (err)
+			goto out;
+		stop_timing(&finish);
+		speed = calc_speed(&start, &finish, 1);
+		printf("%d jobs eraseblock read speed is %ld KiB/s\n", jobs,
+		       speed);
+	}
+
 	/* Write all eraseblocks, 1 page at a time */
 	if (flags & DESTRUCTIVE) {
 		err = erase_good_eraseblocks(peb, count, skip);
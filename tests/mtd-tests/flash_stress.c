@@ -262,7 +262,7 @@ int main(int argc, char **argv)
 		writebuf[i] = rand();
 
 	/* Open device file */
-	if ((fd = open(mtddev, O_RDWR)) == -1) {
+	if ((fd = mtd_open_node(mtddev, O_RDWR)) == -1) {
 		perror(mtddev);
 		goto out;
 	}
@@ -199,7 +199,7 @@ int main(int argc, char **argv)
 
 	is_bad = xmalloc(blocks);
 
-	if ((mtdfd = open(mtddev, O_RDWR)) == -1) {
+	if ((mtdfd = mtd_open_node(mtddev, O_RDWR)) == -1) {
 		perror(mtddev);
 		free(is_bad);
 		free(old);
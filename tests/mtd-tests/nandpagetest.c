@@ -467,7 +467,7 @@ int main(int argc, char **argv)
 	boundary = xmalloc(bufsize);
 	bbt = xzalloc(ebcnt);
 
-	if ((fd = open(mtddev, O_RDWR)) == -1) {
+	if ((fd = mtd_open_node(mtddev, O_RDWR)) == -1) {
 		perror(mtddev);
 		goto out_cleanup;
 	}
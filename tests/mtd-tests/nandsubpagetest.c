@@ -351,7 +351,7 @@ int main(int argc, char **argv)
 	readbuf = xmalloc(bufsize);
 	bbt = xzalloc(ebcnt);
 
-	if ((fd = open(mtddev, O_RDWR)) == -1) {
+	if ((fd = mtd_open_node(mtddev, O_RDWR)) == -1) {
 		perror(mtddev);
 		goto out_cleanup;
 	}
@@ -0,0 +1,136 @@
+#include <stdarg.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <cmocka.h>
+
+#include "crc32.h"
+
+#define BUF_SIZE 8192
+#define BENCH_SIZE (1 << 20)
+#define BENCH_ROUNDS 256
+
+static void fill_random(unsigned char *buf, int len, unsigned int seed)
+{
+	int i;
+
+	srand(seed);
+	for (i = 0; i < len; i++)
+		buf[i] = rand();
+}
+
+static void test_crc32_known(void **state)
+{
+	const char *s = "123456789";
+
+	/* The standard check value of CRC-32 is 0xCBF43926 */
+	assert_int_equal(mtd_crc32_bytewise(~0U, s, 9) ^ ~0U, 0xCBF43926);
+	assert_int_equal(mtd_crc32_slice8(~0U, s, 9) ^ ~0U, 0xCBF43926);
+	assert_int_equal(mtd_crc32(~0U, s, 9) ^ ~0U, 0xCBF43926);
+	assert_int_equal(mtd_crc32(0x12345678, s, 0), 0x12345678);
+	(void) state;
+}
+
+static void test_crc32_cross_check(void **state)
+{
+	unsigned char *buf = malloc(BUF_SIZE);
+	uint32_t seeds[] = { 0, ~0U, 0x12345678 };
+	int i, offs, len;
+
+	assert_non_null(buf);
+	fill_random(buf, BUF_SIZE, 2027);
+
+	/* Every length up to a few folding blocks, with all alignments */
+	for (i = 0; i < 3; i++) {
+		for (offs = 0; offs < 16; offs++) {
+			for (len = 0; len <= 600; len++) {
+				uint32_t ref = mtd_crc32_bytewise(seeds[i],
+							buf + offs, len);
+
+				assert_int_equal(mtd_crc32_slice8(seeds[i],
+						 buf + offs, len), ref);
+				assert_int_equal(mtd_crc32(seeds[i],
+						 buf + offs, len), ref);
+			}
+		}
+	}
+
+	/* Random lengths and offsets over the whole buffer */
+	srand(4096);
+	for (i = 0; i < 10000; i++) {
+		uint32_t seed = rand();
+		uint32_t ref;
+
+		offs = rand() % BUF_SIZE;
+		len = rand() % (BUF_SIZE - offs + 1);
+		ref = mtd_crc32_bytewise(seed, buf + offs, len);
+		assert_int_equal(mtd_crc32_slice8(seed, buf + offs, len), ref);
+		assert_int_equal(mtd_crc32(seed, buf + offs, len), ref);
+	}
+
+	/* Splitting the buffer must not change the result */
+	for (len = 0; len <= BUF_SIZE; len += 97) {
+		uint32_t ref = mtd_crc32_bytewise(~0U, buf, BUF_SIZE);
+		uint32_t crc = mtd_crc32(~0U, buf, len);
+
+		assert_int_equal(mtd_crc32(crc, buf + len, BUF_SIZE - len), ref);
+	}
+
+	free(buf);
+	(void) state;
+}
+
+static double bench(uint32_t (*fn)(uint32_t, const void *, int),
+		    const unsigned char *buf, int len, uint32_t *crc)
+{
+	struct timespec then, now;
+	double secs;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &then);
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		*crc = fn(*crc, buf, len);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	secs = (now.tv_sec - then.tv_sec) + (now.tv_nsec - then.tv_nsec) / 1e9;
+	return (double)len * BENCH_ROUNDS / (1024 * 1024) / secs;
+}
+
+static void test_crc32_bench(void **state)
+{
+	unsigned char *buf = malloc(BENCH_SIZE);
+	uint32_t c1 = 0, c2 = 0, c3 = 0;
+	double bytewise, slice8, best;
+
+	assert_non_null(buf);
+	fill_random(buf, BENCH_SIZE, 1986);
+
+	bytewise = bench(mtd_crc32_bytewise, buf, BENCH_SIZE, &c1);
+	slice8 = bench(mtd_crc32_slice8, buf, BENCH_SIZE, &c2);
+	best = bench(mtd_crc32, buf, BENCH_SIZE, &c3);
+	assert_int_equal(c1, c2);
+	assert_int_equal(c1, c3);
+
+	printf("crc32 bytewise:   %8.1f MiB/s\n", bytewise);
+	printf("crc32 slice-by-8: %8.1f MiB/s\n", slice8);
+	printf("crc32 %s: %8.1f MiB/s (%.1fx)\n", mtd_crc32_impl(), best,
+	       best / bytewise);
+
+	free(buf);
+	(void) state;
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_crc32_known),
+		cmocka_unit_test(test_crc32_cross_check),
+		cmocka_unit_test(test_crc32_bench),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
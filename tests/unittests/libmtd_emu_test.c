@@ -0,0 +1,294 @@
+#include <fcntl.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cmocka.h>
+
+#include "mtd/mtd-user.h"
+#include "libmtd.h"
+
+/* 4 eraseblocks of 8 pages, eraseblock 2 is marked bad on creation */
+#define EMU_CONFIG "type=nand,eb_size=16KiB,page_size=2KiB,oob_size=64,size=64KiB,bad=2"
+#define EB_SIZE   (16 * 1024)
+#define PAGE_SIZE 2048
+#define OOB_SIZE  64
+
+static char tmpdir[] = "/tmp/mtd_emu_test.XXXXXX";
+
+static libmtd_t emu_open(const char *name, struct mtd_dev_info *mtd, int *fd)
+{
+	char node[sizeof(tmpdir) + 64];
+	libmtd_t lib;
+
+	sprintf(node, "file:%s/%s", tmpdir, name);
+	lib = libmtd_open();
+	assert_non_null(lib);
+	assert_int_equal(mtd_get_dev_info(lib, node, mtd), 0);
+	*fd = mtd_open_node(node, O_RDWR);
+	assert_true(*fd > 0);
+	return lib;
+}
+
+static void emu_close(libmtd_t lib, const char *name, int fd)
+{
+	char path[sizeof(tmpdir) + 64];
+
+	close(fd);
+	libmtd_close(lib);
+	sprintf(path, "%s/%s", tmpdir, name);
+	unlink(path);
+	strcat(path, ".oob");
+	unlink(path);
+}
+
+static int all_bytes(const uint8_t *buf, int len, uint8_t val)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (buf[i] != val)
+			return 0;
+	return 1;
+}
+
+static void test_emu_geometry(void **state)
+{
+	struct mtd_dev_info mtd;
+	libmtd_t lib;
+	int fd;
+
+	lib = emu_open("geometry", &mtd, &fd);
+	assert_true(mtd.emulated);
+	assert_true(mtd.writable);
+	assert_true(mtd.bb_allowed);
+	assert_int_equal(mtd.type, MTD_NANDFLASH);
+	assert_int_equal(mtd.size, 4 * EB_SIZE);
+	assert_int_equal(mtd.eb_cnt, 4);
+	assert_int_equal(mtd.eb_size, EB_SIZE);
+	assert_int_equal(mtd.min_io_size, PAGE_SIZE);
+	assert_int_equal(mtd.subpage_size, PAGE_SIZE);
+	assert_int_equal(mtd.oob_size, OOB_SIZE);
+	assert_int_equal(mtd.oobavail, OOB_SIZE / 2);
+	emu_close(lib, "geometry", fd);
+	(void) state;
+}
+
+static void test_emu_erase(void **state)
+{
+	uint8_t buf[EB_SIZE], oob[OOB_SIZE];
+	struct mtd_dev_info mtd;
+	libmtd_t lib;
+	int fd;
+
+	lib = emu_open("erase", &mtd, &fd);
+
+	/* A new device reads as erased */
+	assert_int_equal(mtd_read(&mtd, fd, 1, 0, buf, EB_SIZE), 0);
+	assert_true(all_bytes(buf, EB_SIZE, 0xFF));
+
+	memset(buf, 0x00, EB_SIZE);
+	memset(oob, 0x00, OOB_SIZE);
+	assert_int_equal(mtd_write(lib, &mtd, fd, 1, 0, buf, EB_SIZE, NULL, 0, 0), 0);
+	assert_int_equal(mtd_write_oob(lib, &mtd, fd, EB_SIZE + PAGE_SIZE, OOB_SIZE, oob), 0);
+	assert_int_equal(mtd_read(&mtd, fd, 1, 0, buf, EB_SIZE), 0);
+	assert_true(all_bytes(buf, EB_SIZE, 0x00));
+
+	/* Erasing sets the data and the OOB area back to 0xFF */
+	assert_int_equal(mtd_erase(lib, &mtd, fd, 1), 0);
+	assert_int_equal(mtd_read(&mtd, fd, 1, 0, buf, EB_SIZE), 0);
+	assert_true(all_bytes(buf, EB_SIZE, 0xFF));
+	assert_int_equal(mtd_read_oob(lib, &mtd, fd, EB_SIZE + PAGE_SIZE, OOB_SIZE, oob), 0);
+	assert_true(all_bytes(oob, OOB_SIZE, 0xFF));
+
+	emu_close(lib, "erase", fd);
+	(void) state;
+}
+
+static void test_emu_program(void **state)
+{
+	uint8_t buf[PAGE_SIZE];
+	struct mtd_dev_info mtd;
+	libmtd_t lib;
+	int fd;
+
+	lib = emu_open("program", &mtd, &fd);
+
+	memset(buf, 0xF0, PAGE_SIZE);
+	assert_int_equal(mtd_write(lib, &mtd, fd, 0, PAGE_SIZE, buf, PAGE_SIZE, NULL, 0, 0), 0);
+
+	/* Programming can only clear bits, never set them */
+	memset(buf, 0x3C, PAGE_SIZE);
+	assert_int_equal(mtd_write(lib, &mtd, fd, 0, PAGE_SIZE, buf, PAGE_SIZE, NULL, 0, 0), 0);
+	assert_int_equal(mtd_read(&mtd, fd, 0, PAGE_SIZE, buf, PAGE_SIZE), 0);
+	assert_true(all_bytes(buf, PAGE_SIZE, 0x30));
+
+	/* The neighbouring pages are untouched */
+	assert_int_equal(mtd_read(&mtd, fd, 0, 0, buf, PAGE_SIZE), 0);
+	assert_true(all_bytes(buf, PAGE_SIZE, 0xFF));
+	assert_int_equal(mtd_read(&mtd, fd, 0, 2 * PAGE_SIZE, buf, PAGE_SIZE), 0);
+	assert_true(all_bytes(buf, PAGE_SIZE, 0xFF));
+
+	emu_close(lib, "program", fd);
+	(void) state;
+}
+
+static void test_emu_bad_blocks(void **state)
+{
+	uint8_t buf[PAGE_SIZE];
+	struct mtd_dev_info mtd;
+	libmtd_t lib;
+	int fd;
+
+	lib = emu_open("bad", &mtd, &fd);
+	assert_int_equal(mtd_is_bad(&mtd, fd, 0), 0);
+	assert_int_equal(mtd_is_bad(&mtd, fd, 1), 0);
+	assert_int_equal(mtd_is_bad(&mtd, fd, 2), 1);
+	assert_int_equal(mtd_is_bad(&mtd, fd, 3), 0);
+
+	assert_int_equal(mtd_mark_bad(&mtd, fd, 3), 0);
+	assert_int_equal(mtd_is_bad(&mtd, fd, 3), 1);
+
+	/* Bad eraseblocks cannot be erased */
+	assert_int_equal(mtd_erase(lib, &mtd, fd, 3), -1);
+
+	/* The bad block marker is the first OOB byte of the first page */
+	assert_int_equal(mtd_read_oob(lib, &mtd, fd, 3 * EB_SIZE, OOB_SIZE, buf), 0);
+	assert_int_equal(buf[0], 0x00);
+	assert_true(all_bytes(buf + 1, OOB_SIZE - 1, 0xFF));
+
+	/* The markers persist in the side file */
+	close(fd);
+	libmtd_close(lib);
+	lib = emu_open("bad", &mtd, &fd);
+	assert_int_equal(mtd_is_bad(&mtd, fd, 1), 0);
+	assert_int_equal(mtd_is_bad(&mtd, fd, 3), 1);
+
+	emu_close(lib, "bad", fd);
+	(void) state;
+}
+
+static void test_emu_oob(void **state)
+{
+	uint8_t buf[PAGE_SIZE], oob[OOB_SIZE], rd[OOB_SIZE];
+	struct mtd_dev_info mtd;
+	libmtd_t lib;
+	int fd, i;
+
+	lib = emu_open("oob", &mtd, &fd);
+
+	for (i = 0; i < OOB_SIZE; i++)
+		oob[i] = i | 0x80;
+	assert_int_equal(mtd_write_oob(lib, &mtd, fd, 3 * PAGE_SIZE, OOB_SIZE, oob), 0);
+	assert_int_equal(mtd_read_oob(lib, &mtd, fd, 3 * PAGE_SIZE, OOB_SIZE, rd), 0);
+	assert_memory_equal(oob, rd, OOB_SIZE);
+
+	/* A partial access starts at the given offset in the OOB area */
+	assert_int_equal(mtd_read_oob(lib, &mtd, fd, 3 * PAGE_SIZE + 8, 8, rd), 0);
+	assert_memory_equal(oob + 8, rd, 8);
+
+	/* The OOB areas of the neighbouring pages are untouched */
+	assert_int_equal(mtd_read_oob(lib, &mtd, fd, 2 * PAGE_SIZE, OOB_SIZE, rd), 0);
+	assert_true(all_bytes(rd, OOB_SIZE, 0xFF));
+	assert_int_equal(mtd_read_oob(lib, &mtd, fd, 4 * PAGE_SIZE, OOB_SIZE, rd), 0);
+	assert_true(all_bytes(rd, OOB_SIZE, 0xFF));
+
+	/* An access cannot run into the OOB area of the next page */
+	memset(oob, 0x00, OOB_SIZE);
+	assert_int_equal(mtd_write_oob(lib, &mtd, fd, 3 * PAGE_SIZE + 8, OOB_SIZE, oob), -1);
+	assert_int_equal(mtd_read_oob(lib, &mtd, fd, 3 * PAGE_SIZE + 8, OOB_SIZE, rd), -1);
+	assert_int_equal(mtd_read_oob(lib, &mtd, fd, 4 * PAGE_SIZE, OOB_SIZE, rd), 0);
+	assert_true(all_bytes(rd, OOB_SIZE, 0xFF));
+
+	/* Data and OOB written together */
+	memset(buf, 0x55, PAGE_SIZE);
+	memset(oob, 0xA5, OOB_SIZE);
+	assert_int_equal(mtd_write(lib, &mtd, fd, 1, PAGE_SIZE, buf, PAGE_SIZE,
+				   oob, OOB_SIZE, MTD_OPS_RAW), 0);
+	assert_int_equal(mtd_read_oob(lib, &mtd, fd, EB_SIZE + PAGE_SIZE, OOB_SIZE, rd), 0);
+	assert_memory_equal(oob, rd, OOB_SIZE);
+	assert_int_equal(mtd_read(&mtd, fd, 1, PAGE_SIZE, buf, PAGE_SIZE), 0);
+	assert_true(all_bytes(buf, PAGE_SIZE, 0x55));
+
+	emu_close(lib, "oob", fd);
+	(void) state;
+}
+
+static void test_emu_auto_oob(void **state)
+{
+	uint8_t buf[PAGE_SIZE], oob[OOB_SIZE], rd[OOB_SIZE];
+	struct mtd_dev_info mtd;
+	libmtd_t lib;
+	int fd;
+
+	lib = emu_open("auto_oob", &mtd, &fd);
+
+	/* Free OOB bytes never cover the bad block marker of page 0 */
+	memset(buf, 0x55, PAGE_SIZE);
+	memset(oob, 0x00, OOB_SIZE);
+	assert_int_equal(mtd_write(lib, &mtd, fd, 0, 0, buf, PAGE_SIZE,
+				   oob, mtd.oobavail, MTD_OPS_AUTO_OOB), 0);
+	assert_int_equal(mtd_is_bad(&mtd, fd, 0), 0);
+
+	/* They are placed at the end of the OOB area */
+	assert_int_equal(mtd_read_oob(lib, &mtd, fd, 0, OOB_SIZE, rd), 0);
+	assert_true(all_bytes(rd, OOB_SIZE - mtd.oobavail, 0xFF));
+	assert_true(all_bytes(rd + OOB_SIZE - mtd.oobavail, mtd.oobavail, 0x00));
+
+	/* More than the free OOB bytes is rejected */
+	assert_int_equal(mtd_write(lib, &mtd, fd, 0, PAGE_SIZE, buf, PAGE_SIZE,
+				   oob, mtd.oobavail + 1, MTD_OPS_AUTO_OOB), -1);
+
+	emu_close(lib, "auto_oob", fd);
+	(void) state;
+}
+
+static void test_emu_truncated(void **state)
+{
+	char path[sizeof(tmpdir) + 64];
+	uint8_t buf[PAGE_SIZE];
+	struct mtd_dev_info mtd;
+	libmtd_t lib;
+	int fd;
+
+	lib = emu_open("truncated", &mtd, &fd);
+
+	/* Reading past the end of a truncated file fails instead of hanging */
+	sprintf(path, "%s/truncated", tmpdir);
+	assert_int_equal(truncate(path, EB_SIZE + PAGE_SIZE / 2), 0);
+	assert_int_equal(mtd_read(&mtd, fd, 1, 0, buf, PAGE_SIZE), -1);
+	assert_int_equal(mtd_read(&mtd, fd, 3, 0, buf, PAGE_SIZE), -1);
+
+	emu_close(lib, "truncated", fd);
+	(void) state;
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_emu_geometry),
+		cmocka_unit_test(test_emu_erase),
+		cmocka_unit_test(test_emu_program),
+		cmocka_unit_test(test_emu_bad_blocks),
+		cmocka_unit_test(test_emu_oob),
+		cmocka_unit_test(test_emu_auto_oob),
+		cmocka_unit_test(test_emu_truncated),
+	};
+	int ret;
+
+	setenv("MTD_EMU", EMU_CONFIG, 1);
+	if (!mkdtemp(tmpdir)) {
+		perror(tmpdir);
+		return 1;
+	}
+
+	ret = cmocka_run_group_tests(tests, NULL, NULL);
+	rmdir(tmpdir);
+	return ret;
+}
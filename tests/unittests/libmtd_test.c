@@ -253,8 +253,7 @@ static void test_mtd_read(void **state)
 	mtd.eb_cnt = 1024;
 	mtd.eb_size = 128;
 	seek = (off_t)eb * mtd.eb_size + offs;
-	expect_lseek(seek, SEEK_SET, seek);
-	expect_read(len, len);
+	expect_pread(len, seek, len);
 	int r = mtd_read(&mtd, mock_fd, eb, offs, &buf, len);
 	assert_int_equal(r, 0);
 
@@ -278,8 +277,7 @@ static void test_mtd_write_nooob(void **state)
 	mtd.eb_size = 128;
 	mtd.subpage_size = 64;
 	seek = (off_t)eb * mtd.eb_size + offs;
-	expect_lseek(seek, SEEK_SET, seek);
-	expect_write(buf, len, len);
+	expect_pwrite(buf, len, seek, len);
 	int r = mtd_write(lib, &mtd, mock_fd, eb, offs, buf, len, NULL, 0, 0);
 	assert_int_equal(r, 0);
 
@@ -81,6 +81,27 @@ int __wrap_write(int fd, char *buf, size_t len)
 	return mock_type(int);
 }
 
+ssize_t __wrap_pread(int fd, void *buf, size_t len, off_t seek)
+{
+	assert_true(fd > 0);
+	assert_non_null(buf);
+	check_expected(len);
+	check_expected(seek);
+	return mock_type(ssize_t);
+}
+
+ssize_t __wrap_pwrite(int fd, const void *buf, size_t len, off_t seek)
+{
+	assert_true(fd > 0);
+	assert_non_null(buf);
+	void *expected_buf = mock_type(void*);
+	size_t expected_len = mock_type(size_t);
+	assert_int_equal(expected_len, len);
+	assert_memory_equal(expected_buf, buf, expected_len);
+	check_expected(seek);
+	return mock_type(ssize_t);
+}
+
 off_t __wrap_lseek(int fd, off_t seek, int whence)
 {
 	assert_true(fd > 0);
@@ -124,6 +145,19 @@ off_t __wrap_lseek(int fd, off_t seek, int whence)
 		will_return(__wrap_lseek, Z);\
 	} while(0);
 
+#define expect_pwrite(W,X,Y,Z) do { \
+		will_return(__wrap_pwrite, W);\
+		will_return(__wrap_pwrite, X);\
+		expect_value(__wrap_pwrite, seek, Y);\
+		will_return(__wrap_pwrite, Z);\
+	} while(0);
+
+#define expect_pread(X,Y,Z) do { \
+		expect_value(__wrap_pread, len, X);\
+		expect_value(__wrap_pread, seek, Y);\
+		will_return(__wrap_pread, Z);\
+	} while(0);
+
 #define expect_read(X,Y) do { \
 		expect_value(__wrap_read, len, X);\
 		will_return(__wrap_read, Y);\
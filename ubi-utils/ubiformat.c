@@ -29,6 +29,12 @@
  */
 #define MAX_CONSECUTIVE_BAD_BLOCKS 4
 
+/*
+ * How many eraseblocks of the flash image are read ahead of the eraseblock
+ * being erased and written.
+ */
+#define READ_AHEAD_EBS 4
+
 #define PROGRAM_NAME    "ubiformat"
 
 #include <sys/stat.h>
@@ -37,6 +43,8 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <mtd/ubi-media.h>
 #include <libubi.h>
@@ -53,6 +61,9 @@ struct args {
 	unsigned int quiet:1;
 	unsigned int verbose:1;
 	unsigned int override_ec:1;
+	unsigned int sparse:1;
+	unsigned int diff:1;
+	unsigned int manual_image_seq:1;
 	unsigned int manual_subpage;
 	int subpage_size;
 	int vid_hdr_offs;
@@ -60,6 +71,8 @@ struct args {
 	uint32_t image_seq;
 	off_t image_sz;
 	long long ec;
+	int jobs;
+	const char *scan_cache;
 	const char *image;
 	const char *node;
 	int node_fd;
@@ -68,8 +81,16 @@ struct args {
 static struct args args =
 {
 	.ubi_ver   = 1,
+	.jobs      = 1,
 };
 
+/* Statistics of the "--diff" mode */
+static struct {
+	int skipped_ebs;
+	long long skipped_bytes;
+	long long written_bytes;
+} diff_stats;
+
 static const char doc[] = PROGRAM_NAME " version " VERSION
 		" - a tool to format MTD devices and flash UBI images";
 
@@ -84,12 +105,27 @@ static const char optionsstr[] =
 "                             header)\n"
 "-f, --flash-image=<file>     flash image file, or '-' for stdin\n"
 "-S, --image-size=<bytes>     bytes in input, if not reading from file\n"
+"-d, --diff                   only erase and write the eraseblocks which differ\n"
+"                             from what is already on flash; unchanged\n"
+"                             eraseblocks keep their erase counter unless -e\n"
+"                             is given, and the image sequence number found\n"
+"                             on flash is kept unless -Q is given\n"
+"-z, --sparse                 treat holes in the flash image file as erased\n"
+"                             data (0xFF bytes), e.g. for images generated\n"
+"                             with \"ubinize --sparse\"\n"
 "-e, --erase-counter=<value>  use <value> as the erase counter value for all\n"
 "                             eraseblocks\n"
 "-x, --ubi-ver=<num>          UBI version number to put to EC headers\n"
 "                             (default is 1)\n"
 "-Q, --image-seq=<num>        32-bit UBI image sequence number to use\n"
 "                             (by default a random number is picked)\n"
+"-j, --jobs=<num>             scan the MTD device using <num> threads\n"
+"                             (default is 1)\n"
+"-c, --scan-cache=<file>      use the scanning information saved in <file> by\n"
+"                             a previous run instead of scanning the device,\n"
+"                             and save the new erase counters to it; the\n"
+"                             cache is dropped if the bad eraseblocks or a\n"
+"                             sample of the EC headers do not match it\n"
 "-y, --yes                    assume the answer is \"yes\" for all question\n"
 "                             this program would otherwise ask\n"
 "-q, --quiet                  suppress progress percentage information\n"
@@ -99,11 +135,13 @@ static const char optionsstr[] =
 
 static const char usage[] =
 "Usage: " PROGRAM_NAME " <MTD device node file name> [-s <bytes>] [-O <offs>] [-n]\n"
-"\t\t\t[-Q <num>] [-f <file>] [-S <bytes>] [-e <value>] [-x <num>] [-y] [-q] [-v] [-h]\n"
+"\t\t\t[-Q <num>] [-f <file>] [-S <bytes>] [-d] [-z] [-e <value>] [-x <num>]\n"
+"\t\t\t[-j <num>] [-c <file>] [-y] [-q] [-v] [-h]\n"
 "\t\t\t[--sub-page-size=<bytes>] [--vid-hdr-offset=<offs>] [--no-volume-table]\n"
-"\t\t\t[--flash-image=<file>] [--image-size=<bytes>] [--erase-counter=<value>]\n"
-"\t\t\t[--image-seq=<num>] [--ubi-ver=<num>] [--yes] [--quiet] [--verbose]\n"
-"\t\t\t[--help] [--version]\n\n"
+"\t\t\t[--flash-image=<file>] [--image-size=<bytes>] [--diff] [--sparse]\n"
+"\t\t\t[--erase-counter=<value>] [--image-seq=<num>] [--ubi-ver=<num>]\n"
+"\t\t\t[--jobs=<num>] [--scan-cache=<file>] [--yes]\n"
+"\t\t\t[--quiet] [--verbose] [--help] [--version]\n\n"
 "Example 1: " PROGRAM_NAME " /dev/mtd0 -y - format MTD device number 0 and do\n"
 "           not ask questions.\n"
 "Example 2: " PROGRAM_NAME " /dev/mtd0 -q -e 0 - format MTD device number 0,\n"
@@ -114,6 +152,10 @@ static const struct option long_options[] = {
 	{ .name = "vid-hdr-offset",  .has_arg = 1, .flag = NULL, .val = 'O' },
 	{ .name = "flash-image",     .has_arg = 1, .flag = NULL, .val = 'f' },
 	{ .name = "image-size",      .has_arg = 1, .flag = NULL, .val = 'S' },
+	{ .name = "diff",            .has_arg = 0, .flag = NULL, .val = 'd' },
+	{ .name = "sparse",          .has_arg = 0, .flag = NULL, .val = 'z' },
+	{ .name = "jobs",            .has_arg = 1, .flag = NULL, .val = 'j' },
+	{ .name = "scan-cache",      .has_arg = 1, .flag = NULL, .val = 'c' },
 	{ .name = "yes",             .has_arg = 0, .flag = NULL, .val = 'y' },
 	{ .name = "erase-counter",   .has_arg = 1, .flag = NULL, .val = 'e' },
 	{ .name = "quiet",           .has_arg = 0, .flag = NULL, .val = 'q' },
@@ -134,7 +176,7 @@ static int parse_opt(int argc, char * const argv[])
 		int key, error = 0;
 		unsigned long int image_seq;
 
-		key = getopt_long(argc, argv, "nh?Vyqve:x:s:O:f:S:Q:", long_options, NULL);
+		key = getopt_long(argc, argv, "nh?Vyqvdze:x:s:O:f:S:Q:j:c:", long_options, NULL);
 		if (key == -1)
 			break;
 
@@ -172,6 +214,24 @@ static int parse_opt(int argc, char * const argv[])
 				return errmsg("bad image-size: \"%s\"", optarg);
 			break;
 
+		case 'd':
+			args.diff = 1;
+			break;
+
+		case 'j':
+			args.jobs = simple_strtoul(optarg, &error);
+			if (error || args.jobs <= 0)
+				return errmsg("bad count of jobs: \"%s\"", optarg);
+			break;
+
+		case 'c':
+			args.scan_cache = optarg;
+			break;
+
+		case 'z':
+			args.sparse = 1;
+			break;
+
 		case 'y':
 			args.yes = 1;
 			break;
@@ -191,6 +251,7 @@ static int parse_opt(int argc, char * const argv[])
 			if (error || image_seq > 0xFFFFFFFF)
 				return errmsg("bad UBI image sequence number: \"%s\"", optarg);
 			args.image_seq = image_seq;
+			args.manual_image_seq = 1;
 			break;
 
 
@@ -348,6 +409,181 @@ static int read_all(int fd, void *buf, size_t len)
 	return 0;
 }
 
+/* Seconds elapsed since @t0 */
+static double elapsed(const struct timespec *t0)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t0->tv_sec) + (now.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/*
+ * The flash image is read by a separate thread into a ring of
+ * %READ_AHEAD_EBS eraseblock buffers, so that reading the image overlaps with
+ * erasing and programming the flash.
+ *
+ * @thread: the reader thread
+ * @lock: protects @head, @tail, @failed and @stop
+ * @cond: signalled when @head, @tail, @failed or @stop change
+ * @ring: the eraseblock buffers
+ * @fd: the image file
+ * @eb_size: eraseblock size
+ * @img_ebs: how many eraseblocks the image has
+ * @head: how many eraseblocks were read
+ * @tail: how many eraseblocks were consumed by the writer
+ * @failed: reading the image failed, no more eraseblocks will be read
+ * @stop: the writer is done, the reader has to stop
+ * @read_secs: time spent reading the image
+ * @wait_secs: time the writer spent waiting for the reader
+ */
+struct img_reader {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *ring;
+	int fd;
+	int eb_size;
+	int img_ebs;
+	int head;
+	int tail;
+	int failed;
+	int stop;
+	double read_secs;
+	double wait_secs;
+};
+
+static void *img_reader_thread(void *arg)
+{
+	struct img_reader *rd = arg;
+	struct timespec t0;
+	int n, err, stop;
+
+	for (n = 0; n < rd->img_ebs; n++) {
+		char *buf = rd->ring + (size_t)(n % READ_AHEAD_EBS) * rd->eb_size;
+
+		pthread_mutex_lock(&rd->lock);
+		while (n - rd->tail >= READ_AHEAD_EBS && !rd->stop)
+			pthread_cond_wait(&rd->cond, &rd->lock);
+		stop = rd->stop;
+		pthread_mutex_unlock(&rd->lock);
+		if (stop)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		err = read_all(rd->fd, buf, rd->eb_size);
+		if (err)
+			sys_errmsg("failed to read eraseblock %d from \"%s\"",
+				   n, args.image);
+		else if (args.sparse &&
+			 util_fill_holes(rd->fd, (off_t)n * rd->eb_size, buf,
+					 rd->eb_size))
+			err = sys_errmsg("cannot find the holes of \"%s\"",
+					 args.image);
+		rd->read_secs += elapsed(&t0);
+
+		pthread_mutex_lock(&rd->lock);
+		if (err)
+			rd->failed = 1;
+		else
+			rd->head += 1;
+		pthread_cond_broadcast(&rd->cond);
+		pthread_mutex_unlock(&rd->lock);
+		if (err)
+			break;
+	}
+
+	return NULL;
+}
+
+static int img_reader_start(struct img_reader *rd, int fd, int eb_size,
+			    int img_ebs)
+{
+	int err;
+
+	memset(rd, 0, sizeof(*rd));
+	rd->fd = fd;
+	rd->eb_size = eb_size;
+	rd->img_ebs = img_ebs;
+
+	rd->ring = malloc((size_t)eb_size * READ_AHEAD_EBS);
+	if (!rd->ring)
+		return sys_errmsg("cannot allocate %d bytes of memory",
+				  eb_size * READ_AHEAD_EBS);
+
+	pthread_mutex_init(&rd->lock, NULL);
+	pthread_cond_init(&rd->cond, NULL);
+	err = pthread_create(&rd->thread, NULL, img_reader_thread, rd);
+	if (err) {
+		errno = err;
+		sys_errmsg("cannot create the image reader thread");
+		pthread_cond_destroy(&rd->cond);
+		pthread_mutex_destroy(&rd->lock);
+		free(rd->ring);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait for the next eraseblock of the image to be read. Returns its buffer,
+ * or %NULL if reading the image failed.
+ */
+static char *img_reader_get(struct img_reader *rd)
+{
+	struct timespec t0;
+	char *buf = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_mutex_lock(&rd->lock);
+	while (rd->head == rd->tail && rd->head < rd->img_ebs && !rd->failed)
+		pthread_cond_wait(&rd->cond, &rd->lock);
+	if (rd->head != rd->tail)
+		buf = rd->ring + (size_t)(rd->tail % READ_AHEAD_EBS) * rd->eb_size;
+	pthread_mutex_unlock(&rd->lock);
+	rd->wait_secs += elapsed(&t0);
+
+	return buf;
+}
+
+/* Hand the buffer of the current eraseblock back to the reader */
+static void img_reader_put(struct img_reader *rd)
+{
+	pthread_mutex_lock(&rd->lock);
+	rd->tail += 1;
+	pthread_cond_broadcast(&rd->cond);
+	pthread_mutex_unlock(&rd->lock);
+}
+
+static void img_reader_stop(struct img_reader *rd)
+{
+	pthread_mutex_lock(&rd->lock);
+	rd->stop = 1;
+	pthread_cond_broadcast(&rd->cond);
+	pthread_mutex_unlock(&rd->lock);
+
+	pthread_join(rd->thread, NULL);
+	pthread_cond_destroy(&rd->cond);
+	pthread_mutex_destroy(&rd->lock);
+	free(rd->ring);
+}
+
+/*
+ * Check whether eraseblock @eb already contains exactly @expect, so that it
+ * does not have to be erased and written again in the "--diff" mode. @tmp is
+ * a buffer of eraseblock size for reading the eraseblock. Eraseblocks which
+ * cannot be read are considered to differ.
+ */
+static int eb_unchanged(const struct mtd_dev_info *mtd, int eb,
+			const void *expect, void *tmp)
+{
+	if (mtd_read(mtd, args.node_fd, eb, 0, tmp, mtd->eb_size))
+		return 0;
+
+	return !memcmp(expect, tmp, mtd->eb_size);
+}
+
 /*
  * Returns %-1 if consecutive bad blocks exceeds the
  * MAX_CONSECUTIVE_BAD_BLOCKS and returns %0 otherwise.
@@ -411,8 +647,12 @@ static int mark_bad(const struct mtd_dev_info *mtd, struct ubi_scan_info *si, in
 static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		       const struct ubigen_info *ui, struct ubi_scan_info *si)
 {
-	int fd, img_ebs, eb, written_ebs = 0, divisor, skip_data_read = 0;
+	int fd, img_ebs, eb, written_ebs = 0, divisor, ret = -1;
+	char *buf = NULL, *tmp = NULL;
 	off_t st_size;
+	struct img_reader rd;
+	struct timespec t0;
+	double erase_secs = 0, write_secs = 0;
 
 	fd = open_file(&st_size);
 	if (fd < 0)
@@ -426,17 +666,33 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		goto out_close;
 	}
 
+	if (!img_ebs) {
+		errmsg("file \"%s\" is empty", args.image);
+		goto out_close;
+	}
+
 	if (st_size % mtd->eb_size) {
 		sys_errmsg("file \"%s\" (size %lld bytes) is not multiple of ""eraseblock size (%d bytes)",
 			  args.image, (long long)st_size, mtd->eb_size);
 		goto out_close;
 	}
 
+	if (args.diff) {
+		tmp = malloc(mtd->eb_size);
+		if (!tmp) {
+			sys_errmsg("cannot allocate %d bytes of memory",
+				   mtd->eb_size);
+			goto out_close;
+		}
+	}
+
+	if (img_reader_start(&rd, fd, mtd->eb_size, img_ebs))
+		goto out_close;
+
 	verbose(args.verbose, "will write %d eraseblocks", img_ebs);
 	divisor = img_ebs;
 	for (eb = 0; eb < mtd->eb_cnt; eb++) {
 		int err, new_len;
-		char buf[mtd->eb_size];
 		long long ec;
 
 		if (!args.quiet && !args.verbose) {
@@ -450,35 +706,68 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			continue;
 		}
 
+		/*
+		 * An eraseblock which already has the image data and a valid
+		 * EC header is left alone, with its erase counter unchanged,
+		 * unless another erase counter was requested with "-e".
+		 */
+		if (args.diff && si->ec[eb] <= EC_MAX) {
+			if (!buf) {
+				buf = img_reader_get(&rd);
+				if (!buf)
+					goto out_stop;
+			}
+
+			ec = args.override_ec ? args.ec : si->ec[eb];
+			err = change_ech((struct ubi_ec_hdr *)buf,
+					 ui->image_seq, ec);
+			if (err) {
+				errmsg("bad EC header at eraseblock %d of \"%s\"",
+				       written_ebs, args.image);
+				goto out_stop;
+			}
+
+			if (eb_unchanged(mtd, eb, buf, tmp)) {
+				verbose(args.verbose, "eraseblock %d: unchanged, skip",
+					eb);
+				diff_stats.skipped_ebs += 1;
+				diff_stats.skipped_bytes += mtd->eb_size;
+				img_reader_put(&rd);
+				buf = NULL;
+				if (++written_ebs >= img_ebs)
+					break;
+				continue;
+			}
+		}
+
 		if (args.verbose) {
 			normsg_cont("eraseblock %d: erase", eb);
 			fflush(stdout);
 		}
 
+		clock_gettime(CLOCK_MONOTONIC, &t0);
 		err = mtd_erase(libmtd, mtd, args.node_fd, eb);
+		erase_secs += elapsed(&t0);
 		if (err) {
 			if (!args.quiet)
 				printf("\n");
 			sys_errmsg("failed to erase eraseblock %d", eb);
 
 			if (errno != EIO)
-				goto out_close;
+				goto out_stop;
 
 			if (mark_bad(mtd, si, eb))
-				goto out_close;
+				goto out_stop;
 
 			continue;
 		}
 
-		if (!skip_data_read) {
-			err = read_all(fd, buf, mtd->eb_size);
-			if (err) {
-				sys_errmsg("failed to read eraseblock %d from \"%s\"",
-					   written_ebs, args.image);
-				goto out_close;
-			}
+		/* Wait for the image data only now, reading overlaps the erase */
+		if (!buf) {
+			buf = img_reader_get(&rd);
+			if (!buf)
+				goto out_stop;
 		}
-		skip_data_read = 0;
 
 		if (args.override_ec)
 			ec = args.ec;
@@ -496,7 +785,7 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		if (err) {
 			errmsg("bad EC header at eraseblock %d of \"%s\"",
 			       written_ebs, args.image);
-			goto out_close;
+			goto out_stop;
 		}
 
 		if (args.verbose) {
@@ -506,38 +795,53 @@ static int flash_image(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 
 		new_len = drop_ffs(mtd, buf, mtd->eb_size);
 
+		clock_gettime(CLOCK_MONOTONIC, &t0);
 		err = mtd_write(libmtd, mtd, args.node_fd, eb, 0, buf, new_len,
 				NULL, 0, 0);
+		write_secs += elapsed(&t0);
 		if (err) {
 			sys_errmsg("cannot write eraseblock %d", eb);
 
 			if (errno != EIO)
-				goto out_close;
+				goto out_stop;
 
 			err = mtd_torture(libmtd, mtd, args.node_fd, eb);
 			if (err) {
 				if (mark_bad(mtd, si, eb))
-					goto out_close;
-			}
+					goto out_stop;
+			} else
+				si->ec[eb] = EB_EMPTY;
 
 			/*
-			 * We have to make sure that we do not read next block
-			 * of data from the input image or stdin - we have to
-			 * write buf first instead.
+			 * We have to make sure that we do not take the next
+			 * block of data from the reader - we have to write buf
+			 * first instead.
 			 */
-			skip_data_read = 1;
 			continue;
 		}
+
+		diff_stats.written_bytes += new_len;
+		si->ec[eb] = ec;
+		img_reader_put(&rd);
+		buf = NULL;
 		if (++written_ebs >= img_ebs)
 			break;
 	}
 
 	if (!args.quiet && !args.verbose)
 		printf("\n");
+	ret = eb + 1;
+
+out_stop:
+	img_reader_stop(&rd);
+	verbose(args.verbose, "erase %.3f s, program %.3f s, image read %.3f s (%.3f s waited for)",
+		erase_secs, write_secs, rd.read_secs, rd.wait_secs);
+	free(tmp);
 	close(fd);
-	return eb + 1;
+	return ret;
 
 out_close:
+	free(tmp);
 	close(fd);
 	return -1;
 }
@@ -548,6 +852,7 @@ static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 {
 	int eb, err, write_size;
 	struct ubi_ec_hdr *hdr;
+	char *expect = NULL, *tmp = NULL;
 	struct ubi_vtbl_record *vtbl;
 	int eb1 = -1, eb2 = -1;
 	long long ec1 = -1, ec2 = -1;
@@ -561,6 +866,17 @@ static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		return sys_errmsg("cannot allocate %d bytes of memory", write_size);
 	memset(hdr, 0xFF, write_size);
 
+	if (args.diff) {
+		expect = malloc(mtd->eb_size);
+		tmp = malloc(mtd->eb_size);
+		if (!expect || !tmp) {
+			sys_errmsg("cannot allocate %d bytes of memory",
+				   mtd->eb_size * 2);
+			goto out_free;
+		}
+		memset(expect, 0xFF, mtd->eb_size);
+	}
+
 	for (eb = start_eb; eb < mtd->eb_cnt; eb++) {
 		long long ec;
 
@@ -573,6 +889,24 @@ static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		if (si->ec[eb] == EB_BAD)
 			continue;
 
+		/*
+		 * Already empty eraseblocks with a valid EC header are left
+		 * alone, unless they are needed for the volume table or need
+		 * another erase counter because of "-e".
+		 */
+		if (args.diff && si->ec[eb] <= EC_MAX &&
+		    (novtbl || (eb1 != -1 && eb2 != -1))) {
+			ubigen_init_ec_hdr(ui, (struct ubi_ec_hdr *)expect,
+					   args.override_ec ? args.ec : si->ec[eb]);
+			if (eb_unchanged(mtd, eb, expect, tmp)) {
+				verbose(args.verbose, "eraseblock %d: empty, skip",
+					eb);
+				diff_stats.skipped_ebs += 1;
+				diff_stats.skipped_bytes += mtd->eb_size;
+				continue;
+			}
+		}
+
 		if (args.override_ec)
 			ec = args.ec;
 		else if (si->ec[eb] <= EC_MAX)
@@ -636,10 +970,13 @@ static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 			if (err) {
 				if (mark_bad(mtd, si, eb))
 					goto out_free;
-			}
+			} else
+				si->ec[eb] = EB_EMPTY;
 			continue;
 
 		}
+		diff_stats.written_bytes += write_size;
+		si->ec[eb] = ec;
 	}
 
 	if (!args.quiet && !args.verbose)
@@ -667,11 +1004,14 @@ static int format(libmtd_t libmtd, const struct mtd_dev_info *mtd,
 		errmsg("cannot write layout volume");
 		goto out_free;
 	}
-
-	free(hdr);
-	return 0;
+	diff_stats.written_bytes += 2LL * mtd->eb_size;
+	si->ec[eb1] = ec1;
+	si->ec[eb2] = ec2;
+	ret = 0;
 
 out_free:
+	free(tmp);
+	free(expect);
 	free(hdr);
 	return ret;
 }
@@ -713,7 +1053,7 @@ int main(int argc, char * const argv[])
 		goto out_close_mtd;
 	}
 
-	if (!mtd_info.sysfs_supported) {
+	if (!mtd_info.sysfs_supported && !mtd.emulated) {
 		/*
 		 * Linux kernels older than 2.6.30 did not support sysfs
 		 * interface, and it is impossible to find out sub-page
@@ -748,7 +1088,7 @@ int main(int argc, char * const argv[])
 		}
 	}
 
-	args.node_fd = open(args.node, O_RDWR);
+	args.node_fd = mtd_open_node(args.node, O_RDWR);
 	if (args.node_fd == -1) {
 		sys_errmsg("cannot open \"%s\"", args.node);
 		goto out_close_mtd;
@@ -799,11 +1139,33 @@ int main(int argc, char * const argv[])
 		verbose = 2;
 	else
 		verbose = 1;
-	err = ubi_scan(&mtd, args.node_fd, &si, verbose);
-	if (err) {
-		errmsg("failed to scan mtd%d (%s)", mtd.mtd_num, args.node);
+	if (args.scan_cache)
+		err = ubi_scan_cache_load(&mtd, args.node_fd, args.scan_cache,
+					  &si);
+	else
+		err = 0;
+	if (err < 0) {
+		errmsg("failed to check the scanning information in \"%s\"",
+		       args.scan_cache);
 		goto out_close;
 	}
+	if (err == 1) {
+		verbose(args.verbose, "use scanning information from \"%s\"",
+			args.scan_cache);
+		/* The cache is stale as soon as the flash is changed */
+		unlink(args.scan_cache);
+	} else {
+		if (args.scan_cache)
+			verbose(args.verbose, "cannot use scanning information from \"%s\", scan the device",
+				args.scan_cache);
+		err = ubi_scan_fast(&mtd, args.node_fd, &si, verbose,
+				    args.jobs);
+		if (err) {
+			errmsg("failed to scan mtd%d (%s)", mtd.mtd_num,
+			       args.node);
+			goto out_close;
+		}
+	}
 
 	if (si->good_cnt == 0) {
 		errmsg("all %d eraseblocks are bad", si->bad_cnt);
@@ -879,6 +1241,16 @@ int main(int argc, char * const argv[])
 	if (!args.quiet && args.override_ec)
 		normsg("use erase counter %lld for all eraseblocks", args.ec);
 
+	/*
+	 * Eraseblocks with a different image sequence number always differ,
+	 * so keep the one which is on flash.
+	 */
+	if (args.diff && !args.manual_image_seq && si->vid_hdr_offs != -1) {
+		args.image_seq = si->image_seq;
+		verbose(args.verbose, "use image sequence number %u from flash",
+			args.image_seq);
+	}
+
 	ubigen_info_init(&ui, mtd.eb_size, mtd.min_io_size, mtd.subpage_size,
 			 args.vid_hdr_offs, args.ubi_ver, args.image_seq);
 
@@ -923,6 +1295,20 @@ int main(int argc, char * const argv[])
 			goto out_free;
 	}
 
+	if (args.scan_cache) {
+		si->vid_hdr_offs = ui.vid_hdr_offs;
+		si->data_offs = ui.data_offs;
+		si->image_seq = ui.image_seq;
+		if (ubi_scan_cache_save(&mtd, args.scan_cache, si))
+			warnmsg("cannot save scanning information to \"%s\"",
+				args.scan_cache);
+	}
+
+	if (args.diff && !args.quiet)
+		normsg("skipped %d unchanged eraseblocks (%lld bytes), wrote %lld bytes",
+		       diff_stats.skipped_ebs, diff_stats.skipped_bytes,
+		       diff_stats.written_bytes);
+
 	ubi_scan_free(si);
 	close(args.node_fd);
 	libmtd_close(libmtd);
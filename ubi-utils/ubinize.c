@@ -31,6 +31,7 @@
 #include <getopt.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include <mtd/ubi-media.h>
 #include <libubigen.h>
@@ -60,6 +61,10 @@ static const char optionsstr[] =
 "                             (default is 1)\n"
 "-Q, --image-seq=<num>        32-bit UBI image sequence number to use\n"
 "                             (by default a random number is picked)\n"
+"-z, --sparse                 leave holes instead of erased (all 0xFF) blocks\n"
+"                             in the output file and treat holes in the\n"
+"                             input images as erased data; only use this if\n"
+"                             the flasher treats holes as erased flash\n"
 "-v, --verbose                be verbose\n"
 "-h, --help                   print help message\n"
 "-V, --version                print program version\n\n";
@@ -79,6 +84,7 @@ static const struct option long_options[] = {
 	{ .name = "erase-counter",  .has_arg = 1, .flag = NULL, .val = 'e' },
 	{ .name = "ubi-ver",        .has_arg = 1, .flag = NULL, .val = 'x' },
 	{ .name = "image-seq",      .has_arg = 1, .flag = NULL, .val = 'Q' },
+	{ .name = "sparse",         .has_arg = 0, .flag = NULL, .val = 'z' },
 	{ .name = "verbose",        .has_arg = 0, .flag = NULL, .val = 'v' },
 	{ .name = "help",           .has_arg = 0, .flag = NULL, .val = 'h' },
 	{ .name = "version",        .has_arg = 0, .flag = NULL, .val = 'V' },
@@ -96,6 +102,7 @@ struct args {
 	int ec;
 	int ubi_ver;
 	uint32_t image_seq;
+	int sparse;
 	int verbose;
 	dictionary *dict;
 };
@@ -116,7 +123,7 @@ static int parse_opt(int argc, char * const argv[])
 		int key, error = 0;
 		unsigned long int image_seq;
 
-		key = getopt_long(argc, argv, "o:p:m:s:O:e:x:Q:vhV", long_options, NULL);
+		key = getopt_long(argc, argv, "o:p:m:s:O:e:x:Q:zvhV", long_options, NULL);
 		if (key == -1)
 			break;
 
@@ -176,6 +183,10 @@ static int parse_opt(int argc, char * const argv[])
 			args.image_seq = image_seq;
 			break;
 
+		case 'z':
+			args.sparse = 1;
+			break;
+
 		case 'v':
 			args.verbose = 1;
 			break;
@@ -424,6 +435,8 @@ int main(int argc, char * const argv[])
 	struct ubi_vtbl_record *vtbl;
 	struct ubigen_vol_info *vi;
 	off_t seek;
+	struct timespec then, now;
+	double secs;
 
 	err = parse_opt(argc, argv);
 	if (err)
@@ -432,6 +445,7 @@ int main(int argc, char * const argv[])
 	ubigen_info_init(&ui, args.peb_size, args.min_io_size,
 			 args.subpage_size, args.vid_hdr_offs,
 			 args.ubi_ver, args.image_seq);
+	ui.sparse = args.sparse;
 
 	verbose(args.verbose, "LEB size:                  %d", ui.leb_size);
 	verbose(args.verbose, "PEB size:                  %d", ui.peb_size);
@@ -570,12 +584,20 @@ int main(int argc, char * const argv[])
 			verbose(args.verbose, "writing volume %d", vi[i].id);
 			verbose(args.verbose, "image file: %s", img);
 
+			clock_gettime(CLOCK_MONOTONIC, &then);
 			err = ubigen_write_volume(&ui, &vi[i], args.ec, st.st_size, fd, args.out_fd);
 			close(fd);
 			if (err) {
 				errmsg("cannot write volume for section \"%s\"", sname);
 				goto out_free;
 			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			secs = (now.tv_sec - then.tv_sec) +
+			       (now.tv_nsec - then.tv_nsec) / 1e9;
+			verbose(args.verbose, "wrote %lld bytes in %.3f s (%.1f MiB/s)",
+				(long long)st.st_size, secs,
+				secs > 0 ? st.st_size / secs / (1024 * 1024) : 0);
 		}
 
 		if (args.verbose)
@@ -38,11 +38,17 @@
 #undef crc32
 #endif
 
+#include "atomic.h"
 #include "compr.h"
 #include "ubifs.h"
 
-static void *lzo_mem;
-static unsigned long long errcnt = 0;
+/*
+ * Compressor work memory is per-thread, so that 'compress_data()' may be
+ * called concurrently from several threads, each of which has called
+ * 'init_compression_thread()' first.
+ */
+static __thread void *lzo_mem;
+static atomic_long_t errcnt = ATOMIC_INIT(0);
 #ifdef WITH_LZO
 extern struct ubifs_info info_;
 static struct ubifs_info *c = &info_;
@@ -68,7 +74,7 @@ static int zlib_deflate(void *in_buf, size_t in_len, void *out_buf,
         if (deflateInit2(&strm, DEFLATE_DEF_LEVEL, Z_DEFLATED,
 			 -DEFLATE_DEF_WINBITS, DEFLATE_DEF_MEMLEVEL,
 			 Z_DEFAULT_STRATEGY)) {
-		errcnt += 1;
+		atomic_long_inc(&errcnt);
 		return -1;
 	}
 
@@ -82,12 +88,12 @@ static int zlib_deflate(void *in_buf, size_t in_len, void *out_buf,
 
 	if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
 		deflateEnd(&strm);
-		errcnt += 1;
+		atomic_long_inc(&errcnt);
 		return -1;
 	}
 
 	if (deflateEnd(&strm) != Z_OK) {
-		errcnt += 1;
+		atomic_long_inc(&errcnt);
 		return -1;
 	}
 
@@ -109,7 +115,7 @@ static int lzo_compress(void *in_buf, size_t in_len, void *out_buf,
 	*out_len = len;
 
 	if (ret != LZO_E_OK) {
-		errcnt += 1;
+		atomic_long_inc(&errcnt);
 		return -1;
 	}
 
@@ -118,7 +124,7 @@ static int lzo_compress(void *in_buf, size_t in_len, void *out_buf,
 #endif
 
 #ifdef WITH_ZSTD
-static ZSTD_CCtx *zctx;
+static __thread ZSTD_CCtx *zctx;
 
 static int zstd_compress(void *in_buf, size_t in_len, void *out_buf,
 			 size_t *out_len)
@@ -127,7 +133,7 @@ static int zstd_compress(void *in_buf, size_t in_len, void *out_buf,
 
 	ret = ZSTD_compressCCtx(zctx, out_buf, *out_len, in_buf, in_len, 0);
 	if (ZSTD_isError(ret)) {
-		errcnt += 1;
+		atomic_long_inc(&errcnt);
 		return -1;
 	}
 	*out_len = ret;
@@ -143,7 +149,7 @@ static int no_compress(void *in_buf, size_t in_len, void *out_buf,
 	return 0;
 }
 
-static char *zlib_buf;
+static __thread char *zlib_buf;
 
 #if defined(WITH_LZO) && defined(WITH_ZLIB)
 static int favor_lzo_compress(void *in_buf, size_t in_len, void *out_buf,
@@ -230,7 +236,7 @@ int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
 			ret = 1;
 			break;
 		default:
-			errcnt += 1;
+			atomic_long_inc(&errcnt);
 			ret = 1;
 			break;
 		}
@@ -242,7 +248,13 @@ int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
 	return type;
 }
 
-int init_compression(void)
+/**
+ * init_compression_thread - allocate compressor state of the calling thread.
+ *
+ * Every thread other than the one which called 'init_compression()' has to
+ * call this function before using 'compress_data()'.
+ */
+int init_compression_thread(void)
 {
 #ifndef WITH_LZO
 	lzo_mem = NULL;
@@ -273,13 +285,27 @@ err:
 	return -1;
 }
 
-void destroy_compression(void)
+/**
+ * destroy_compression_thread - free compressor state of the calling thread.
+ */
+void destroy_compression_thread(void)
 {
 	free(zlib_buf);
 	free(lzo_mem);
 #ifdef WITH_ZSTD
 	ZSTD_freeCCtx(zctx);
 #endif
-	if (errcnt)
-		fprintf(stderr, "%llu compression errors occurred\n", errcnt);
+}
+
+int init_compression(void)
+{
+	return init_compression_thread();
+}
+
+void destroy_compression(void)
+{
+	destroy_compression_thread();
+	if (atomic_long_read(&errcnt))
+		fprintf(stderr, "%ld compression errors occurred\n",
+			atomic_long_read(&errcnt));
 }
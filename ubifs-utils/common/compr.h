@@ -35,5 +35,7 @@ int compress_data(void *in_buf, size_t in_len, void *out_buf, size_t *out_len,
 		  int type);
 int init_compression(void);
 void destroy_compression(void);
+int init_compression_thread(void);
+void destroy_compression_thread(void);
 
 #endif
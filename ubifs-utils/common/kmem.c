@@ -62,3 +62,123 @@ void *kmemdup(const void *src, size_t len, gfp_t gfp)
 
 	return p;
 }
+
+/* Slabs are allocated in chunks of this size (at least one object though) */
+#define SLAB_SIZE (64 * 1024)
+
+/*
+ * Free objects are linked through their first word and the first object of
+ * every slab links the slab into the @slabs list of the cache, so objects are
+ * at least pointer-sized.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align)
+{
+	struct kmem_cache *s;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	size = (size + align - 1) & ~(align - 1);
+
+	s = kmem_zalloc(sizeof(struct kmem_cache));
+	if (!s)
+		return NULL;
+
+	s->name = name;
+	s->size = size;
+	s->align = align;
+	s->objs_per_slab = SLAB_SIZE / size;
+	if (s->objs_per_slab < 2)
+		s->objs_per_slab = 2;
+	pthread_mutex_init(&s->lock, NULL);
+
+	return s;
+}
+
+/*
+ * Allocate a new slab and put all its objects but the first one on the free
+ * list. Must be called with @s->lock held.
+ */
+static int grow_cache(struct kmem_cache *s)
+{
+	size_t bytes = s->objs_per_slab * s->size;
+	unsigned int i;
+	char *slab;
+	int err;
+
+	err = posix_memalign((void **)&slab, s->align, bytes);
+	if (err) {
+		errno = err;
+		sys_errmsg("cannot allocate slab for cache %s (%zu bytes)",
+			   s->name, bytes);
+		return -1;
+	}
+
+	*(void **)slab = s->slabs;
+	s->slabs = slab;
+	s->nr_slabs += 1;
+
+	for (i = s->objs_per_slab - 1; i > 0; i--) {
+		void *obj = slab + i * s->size;
+
+		*(void **)obj = s->freelist;
+		s->freelist = obj;
+	}
+
+	return 0;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *s, gfp_t flags)
+{
+	void *obj = NULL;
+
+	pthread_mutex_lock(&s->lock);
+	if (!s->freelist && grow_cache(s))
+		goto out;
+
+	obj = s->freelist;
+	s->freelist = *(void **)obj;
+	s->active_objs += 1;
+	s->total_allocs += 1;
+	if (s->active_objs > s->peak_objs)
+		s->peak_objs = s->active_objs;
+out:
+	pthread_mutex_unlock(&s->lock);
+
+	if (obj && (flags & __GFP_ZERO))
+		memset(obj, 0, s->size);
+	return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *s, const void *obj)
+{
+	if (!obj)
+		return;
+
+	pthread_mutex_lock(&s->lock);
+	*(void **)obj = s->freelist;
+	s->freelist = (void *)obj;
+	s->active_objs -= 1;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Release all the slabs of @s at once, whether their objects were freed or
+ * not.
+ */
+void kmem_cache_destroy(struct kmem_cache *s)
+{
+	void *slab, *next;
+
+	if (!s)
+		return;
+
+	for (slab = s->slabs; slab; slab = next) {
+		next = *(void **)slab;
+		free(slab);
+	}
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
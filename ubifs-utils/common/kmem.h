@@ -7,6 +7,7 @@
 #define __KMEM_H__
 
 #include <stdlib.h>
+#include <pthread.h>
 
 typedef unsigned int gfp_t;
 
@@ -53,4 +54,53 @@ static inline void *kcalloc(size_t n, size_t size, gfp_t flags)
 	return kmalloc_array(n, size, flags | __GFP_ZERO);
 }
 
+/**
+ * struct kmem_cache - a pool of equally sized objects.
+ * @name: name of the cache, used when printing statistics
+ * @size: object size, rounded up to @align
+ * @align: object alignment
+ * @objs_per_slab: how many objects fit in one slab
+ * @freelist: free objects, linked through their first word
+ * @slabs: slabs allocated by the cache, linked through their first word
+ * @lock: protects all the fields below and the lists above
+ * @active_objs: how many objects are currently allocated
+ * @peak_objs: maximum value @active_objs has reached
+ * @total_allocs: how many objects have been allocated in total
+ * @nr_slabs: how many slabs are allocated
+ *
+ * Objects are carved out of big slabs and are put on @freelist when freed,
+ * slabs are released all together by 'kmem_cache_destroy()'. This avoids the
+ * per-object overhead of malloc() for the many small objects fsck.ubifs
+ * allocates and makes tearing down large trees of such objects cheap.
+ */
+struct kmem_cache {
+	const char *name;
+	size_t size;
+	size_t align;
+	unsigned int objs_per_slab;
+	void *freelist;
+	void *slabs;
+	pthread_mutex_t lock;
+	unsigned long active_objs;
+	unsigned long peak_objs;
+	unsigned long long total_allocs;
+	unsigned long nr_slabs;
+};
+
+extern struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+					    size_t align);
+extern void	*kmem_cache_alloc(struct kmem_cache *s, gfp_t flags);
+extern void	kmem_cache_free(struct kmem_cache *s, const void *obj);
+extern void	kmem_cache_destroy(struct kmem_cache *s);
+
+static inline void *kmem_cache_zalloc(struct kmem_cache *s, gfp_t flags)
+{
+	return kmem_cache_alloc(s, flags | __GFP_ZERO);
+}
+
+static inline size_t kmem_cache_bytes(const struct kmem_cache *s)
+{
+	return s->nr_slabs * s->objs_per_slab * s->size;
+}
+
 #endif
@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * A minimal pool of worker threads for the offline UBIFS tools.
+ *
+ * The pool only knows how to run a batch of independent work items, i.e.
+ * 'thread_pool_run()' calls @fn for every index of the batch, spreading the
+ * calls among the workers and the calling thread, and returns once all of them
+ * are done. Ordering of the results is left to the caller, which typically
+ * fills a per-index slot in an array and consumes the array sequentially.
+ */
+
+#include <pthread.h>
+
+#include "linux_types.h"
+#include "defs.h"
+#include "thread_pool.h"
+
+struct thread_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	int nr_threads;
+	int (*init)(void);
+	void (*exit)(void);
+	int init_err;
+	int started;
+	int stop;
+	unsigned long long gen;
+	thread_pool_fn_t fn;
+	void *arg;
+	int cnt;
+	int next;
+	int busy;
+};
+
+/*
+ * Grab and execute work items of the current batch until there is no more.
+ * Called with @pool->lock held, returns with it held.
+ */
+static void run_items(struct thread_pool *pool)
+{
+	while (pool->next < pool->cnt) {
+		int idx = pool->next++;
+
+		pool->busy += 1;
+		pthread_mutex_unlock(&pool->lock);
+		pool->fn(pool->arg, idx);
+		pthread_mutex_lock(&pool->lock);
+		pool->busy -= 1;
+	}
+	if (!pool->busy)
+		pthread_cond_broadcast(&pool->done_cond);
+}
+
+static void *worker(void *data)
+{
+	struct thread_pool *pool = data;
+	unsigned long long gen = 0;
+	int err = 0;
+
+	if (pool->init)
+		err = pool->init();
+
+	pthread_mutex_lock(&pool->lock);
+	if (err)
+		pool->init_err = err;
+	pool->started += 1;
+	pthread_cond_broadcast(&pool->done_cond);
+	while (!err) {
+		while (!pool->stop && pool->gen == gen)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if (pool->stop)
+			break;
+		gen = pool->gen;
+		run_items(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!err && pool->exit)
+		pool->exit();
+	return NULL;
+}
+
+/**
+ * thread_pool_create - create a pool of worker threads.
+ * @nr_threads: number of threads to start in addition to the calling one
+ * @init: called once in the context of each worker before it accepts work
+ * @exit: called once in the context of each worker when it is stopped
+ *
+ * @init and @exit may be %NULL, they are intended to set up and tear down
+ * per-thread state like compressor contexts. Returns the new pool or %NULL if
+ * a thread could not be started or its @init failed.
+ */
+struct thread_pool *thread_pool_create(int nr_threads, int (*init)(void),
+				       void (*exit)(void))
+{
+	struct thread_pool *pool;
+	int i, err;
+
+	pool = xzalloc(sizeof(struct thread_pool));
+	pool->threads = xcalloc(nr_threads, sizeof(pthread_t));
+	pool->init = init;
+	pool->exit = exit;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (i = 0; i < nr_threads; i++) {
+		err = pthread_create(&pool->threads[i], NULL, worker, pool);
+		if (err) {
+			errno = err;
+			sys_errmsg("cannot create worker thread");
+			break;
+		}
+		pool->nr_threads += 1;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->started < pool->nr_threads)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	err = pool->init_err;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (err || pool->nr_threads != nr_threads) {
+		thread_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/**
+ * thread_pool_run - run a batch of work items and wait for its completion.
+ * @pool: the pool (may be %NULL to run everything in the calling thread)
+ * @fn: the function to call for every work item
+ * @arg: argument to pass to @fn
+ * @cnt: number of work items in the batch
+ */
+void thread_pool_run(struct thread_pool *pool, thread_pool_fn_t fn, void *arg,
+		     int cnt)
+{
+	int i;
+
+	if (!pool || cnt <= 1) {
+		for (i = 0; i < cnt; i++)
+			fn(arg, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->cnt = cnt;
+	pool->next = 0;
+	pool->gen += 1;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	run_items(pool);
+	while (pool->busy)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * thread_pool_destroy - stop all workers and free the pool.
+ * @pool: the pool to destroy (may be %NULL)
+ */
+void thread_pool_destroy(struct thread_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * A minimal pool of worker threads for the offline UBIFS tools.
+ */
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+struct thread_pool;
+
+/**
+ * thread_pool_fn_t - a unit of work executed by the pool.
+ * @arg: the argument passed to 'thread_pool_run()'
+ * @idx: index of the work item, from 0 to @cnt - 1
+ */
+typedef void (*thread_pool_fn_t)(void *arg, int idx);
+
+struct thread_pool *thread_pool_create(int nr_threads, int (*init)(void),
+				       void (*exit)(void));
+void thread_pool_run(struct thread_pool *pool, thread_pool_fn_t fn, void *arg,
+		     int cnt);
+void thread_pool_destroy(struct thread_pool *pool);
+
+#endif
@@ -16,8 +16,12 @@
 #include "defs.h"
 #include "debug.h"
 #include "key.h"
+#include "thread_pool.h"
 #include "fsck.ubifs.h"
 
+/* Number of leaf nodes read by each thread in a batch */
+#define READ_LEAVES_PER_JOB 256
+
 struct invalid_node {
 	union ubifs_key key;
 	int lnum;
@@ -238,6 +242,171 @@ static int check_znode(struct ubifs_info *c, struct ubifs_znode *znode,
 	return 0;
 }
 
+/**
+ * struct leaf_batch - a batch of leaf nodes read and checked in parallel.
+ * @wc: copy of the file-system description object with messages disabled
+ * @iter: iteration information
+ * @pool: threads reading the leaf nodes
+ * @cnt: number of leaves in the batch
+ * @max: maximum number of leaves in the batch
+ * @zbrs: zbranches of the leaves, in TNC order
+ * @nodes: the leaf nodes, %NULL if reading or checking a node failed, in
+ *	   which case the leaf is handled again by 'check_leaf()'
+ */
+struct leaf_batch {
+	struct ubifs_info *wc;
+	struct iteration_info *iter;
+	struct thread_pool *pool;
+	int cnt;
+	int max;
+	struct ubifs_zbranch *zbrs;
+	void **nodes;
+};
+
+/*
+ * Read and check a leaf node the way 'ubifs_tnc_read_node()' does, but
+ * without printing anything or recording failure reasons.
+ */
+static void read_leaf_worker(void *arg, int idx)
+{
+	struct leaf_batch *b = arg;
+	struct ubifs_info *wc = b->wc;
+	struct ubifs_zbranch *zbr = &b->zbrs[idx];
+	struct ubifs_ch *ch;
+	union ubifs_key key;
+	void *node;
+
+	b->nodes[idx] = NULL;
+	if (ubifs_get_wbuf(wc, zbr->lnum))
+		return;
+
+	node = kmalloc(zbr->len, GFP_NOFS);
+	if (!node)
+		return;
+
+	ch = node;
+	if (ubifs_leb_read(wc, zbr->lnum, node, zbr->offs, zbr->len, 0) ||
+	    ch->node_type != key_type(wc, &zbr->key) ||
+	    ubifs_check_node(wc, node, zbr->len, zbr->lnum, zbr->offs, 1, 0) ||
+	    le32_to_cpu(ch->len) != zbr->len)
+		goto out_free;
+
+	key_read(wc, node + UBIFS_KEY_OFFSET, &key);
+	if (!keys_eq(wc, &zbr->key, &key) ||
+	    ubifs_node_check_hash(wc, node, zbr->hash))
+		goto out_free;
+
+	b->nodes[idx] = node;
+	return;
+
+out_free:
+	kfree(node);
+}
+
+/*
+ * Read the leaves of @b in parallel, then construct files from them in TNC
+ * order. Leaves which could not be read or checked go through
+ * 'check_leaf()', so problems are reported exactly as by a serial traversal.
+ */
+static int flush_leaf_batch(struct ubifs_info *c, struct leaf_batch *b)
+{
+	int i, err = 0;
+	struct ubifs_zbranch *zbr;
+
+	thread_pool_run(b->pool, read_leaf_worker, b, b->cnt);
+
+	for (i = 0; i < b->cnt; i++) {
+		zbr = &b->zbrs[i];
+		if (!err) {
+			if (b->nodes[i])
+				err = construct_file(c, &zbr->key, zbr->lnum,
+						     zbr->offs, b->nodes[i],
+						     b->iter);
+			else
+				err = check_leaf(c, zbr, b->iter);
+		}
+		kfree(b->nodes[i]);
+	}
+	b->cnt = 0;
+
+	return err;
+}
+
+static int queue_leaf(struct ubifs_info *c, struct ubifs_zbranch *zbr,
+		      void *priv)
+{
+	int err, type = key_type(c, &zbr->key);
+	struct leaf_batch *b = priv;
+
+	if (zbr->len < UBIFS_CH_SZ ||
+	    (type != UBIFS_INO_KEY && type != UBIFS_DATA_KEY &&
+	     type != UBIFS_DENT_KEY && type != UBIFS_XENT_KEY)) {
+		/* Report the problems of the queued leaves first */
+		err = flush_leaf_batch(c, b);
+		return err ? : check_leaf(c, zbr, b->iter);
+	}
+
+	b->zbrs[b->cnt++] = *zbr;
+	if (b->cnt == b->max)
+		return flush_leaf_batch(c, b);
+
+	return 0;
+}
+
+/**
+ * walk_index_parallel - traverse TNC, reading leaf nodes with several threads.
+ * @c: UBIFS file-system description object
+ * @iter: iteration information
+ *
+ * Same as walking the index with 'check_leaf()', for the check mode only,
+ * where checking a leaf amounts to reading it and constructing its file.
+ * The index is walked by the calling thread, which queues the leaves; they
+ * are read and checked by a pool of threads, a batch at a time, and files
+ * are constructed from them in TNC order.
+ */
+static int walk_index_parallel(struct ubifs_info *c,
+			       struct iteration_info *iter)
+{
+	int err, ret, jobs = FSCK(c)->jobs;
+	struct leaf_batch b = {
+		.iter = iter,
+		.max = jobs * READ_LEAVES_PER_JOB,
+	};
+
+	ubifs_assert(c, FSCK(c)->mode == CHECK_MODE);
+
+	b.wc = kmalloc(sizeof(struct ubifs_info), GFP_KERNEL);
+	b.zbrs = kcalloc(b.max, sizeof(struct ubifs_zbranch), GFP_KERNEL);
+	b.nodes = kcalloc(b.max, sizeof(void *), GFP_KERNEL);
+	if (!b.wc || !b.zbrs || !b.nodes) {
+		err = -ENOMEM;
+		log_err(c, errno, "can not allocate leaf batch");
+		goto out_free;
+	}
+	*b.wc = *c;
+	b.wc->debug_level = 0;
+
+	b.pool = thread_pool_create(jobs - 1, NULL, NULL);
+	if (!b.pool) {
+		err = -ENOMEM;
+		log_err(c, 0, "can not start reading threads");
+		goto out_free;
+	}
+
+	err = dbg_walk_index(c, queue_leaf, check_znode, &b);
+	/* Leaves queued before an error come before it in TNC order */
+	ret = flush_leaf_batch(c, &b);
+	if (!err)
+		err = ret;
+
+	thread_pool_destroy(b.pool);
+out_free:
+	kfree(b.nodes);
+	kfree(b.zbrs);
+	kfree(b.wc);
+	return err;
+}
+
 static int remove_invalid_nodes(struct ubifs_info *c,
 				struct list_head *invalid_nodes, int error)
 {
@@ -296,7 +465,12 @@ int traverse_tnc_and_construct_files(struct ubifs_info *c)
 		goto out;
 	}
 
-	err = dbg_walk_index(c, check_leaf, check_znode, &iter);
+	/* Debug messages of the reading code cannot be kept in order */
+	if (FSCK(c)->mode == CHECK_MODE && FSCK(c)->jobs > 1 &&
+	    c->debug_level < DEBUG_LEVEL)
+		err = walk_index_parallel(c, &iter);
+	else
+		err = dbg_walk_index(c, check_leaf, check_znode, &iter);
 
 	ret = remove_invalid_nodes(c, &iter.invalid_nodes, err);
 	if (!err)
@@ -398,11 +572,11 @@ int handle_invalid_files(struct ubifs_info *c)
 		err = file_is_valid(c, file, tree, NULL);
 		if (err < 0) {
 			destroy_file_content(c, file);
-			kfree(file);
+			kmem_cache_free(FSCK(c)->file_slab, file);
 			return err;
 		} else if (!err) {
 			err = delete_file(c, file);
-			kfree(file);
+			kmem_cache_free(FSCK(c)->file_slab, file);
 			if (err)
 				return err;
 		}
@@ -433,7 +607,7 @@ int handle_invalid_files(struct ubifs_info *c)
 		if (err)
 			return err;
 		rb_erase(&file->rb, tree);
-		kfree(file);
+		kmem_cache_free(FSCK(c)->file_slab, file);
 	}
 
 	/* Remove disconnected file from the file tree. */
@@ -493,7 +667,7 @@ int handle_dentry_tree(struct ubifs_info *c)
 			if (err)
 				return err;
 			rb_erase(&file->rb, tree);
-			kfree(file);
+			kmem_cache_free(FSCK(c)->file_slab, file);
 		}
 	}
 
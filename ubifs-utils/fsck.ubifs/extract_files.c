@@ -509,13 +509,14 @@ out:
 
 /**
  * insert_file_dentry - insert dentry according to scanned dent node.
+ * @c: UBIFS file-system description object
  * @file: file object
  * @n_dent: scanned dent node
  *
  * Insert file dentry information. Returns zero in case of success, a
  * negative error code in case of failure.
  */
-static int insert_file_dentry(struct scanned_file *file,
+static int insert_file_dentry(struct ubifs_info *c, struct scanned_file *file,
 			      struct scanned_dent_node *n_dent)
 {
 	struct scanned_dent_node *dent;
@@ -531,7 +532,7 @@ static int insert_file_dentry(struct scanned_file *file,
 			p = &(*p)->rb_right;
 	}
 
-	dent = kmalloc(sizeof(struct scanned_dent_node), GFP_KERNEL);
+	dent = kmem_cache_alloc(FSCK(c)->dent_slab, GFP_KERNEL);
 	if (!dent)
 		return -ENOMEM;
 
@@ -583,7 +584,7 @@ static int update_file_data(struct ubifs_info *c, struct scanned_file *file,
 		return 0;
 	}
 
-	dn = kmalloc(sizeof(struct scanned_data_node), GFP_KERNEL);
+	dn = kmem_cache_alloc(FSCK(c)->data_slab, GFP_KERNEL);
 	if (!dn)
 		return -ENOMEM;
 
@@ -629,7 +630,7 @@ static int update_file(struct ubifs_info *c, struct scanned_file *file,
 		struct scanned_dent_node *dent = (struct scanned_dent_node *)sn;
 
 		dent->file = file;
-		err = insert_file_dentry(file, dent);
+		err = insert_file_dentry(c, file, dent);
 		break;
 	}
 	case UBIFS_DATA_KEY:
@@ -695,7 +696,7 @@ int insert_or_update_file(struct ubifs_info *c, struct rb_root *file_tree,
 	if (old_file)
 		return update_file(c, old_file, sn, key_type);
 
-	file = kzalloc(sizeof(struct scanned_file), GFP_KERNEL);
+	file = kmem_cache_zalloc(FSCK(c)->file_slab, GFP_KERNEL);
 	if (!file)
 		return -ENOMEM;
 
@@ -706,7 +707,7 @@ int insert_or_update_file(struct ubifs_info *c, struct rb_root *file_tree,
 	INIT_LIST_HEAD(&file->list);
 	err = update_file(c, file, sn, key_type);
 	if (err) {
-		kfree(file);
+		kmem_cache_free(FSCK(c)->file_slab, file);
 		return err;
 	}
 	rb_link_node(&file->rb, parent, p);
@@ -735,7 +736,7 @@ void destroy_file_content(struct ubifs_info *c, struct scanned_file *file)
 		this = rb_next(this);
 
 		rb_erase(&data_node->rb, &file->data_nodes);
-		kfree(data_node);
+		kmem_cache_free(FSCK(c)->data_slab, data_node);
 	}
 
 	this = rb_first(&file->dent_nodes);
@@ -744,7 +745,7 @@ void destroy_file_content(struct ubifs_info *c, struct scanned_file *file)
 		this = rb_next(this);
 
 		rb_erase(&dent_node->rb, &file->dent_nodes);
-		kfree(dent_node);
+		kmem_cache_free(FSCK(c)->dent_slab, dent_node);
 	}
 
 	this = rb_first(&file->xattr_files);
@@ -755,7 +756,7 @@ void destroy_file_content(struct ubifs_info *c, struct scanned_file *file)
 		ubifs_assert(c, !rb_first(&xattr_file->xattr_files));
 		destroy_file_content(c, xattr_file);
 		rb_erase(&xattr_file->rb, &file->xattr_files);
-		kfree(xattr_file);
+		kmem_cache_free(FSCK(c)->file_slab, xattr_file);
 	}
 }
 
@@ -779,7 +780,7 @@ void destroy_file_tree(struct ubifs_info *c, struct rb_root *file_tree)
 		destroy_file_content(c, file);
 
 		rb_erase(&file->rb, file_tree);
-		kfree(file);
+		kmem_cache_free(FSCK(c)->file_slab, file);
 	}
 }
 
@@ -799,7 +800,7 @@ void destroy_file_list(struct ubifs_info *c, struct list_head *file_list)
 
 		destroy_file_content(c, file);
 		list_del(&file->list);
-		kfree(file);
+		kmem_cache_free(FSCK(c)->file_slab, file);
 	}
 }
 
@@ -877,7 +878,7 @@ static int delete_dent_nodes(struct ubifs_info *c, struct scanned_file *file,
 		}
 
 		rb_erase(&dent_node->rb, &file->dent_nodes);
-		kfree(dent_node);
+		kmem_cache_free(FSCK(c)->dent_slab, dent_node);
 	}
 
 	return ret;
@@ -910,7 +911,7 @@ int delete_file(struct ubifs_info *c, struct scanned_file *file)
 		}
 
 		rb_erase(&data_node->rb, &file->data_nodes);
-		kfree(data_node);
+		kmem_cache_free(FSCK(c)->data_slab, data_node);
 	}
 
 	err = delete_dent_nodes(c, file, err);
@@ -927,7 +928,7 @@ int delete_file(struct ubifs_info *c, struct scanned_file *file)
 		if (err)
 			ret = ret ? ret : err;
 		rb_erase(&xattr_file->rb, &file->xattr_files);
-		kfree(xattr_file);
+		kmem_cache_free(FSCK(c)->file_slab, xattr_file);
 	}
 
 	return ret;
@@ -1045,7 +1046,7 @@ int file_is_valid(struct ubifs_info *c, struct scanned_file *file,
 
 		list_del(&dent_node->list);
 		rb_erase(&dent_node->rb, &file->dent_nodes);
-		kfree(dent_node);
+		kmem_cache_free(FSCK(c)->dent_slab, dent_node);
 	}
 
 	if (type != UBIFS_ITYPE_DIR && !file->ino.is_xattr)
@@ -1068,7 +1069,7 @@ int file_is_valid(struct ubifs_info *c, struct scanned_file *file,
 		}
 
 		rb_erase(&dent_node->rb, &file->dent_nodes);
-		kfree(dent_node);
+		kmem_cache_free(FSCK(c)->dent_slab, dent_node);
 	}
 
 check_data_nodes:
@@ -1091,7 +1092,7 @@ check_data_nodes:
 		}
 
 		rb_erase(&data_node->rb, &file->data_nodes);
-		kfree(data_node);
+		kmem_cache_free(FSCK(c)->data_slab, data_node);
 	}
 
 check_dent_node:
@@ -1261,7 +1262,7 @@ retry:
 				 "<encrypted>" : dent_node->name, c->dev_name);
 			list_del(&dent_node->list);
 			rb_erase(&dent_node->rb, &dent_node->file->dent_nodes);
-			kfree(dent_node);
+			kmem_cache_free(FSCK(c)->dent_slab, dent_node);
 		}
 
 		/* Since dentry node is removed from rb-tree, rescan rb-tree. */
@@ -1455,7 +1456,7 @@ drop_data:
 		}
 		list_del(&data_node->list);
 		rb_erase(&data_node->rb, &file->data_nodes);
-		kfree(data_node);
+		kmem_cache_free(FSCK(c)->data_slab, data_node);
 	}
 
 	return 0;
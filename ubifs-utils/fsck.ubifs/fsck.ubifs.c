@@ -28,7 +28,7 @@ static struct ubifs_info *c = &info_;
 
 int exit_code = FSCK_OK;
 
-static const char *optstring = "Vrg:abyn";
+static const char *optstring = "Vrg:abynj:c:i:l:t:";
 
 static const struct option longopts[] = {
 	{"version",            0, NULL, 'V'},
@@ -38,6 +38,11 @@ static const struct option longopts[] = {
 	{"rebuild",            1, NULL, 'b'},
 	{"yes",                1, NULL, 'y'},
 	{"nochange",           1, NULL, 'n'},
+	{"jobs",               1, NULL, 'j'},
+	{"leb-cache",          1, NULL, 'c'},
+	{"incremental",        1, NULL, 'i'},
+	{"leb-budget",         1, NULL, 'l'},
+	{"time-budget",        1, NULL, 't'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -60,6 +65,14 @@ static const char *helptext =
 "-n, --nochange           Make no changes to the filesystem, only check filesystem.\n"
 "                         This mode don't check space, because unclean LEBs are not rewritten in readonly mode.\n"
 "                         Can not be specified at the same time as the -a or -y options\n"
+"-j, --jobs=NUM           Scan LEBs with NUM threads when rebuilding the filesystem, and read\n"
+"                         TNC leaf nodes with NUM threads in check mode (default: 1)\n"
+"-c, --leb-cache=SIZE     Keep up to SIZE bytes (KiB, MiB or GiB suffixes allowed) of LEBs read from the\n"
+"                         volume in memory, to read each LEB once (default: no cache)\n"
+"-i, --incremental=FILE   Only check a slice of the main area per run and save the progress in FILE,\n"
+"                         the next run continues where this one stopped. Depends on -n option\n"
+"-l, --leb-budget=NUM     Scan at most NUM LEBs per incremental run (default: no limit)\n"
+"-t, --time-budget=SECS   Stop an incremental run after about SECS seconds (default: no limit)\n"
 "Examples:\n"
 "\t1. Check and repair filesystem from UBI volume /dev/ubi0_0\n"
 "\t   fsck.ubifs /dev/ubi0_0\n"
@@ -68,7 +81,9 @@ static const char *helptext =
 "\t3. Check and safely repair filesystem from UBI volume /dev/ubi0_0\n"
 "\t   fsck.ubifs -a /dev/ubi0_0\n"
 "\t4. Check and forcedly repair filesystem from UBI volume /dev/ubi0_0\n"
-"\t   fsck.ubifs -y -b /dev/ubi0_0\n\n";
+"\t   fsck.ubifs -y -b /dev/ubi0_0\n"
+"\t5. Check at most 64 LEBs of UBI volume /dev/ubi0_0 per run, continuing from the last run\n"
+"\t   fsck.ubifs -n -i /var/lib/fsck.ubifs.state -l 64 /dev/ubi0_0\n\n";
 
 static inline void usage(void)
 {
@@ -77,7 +92,9 @@ static inline void usage(void)
 	exit(exit_code);
 }
 
-static void get_options(int argc, char *argv[], int *mode)
+static void get_options(int argc, char *argv[], int *mode, int *jobs,
+			long long *leb_cache_size, const char **incr_file,
+			int *incr_lebs, int *incr_secs)
 {
 	int opt, i, submode = 0;
 	char *endp;
@@ -120,6 +137,37 @@ conflict_opt:
 			*mode = CHECK_MODE;
 			c->ro_mount = 1;
 			break;
+		case 'j':
+			*jobs = strtol(optarg, &endp, 0);
+			if (*endp != '\0' || endp == optarg || *jobs <= 0) {
+				log_err(c, 0, "bad count of jobs '%s'", optarg);
+				usage();
+			}
+			break;
+		case 'c':
+			*leb_cache_size = util_get_bytes(optarg);
+			if (*leb_cache_size <= 0) {
+				log_err(c, 0, "bad LEB cache size '%s'", optarg);
+				usage();
+			}
+			break;
+		case 'i':
+			*incr_file = optarg;
+			break;
+		case 'l':
+			*incr_lebs = strtol(optarg, &endp, 0);
+			if (*endp != '\0' || endp == optarg || *incr_lebs <= 0) {
+				log_err(c, 0, "bad LEB budget '%s'", optarg);
+				usage();
+			}
+			break;
+		case 't':
+			*incr_secs = strtol(optarg, &endp, 0);
+			if (*endp != '\0' || endp == optarg || *incr_secs <= 0) {
+				log_err(c, 0, "bad time budget '%s'", optarg);
+				usage();
+			}
+			break;
 		case 'r':
 			/* Compatible with FSCK(8). */
 			break;
@@ -136,6 +184,15 @@ conflict_opt:
 			*mode = DANGER_MODE1;
 	}
 
+	if (*incr_file && *mode != CHECK_MODE) {
+		log_err(c, 0, "Option -n is not specified when -i is used");
+		usage();
+	}
+	if ((*incr_lebs || *incr_secs) && !*incr_file) {
+		log_err(c, 0, "Option -i is not specified when -l or -t is used");
+		usage();
+	}
+
 	if (optind != argc) {
 		c->dev_name = strdup(argv[optind]);
 		if (!c->dev_name) {
@@ -348,9 +405,57 @@ static void signal_cancel(int sig)
 	exit(exit_code);
 }
 
+/*
+ * Scanned nodes, files and znodes are the objects fsck allocates by millions
+ * on big filesystems, so they come from slab caches. The znode cache is
+ * created by 'ubifs_load_filesystem()' once the fanout is known.
+ */
+static int create_slabs(struct ubifs_info *c)
+{
+	c->snod_slab = kmem_cache_create("scan_node",
+					 sizeof(struct ubifs_scan_node), 0);
+	FSCK(c)->file_slab = kmem_cache_create("scanned_file",
+					       sizeof(struct scanned_file), 0);
+	FSCK(c)->ino_slab = kmem_cache_create("scanned_ino_node",
+					sizeof(struct scanned_ino_node), 0);
+	FSCK(c)->dent_slab = kmem_cache_create("scanned_dent_node",
+					sizeof(struct scanned_dent_node), 0);
+	FSCK(c)->data_slab = kmem_cache_create("scanned_data_node",
+					sizeof(struct scanned_data_node), 0);
+	if (!c->snod_slab || !FSCK(c)->file_slab || !FSCK(c)->ino_slab ||
+	    !FSCK(c)->dent_slab || !FSCK(c)->data_slab)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void destroy_slab(struct ubifs_info *c, struct kmem_cache **s)
+{
+	if (!*s)
+		return;
+
+	ubifs_msg(c, "slab %s: %zu bytes objects, %lu active, %lu peak, %llu allocated, %lu slabs (%zu bytes)",
+		  (*s)->name, (*s)->size, (*s)->active_objs, (*s)->peak_objs,
+		  (*s)->total_allocs, (*s)->nr_slabs, kmem_cache_bytes(*s));
+	kmem_cache_destroy(*s);
+	*s = NULL;
+}
+
+static void destroy_slabs(struct ubifs_info *c)
+{
+	destroy_slab(c, &c->znode_slab);
+	destroy_slab(c, &c->snod_slab);
+	destroy_slab(c, &FSCK(c)->file_slab);
+	destroy_slab(c, &FSCK(c)->ino_slab);
+	destroy_slab(c, &FSCK(c)->dent_slab);
+	destroy_slab(c, &FSCK(c)->data_slab);
+}
+
 static int init_fsck_info(struct ubifs_info *c, int argc, char *argv[])
 {
-	int err = 0, mode = NORMAL_MODE;
+	int err = 0, mode = NORMAL_MODE, jobs = 1, incr_lebs = 0, incr_secs = 0;
+	long long leb_cache_size = 0;
+	const char *incr_file = NULL;
 	struct sigaction sa;
 	struct ubifs_fsck_info *fsck = NULL;
 
@@ -360,7 +465,8 @@ static int init_fsck_info(struct ubifs_info *c, int argc, char *argv[])
 	}
 
 	init_ubifs_info(c, FSCK_PROGRAM_TYPE);
-	get_options(argc, argv, &mode);
+	get_options(argc, argv, &mode, &jobs, &leb_cache_size, &incr_file,
+		    &incr_lebs, &incr_secs);
 
 	fsck = calloc(1, sizeof(struct ubifs_fsck_info));
 	if (!fsck) {
@@ -371,6 +477,11 @@ static int init_fsck_info(struct ubifs_info *c, int argc, char *argv[])
 
 	c->private = fsck;
 	FSCK(c)->mode = mode;
+	FSCK(c)->jobs = jobs;
+	FSCK(c)->leb_cache_size = leb_cache_size;
+	FSCK(c)->incr_file = incr_file;
+	FSCK(c)->incr_lebs = incr_lebs;
+	FSCK(c)->incr_secs = incr_secs;
 	INIT_LIST_HEAD(&FSCK(c)->disconnected_files);
 	c->assert_failed_cb = fsck_assert_failed;
 	c->set_failure_reason_cb = fsck_set_failure_reason;
@@ -382,6 +493,12 @@ static int init_fsck_info(struct ubifs_info *c, int argc, char *argv[])
 	c->can_ignore_failure_cb = fsck_can_ignore_failure;
 	c->handle_failure_cb = fsck_handle_failure;
 
+	err = create_slabs(c);
+	if (err) {
+		log_err(c, errno, "can not create slab caches");
+		goto out_err;
+	}
+
 	memset(&sa, 0, sizeof(struct sigaction));
 	sa.sa_handler = signal_cancel;
 	if (sigaction(SIGINT, &sa, NULL) || sigaction(SIGTERM, &sa, NULL)) {
@@ -393,6 +510,8 @@ static int init_fsck_info(struct ubifs_info *c, int argc, char *argv[])
 	return 0;
 
 out_err:
+	if (fsck)
+		destroy_slabs(c);
 	free(fsck);
 	free(c->dev_name);
 	c->dev_name = NULL;
@@ -401,6 +520,7 @@ out_err:
 
 static void destroy_fsck_info(struct ubifs_info *c)
 {
+	destroy_slabs(c);
 	free(c->private);
 	c->private = NULL;
 	free(c->dev_name);
@@ -589,6 +709,15 @@ int main(int argc, char *argv[])
 		goto out_destroy_fsck;
 	}
 
+	if (FSCK(c)->leb_cache_size) {
+		err = ubifs_leb_cache_init(c, FSCK(c)->leb_cache_size);
+		if (err) {
+			exit_code |= FSCK_ERROR;
+			log_err(c, errno, "cannot allocate LEB cache");
+			goto out_close;
+		}
+	}
+
 	/*
 	 * Init: Read superblock
 	 * Step 1: Read master & init lpt
@@ -604,6 +733,15 @@ int main(int argc, char *argv[])
 		goto out_close;
 	}
 
+	if (FSCK(c)->incr_file) {
+		/* Check the next slice of the main area instead of steps 6-18. */
+		err = incremental_check(c);
+		if (err && !(exit_code & (FSCK_UNCORRECTED | FSCK_ERROR)))
+			exit_code |= FSCK_ERROR;
+		ubifs_destroy_filesystem(c);
+		goto out_close;
+	}
+
 	/*
 	 * Step 6: Traverse tnc and construct files
 	 * Step 7: Update files' size
@@ -628,6 +766,7 @@ int main(int argc, char *argv[])
 	}
 
 out_close:
+	ubifs_leb_cache_destroy(c);
 	ubifs_close_volume(c);
 out_destroy_fsck:
 	destroy_fsck_info(c);
@@ -46,7 +46,8 @@ enum { SB_CORRUPTED = 0, MST_CORRUPTED, LOG_CORRUPTED, BUD_CORRUPTED,
        FILE_ROOT_HAS_DENT, DENTRY_IS_UNREACHABLE, FILE_IS_INCONSISTENT,
        EMPTY_TNC, LPT_CORRUPTED, NNODE_INCORRECT, PNODE_INCORRECT,
        LP_INCORRECT, SPACE_STAT_INCORRECT, LTAB_INCORRECT, INCORRECT_IDX_SZ,
-       ROOT_DIR_NOT_FOUND, DISCONNECTED_FILE_CANNOT_BE_RECOVERED };
+       ROOT_DIR_NOT_FOUND, DISCONNECTED_FILE_CANNOT_BE_RECOVERED,
+       LEB_CORRUPTED };
 
 enum { HAS_DATA_CORRUPTED = 1, HAS_TNC_CORRUPTED = 2 };
 
@@ -278,6 +279,16 @@ struct ubifs_rebuild_info {
  * @try_rebuild: %true means that try to rebuild fs when fsck failed
  * @rebuild: rebuilding-related information
  * @lost_and_found: inode number of the lost+found directory, %0 means invalid
+ * @jobs: number of threads scanning LEBs when rebuilding the filesystem, or
+ *	  reading leaf nodes in check mode
+ * @leb_cache_size: memory budget of the LEB cache, %0 means no cache
+ * @file_slab: slab cache of &struct scanned_file objects
+ * @ino_slab: slab cache of &struct scanned_ino_node objects
+ * @dent_slab: slab cache of &struct scanned_dent_node objects
+ * @data_slab: slab cache of &struct scanned_data_node objects
+ * @incr_file: state file of the incremental check, %NULL means a full check
+ * @incr_lebs: maximum LEBs to scan per incremental run, %0 means no limit
+ * @incr_secs: maximum seconds to spend per incremental run, %0 means no limit
  */
 struct ubifs_fsck_info {
 	int mode;
@@ -290,6 +301,15 @@ struct ubifs_fsck_info {
 	bool try_rebuild;
 	struct ubifs_rebuild_info *rebuild;
 	ino_t lost_and_found;
+	int jobs;
+	long long leb_cache_size;
+	struct kmem_cache *file_slab;
+	struct kmem_cache *ino_slab;
+	struct kmem_cache *dent_slab;
+	struct kmem_cache *data_slab;
+	const char *incr_file;
+	int incr_lebs;
+	int incr_secs;
 };
 
 #define FSCK(c) ((struct ubifs_fsck_info*)c->private)
@@ -389,4 +409,7 @@ int check_and_correct_index_size(struct ubifs_info *c);
 int check_and_create_lost_found(struct ubifs_info *c);
 int handle_disonnected_files(struct ubifs_info *c);
 
+/* incremental.c */
+int incremental_check(struct ubifs_info *c);
+
 #endif
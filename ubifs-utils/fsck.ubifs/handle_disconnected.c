@@ -190,7 +190,7 @@ int handle_disonnected_files(struct ubifs_info *c)
 		if (err)
 			ret = ret ? ret : err;
 		destroy_file_content(c, file);
-		kfree(file);
+		kmem_cache_free(FSCK(c)->file_slab, file);
 	}
 
 	return ret;
@@ -0,0 +1,462 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Incremental checking: every run checks a bounded slice of the main area
+ * and records where the next run has to continue in a small state file, so
+ * that a big filesystem is fully checked over several boots.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "linux_err.h"
+#include "bitops.h"
+#include "ubifs.h"
+#include "defs.h"
+#include "debug.h"
+#include "key.h"
+#include "misc.h"
+#include "crc32.h"
+#include "fsck.ubifs.h"
+
+#define INCR_STATE_MAGIC	0x58494255 /* "UBIX" */
+#define INCR_STATE_VERSION	1
+
+/**
+ * struct incr_state - progress of the incremental check.
+ * @magic: %INCR_STATE_MAGIC
+ * @version: %INCR_STATE_VERSION
+ * @crc: CRC32 checksum of the fields following it
+ * @uuid: UUID of the filesystem the progress belongs to
+ * @leb_size: LEB size of the filesystem
+ * @main_lebs: count of LEBs in the main area
+ * @cursor: index of the next main area LEB to check
+ * @pass: count of completed passes over the main area
+ * @runs: count of runs in the current pass
+ * @checked_lebs: LEBs scanned in the current pass
+ * @skipped_lebs: empty and journal LEBs skipped in the current pass
+ * @checked_nodes: live nodes checked in the current pass
+ * @pass_start: time the current pass started
+ * @last_pass_end: time the last complete pass finished, %0 if there was none
+ *
+ * The state file is only read back on the machine which wrote it, so the
+ * fields are stored in host byte order.
+ */
+struct incr_state {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t crc;
+	uint8_t uuid[16];
+	uint32_t leb_size;
+	uint32_t main_lebs;
+	uint32_t cursor;
+	uint32_t pass;
+	uint32_t runs;
+	uint32_t checked_lebs;
+	uint32_t skipped_lebs;
+	uint64_t checked_nodes;
+	uint64_t pass_start;
+	uint64_t last_pass_end;
+};
+
+static struct incr_state state;
+static struct ubifs_info *incr_c;
+static bool state_saved = true;
+
+static uint32_t state_crc(const struct incr_state *st)
+{
+	size_t offs = offsetof(struct incr_state, uuid);
+
+	return crc32(UBIFS_CRC32_INIT, (const void *)st + offs,
+		     sizeof(struct incr_state) - offs);
+}
+
+static void reset_state(struct ubifs_info *c)
+{
+	memset(&state, 0, sizeof(struct incr_state));
+	state.magic = INCR_STATE_MAGIC;
+	state.version = INCR_STATE_VERSION;
+	memcpy(state.uuid, c->sup_node->uuid, sizeof(state.uuid));
+	state.leb_size = c->leb_size;
+	state.main_lebs = c->main_lebs;
+}
+
+/**
+ * read_state - read the progress of the previous runs.
+ * @c: UBIFS file-system description object
+ *
+ * A missing state file starts the first pass. A state file which is damaged
+ * or belongs to another filesystem is ignored, and checking starts over.
+ * Returns zero in case of success and a negative error code in case of
+ * failure.
+ */
+static int read_state(struct ubifs_info *c)
+{
+	const char *file = FSCK(c)->incr_file;
+	struct incr_state st;
+	ssize_t ret;
+	int fd;
+
+	reset_state(c);
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		log_err(c, errno, "cannot open state file %s", file);
+		return -errno;
+	}
+
+	ret = read(fd, &st, sizeof(struct incr_state));
+	close(fd);
+	if (ret < 0) {
+		log_err(c, errno, "cannot read state file %s", file);
+		return -errno;
+	}
+
+	if (ret != sizeof(struct incr_state) || st.magic != INCR_STATE_MAGIC ||
+	    st.version != INCR_STATE_VERSION || st.crc != state_crc(&st)) {
+		log_out(c, "Ignore bad state file %s, start over", file);
+		return 0;
+	}
+	if (memcmp(st.uuid, state.uuid, sizeof(state.uuid)) ||
+	    st.leb_size != state.leb_size || st.main_lebs != state.main_lebs ||
+	    st.cursor >= st.main_lebs) {
+		log_out(c, "State file %s does not match the filesystem, start over",
+			file);
+		return 0;
+	}
+
+	state = st;
+	return 0;
+}
+
+/**
+ * write_state - save the progress for the next run.
+ * @c: UBIFS file-system description object
+ *
+ * The state is written to a temporary file which then replaces the old one,
+ * so a power cut leaves either the old or the new progress behind. Returns
+ * zero in case of success and a negative error code in case of failure.
+ */
+static int write_state(struct ubifs_info *c)
+{
+	const char *file = FSCK(c)->incr_file;
+	char *tmp;
+	int fd, err = 0;
+
+	tmp = malloc(strlen(file) + 5);
+	if (!tmp)
+		return -ENOMEM;
+	sprintf(tmp, "%s.tmp", file);
+
+	state.crc = state_crc(&state);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		err = -errno;
+		log_err(c, errno, "cannot create %s", tmp);
+		goto out;
+	}
+	if (write(fd, &state, sizeof(struct incr_state)) !=
+	    sizeof(struct incr_state) || fsync(fd)) {
+		err = errno ? -errno : -EIO;
+		log_err(c, errno, "cannot write %s", tmp);
+		close(fd);
+		goto out_unlink;
+	}
+	close(fd);
+
+	if (rename(tmp, file)) {
+		err = -errno;
+		log_err(c, errno, "cannot rename %s to %s", tmp, file);
+		goto out_unlink;
+	}
+	state_saved = true;
+	goto out;
+
+out_unlink:
+	unlink(tmp);
+out:
+	free(tmp);
+	return err;
+}
+
+/*
+ * Problems found in check mode terminate fsck, and so do signals. The cursor
+ * still points to the LEB being checked then, so the next run starts with it
+ * again (after the filesystem has been repaired).
+ */
+static void save_state_on_exit(void)
+{
+	if (!state_saved && incr_c->private)
+		write_state(incr_c);
+}
+
+static int check_node(struct ubifs_info *c, int lnum,
+		      struct ubifs_scan_node *snod)
+{
+	switch (snod->type) {
+	case UBIFS_INO_NODE:
+	{
+		struct scanned_ino_node ino_node;
+
+		if (!parse_ino_node(c, lnum, snod->offs, snod->node,
+				    &snod->key, &ino_node)) {
+			fix_problem(c, INVALID_INO_NODE, NULL);
+			return -EINVAL;
+		}
+		break;
+	}
+	case UBIFS_DENT_NODE:
+	case UBIFS_XENT_NODE:
+	{
+		struct scanned_dent_node dent_node;
+
+		if (!parse_dent_node(c, lnum, snod->offs, snod->node,
+				     &snod->key, &dent_node)) {
+			fix_problem(c, INVALID_DENT_NODE, NULL);
+			return -EINVAL;
+		}
+		break;
+	}
+	case UBIFS_DATA_NODE:
+	{
+		struct scanned_data_node data_node;
+
+		if (!parse_data_node(c, lnum, snod->offs, snod->node,
+				     &snod->key, &data_node)) {
+			fix_problem(c, INVALID_DATA_NODE, NULL);
+			return -EINVAL;
+		}
+		break;
+	}
+	}
+
+	return 0;
+}
+
+/**
+ * check_leb - check one LEB of the main area.
+ * @c: UBIFS file-system description object
+ * @lnum: LEB number
+ *
+ * This function scans LEB @lnum, validates the nodes which are still
+ * referenced by the TNC and compares the space found in the LEB with its
+ * properties, like the full check does for the whole filesystem. Empty LEBs
+ * hold no data and journal LEBs are still being written, so they are skipped.
+ * Freeable LEBs are scanned, they must not hold any live node.
+ *
+ * Like in the full check, inconsistencies are reported by 'fix_problem()' and
+ * left uncorrected, other failures set %FSCK_ERROR. Returns %1 if the LEB was
+ * scanned, %0 if it was skipped and a negative error code in case of failure.
+ */
+static int check_leb(struct ubifs_info *c, int lnum)
+{
+	int err = 0, used = 0, idx_leb = -1, free, dirty;
+	struct ubifs_lprops lp, *lpt_lp;
+	struct ubifs_scan_leb *sleb;
+	struct ubifs_scan_node *snod;
+
+	lpt_lp = ubifs_lpt_lookup(c, lnum);
+	if (IS_ERR(lpt_lp)) {
+		if (test_and_clear_failure_reason_callback(c, FR_LPT_CORRUPTED))
+			fix_problem(c, LPT_CORRUPTED, NULL);
+		else
+			exit_code |= FSCK_ERROR;
+		return PTR_ERR(lpt_lp);
+	}
+	lp = *lpt_lp;
+
+	if (lp.free == c->leb_size || (lp.flags & LPROPS_TAKEN) ||
+	    ubifs_search_bud(c, lnum) ||
+	    (c->need_recovery && lnum == c->ihead_lnum))
+		return 0;
+
+	sleb = ubifs_scan(c, lnum, 0, c->sbuf, 0);
+	if (IS_ERR(sleb)) {
+		if (test_and_clear_failure_reason_callback(c, FR_DATA_CORRUPTED))
+			fix_problem(c, LEB_CORRUPTED, &lnum);
+		else
+			exit_code |= FSCK_ERROR;
+		return PTR_ERR(sleb);
+	}
+
+	list_for_each_entry(snod, &sleb->nodes, list) {
+		int found, level = 0;
+
+		if (idx_leb == -1)
+			idx_leb = (snod->type == UBIFS_IDX_NODE) ? 1 : 0;
+
+		if (idx_leb != (snod->type == UBIFS_IDX_NODE)) {
+			/* Index and non-index nodes never share a LEB. */
+			fix_problem(c, LEB_CORRUPTED, &lnum);
+			err = -EINVAL;
+			goto out;
+		}
+
+		if (snod->type == UBIFS_IDX_NODE) {
+			struct ubifs_idx_node *idx = snod->node;
+
+			key_read(c, ubifs_idx_key(c, idx), &snod->key);
+			level = le16_to_cpu(idx->level);
+		}
+
+		found = ubifs_tnc_has_node(c, &snod->key, level, lnum,
+					   snod->offs, idx_leb);
+		if (found < 0) {
+			err = found;
+			handle_error(c, HAS_TNC_CORRUPTED);
+			goto out;
+		}
+		if (!found)
+			continue;
+
+		used += ALIGN(snod->len, 8);
+		err = check_node(c, lnum, snod);
+		if (err)
+			goto out;
+		state.checked_nodes += 1;
+	}
+
+	/*
+	 * Unclean LEBs are not recovered in check mode, so the space of LEBs
+	 * can only be trusted on a cleanly unmounted filesystem.
+	 */
+	free = c->leb_size - sleb->endpt;
+	dirty = sleb->endpt - used;
+	if (!c->need_recovery &&
+	    (free != lp.free || dirty != lp.dirty ||
+	     (idx_leb == 1) != !!(lp.flags & LPROPS_INDEX))) {
+		struct lp_problem lpp = {
+			.lnum = lnum,
+			.lp = &lp,
+			.free = free,
+			.dirty = dirty,
+			.is_idx = idx_leb == 1,
+		};
+
+		fix_problem(c, LP_INCORRECT, &lpp);
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = 1;
+
+out:
+	ubifs_scan_destroy(sleb);
+	return err;
+}
+
+static bool time_is_up(const struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > deadline->tv_sec ||
+	       (now.tv_sec == deadline->tv_sec &&
+		now.tv_nsec >= deadline->tv_nsec);
+}
+
+/**
+ * incremental_check - check the next slice of the filesystem.
+ * @c: UBIFS file-system description object
+ *
+ * This function continues the current pass over the main area from the LEB
+ * recorded in the state file, until @FSCK(c)->incr_lebs LEBs have been
+ * scanned, @FSCK(c)->incr_secs seconds have passed or the pass is complete,
+ * and saves the progress. The time limit is checked before every LEB, so a
+ * run may exceed it by the time of one LEB scan. Inconsistencies are left
+ * uncorrected like in the full check mode and stop the run, so that the next
+ * run starts with the same LEB again. Returns zero in case of success and a
+ * negative error code in case of failure, the exit code is set accordingly.
+ */
+int incremental_check(struct ubifs_info *c)
+{
+	int err, lebs = 0, first;
+	struct timespec deadline;
+
+	ubifs_assert(c, FSCK(c)->mode == CHECK_MODE);
+
+	if (FSCK(c)->lpt_status) {
+		/* Same as 'check_and_correct_space()' in check mode. */
+		log_out(c, "Space statistics are inconsistent, skip incremental check");
+		exit_code |= FSCK_UNCORRECTED;
+		return 0;
+	}
+
+	err = read_state(c);
+	if (err) {
+		exit_code |= FSCK_ERROR;
+		return err;
+	}
+
+	incr_c = c;
+	if (atexit(save_state_on_exit)) {
+		log_err(c, errno, "can not set exit callback");
+		exit_code |= FSCK_ERROR;
+		return -errno;
+	}
+
+	if (!state.cursor && !state.runs)
+		state.pass_start = time(NULL);
+	state.runs += 1;
+	state_saved = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += FSCK(c)->incr_secs;
+
+	first = state.cursor;
+	log_out(c, "Incremental check of pass %u, run %u, from LEB %d",
+		state.pass + 1, state.runs, first + c->main_first);
+
+	while (state.cursor < state.main_lebs) {
+		if (FSCK(c)->incr_lebs && lebs >= FSCK(c)->incr_lebs)
+			break;
+		if (FSCK(c)->incr_secs && time_is_up(&deadline))
+			break;
+
+		err = check_leb(c, state.cursor + c->main_first);
+		if (err < 0) {
+			/* Save the progress up to this LEB */
+			if (write_state(c))
+				exit_code |= FSCK_ERROR;
+			return err;
+		}
+		if (err) {
+			lebs += 1;
+			state.checked_lebs += 1;
+		} else {
+			state.skipped_lebs += 1;
+		}
+		state.cursor += 1;
+	}
+
+	log_out(c, "Checked LEBs %d-%d, %d scanned",
+		first + c->main_first, state.cursor + c->main_first - 1, lebs);
+
+	if (state.cursor == state.main_lebs) {
+		log_out(c, "Pass %u complete in %u runs: %u LEBs scanned, %u skipped, %llu nodes checked",
+			state.pass + 1, state.runs, state.checked_lebs,
+			state.skipped_lebs,
+			(unsigned long long)state.checked_nodes);
+		state.pass += 1;
+		state.last_pass_end = time(NULL);
+		state.cursor = 0;
+		state.runs = 0;
+		state.checked_lebs = 0;
+		state.skipped_lebs = 0;
+		state.checked_nodes = 0;
+	} else {
+		log_out(c, "%u of %u main area LEBs done in pass %u",
+			state.cursor, state.main_lebs, state.pass + 1);
+	}
+
+	err = write_state(c);
+	if (err)
+		exit_code |= FSCK_ERROR;
+
+	return err;
+}
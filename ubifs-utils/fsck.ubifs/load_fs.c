@@ -83,6 +83,16 @@ int ubifs_load_filesystem(struct ubifs_info *c)
 		goto out_mounting;
 	}
 
+	if (!c->znode_slab) {
+		c->znode_slab = kmem_cache_create("znode", c->max_znode_sz, 0);
+		if (!c->znode_slab) {
+			err = -ENOMEM;
+			exit_code |= FSCK_ERROR;
+			log_err(c, errno, "cannot create znode slab cache");
+			goto out_mounting;
+		}
+	}
+
 	sz = ALIGN(c->max_idx_node_sz, c->min_io_size) * 2;
 	c->cbuf = kmalloc(sz, GFP_NOFS);
 	if (!c->cbuf) {
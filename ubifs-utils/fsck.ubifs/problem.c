@@ -70,6 +70,7 @@ static const struct fsck_problem problem_table[] = {
 	{PROBLEM_FIXABLE | PROBLEM_MUST_FIX, "Incorrect index size"},	// INCORRECT_IDX_SZ
 	{PROBLEM_FIXABLE | PROBLEM_MUST_FIX, "Root dir is lost"},	// ROOT_DIR_NOT_FOUND
 	{PROBLEM_FIXABLE | PROBLEM_DROP_DATA, "Disconnected file cannot be recovered"},	// DISCONNECTED_FILE_CANNOT_BE_RECOVERED
+	{PROBLEM_FIXABLE | PROBLEM_MUST_FIX | PROBLEM_DROP_DATA, "Corrupted main area LEB"},	// LEB_CORRUPTED
 };
 
 static const char *get_question(const struct fsck_problem *problem,
@@ -86,6 +87,7 @@ static const char *get_question(const struct fsck_problem *problem,
 	case INVALID_DENT_NODE:
 	case INVALID_DATA_NODE:
 	case SCAN_CORRUPTED:
+	case LEB_CORRUPTED:
 		return "Drop it?";
 	case ORPHAN_CORRUPTED:
 		return "Drop orphans on the LEB?";
@@ -129,6 +131,7 @@ static void print_problem(const struct ubifs_info *c,
 		break;
 	}
 	case ORPHAN_CORRUPTED:
+	case LEB_CORRUPTED:
 	{
 		const int *lnum = (const int *)priv;
 
@@ -18,8 +18,12 @@
 #include "debug.h"
 #include "key.h"
 #include "misc.h"
+#include "thread_pool.h"
 #include "fsck.ubifs.h"
 
+/* How many LEBs each scanning thread gets per batch */
+#define SCAN_LEBS_PER_JOB 4
+
 /**
  * scanned_info - nodes and files information from scanning.
  * @valid_inos: the tree of scanned inode nodes with 'nlink > 0'
@@ -158,7 +162,7 @@ static int insert_or_update_ino_node(struct ubifs_info *c,
 		return 0;
 	}
 
-	ino_node = kmalloc(sizeof(struct scanned_ino_node), GFP_KERNEL);
+	ino_node = kmem_cache_alloc(FSCK(c)->ino_slab, GFP_KERNEL);
 	if (!ino_node)
 		return -ENOMEM;
 
@@ -229,7 +233,7 @@ static int insert_or_update_dent_node(struct ubifs_info *c,
 		return 0;
 	}
 
-	dent_node = kmalloc(sizeof(struct scanned_dent_node), GFP_KERNEL);
+	dent_node = kmem_cache_alloc(FSCK(c)->dent_slab, GFP_KERNEL);
 	if (!dent_node)
 		return -ENOMEM;
 
@@ -339,7 +343,7 @@ static void destroy_scanned_info(struct ubifs_info *c, struct scanned_info *si)
 		this = rb_next(this);
 
 		rb_erase(&ino_node->rb, &si->valid_inos);
-		kfree(ino_node);
+		kmem_cache_free(FSCK(c)->ino_slab, ino_node);
 	}
 
 	this = rb_first(&si->del_inos);
@@ -348,7 +352,7 @@ static void destroy_scanned_info(struct ubifs_info *c, struct scanned_info *si)
 		this = rb_next(this);
 
 		rb_erase(&ino_node->rb, &si->del_inos);
-		kfree(ino_node);
+		kmem_cache_free(FSCK(c)->ino_slab, ino_node);
 	}
 
 	this = rb_first(&si->valid_dents);
@@ -357,7 +361,7 @@ static void destroy_scanned_info(struct ubifs_info *c, struct scanned_info *si)
 		this = rb_next(this);
 
 		rb_erase(&dent_node->rb, &si->valid_dents);
-		kfree(dent_node);
+		kmem_cache_free(FSCK(c)->dent_slab, dent_node);
 	}
 
 	this = rb_first(&si->del_dents);
@@ -366,8 +370,177 @@ static void destroy_scanned_info(struct ubifs_info *c, struct scanned_info *si)
 		this = rb_next(this);
 
 		rb_erase(&dent_node->rb, &si->del_dents);
-		kfree(dent_node);
+		kmem_cache_free(FSCK(c)->dent_slab, dent_node);
+	}
+}
+
+/**
+ * scan_leb - scan one LEB, recovering it if needed.
+ * @c: UBIFS file-system description object
+ * @lnum: logical eraseblock number
+ * @sleb: the scanning information is returned here
+ *
+ * This function scans LEB @lnum into @c->sbuf. Returns zero in case of
+ * success, a negative error code in case of failure. @sleb is set to %NULL
+ * if the LEB holds corrupted data and should be abandoned.
+ */
+static int scan_leb(struct ubifs_info *c, int lnum,
+		    struct ubifs_scan_leb **sleb)
+{
+	*sleb = ubifs_scan(c, lnum, 0, c->sbuf, 1);
+	if (!IS_ERR(*sleb))
+		return 0;
+	if (PTR_ERR(*sleb) != -EUCLEAN)
+		return PTR_ERR(*sleb);
+
+	*sleb = ubifs_recover_leb(c, lnum, 0, c->sbuf, -1);
+	if (!IS_ERR(*sleb))
+		return 0;
+	if (PTR_ERR(*sleb) != -EUCLEAN)
+		return PTR_ERR(*sleb);
+
+	/* This LEB holds corrupted data, abandon it. */
+	*sleb = NULL;
+	return 0;
+}
+
+/**
+ * process_scanned_leb - process the nodes of a scanned LEB.
+ * @c: UBIFS file-system description object
+ * @sleb: scanning information of the LEB
+ * @si: records nodes and files information during scanning
+ *
+ * Returns zero in case of success, a negative error code in case of failure.
+ */
+static int process_scanned_leb(struct ubifs_info *c,
+			       struct ubifs_scan_leb *sleb,
+			       struct scanned_info *si)
+{
+	int err;
+	struct ubifs_scan_node *snod;
+
+	list_for_each_entry(snod, &sleb->nodes, list) {
+		if (snod->sqnum > c->max_sqnum)
+			c->max_sqnum = snod->sqnum;
+
+		err = process_scanned_node(c, sleb->lnum, snod, si);
+		if (err < 0) {
+			log_err(c, 0, "process node failed at LEB %d, err %d",
+				sleb->lnum, err);
+			return err;
+		} else if (err == 1) {
+			break;
+		}
 	}
+
+	return 0;
+}
+
+/**
+ * struct scan_batch - a batch of LEBs scanned in parallel.
+ * @wc: copy of the file-system description object with messages disabled
+ * @first: the first LEB of the batch
+ * @bufs: scan buffers, one for each LEB of the batch
+ * @slebs: scanning information of each LEB, %NULL if it must be scanned
+ *	   again by 'scan_leb()'
+ */
+struct scan_batch {
+	struct ubifs_info *wc;
+	int first;
+	void **bufs;
+	struct ubifs_scan_leb **slebs;
+};
+
+static void scan_leb_worker(void *arg, int idx)
+{
+	struct scan_batch *b = arg;
+	struct ubifs_scan_leb *sleb;
+
+	sleb = ubifs_scan(b->wc, b->first + idx, 0, b->bufs[idx], 1);
+	b->slebs[idx] = IS_ERR(sleb) ? NULL : sleb;
+}
+
+/**
+ * scan_nodes_parallel - scan node information from flash with several threads.
+ * @c: UBIFS file-system description object
+ * @si: records nodes and files information during scanning
+ *
+ * Same as 'scan_nodes()', but LEBs are read and their nodes checked by a
+ * pool of threads, a batch of LEBs at a time. The workers do not print
+ * anything: LEBs which fail to scan cleanly are scanned and recovered again
+ * by 'scan_leb()', and all scanned nodes are processed in LEB order, so the
+ * messages and the result are the same as those of a serial scan.
+ */
+static int scan_nodes_parallel(struct ubifs_info *c, struct scanned_info *si)
+{
+	int i, n, lnum, cnt, err = 0, jobs = FSCK(c)->jobs;
+	struct thread_pool *pool;
+	struct scan_batch b;
+	struct ubifs_scan_leb *sleb;
+
+	cnt = jobs * SCAN_LEBS_PER_JOB;
+	b.wc = kmalloc(sizeof(struct ubifs_info), GFP_KERNEL);
+	b.bufs = kcalloc(cnt, sizeof(void *), GFP_KERNEL);
+	b.slebs = kcalloc(cnt, sizeof(struct ubifs_scan_leb *), GFP_KERNEL);
+	if (!b.wc || !b.bufs || !b.slebs) {
+		err = -ENOMEM;
+		log_err(c, errno, "can not allocate scan batch");
+		goto out_free;
+	}
+	for (i = 0; i < cnt; i++) {
+		b.bufs[i] = vmalloc(c->leb_size);
+		if (!b.bufs[i]) {
+			err = -ENOMEM;
+			log_err(c, errno, "can not allocate scan buffer");
+			goto out_free;
+		}
+	}
+	*b.wc = *c;
+	b.wc->debug_level = 0;
+
+	pool = thread_pool_create(jobs - 1, NULL, NULL);
+	if (!pool) {
+		err = -ENOMEM;
+		log_err(c, 0, "can not start scanning threads");
+		goto out_free;
+	}
+
+	for (lnum = c->main_first; lnum < c->leb_cnt; lnum += n) {
+		n = min(cnt, c->leb_cnt - lnum);
+		b.first = lnum;
+		thread_pool_run(pool, scan_leb_worker, &b, n);
+
+		for (i = 0; i < n; i++) {
+			sleb = b.slebs[i];
+			b.slebs[i] = NULL;
+			if (!sleb) {
+				err = scan_leb(c, lnum + i, &sleb);
+				if (err)
+					goto out_destroy;
+				if (!sleb)
+					continue;
+			}
+
+			err = process_scanned_leb(c, sleb, si);
+			ubifs_scan_destroy(sleb);
+			if (err)
+				goto out_destroy;
+		}
+	}
+
+out_destroy:
+	for (i = 0; i < cnt; i++)
+		if (b.slebs[i])
+			ubifs_scan_destroy(b.slebs[i]);
+	thread_pool_destroy(pool);
+out_free:
+	if (b.bufs)
+		for (i = 0; i < cnt; i++)
+			vfree(b.bufs[i]);
+	kfree(b.slebs);
+	kfree(b.bufs);
+	kfree(b.wc);
+	return err;
 }
 
 /**
@@ -383,46 +556,26 @@ static int scan_nodes(struct ubifs_info *c, struct scanned_info *si)
 {
 	int lnum, err = 0;
 	struct ubifs_scan_leb *sleb;
-	struct ubifs_scan_node *snod;
+
+	/* Debug messages of the scanning code cannot be kept in order */
+	if (FSCK(c)->jobs > 1 && c->debug_level < DEBUG_LEVEL)
+		return scan_nodes_parallel(c, si);
 
 	for (lnum = c->main_first; lnum < c->leb_cnt; ++lnum) {
 		dbg_fsck("scan nodes at LEB %d, in %s", lnum, c->dev_name);
 
-		sleb = ubifs_scan(c, lnum, 0, c->sbuf, 1);
-		if (IS_ERR(sleb)) {
-			if (PTR_ERR(sleb) != -EUCLEAN)
-				return PTR_ERR(sleb);
-
-			sleb = ubifs_recover_leb(c, lnum, 0, c->sbuf, -1);
-			if (IS_ERR(sleb)) {
-				if (PTR_ERR(sleb) != -EUCLEAN)
-					return PTR_ERR(sleb);
-
-				/* This LEB holds corrupted data, abandon it. */
-				continue;
-			}
-		}
-
-		list_for_each_entry(snod, &sleb->nodes, list) {
-			if (snod->sqnum > c->max_sqnum)
-				c->max_sqnum = snod->sqnum;
-
-			err = process_scanned_node(c, lnum, snod, si);
-			if (err < 0) {
-				log_err(c, 0, "process node failed at LEB %d, err %d",
-					lnum, err);
-				ubifs_scan_destroy(sleb);
-				goto out;
-			} else if (err == 1) {
-				err = 0;
-				break;
-			}
-		}
+		err = scan_leb(c, lnum, &sleb);
+		if (err)
+			return err;
+		if (!sleb)
+			continue;
 
+		err = process_scanned_leb(c, sleb, si);
 		ubifs_scan_destroy(sleb);
+		if (err)
+			break;
 	}
 
-out:
 	return err;
 }
 
@@ -529,11 +682,11 @@ static void remove_del_nodes(struct ubifs_info *c, struct scanned_info *si)
 		if (valid_ino_node) {
 			update_lpt(c, &del_ino_node->header, true);
 			rb_erase(&valid_ino_node->rb, &si->valid_inos);
-			kfree(valid_ino_node);
+			kmem_cache_free(FSCK(c)->ino_slab, valid_ino_node);
 		}
 
 		rb_erase(&del_ino_node->rb, &si->del_inos);
-		kfree(del_ino_node);
+		kmem_cache_free(FSCK(c)->ino_slab, del_ino_node);
 	}
 
 	this = rb_first(&si->del_dents);
@@ -545,11 +698,11 @@ static void remove_del_nodes(struct ubifs_info *c, struct scanned_info *si)
 		if (valid_dent_node) {
 			update_lpt(c, &del_dent_node->header, true);
 			rb_erase(&valid_dent_node->rb, &si->valid_dents);
-			kfree(valid_dent_node);
+			kmem_cache_free(FSCK(c)->dent_slab, valid_dent_node);
 		}
 
 		rb_erase(&del_dent_node->rb, &si->del_dents);
-		kfree(del_dent_node);
+		kmem_cache_free(FSCK(c)->dent_slab, del_dent_node);
 	}
 }
 
@@ -586,7 +739,7 @@ static int add_valid_nodes_into_file(struct ubifs_info *c,
 			return err;
 
 		rb_erase(&ino_node->rb, &si->valid_inos);
-		kfree(ino_node);
+		kmem_cache_free(FSCK(c)->ino_slab, ino_node);
 	}
 
 	this = rb_first(&si->valid_dents);
@@ -602,7 +755,7 @@ static int add_valid_nodes_into_file(struct ubifs_info *c,
 			return err;
 
 		rb_erase(&dent_node->rb, &si->valid_dents);
-		kfree(dent_node);
+		kmem_cache_free(FSCK(c)->dent_slab, dent_node);
 	}
 
 	return 0;
@@ -642,7 +795,7 @@ static void filter_invalid_files(struct ubifs_info *c)
 		rb_erase(&file->rb, tree);
 		if (!file_is_valid(c, file, tree, NULL)) {
 			destroy_file_content(c, file);
-			kfree(file);
+			kmem_cache_free(FSCK(c)->file_slab, file);
 		}
 	}
 
@@ -661,7 +814,7 @@ static void filter_invalid_files(struct ubifs_info *c)
 		list_del(&file->list);
 		destroy_file_content(c, file);
 		rb_erase(&file->rb, tree);
-		kfree(file);
+		kmem_cache_free(FSCK(c)->file_slab, file);
 	}
 }
 
@@ -701,7 +854,7 @@ static void extract_dentry_tree(struct ubifs_info *c)
 		list_del(&file->list);
 		destroy_file_content(c, file);
 		rb_erase(&file->rb, tree);
-		kfree(file);
+		kmem_cache_free(FSCK(c)->file_slab, file);
 	}
 }
 
@@ -847,7 +1000,7 @@ static int create_root(struct ubifs_info *c)
 	if (err)
 		goto out;
 
-	file = kzalloc(sizeof(struct scanned_file), GFP_KERNEL);
+	file = kmem_cache_zalloc(FSCK(c)->file_slab, GFP_KERNEL);
 	if (!file) {
 		err = -ENOMEM;
 		goto out;
@@ -252,7 +252,7 @@ static int sort_nodes(struct ubifs_info *c, struct ubifs_scan_leb *sleb,
 		    snod->type != UBIFS_XENT_NODE) {
 			/* Probably truncation node, zap it */
 			list_del(&snod->list);
-			kfree(snod);
+			ubifs_free_snod(sleb, snod);
 			continue;
 		}
 
@@ -269,7 +269,7 @@ static int sort_nodes(struct ubifs_info *c, struct ubifs_scan_leb *sleb,
 		if (!err) {
 			/* The node is obsolete, remove it from the list */
 			list_del(&snod->list);
-			kfree(snod);
+			ubifs_free_snod(sleb, snod);
 			continue;
 		}
 
@@ -318,7 +318,7 @@ static int move_node(struct ubifs_info *c, struct ubifs_scan_leb *sleb,
 				snod->offs, new_lnum, new_offs,
 				snod->len);
 	list_del(&snod->list);
-	kfree(snod);
+	ubifs_free_snod(sleb, snod);
 	return err;
 }
 
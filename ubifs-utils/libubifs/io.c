@@ -58,6 +58,8 @@
  * they are read from the flash media.
  */
 
+#include <sys/uio.h>
+
 #include "kmem.h"
 #include "crc32.h"
 #include "ubifs.h"
@@ -79,6 +81,248 @@ void ubifs_ro_mode(struct ubifs_info *c, int err)
 	}
 }
 
+/*
+ * The LEB cache keeps whole LEBs in memory, so that the many small reads of
+ * nodes scattered over the same LEBs done by the offline tools (e.g. TNC
+ * traversal in fsck.ubifs) cost one read of each LEB from the media. When
+ * LEBs are missed in sequence, as when scanning, several LEBs are read at
+ * once. Slots of LEBs being read are in neither list of the cache, so the
+ * lock does not have to be held during I/O and several threads may read
+ * through the cache.
+ */
+
+/* Maximum number of LEBs read ahead at once */
+#define LEB_CACHE_MAX_RA 8
+
+/**
+ * ubifs_leb_cache_init - set up the LEB cache.
+ * @c: UBIFS file-system description object
+ * @budget: how many bytes the cached LEBs may take
+ *
+ * This function has to be called after the UBI volume has been opened. It
+ * returns zero in case of success and a negative error code in case of
+ * failure.
+ */
+int ubifs_leb_cache_init(struct ubifs_info *c, long long budget)
+{
+	struct ubifs_leb_cache *lc;
+	int i;
+
+	ubifs_assert(c, c->libubi && !c->leb_cache);
+
+	lc = kzalloc(sizeof(struct ubifs_leb_cache), GFP_KERNEL);
+	if (!lc)
+		return -ENOMEM;
+
+	lc->leb_size = c->vi.leb_size;
+	lc->leb_cnt = c->vi.rsvd_lebs;
+	lc->nr = min_t(long long, budget / lc->leb_size, lc->leb_cnt);
+	if (lc->nr < 1)
+		lc->nr = 1;
+	lc->ra_lebs = min(lc->nr / 4, LEB_CACHE_MAX_RA);
+	if (lc->ra_lebs < 1)
+		lc->ra_lebs = 1;
+	lc->last_miss = -2;
+	spin_lock_init(&lc->lock);
+	INIT_LIST_HEAD(&lc->lru);
+	INIT_LIST_HEAD(&lc->free);
+
+	lc->slots = kcalloc(lc->nr, sizeof(struct ubifs_cached_leb),
+			    GFP_KERNEL);
+	lc->map = kcalloc(lc->leb_cnt, sizeof(struct ubifs_cached_leb *),
+			  GFP_KERNEL);
+	if (!lc->slots || !lc->map)
+		goto out_free;
+
+	for (i = 0; i < lc->nr; i++) {
+		lc->slots[i].buf = vmalloc(lc->leb_size);
+		if (!lc->slots[i].buf)
+			goto out_free;
+		lc->slots[i].lnum = -1;
+		list_add_tail(&lc->slots[i].list, &lc->free);
+	}
+
+	c->leb_cache = lc;
+	return 0;
+
+out_free:
+	if (lc->slots)
+		for (i = 0; i < lc->nr; i++)
+			vfree(lc->slots[i].buf);
+	kfree(lc->slots);
+	kfree(lc->map);
+	kfree(lc);
+	return -ENOMEM;
+}
+
+/**
+ * ubifs_leb_cache_destroy - free the LEB cache.
+ * @c: UBIFS file-system description object
+ *
+ * The statistics of the cache are printed at the info debug level.
+ */
+void ubifs_leb_cache_destroy(struct ubifs_info *c)
+{
+	struct ubifs_leb_cache *lc = c->leb_cache;
+	int i;
+
+	if (!lc)
+		return;
+
+	ubifs_msg(c, "LEB cache: %d LEBs, %llu hits, %llu misses (%llu%% hit rate), %llu LEBs read ahead (%llu used)",
+		  lc->nr, lc->hits, lc->misses,
+		  lc->hits * 100 / (lc->hits + lc->misses ? : 1),
+		  lc->ra_read, lc->ra_hits);
+	ubifs_msg(c, "LEB cache: %llu reads, %llu bytes read from the media",
+		  lc->dev_reads, lc->dev_bytes);
+
+	for (i = 0; i < lc->nr; i++)
+		vfree(lc->slots[i].buf);
+	kfree(lc->slots);
+	kfree(lc->map);
+	kfree(lc);
+	c->leb_cache = NULL;
+}
+
+/*
+ * Take a slot to read a LEB into: a free one, or else the least recently used
+ * one. Returns %NULL if all the slots are being read into by other threads.
+ * Must be called with @lc->lock held.
+ */
+static struct ubifs_cached_leb *get_slot(struct ubifs_leb_cache *lc)
+{
+	struct ubifs_cached_leb *slot;
+
+	if (!list_empty(&lc->free))
+		slot = list_first_entry(&lc->free, struct ubifs_cached_leb,
+					list);
+	else if (!list_empty(&lc->lru)) {
+		slot = list_last_entry(&lc->lru, struct ubifs_cached_leb, list);
+		lc->map[slot->lnum] = NULL;
+	} else
+		return NULL;
+
+	list_del(&slot->list);
+	return slot;
+}
+
+/* Must be called with @lc->lock held */
+static void put_slot(struct ubifs_leb_cache *lc, struct ubifs_cached_leb *slot)
+{
+	slot->lnum = -1;
+	list_add(&slot->list, &lc->free);
+}
+
+/*
+ * Read @len bytes at offset @offs of LEB @lnum through the LEB cache. Returns
+ * zero if @buf has been filled, and %-1 if the LEB could not be read as a
+ * whole, in which case the caller reads @buf directly from the media.
+ */
+static int leb_cache_read(const struct ubifs_info *c, int lnum, void *buf,
+			  int offs, int len)
+{
+	struct ubifs_leb_cache *lc = c->leb_cache;
+	struct ubifs_cached_leb *slot, *slots[LEB_CACHE_MAX_RA];
+	struct iovec iov[LEB_CACHE_MAX_RA];
+	unsigned long long gen;
+	int i, n = 1, got;
+	ssize_t ret;
+
+	if (lnum < 0 || lnum >= lc->leb_cnt || offs + len > lc->leb_size)
+		return -1;
+
+	spin_lock(&lc->lock);
+	slot = lc->map[lnum];
+	if (slot) {
+		list_move(&slot->list, &lc->lru);
+		lc->hits += 1;
+		if (slot->ra) {
+			lc->ra_hits += 1;
+			slot->ra = 0;
+		}
+		memcpy(buf, slot->buf + offs, len);
+		spin_unlock(&lc->lock);
+		return 0;
+	}
+
+	lc->misses += 1;
+	if (lnum == lc->last_miss + 1)
+		n = lc->ra_lebs;
+	lc->last_miss = lnum;
+
+	for (i = 0; i < n && lnum + i < lc->leb_cnt; i++) {
+		if (i && lc->map[lnum + i])
+			break;
+		slot = get_slot(lc);
+		if (!slot)
+			break;
+		slot->lnum = lnum + i;
+		slots[i] = slot;
+		iov[i].iov_base = slot->buf;
+		iov[i].iov_len = lc->leb_size;
+	}
+	n = i;
+	gen = lc->gen;
+	spin_unlock(&lc->lock);
+	if (!n)
+		return -1;
+
+	ret = preadv(c->dev_fd, iov, n, (off_t)lnum * lc->leb_size);
+	got = ret > 0 ? ret / lc->leb_size : 0;
+
+	spin_lock(&lc->lock);
+	lc->dev_reads += 1;
+	lc->dev_bytes += ret > 0 ? ret : 0;
+	for (i = n - 1; i >= 0; i--) {
+		slot = slots[i];
+		if (i >= got || gen != lc->gen || lc->map[slot->lnum]) {
+			put_slot(lc, slot);
+			continue;
+		}
+
+		slot->ra = i > 0;
+		if (slot->ra)
+			lc->ra_read += 1;
+		lc->map[slot->lnum] = slot;
+		list_add(&slot->list, &lc->lru);
+	}
+
+	slot = lc->map[lnum];
+	if (slot)
+		memcpy(buf, slot->buf + offs, len);
+	spin_unlock(&lc->lock);
+
+	return slot ? 0 : -1;
+}
+
+/*
+ * Make the cached copy of LEB @lnum match the @len bytes at offset @offs
+ * just written from @buf, or drop it if @buf is %NULL.
+ */
+static void leb_cache_update(const struct ubifs_info *c, int lnum,
+			     const void *buf, int offs, int len)
+{
+	struct ubifs_leb_cache *lc = c->leb_cache;
+	struct ubifs_cached_leb *slot;
+
+	if (!lc || lnum < 0 || lnum >= lc->leb_cnt)
+		return;
+
+	spin_lock(&lc->lock);
+	lc->gen += 1;
+	slot = lc->map[lnum];
+	if (slot) {
+		if (buf) {
+			memcpy(slot->buf + offs, buf, len);
+		} else {
+			lc->map[lnum] = NULL;
+			list_del(&slot->list);
+			put_slot(lc, slot);
+		}
+	}
+	spin_unlock(&lc->lock);
+}
+
 /*
  * Below are simple wrappers over UBI I/O functions which include some
  * additional checks and UBIFS debugging stuff. See corresponding UBI function
@@ -94,20 +338,19 @@ int ubifs_leb_read(const struct ubifs_info *c, int lnum, void *buf, int offs,
 	if (!len)
 		return 0;
 
+	if (c->leb_cache && !leb_cache_read(c, lnum, buf, offs, len))
+		return 0;
+
 	/*
 	 * The %-EBADMSG may be ignored in some case, the buf may not be filled
 	 * with data in some buggy mtd drivers. So we'd better to reset the buf
 	 * content before reading.
 	 */
 	memset(buf, 0, len);
-	if (lseek(c->dev_fd, pos, SEEK_SET) != pos) {
+	/* Use pread() so that several threads may read LEBs concurrently */
+	if (pread(c->dev_fd, buf, len, pos) != len)
 		err = -errno;
-		goto out;
-	}
 
-	if (read(c->dev_fd, buf, len) != len)
-		err = -errno;
-out:
 	/*
 	 * In case of %-EBADMSG print the error message only if the
 	 * @even_ebadmsg is true.
@@ -144,6 +387,7 @@ int ubifs_leb_write(struct ubifs_info *c, int lnum, const void *buf, int offs,
 	if (write(c->dev_fd, buf, len) != len)
 		err = -errno;
 out:
+	leb_cache_update(c, lnum, err ? NULL : buf, offs, len);
 	if (err) {
 		ubifs_err(c, "writing %d bytes to LEB %d:%d failed, error %d",
 			  len, lnum, offs, err);
@@ -161,6 +405,7 @@ int ubifs_leb_change(struct ubifs_info *c, int lnum, const void *buf, int len)
 	ubifs_assert(c, !c->ro_media && !c->ro_mount);
 	if (c->ro_error)
 		return -EROFS;
+	leb_cache_update(c, lnum, NULL, 0, 0);
 	if (c->libubi) {
 		err = ubi_leb_change_start(c->libubi, c->dev_fd, lnum, len);
 		if (err) {
@@ -177,7 +422,10 @@ int ubifs_leb_change(struct ubifs_info *c, int lnum, const void *buf, int len)
 		err = -errno;
 		goto out;
 	}
-	if (write(c->dev_fd, buf, len) != len)
+	if (!c->libubi && c->sparse_image) {
+		if (util_write_sparse(c->dev_fd, buf, len))
+			err = -errno;
+	} else if (write(c->dev_fd, buf, len) != len)
 		err = -errno;
 out:
 	if (err) {
@@ -198,6 +446,7 @@ int ubifs_leb_unmap(struct ubifs_info *c, int lnum)
 		return -EROFS;
 	if (!c->libubi)
 		return -ENODEV;
+	leb_cache_update(c, lnum, NULL, 0, 0);
 	if (ubi_leb_unmap(c->dev_fd, lnum))
 		err = -errno;
 	if (err) {
@@ -217,6 +466,7 @@ int ubifs_leb_map(struct ubifs_info *c, int lnum)
 		return -EROFS;
 	if (!c->libubi)
 		return -ENODEV;
+	leb_cache_update(c, lnum, NULL, 0, 0);
 	if (ubi_leb_map(c->dev_fd, lnum))
 		err = -errno;
 	if (err) {
@@ -560,7 +560,7 @@ static void drop_last_group(struct ubifs_scan_leb *sleb, int *offs)
 			  sleb->lnum, snod->offs);
 		*offs = snod->offs;
 		list_del(&snod->list);
-		kfree(snod);
+		ubifs_free_snod(sleb, snod);
 		sleb->nodes_cnt -= 1;
 	}
 }
@@ -585,7 +585,7 @@ static void drop_last_node(struct ubifs_scan_leb *sleb, int *offs)
 			  sleb->lnum, snod->offs);
 		*offs = snod->offs;
 		list_del(&snod->list);
-		kfree(snod);
+		ubifs_free_snod(sleb, snod);
 		sleb->nodes_cnt -= 1;
 	}
 }
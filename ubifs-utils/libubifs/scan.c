@@ -142,6 +142,7 @@ struct ubifs_scan_leb *ubifs_start_scan(const struct ubifs_info *c, int lnum,
 	sleb->lnum = lnum;
 	INIT_LIST_HEAD(&sleb->nodes);
 	sleb->buf = sbuf;
+	sleb->snod_slab = c->snod_slab;
 
 	err = ubifs_leb_read(c, lnum, sbuf + offs, offs, c->leb_size - offs, 0);
 	if (err && err != -EBADMSG) {
@@ -190,7 +191,10 @@ int ubifs_add_snod(const struct ubifs_info *c, struct ubifs_scan_leb *sleb,
 	struct ubifs_ino_node *ino = buf;
 	struct ubifs_scan_node *snod;
 
-	snod = kmalloc(sizeof(struct ubifs_scan_node), GFP_NOFS);
+	if (sleb->snod_slab)
+		snod = kmem_cache_alloc(sleb->snod_slab, GFP_NOFS);
+	else
+		snod = kmalloc(sizeof(struct ubifs_scan_node), GFP_NOFS);
 	if (!snod)
 		return -ENOMEM;
 
@@ -366,7 +370,22 @@ void ubifs_scan_destroy(struct ubifs_scan_leb *sleb)
 	while (!list_empty(head)) {
 		node = list_entry(head->next, struct ubifs_scan_node, list);
 		list_del(&node->list);
-		kfree(node);
+		ubifs_free_snod(sleb, node);
 	}
 	kfree(sleb);
 }
+
+/**
+ * ubifs_free_snod - free a scanned node.
+ * @sleb: scanning information @snod belongs to
+ * @snod: scanned node to free
+ *
+ * The caller has to remove @snod from @sleb->nodes first.
+ */
+void ubifs_free_snod(struct ubifs_scan_leb *sleb, struct ubifs_scan_node *snod)
+{
+	if (sleb->snod_slab)
+		kmem_cache_free(sleb->snod_slab, snod);
+	else
+		kfree(snod);
+}
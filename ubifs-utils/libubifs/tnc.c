@@ -205,10 +205,11 @@ static struct ubifs_znode *copy_znode(struct ubifs_info *c,
 {
 	struct ubifs_znode *zn;
 
-	zn = kmemdup(znode, c->max_znode_sz, GFP_NOFS);
+	zn = ubifs_alloc_znode(c);
 	if (unlikely(!zn))
 		return ERR_PTR(-ENOMEM);
 
+	memcpy(zn, znode, c->max_znode_sz);
 	zn->cnext = NULL;
 	__set_bit(DIRTY_ZNODE, &zn->flags);
 	__clear_bit(COW_ZNODE, &zn->flags);
@@ -322,7 +323,7 @@ static struct ubifs_znode *dirty_cow_znode(struct ubifs_info *c,
 	return zn;
 
 out:
-	kfree(zn);
+	ubifs_free_znode(c, zn);
 	return ERR_PTR(err);
 }
 
@@ -1700,7 +1701,7 @@ again:
 		 */
 		ins_clr_old_idx_znode(c, znode);
 
-	zn = kzalloc(c->max_znode_sz, GFP_NOFS);
+	zn = ubifs_alloc_znode(c);
 	if (!zn)
 		return -ENOMEM;
 	zn->parent = zp;
@@ -1811,7 +1812,7 @@ do_split:
 	/* We have to split root znode */
 	dbg_tnc("creating new zroot at level %d", znode->level + 1);
 
-	zi = kzalloc(c->max_znode_sz, GFP_NOFS);
+	zi = ubifs_alloc_znode(c);
 	if (!zi)
 		return -ENOMEM;
 
@@ -2139,7 +2140,7 @@ static int tnc_delete(struct ubifs_info *c, struct ubifs_znode *znode, int n)
 			atomic_long_inc(&c->clean_zn_cnt);
 			atomic_long_inc(&ubifs_clean_zn_cnt);
 		} else
-			kfree(znode);
+			ubifs_free_znode(c, znode);
 		znode = zp;
 	} while (znode->child_cnt == 1); /* while removing last child */
 
@@ -2648,7 +2649,7 @@ static void tnc_destroy_cnext(struct ubifs_info *c)
 
 		cnext = cnext->cnext;
 		if (ubifs_zn_obsolete(znode))
-			kfree(znode);
+			ubifs_free_znode(c, znode);
 		else if (!ubifs_zn_cow(znode)) {
 			/*
 			 * Don't forget to update clean znode count after
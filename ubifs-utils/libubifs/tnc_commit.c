@@ -1044,7 +1044,7 @@ static void free_obsolete_znodes(struct ubifs_info *c)
 		znode = cnext;
 		cnext = znode->cnext;
 		if (ubifs_zn_obsolete(znode))
-			kfree(znode);
+			ubifs_free_znode(c, znode);
 		else {
 			znode->cnext = NULL;
 			atomic_long_inc(&c->clean_zn_cnt);
@@ -133,6 +133,35 @@ struct ubifs_znode *ubifs_tnc_postorder_next(const struct ubifs_info *c,
 	return ubifs_tnc_postorder_first(zn);
 }
 
+/**
+ * ubifs_alloc_znode - allocate a zeroed znode.
+ * @c: UBIFS file-system description object
+ *
+ * Znodes come from @c->znode_slab if the user of the library has set it up,
+ * and from the heap otherwise. Returns the znode or %NULL if there is no
+ * memory.
+ */
+struct ubifs_znode *ubifs_alloc_znode(const struct ubifs_info *c)
+{
+	if (c->znode_slab)
+		return kmem_cache_zalloc(c->znode_slab, GFP_NOFS);
+
+	return kzalloc(c->max_znode_sz, GFP_NOFS);
+}
+
+/**
+ * ubifs_free_znode - free a znode allocated by 'ubifs_alloc_znode()'.
+ * @c: UBIFS file-system description object
+ * @znode: znode to free
+ */
+void ubifs_free_znode(const struct ubifs_info *c, struct ubifs_znode *znode)
+{
+	if (c->znode_slab)
+		kmem_cache_free(c->znode_slab, znode);
+	else
+		kfree(znode);
+}
+
 /**
  * ubifs_destroy_tnc_subtree - destroy all znodes connected to a subtree.
  * @c: UBIFS file-system description object
@@ -159,13 +188,13 @@ long ubifs_destroy_tnc_subtree(const struct ubifs_info *c,
 				clean_freed += 1;
 
 			cond_resched();
-			kfree(zn->zbranch[n].znode);
+			ubifs_free_znode(c, zn->zbranch[n].znode);
 		}
 
 		if (zn == znode) {
 			if (!ubifs_zn_dirty(zn))
 				clean_freed += 1;
-			kfree(zn);
+			ubifs_free_znode(c, zn);
 			return clean_freed;
 		}
 
@@ -364,10 +393,11 @@ struct ubifs_znode *ubifs_load_znode(struct ubifs_info *c,
 
 	ubifs_assert(c, !zbr->znode);
 	/*
-	 * A slab cache is not presently used for znodes because the znode size
-	 * depends on the fanout which is stored in the superblock.
+	 * The znode size depends on the fanout which is stored in the
+	 * superblock, so the slab cache, if any, is set up by the user of the
+	 * library once the superblock has been read.
 	 */
-	znode = kzalloc(c->max_znode_sz, GFP_NOFS);
+	znode = ubifs_alloc_znode(c);
 	if (!znode)
 		return ERR_PTR(-ENOMEM);
 
@@ -393,7 +423,7 @@ struct ubifs_znode *ubifs_load_znode(struct ubifs_info *c,
 	return znode;
 
 out:
-	kfree(znode);
+	ubifs_free_znode(c, znode);
 	return ERR_PTR(err);
 }
 
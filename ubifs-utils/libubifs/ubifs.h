@@ -236,6 +236,8 @@ struct ubifs_scan_node {
  * @nodes: list of struct ubifs_scan_node
  * @endpt: end point (and therefore the start of empty space)
  * @buf: buffer containing entire LEB scanned
+ * @snod_slab: slab cache the nodes of @nodes come from, %NULL if they were
+ *             allocated with kmalloc()
  */
 struct ubifs_scan_leb {
 	int lnum;
@@ -243,6 +245,7 @@ struct ubifs_scan_leb {
 	struct list_head nodes;
 	int endpt;
 	void *buf;
+	struct kmem_cache *snod_slab;
 };
 
 /**
@@ -548,6 +551,63 @@ typedef int (*ubifs_lpt_scan_callback)(struct ubifs_info *c,
 				       const struct ubifs_lprops *lprops,
 				       int in_tree, void *data);
 
+/**
+ * struct ubifs_cached_leb - a LEB held in the LEB cache.
+ * @list: link in the LRU list or in the list of free slots of the cache
+ * @lnum: number of the cached LEB, %-1 if the slot is not in use
+ * @ra: the LEB was read ahead and has not been used yet
+ * @buf: contents of the LEB
+ */
+struct ubifs_cached_leb {
+	struct list_head list;
+	int lnum;
+	int ra;
+	void *buf;
+};
+
+/**
+ * struct ubifs_leb_cache - LRU cache of whole LEBs below 'ubifs_leb_read()'.
+ * @lock: protects all the fields of the cache
+ * @leb_size: LEB size
+ * @leb_cnt: number of LEBs of the volume
+ * @nr: number of slots
+ * @slots: the slots, each holding one LEB
+ * @map: slot holding each LEB of the volume, %NULL if the LEB is not cached
+ * @lru: cached LEBs, the most recently used first
+ * @free: slots not in use
+ * @ra_lebs: how many LEBs are read at once when LEBs are read sequentially
+ * @last_miss: number of the LEB of the last cache miss
+ * @gen: incremented every time a LEB is changed on the media, so that LEBs
+ *       read concurrently are not published if they might be stale
+ *
+ * @hits: reads served from the cache
+ * @misses: reads which had to go to the media
+ * @ra_read: LEBs read ahead
+ * @ra_hits: LEBs read ahead which were used before being evicted
+ * @dev_reads: read requests sent to the media
+ * @dev_bytes: bytes read from the media
+ */
+struct ubifs_leb_cache {
+	spinlock_t lock;
+	int leb_size;
+	int leb_cnt;
+	int nr;
+	struct ubifs_cached_leb *slots;
+	struct ubifs_cached_leb **map;
+	struct list_head lru;
+	struct list_head free;
+	int ra_lebs;
+	int last_miss;
+	unsigned long long gen;
+
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long ra_read;
+	unsigned long long ra_hits;
+	unsigned long long dev_reads;
+	unsigned long long dev_bytes;
+};
+
 /**
  * struct ubifs_wbuf - UBIFS write-buffer.
  * @c: UBIFS file-system description object
@@ -841,6 +901,8 @@ struct ubifs_budg_info {
  * @dev_name: device name
  * @dev_fd: opening handler for an UBI volume or an image file
  * @libubi: opening handler for libubi
+ * @sparse_image: leave holes instead of erased (0xFF) blocks when writing to
+ *                an image file
  *
  * @lhead_lnum: log head logical eraseblock number
  * @lhead_offs: log head offset
@@ -1061,6 +1123,11 @@ struct ubifs_budg_info {
  * @new_ihead_lnum: used by debugging to check @c->ihead_lnum
  * @new_ihead_offs: used by debugging to check @c->ihead_offs
  *
+ * @znode_slab: slab cache to allocate znodes from, %NULL to use kmalloc()
+ * @snod_slab: slab cache to allocate scanned nodes from, %NULL to use
+ *             kmalloc()
+ * @leb_cache: cache of LEBs read from the volume, %NULL if not used
+ *
  * @private: private information related to specific situation, eg. fsck.
  * @assert_failed_cb: callback function to handle assertion failure
  * @set_failure_reason_cb: record reasons while certain failure happens
@@ -1094,6 +1161,7 @@ struct ubifs_info {
 	char *dev_name;
 	int dev_fd;
 	libubi_t libubi;
+	int sparse_image;
 
 	int lhead_lnum;
 	int lhead_offs;
@@ -1300,6 +1368,10 @@ struct ubifs_info {
 	int new_ihead_lnum;
 	int new_ihead_offs;
 
+	struct kmem_cache *znode_slab;
+	struct kmem_cache *snod_slab;
+	struct ubifs_leb_cache *leb_cache;
+
 	void *private;
 	void (*assert_failed_cb)(const struct ubifs_info *c);
 	void (*set_failure_reason_cb)(const struct ubifs_info *c,
@@ -1542,6 +1614,8 @@ int ubifs_leb_write(struct ubifs_info *c, int lnum, const void *buf, int offs,
 int ubifs_leb_change(struct ubifs_info *c, int lnum, const void *buf, int len);
 int ubifs_leb_unmap(struct ubifs_info *c, int lnum);
 int ubifs_leb_map(struct ubifs_info *c, int lnum);
+int ubifs_leb_cache_init(struct ubifs_info *c, long long budget);
+void ubifs_leb_cache_destroy(struct ubifs_info *c);
 int ubifs_is_mapped(const struct ubifs_info *c, int lnum);
 int ubifs_wbuf_write_nolock(struct ubifs_wbuf *wbuf, void *buf, int len);
 int ubifs_wbuf_seek_nolock(struct ubifs_wbuf *wbuf, int lnum, int offs);
@@ -1570,6 +1644,7 @@ int ubifs_wbuf_sync_nolock(struct ubifs_wbuf *wbuf);
 struct ubifs_scan_leb *ubifs_scan(const struct ubifs_info *c, int lnum,
 				  int offs, void *sbuf, int quiet);
 void ubifs_scan_destroy(struct ubifs_scan_leb *sleb);
+void ubifs_free_snod(struct ubifs_scan_leb *sleb, struct ubifs_scan_node *snod);
 int ubifs_scan_a_node(const struct ubifs_info *c, void *buf, int len, int lnum,
 		      int offs, int quiet);
 struct ubifs_scan_leb *ubifs_start_scan(const struct ubifs_info *c, int lnum,
@@ -1729,6 +1804,8 @@ int is_idx_node_in_tnc(struct ubifs_info *c, union ubifs_key *key, int level,
 int insert_old_idx_znode(struct ubifs_info *c, struct ubifs_znode *znode);
 
 /* tnc_misc.c */
+struct ubifs_znode *ubifs_alloc_znode(const struct ubifs_info *c);
+void ubifs_free_znode(const struct ubifs_info *c, struct ubifs_znode *znode);
 int ubifs_search_zbranch(const struct ubifs_info *c,
 			 const struct ubifs_znode *znode,
 			 const union ubifs_key *key, int *n);
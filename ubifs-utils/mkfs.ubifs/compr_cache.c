@@ -0,0 +1,507 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Content-addressed cache of compressed data node payloads for mkfs.ubifs.
+ *
+ * Incremental image builds mostly re-compress the very same blocks. The cache
+ * remembers the result of 'compress_data()' for a block in a file, keyed by
+ * the SHA-256 digest of the raw block data and the requested compressor. The
+ * cached payload is the one before encryption, so it does not depend on the
+ * encryption context and may be shared by encrypted and plain images.
+ *
+ * The cache file consists of a header followed by records. The header
+ * identifies the compressor libraries and the compression settings; the
+ * cache is discarded if they do not match the current ones, because another
+ * compressor version may produce different output and the image would not be
+ * reproducible any more. Each record is a 'struct compr_cache_rec' followed
+ * by @len bytes of compressed data. New records are appended at the end.
+ * When the cache is opened, the records are verified by their CRC, and the
+ * cache is truncated at the first bad record (e.g. a record torn by an
+ * interrupted run). Records are verified again before use, so a cache which
+ * gets corrupted later only results in misses.
+ */
+
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#ifdef WITH_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_ZLIB
+#define crc32 __zlib_crc32
+#include <zlib.h>
+#undef crc32
+#endif
+
+#include "compiler_attributes.h"
+#include "linux_types.h"
+#include "defs.h"
+#include "ubifs.h"
+#include "compr.h"
+#include "crc32.h"
+#include "hashtable/hashtable.h"
+#include "compr_cache.h"
+
+#define COMPR_CACHE_MAGIC	0x43434655 /* "UFCC" */
+#define COMPR_CACHE_VERSION	1
+#define COMPR_CACHE_IDENT_LEN	120
+#define COMPR_CACHE_DIGEST_LEN	32
+
+/**
+ * struct compr_cache_hdr - cache file header.
+ * @magic: %COMPR_CACHE_MAGIC
+ * @version: %COMPR_CACHE_VERSION
+ * @ident: compressor libraries and settings the cache was built with
+ */
+struct compr_cache_hdr {
+	__le32 magic;
+	__le32 version;
+	char ident[COMPR_CACHE_IDENT_LEN];
+} __packed;
+
+/**
+ * struct compr_cache_rec - cache record header.
+ * @crc: CRC32 of the rest of the record header and of the data
+ * @compr_type: compressor type 'compress_data()' returned
+ * @len: length of the compressed data following the header, zero for
+ *       uncompressed data, which is taken from the input block instead
+ * @in_len: length of the input block
+ * @digest: digest of the requested compressor and the input block
+ */
+struct compr_cache_rec {
+	__le32 crc;
+	__le16 compr_type;
+	__le16 len;
+	__le16 in_len;
+	__u8 padding[2];
+	__u8 digest[COMPR_CACHE_DIGEST_LEN];
+} __packed;
+
+/**
+ * struct cache_entry - in-memory index entry of a cache record.
+ * @digest: digest of the record
+ * @offs: offset of the record in the cache file
+ * @len: length of the compressed data of the record
+ */
+struct cache_entry {
+	uint8_t digest[COMPR_CACHE_DIGEST_LEN];
+	off_t offs;
+	int len;
+};
+
+static int cache_fd = -1;
+static off_t cache_end;
+static bool store_failed;
+static struct hashtable *cache_htbl;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long hits, misses, bad_recs;
+
+static unsigned int digest_hash(void *k)
+{
+	const struct cache_entry *e = k;
+	unsigned int h;
+
+	memcpy(&h, e->digest, sizeof(h));
+	return h;
+}
+
+static int digest_eq(void *k1, void *k2)
+{
+	const struct cache_entry *e1 = k1, *e2 = k2;
+
+	return !memcmp(e1->digest, e2->digest, COMPR_CACHE_DIGEST_LEN);
+}
+
+/**
+ * make_ident - describe compressor libraries and settings.
+ * @ident: buffer of %COMPR_CACHE_IDENT_LEN bytes to fill
+ */
+static void make_ident(char *ident)
+{
+	const char *zlib_ver = "none", *lzo_ver = "none";
+	unsigned int zstd_ver = 0;
+
+#ifdef WITH_ZLIB
+	zlib_ver = zlibVersion();
+#endif
+#ifdef WITH_LZO
+	lzo_ver = lzo_version_string();
+#endif
+#ifdef WITH_ZSTD
+	zstd_ver = ZSTD_versionNumber();
+#endif
+	memset(ident, 0, COMPR_CACHE_IDENT_LEN);
+	snprintf(ident, COMPR_CACHE_IDENT_LEN,
+		 "zlib %s lzo %s zstd %u favor_lzo %d favor_percent %d",
+		 zlib_ver, lzo_ver, zstd_ver, info_.favor_lzo,
+		 info_.favor_percent);
+}
+
+static uint32_t rec_crc(const struct compr_cache_rec *rec, const void *data,
+			int len)
+{
+	uint32_t crc;
+
+	crc = mtd_crc32(UBIFS_CRC32_INIT, (const void *)rec + 4,
+			sizeof(struct compr_cache_rec) - 4);
+	return mtd_crc32(crc, data, len);
+}
+
+/**
+ * calc_digest - calculate the cache digest of a block.
+ * @in_buf: the block
+ * @in_len: length of the block
+ * @type: the requested compressor
+ * @digest: the digest is returned here
+ */
+static int calc_digest(const void *in_buf, size_t in_len, int type,
+		       uint8_t *digest)
+{
+	EVP_MD_CTX *mdctx;
+	__le16 t = cpu_to_le16(type);
+	unsigned int len;
+	int ok;
+
+	mdctx = EVP_MD_CTX_create();
+	if (!mdctx)
+		return -1;
+
+	ok = EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL) == 1 &&
+	     EVP_DigestUpdate(mdctx, &t, sizeof(t)) == 1 &&
+	     EVP_DigestUpdate(mdctx, in_buf, in_len) == 1 &&
+	     EVP_DigestFinal_ex(mdctx, digest, &len) == 1;
+
+	EVP_MD_CTX_destroy(mdctx);
+	return ok ? 0 : -1;
+}
+
+/**
+ * add_entry - add a cache record to the in-memory index.
+ * @digest: digest of the record
+ * @offs: offset of the record in the cache file
+ * @len: length of the compressed data of the record
+ *
+ * Must be called with @cache_lock held. Duplicates are silently ignored.
+ */
+static int add_entry(const uint8_t *digest, off_t offs, int len)
+{
+	struct cache_entry *e;
+
+	e = xmalloc(sizeof(struct cache_entry));
+	memcpy(e->digest, digest, COMPR_CACHE_DIGEST_LEN);
+	e->offs = offs;
+	e->len = len;
+
+	if (hashtable_search(cache_htbl, e)) {
+		free(e);
+		return 0;
+	}
+	if (!hashtable_insert(cache_htbl, e, e)) {
+		free(e);
+		return errmsg("cannot insert into the compression cache");
+	}
+	return 0;
+}
+
+/**
+ * load_cache - build the in-memory index of the cache file.
+ * @size: size of the cache file
+ *
+ * The cache file is truncated at the first record which does not fit in the
+ * file or fails the CRC check, nothing after it can be trusted.
+ */
+static int load_cache(off_t size)
+{
+	struct compr_cache_rec rec;
+	off_t offs = sizeof(struct compr_cache_hdr);
+	int len, err = 0;
+	void *buf;
+
+	buf = xmalloc(UBIFS_BLOCK_SIZE * WORST_COMPR_FACTOR);
+	while (size - offs >= (off_t)sizeof(rec)) {
+		if (pread(cache_fd, &rec, sizeof(rec), offs) != sizeof(rec)) {
+			err = sys_errmsg("cannot read compression cache");
+			goto out;
+		}
+		len = le16_to_cpu(rec.len);
+		if (len > UBIFS_BLOCK_SIZE * WORST_COMPR_FACTOR ||
+		    le16_to_cpu(rec.in_len) > UBIFS_BLOCK_SIZE ||
+		    len > size - offs - (off_t)sizeof(rec))
+			break;
+		if (pread(cache_fd, buf, len, offs + sizeof(rec)) != len) {
+			err = sys_errmsg("cannot read compression cache");
+			goto out;
+		}
+		if (le32_to_cpu(rec.crc) != rec_crc(&rec, buf, len))
+			break;
+		err = add_entry(rec.digest, offs, len);
+		if (err)
+			goto out;
+		offs += sizeof(rec) + len;
+	}
+
+	if (offs != size) {
+		pr_notice("dropping %lld bytes from the first bad record on\n",
+			  (long long)(size - offs));
+		if (ftruncate(cache_fd, offs)) {
+			err = sys_errmsg("cannot truncate compression cache");
+			goto out;
+		}
+	}
+	cache_end = offs;
+
+out:
+	free(buf);
+	return err;
+}
+
+/**
+ * compr_cache_open - open or create a compression cache file.
+ * @path: path to the cache file
+ *
+ * If the cache file is locked by another mkfs.ubifs instance, a warning is
+ * printed and the cache is not used. Returns zero in case of success and a
+ * negative error code in case of failure.
+ */
+int compr_cache_open(const char *path)
+{
+	struct compr_cache_hdr hdr, want;
+	struct stat st;
+	int err;
+
+	cache_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (cache_fd == -1)
+		return sys_errmsg("cannot open compression cache '%s'", path);
+
+	if (flock(cache_fd, LOCK_EX | LOCK_NB)) {
+		warnmsg("compression cache '%s' is in use, not using it",
+			path);
+		close(cache_fd);
+		cache_fd = -1;
+		return 0;
+	}
+
+	cache_htbl = create_hashtable(1024, &digest_hash, &digest_eq);
+	if (!cache_htbl) {
+		err = errmsg("cannot create compression cache index");
+		goto out_close;
+	}
+
+	memset(&want, 0, sizeof(want));
+	want.magic = cpu_to_le32(COMPR_CACHE_MAGIC);
+	want.version = cpu_to_le32(COMPR_CACHE_VERSION);
+	make_ident(want.ident);
+
+	if (fstat(cache_fd, &st)) {
+		err = sys_errmsg("cannot stat compression cache '%s'", path);
+		goto out_close;
+	}
+
+	if (st.st_size >= (off_t)sizeof(hdr)) {
+		if (pread(cache_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			err = sys_errmsg("cannot read compression cache '%s'",
+					 path);
+			goto out_close;
+		}
+		if (!memcmp(&hdr, &want, sizeof(hdr))) {
+			err = load_cache(st.st_size);
+			if (err)
+				goto out_close;
+			return 0;
+		}
+		pr_notice("compression cache '%s' does not match, starting a new one\n",
+			  path);
+	}
+
+	if (ftruncate(cache_fd, 0) ||
+	    pwrite(cache_fd, &want, sizeof(want), 0) != sizeof(want)) {
+		err = sys_errmsg("cannot initialize compression cache '%s'",
+				 path);
+		goto out_close;
+	}
+	cache_end = sizeof(want);
+	return 0;
+
+out_close:
+	compr_cache_close();
+	return err;
+}
+
+/**
+ * compr_cache_close - close the compression cache.
+ */
+void compr_cache_close(void)
+{
+	if (cache_htbl)
+		hashtable_destroy(cache_htbl, 0);
+	cache_htbl = NULL;
+	if (cache_fd != -1)
+		close(cache_fd);
+	cache_fd = -1;
+}
+
+/**
+ * lookup - look up a block in the cache.
+ * @key: index entry containing the digest to look for
+ * @in_buf: input block
+ * @in_len: length of the input block
+ * @out_buf: output buffer
+ * @out_len: length of the output is returned here
+ *
+ * Returns the compressor type in case of a hit and %-1 otherwise.
+ */
+static int lookup(const struct cache_entry *key, void *in_buf, size_t in_len,
+		  void *out_buf, size_t *out_len)
+{
+	struct compr_cache_rec rec;
+	struct cache_entry *e;
+	struct iovec iov[2];
+	off_t offs = 0;
+	int len = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	e = hashtable_search(cache_htbl, (void *)key);
+	if (e) {
+		offs = e->offs;
+		len = e->len;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	if (!e)
+		return -1;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = out_buf;
+	iov[1].iov_len = len;
+	if (preadv(cache_fd, iov, 2, offs) != (ssize_t)sizeof(rec) + len)
+		goto bad;
+	if (le32_to_cpu(rec.crc) != rec_crc(&rec, out_buf, len) ||
+	    memcmp(rec.digest, key->digest, COMPR_CACHE_DIGEST_LEN) ||
+	    le16_to_cpu(rec.in_len) != in_len)
+		goto bad;
+
+	if (len == 0) {
+		memcpy(out_buf, in_buf, in_len);
+		*out_len = in_len;
+	} else
+		*out_len = len;
+	return le16_to_cpu(rec.compr_type);
+
+bad:
+	pthread_mutex_lock(&cache_lock);
+	bad_recs += 1;
+	pthread_mutex_unlock(&cache_lock);
+	return -1;
+}
+
+/**
+ * store - append a compressed block to the cache.
+ * @digest: digest of the block
+ * @in_len: length of the input block
+ * @out_buf: compressed data
+ * @out_len: length of the compressed data
+ * @compr_type: compressor type 'compress_data()' returned
+ */
+static void store(const uint8_t *digest, size_t in_len, const void *out_buf,
+		  size_t out_len, int compr_type)
+{
+	struct compr_cache_rec rec;
+	struct iovec iov[2];
+	off_t offs;
+	int len;
+
+	len = compr_type == UBIFS_COMPR_NONE ? 0 : out_len;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.compr_type = cpu_to_le16(compr_type);
+	rec.len = cpu_to_le16(len);
+	rec.in_len = cpu_to_le16(in_len);
+	memcpy(rec.digest, digest, COMPR_CACHE_DIGEST_LEN);
+	rec.crc = cpu_to_le32(rec_crc(&rec, out_buf, len));
+
+	/* Reserve space, write the record, then make it visible */
+	pthread_mutex_lock(&cache_lock);
+	if (store_failed) {
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+	offs = cache_end;
+	cache_end += sizeof(rec) + len;
+	pthread_mutex_unlock(&cache_lock);
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *)out_buf;
+	iov[1].iov_len = len;
+	if (pwritev(cache_fd, iov, 2, offs) != (ssize_t)sizeof(rec) + len) {
+		/*
+		 * This leaves a bad record behind, and the next run drops it
+		 * and every record after it. So stop adding records.
+		 */
+		pr_warn("cannot write to compression cache: %s\n",
+			strerror(errno));
+		pthread_mutex_lock(&cache_lock);
+		store_failed = true;
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	add_entry(digest, offs, len);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * compr_cache_compress - compress data using the compression cache.
+ *
+ * This is a drop-in replacement of 'compress_data()' which looks the block
+ * up in the cache first, and adds the result of the compression to the cache
+ * on a miss. It may be called concurrently from several compression threads.
+ */
+int compr_cache_compress(void *in_buf, size_t in_len, void *out_buf,
+			 size_t *out_len, int type)
+{
+	struct cache_entry key;
+	int compr_type;
+
+	if (cache_fd == -1 || type == UBIFS_COMPR_NONE ||
+	    in_len < UBIFS_MIN_COMPR_LEN ||
+	    calc_digest(in_buf, in_len, type, key.digest))
+		return compress_data(in_buf, in_len, out_buf, out_len, type);
+
+	compr_type = lookup(&key, in_buf, in_len, out_buf, out_len);
+	if (compr_type >= 0) {
+		pthread_mutex_lock(&cache_lock);
+		hits += 1;
+		pthread_mutex_unlock(&cache_lock);
+		return compr_type;
+	}
+
+	compr_type = compress_data(in_buf, in_len, out_buf, out_len, type);
+	store(key.digest, in_len, out_buf, *out_len, compr_type);
+
+	pthread_mutex_lock(&cache_lock);
+	misses += 1;
+	pthread_mutex_unlock(&cache_lock);
+	return compr_type;
+}
+
+/**
+ * compr_cache_print_stats - print compression cache statistics.
+ */
+void compr_cache_print_stats(void)
+{
+	if (cache_fd == -1)
+		return;
+
+	printf("\tcompr cache:  %llu hits, %llu misses", hits, misses);
+	if (hits + misses)
+		printf(" (%llu%% hit rate)", hits * 100 / (hits + misses));
+	if (bad_recs)
+		printf(", %llu bad records", bad_recs);
+	printf(", %lld bytes\n", (long long)cache_end);
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Content-addressed cache of compressed data node payloads for mkfs.ubifs.
+ */
+#ifndef __COMPR_CACHE_H__
+#define __COMPR_CACHE_H__
+
+#ifdef WITH_CRYPTO
+int compr_cache_open(const char *path);
+void compr_cache_close(void);
+int compr_cache_compress(void *in_buf, size_t in_len, void *out_buf,
+			 size_t *out_len, int type);
+void compr_cache_print_stats(void);
+#else
+static inline int compr_cache_open(const char *path)
+{
+	(void)path;
+	return errmsg("mkfs.ubifs was built without crypto support.");
+}
+static inline void compr_cache_close(void) {}
+static inline int compr_cache_compress(void *in_buf, size_t in_len,
+				       void *out_buf, size_t *out_len, int type)
+{
+	return compress_data(in_buf, in_len, out_buf, out_len, type);
+}
+static inline void compr_cache_print_stats(void) {}
+#endif
+
+#endif
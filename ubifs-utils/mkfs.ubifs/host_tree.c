@@ -0,0 +1,370 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Read-ahead of the host source tree metadata for mkfs.ubifs.
+ *
+ * When the source tree lives on NFS or overlayfs, writing the image is
+ * dominated by the metadata system calls made for every file one after
+ * another. This walks the tree beforehand, one directory level at a time:
+ * first all directories of the level are listed, then all their entries are
+ * stat'ed, both spread over the thread pool. The result is a tree in
+ * 'readdir()' order, which the single-threaded writer consumes instead of
+ * making the system calls itself, so the image does not depend on the count
+ * of threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#ifdef WITH_XATTR
+#include <sys/xattr.h>
+#endif
+
+#include "linux_types.h"
+#include "defs.h"
+#include "ubifs-media.h"
+#include "thread_pool.h"
+#include "host_tree.h"
+
+/* The writer reads extended attributes into a buffer of this size */
+#define XATTR_VALUE_MAX 1023
+
+static char *child_path(const struct host_entry *dir, const char *name)
+{
+	size_t len = strlen(dir->path);
+	char *s = xmalloc(len + strlen(name) + 2);
+
+	if (len && dir->path[len - 1] == '/')
+		sprintf(s, "%s%s", dir->path, name);
+	else
+		sprintf(s, "%s/%s", dir->path, name);
+
+	return s;
+}
+
+#ifdef STATX_BASIC_STATS
+static int read_stat(const char *path, int at_flags, struct stat *st)
+{
+	struct statx stx;
+
+	if (statx(AT_FDCWD, path, at_flags, STATX_BASIC_STATS, &stx)) {
+		if (errno == ENOSYS)
+			return fstatat(AT_FDCWD, path, st, at_flags);
+		return -1;
+	}
+
+	memset(st, 0, sizeof(struct stat));
+	st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	st->st_ino = stx.stx_ino;
+	st->st_mode = stx.stx_mode;
+	st->st_nlink = stx.stx_nlink;
+	st->st_uid = stx.stx_uid;
+	st->st_gid = stx.stx_gid;
+	st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	st->st_size = stx.stx_size;
+	st->st_blksize = stx.stx_blksize;
+	st->st_blocks = stx.stx_blocks;
+	st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+
+	return 0;
+}
+#else
+static int read_stat(const char *path, int at_flags, struct stat *st)
+{
+	return fstatat(AT_FDCWD, path, st, at_flags);
+}
+#endif
+
+#ifdef WITH_XATTR
+static int read_xattrs(struct host_entry *e, const char *path)
+{
+	char *names, *name;
+	ssize_t len, pos;
+	int n = 0;
+
+	len = llistxattr(path, NULL, 0);
+	if (len < 0)
+		return errno == ENOENT || errno == EOPNOTSUPP ? 0 : -1;
+	if (len == 0)
+		return 0;
+
+	names = xmalloc(len);
+	len = llistxattr(path, names, len);
+	if (len < 0)
+		goto out_free;
+
+	for (pos = 0; pos < len; pos += strlen(names + pos) + 1)
+		n += 1;
+	e->xattrs = xcalloc(n, sizeof(struct host_xattr));
+
+	for (pos = 0; pos < len; pos += strlen(name) + 1) {
+		struct host_xattr *x = &e->xattrs[e->nr_xattrs];
+		char buf[XATTR_VALUE_MAX];
+
+		name = names + pos;
+		x->size = lgetxattr(path, name, buf, XATTR_VALUE_MAX);
+		if (x->size < 0)
+			goto out_free;
+		x->name = strdup(name);
+		x->value = xmalloc(x->size + 1);
+		memcpy(x->value, buf, x->size);
+		((char *)x->value)[x->size] = '\0';
+		e->nr_xattrs += 1;
+	}
+
+	free(names);
+	return 0;
+
+out_free:
+	free(names);
+	return -1;
+}
+#else
+static inline int read_xattrs(struct host_entry *e, const char *path)
+{
+	(void)e;
+	(void)path;
+
+	return 0;
+}
+#endif
+
+static int read_flags(const char *path, int *flags)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_NOCTTY);
+	if (fd == -1)
+		return -1;
+	if (ioctl(fd, FS_IOC_GETFLAGS, flags) == -1)
+		*flags = 0;
+	return close(fd);
+}
+
+/*
+ * Read the metadata of one entry. Nothing is reported here: an entry which
+ * is not valid is read again by the writer, which then reports the error.
+ */
+static void read_entry(struct host_entry *e, const char *path, int at_flags)
+{
+	char buf[UBIFS_MAX_INO_DATA + 1];
+	struct stat st;
+	ssize_t len;
+
+	if (read_stat(path, at_flags, &st))
+		return;
+
+	e->st.dev = st.st_dev;
+	e->st.rdev = st.st_rdev;
+	e->st.ino = st.st_ino;
+	e->st.size = st.st_size;
+	e->st.atime = st.st_atime;
+	e->st.mtime = st.st_mtime;
+	e->st.ctime = st.st_ctime;
+	e->st.mode = st.st_mode;
+	e->st.nlink = st.st_nlink;
+	e->st.uid = st.st_uid;
+	e->st.gid = st.st_gid;
+
+	if (S_ISREG(e->st.mode) && read_flags(path, &e->flags))
+		return;
+
+	if (S_ISLNK(e->st.mode)) {
+		len = readlink(path, buf, UBIFS_MAX_INO_DATA + 1);
+		if (len <= 0 || len > UBIFS_MAX_INO_DATA)
+			return;
+		e->link = xmalloc(len);
+		memcpy(e->link, buf, len);
+		e->link_len = len;
+	}
+
+	if (read_xattrs(e, path))
+		return;
+
+	e->valid = 1;
+}
+
+static void read_entry_fn(void *arg, int idx)
+{
+	struct host_entry **ents = arg;
+	struct host_entry *e = ents[idx];
+
+	read_entry(e, e->path, AT_SYMLINK_NOFOLLOW);
+	if (!e->valid || !S_ISDIR(e->st.mode)) {
+		free(e->path);
+		e->path = NULL;
+	}
+}
+
+/*
+ * List a directory. Its inode flags are read through the same descriptor, as
+ * the writer does it.
+ */
+static void list_dir_fn(void *arg, int idx)
+{
+	struct host_entry *dir = ((struct host_entry **)arg)[idx];
+	struct dirent *entry;
+	int fd, cnt = 0, max = 0;
+	DIR *d;
+
+	fd = open(dir->path, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return;
+	if (ioctl(fd, FS_IOC_GETFLAGS, &dir->flags) == -1)
+		dir->flags = 0;
+
+	d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return;
+	}
+
+	while (1) {
+		errno = 0;
+		entry = readdir(d);
+		if (!entry)
+			break;
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+
+		if (cnt == max) {
+			max = max ? max * 2 : 16;
+			dir->children = xrealloc(dir->children,
+					max * sizeof(struct host_entry));
+		}
+		memset(&dir->children[cnt], 0, sizeof(struct host_entry));
+		dir->children[cnt].name = strdup(entry->d_name);
+		cnt += 1;
+	}
+	dir->nr_children = cnt;
+
+	if (!errno)
+		dir->listed = 1;
+	closedir(d);
+}
+
+/**
+ * host_tree_read - read the metadata of a host directory tree.
+ * @root: path of the root directory
+ * @pool: threads to spread the system calls over (may be %NULL)
+ *
+ * This function returns the root entry of the tree read, the root directory
+ * itself is stat'ed following symbolic links. Entries which could not be
+ * read are marked as such and left to the writer.
+ */
+struct host_entry *host_tree_read(const char *root, struct thread_pool *pool)
+{
+	struct host_entry *top, **dirs, **ents = NULL;
+	int nr_dirs = 1, nr_ents, i, j;
+
+	top = xzalloc(sizeof(struct host_entry));
+	top->name = strdup(root);
+	top->path = strdup(root);
+	read_entry(top, root, 0);
+	if (!top->valid || !S_ISDIR(top->st.mode))
+		return top;
+
+	dirs = xmalloc(sizeof(struct host_entry *));
+	dirs[0] = top;
+
+	while (nr_dirs) {
+		thread_pool_run(pool, list_dir_fn, dirs, nr_dirs);
+
+		nr_ents = 0;
+		for (i = 0; i < nr_dirs; i++)
+			nr_ents += dirs[i]->nr_children;
+		ents = xrealloc(ents, (nr_ents ? : 1) * sizeof(*ents));
+
+		nr_ents = 0;
+		for (i = 0; i < nr_dirs; i++) {
+			for (j = 0; j < dirs[i]->nr_children; j++) {
+				struct host_entry *e = &dirs[i]->children[j];
+
+				e->path = child_path(dirs[i], e->name);
+				ents[nr_ents++] = e;
+			}
+			free(dirs[i]->path);
+			dirs[i]->path = NULL;
+		}
+
+		thread_pool_run(pool, read_entry_fn, ents, nr_ents);
+
+		nr_dirs = 0;
+		for (i = 0; i < nr_ents; i++)
+			if (ents[i]->path)
+				nr_dirs += 1;
+		dirs = xrealloc(dirs, (nr_dirs ? : 1) * sizeof(*dirs));
+
+		nr_dirs = 0;
+		for (i = 0; i < nr_ents; i++)
+			if (ents[i]->path)
+				dirs[nr_dirs++] = ents[i];
+	}
+
+	free(ents);
+	free(dirs);
+	return top;
+}
+
+static void free_entry(struct host_entry *e)
+{
+	int i;
+
+	for (i = 0; i < e->nr_children; i++)
+		free_entry(&e->children[i]);
+	for (i = 0; i < e->nr_xattrs; i++) {
+		free(e->xattrs[i].name);
+		free(e->xattrs[i].value);
+	}
+	free(e->children);
+	free(e->xattrs);
+	free(e->link);
+	free(e->path);
+	free(e->name);
+}
+
+/**
+ * host_entry_stat - get the 'struct stat' of an entry.
+ * @e: the entry, which must be valid
+ * @st: the result, fields not read ahead are zero
+ */
+void host_entry_stat(const struct host_entry *e, struct stat *st)
+{
+	memset(st, 0, sizeof(struct stat));
+	st->st_dev = e->st.dev;
+	st->st_rdev = e->st.rdev;
+	st->st_ino = e->st.ino;
+	st->st_size = e->st.size;
+	st->st_atime = e->st.atime;
+	st->st_mtime = e->st.mtime;
+	st->st_ctime = e->st.ctime;
+	st->st_mode = e->st.mode;
+	st->st_nlink = e->st.nlink;
+	st->st_uid = e->st.uid;
+	st->st_gid = e->st.gid;
+}
+
+/**
+ * host_tree_free - free a tree returned by 'host_tree_read()'.
+ * @root: root entry of the tree (may be %NULL)
+ */
+void host_tree_free(struct host_entry *root)
+{
+	if (!root)
+		return;
+
+	free_entry(root);
+	free(root);
+}
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Read-ahead of the host source tree metadata for mkfs.ubifs.
+ */
+#ifndef __HOST_TREE_H__
+#define __HOST_TREE_H__
+
+#include <sys/stat.h>
+
+struct thread_pool;
+
+/**
+ * struct host_xattr - an extended attribute read ahead.
+ * @name: attribute name
+ * @value: attribute value
+ * @size: size of @value in bytes
+ */
+struct host_xattr {
+	char *name;
+	void *value;
+	ssize_t size;
+};
+
+/**
+ * struct host_stat - the part of 'struct stat' the image is made of.
+ */
+struct host_stat {
+	dev_t dev;
+	dev_t rdev;
+	ino_t ino;
+	off_t size;
+	time_t atime;
+	time_t mtime;
+	time_t ctime;
+	mode_t mode;
+	unsigned int nlink;
+	uid_t uid;
+	gid_t gid;
+};
+
+/**
+ * struct host_entry - metadata of a host file read ahead.
+ * @name: directory entry name (the path for the root)
+ * @path: path name, only kept for directories
+ * @st: 'lstat()' information
+ * @flags: inode flags of regular files, and of directories if @listed
+ * @link: target of a symbolic link
+ * @link_len: length of @link
+ * @xattrs: extended attributes in the order 'llistxattr()' returns them
+ * @nr_xattrs: count of @xattrs
+ * @children: directory entries in the order 'readdir()' returns them
+ * @nr_children: count of @children
+ * @valid: @st, @flags, @link and @xattrs were all read successfully
+ * @listed: @children were read successfully
+ *
+ * Whatever could not be read ahead is read again, and errors are reported,
+ * when the entry is written to the image.
+ */
+struct host_entry {
+	char *name;
+	char *path;
+	struct host_stat st;
+	int flags;
+	char *link;
+	int link_len;
+	struct host_xattr *xattrs;
+	int nr_xattrs;
+	struct host_entry *children;
+	int nr_children;
+	unsigned int valid:1;
+	unsigned int listed:1;
+};
+
+struct host_entry *host_tree_read(const char *root, struct thread_pool *pool);
+void host_tree_free(struct host_entry *root);
+void host_entry_stat(const struct host_entry *e, struct stat *st);
+
+#endif
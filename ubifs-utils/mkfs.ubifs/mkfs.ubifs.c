@@ -24,6 +24,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <libgen.h>
 #include <getopt.h>
 #include <dirent.h>
@@ -33,6 +34,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #ifdef WITH_XATTR
 #include <sys/xattr.h>
 #endif
@@ -56,6 +58,9 @@
 #include "compr.h"
 #include "misc.h"
 #include "devtable.h"
+#include "thread_pool.h"
+#include "compr_cache.h"
+#include "host_tree.h"
 
 /* Size (prime number) of hash table for link counting */
 #define HASH_TABLE_SIZE 10099
@@ -64,6 +69,24 @@
 #define NODE_BUFFER_SIZE (UBIFS_DATA_NODE_SZ + \
 			  UBIFS_BLOCK_SIZE * WORST_COMPR_FACTOR)
 
+/* Count of data blocks compressed at once by each compression thread */
+#define DATA_BLOCKS_PER_JOB 16
+
+/* Index entries and bytes of names per index array chunk */
+#define IDX_CHUNK_SHIFT 12
+#define IDX_CHUNK_ENTRIES (1 << IDX_CHUNK_SHIFT)
+#define NAME_CHUNK_SIZE (64 * 1024)
+
+/*
+ * Adaptive compression: count of leading blocks of a file sampled to pick its
+ * compressor, the entropy (bits per byte) above which the data is considered
+ * incompressible, and the minimum saving (percent) that makes compression of a
+ * file worth it.
+ */
+#define ADAPT_SAMPLE_BLOCKS 4
+#define ADAPT_MAX_ENTROPY 7.8
+#define ADAPT_MIN_SAVING 3
+
 /* Default time granularity in nanoseconds */
 #define DEFAULT_TIME_GRAN 1000000000
 
@@ -75,29 +98,42 @@ static struct selabel_handle *sehnd;
 
 /**
  * struct idx_entry - index entry.
- * @next: next index entry (NULL at end of list)
- * @prev: previous index entry (NULL at beginning of list)
  * @key: key
  * @name: directory entry name used for sorting colliding keys by name
+ * @name_len: length of @name
  * @lnum: LEB number
  * @offs: offset
  * @len: length
- * @hash: hash of the node
+ * @hash: hash of the node (@c->hash_len bytes)
  *
- * The index is recorded as a linked list which is sorted and used to create
- * the bottom level of the on-flash index tree. The remaining levels of the
- * index tree are each built from the level below.
+ * The index is recorded as an array of entries which is sorted and used to
+ * create the bottom level of the on-flash index tree. The remaining levels of
+ * the index tree are each built from the level below.
+ *
+ * The entries are variable-sized because the hash is only stored if the image
+ * is authenticated. They are packed in chunks of %IDX_CHUNK_ENTRIES entries,
+ * and the names are packed in chunks of %NAME_CHUNK_SIZE bytes, so that no
+ * per-entry allocations are needed.
  */
 struct idx_entry {
-	struct idx_entry *next;
-	struct idx_entry *prev;
 	union ubifs_key key;
 	char *name;
 	int name_len;
 	int lnum;
 	int offs;
 	int len;
-	uint8_t hash[UBIFS_MAX_HASH_LEN];
+	uint8_t hash[];
+};
+
+/**
+ * struct idx_sort_entry - index entry sort record.
+ * @key: the key of the index entry as a 64-bit number, which sorts the same
+ *       way as 'keys_cmp()' orders the keys
+ * @pos: position of the entry in the index array
+ */
+struct idx_sort_entry {
+	uint64_t key;
+	size_t pos;
 };
 
 /**
@@ -112,6 +148,7 @@ struct idx_entry {
  * @st: struct stat object containing inode attributes which have to be used
  *      when the inode is being created (actually only UID, GID, access
  *      mode, major and minor device numbers)
+ * @entry: metadata of the file read ahead, %NULL if there is none
  *
  * If a file has more than one hard link, then the number of hard links that
  * exist in the source directory hierarchy must be counted to exclude the
@@ -129,6 +166,7 @@ struct inum_mapping {
 	unsigned int use_nlink;
 	char *path_name;
 	struct stat st;
+	struct host_entry *entry;
 };
 
 /*
@@ -156,15 +194,36 @@ static int head_lnum;
 static int head_offs;
 static int head_flags;
 
-/* The index list */
-static struct idx_entry *idx_list_first;
-static struct idx_entry *idx_list_last;
+/* The index array */
+static void **idx_chunks;
+static size_t idx_chunks_cnt;
+static size_t idx_entry_sz;
 static size_t idx_cnt;
+static char *name_chunk;
+static size_t name_chunk_used;
+static void **name_chunks;
+static size_t name_chunks_cnt;
+static size_t idx_mem;
 
 /* Global buffers */
 static void *leb_buf;
 static void *node_buf;
-static void *block_buf;
+
+/*
+ * Count of threads compressing file data, the pool of those of them which are
+ * not the main thread, and the blocks they compress at once.
+ */
+static int jobs = 1;
+static struct thread_pool *compr_pool;
+static struct data_block *data_blocks;
+static int data_blocks_cnt;
+
+/* Compression cache file */
+static char *compr_cache_path;
+
+/* Adaptive per-file compressor selection and count of files per compressor */
+static int adaptive_compr;
+static unsigned long long adaptive_files[UBIFS_COMPR_TYPES_CNT];
 
 /* Hash table for inode link counting */
 static struct inum_mapping **hash_table;
@@ -172,12 +231,18 @@ static struct inum_mapping **hash_table;
 /* Inode creation sequence number */
 static unsigned long long creat_sqnum;
 
+/* Metadata of the host file being added, %NULL if it was not read ahead */
+static struct host_entry *cur_entry;
+
 static const char *optstring = "d:r:m:o:D:yh?vVe:c:g:f:Fp:k:x:X:j:R:l:j:UQqaK:b:P:C:";
 
 enum {
 	HASH_ALGO_OPTION = CHAR_MAX + 1,
 	AUTH_KEY_OPTION,
 	AUTH_CERT_OPTION,
+	JOBS_OPTION,
+	COMPR_CACHE_OPTION,
+	SPARSE_OPTION,
 };
 
 static const struct option longopts[] = {
@@ -211,6 +276,9 @@ static const struct option longopts[] = {
 	{"hash-algo",          1, NULL, HASH_ALGO_OPTION},
 	{"auth-key",           1, NULL, AUTH_KEY_OPTION},
 	{"auth-cert",          1, NULL, AUTH_CERT_OPTION},
+	{"jobs",               1, NULL, JOBS_OPTION},
+	{"compr-cache",        1, NULL, COMPR_CACHE_OPTION},
+	{"sparse",             0, NULL, SPARSE_OPTION},
 	{NULL, 0, NULL, 0}
 };
 
@@ -233,10 +301,19 @@ static const char *helptext =
 "-j, --jrn-size=SIZE      journal size\n"
 "-R, --reserved=SIZE      how much space should be reserved for the super-user\n"
 "-x, --compr=TYPE         compression type - \"lzo\", \"favor_lzo\", \"zlib\"\n"
-"                         \"zstd\" or \"none\" (default: \"lzo\")\n"
-"-X, --favor-percent      may only be used with favor LZO compression and defines\n"
-"                         how many percent better zlib should compress to make\n"
-"                         mkfs.ubifs use zlib instead of LZO (default 20%)\n"
+"                         \"zstd\", \"adaptive\" or \"none\" (default: \"lzo\")\n"
+"-X, --favor-percent      may only be used with favor LZO or adaptive compression\n"
+"                         and defines how many percent better zlib should compress\n"
+"                         to make mkfs.ubifs use zlib instead of LZO (default 20%)\n"
+"    --jobs=NUM           compress file data and read the metadata of the root\n"
+"                         directory tree using NUM threads (default: 1), the\n"
+"                         resulting image does not depend on NUM\n"
+"    --compr-cache=FILE   reuse compressed data from the cache FILE, and add\n"
+"                         newly compressed data to it\n"
+"    --sparse             leave holes instead of erased (all 0xFF) blocks in the\n"
+"                         output image file; only use this if the image is\n"
+"                         consumed by tools treating holes as erased flash,\n"
+"                         like \"ubinize --sparse\"\n"
 "-f, --fanout=NUM         fanout NUM (default: 8)\n"
 "-F, --space-fixup        file-system free space has to be fixed up on first mount\n"
 "                         (requires kernel version 3.0 or greater)\n"
@@ -278,6 +355,11 @@ static const char *helptext =
 "or more percent better than \"lzo\", mkfs.ubifs chooses \"zlib\", otherwise it chooses\n"
 "\"lzo\". The \"--favor-percent\" may specify arbitrary threshold instead of the\n"
 "default 20%.\n\n"
+"The \"adaptive\" method picks the compressor per file. mkfs.ubifs samples the\n"
+"first blocks of every file, stores files which look already compressed (by their\n"
+"format signature or the entropy of the data) uncompressed, and otherwise uses\n"
+"the fastest to decompress of \"lzo\", \"zstd\" and \"zlib\" whose result is not\n"
+"more than \"--favor-percent\" percent worse than the best one.\n\n"
 "The -F parameter is used to set the \"fix up free space\" flag in the superblock,\n"
 "which forces UBIFS to \"fixup\" all the free space which it is going to use. This\n"
 "option is useful to work-around the problem of double free space programming: if the\n"
@@ -639,6 +721,18 @@ static int get_options(int argc, char**argv)
 		case 'F':
 			c->space_fixup = 1;
 			break;
+		case JOBS_OPTION:
+			jobs = strtol(optarg, &endp, 0);
+			if (*endp != '\0' || endp == optarg || jobs <= 0)
+				return errmsg("bad count of jobs '%s'", optarg);
+			break;
+		case SPARSE_OPTION:
+			c->sparse_image = 1;
+			break;
+		case COMPR_CACHE_OPTION:
+			free(compr_cache_path);
+			compr_cache_path = xstrdup(optarg);
+			break;
 		case 'l':
 			c->log_lebs = strtol(optarg, &endp, 0);
 			if (*endp != '\0' || endp == optarg || c->log_lebs <= 0)
@@ -683,6 +777,10 @@ static int get_options(int argc, char**argv)
 				c->favor_lzo = 1;
 			}
 #endif
+			else if (strcmp(optarg, "adaptive") == 0) {
+				c->default_compr = -1;
+				adaptive_compr = 1;
+			}
 			else
 				return errmsg("bad compressor name");
 			break;
@@ -887,13 +985,21 @@ static int get_options(int argc, char**argv)
 		case UBIFS_COMPR_ZLIB:
 			printf("\tcompr:        zlib\n");
 			break;
+		case UBIFS_COMPR_ZSTD:
+			printf("\tcompr:        zstd\n");
+			break;
 		case UBIFS_COMPR_NONE:
 			printf("\tcompr:        none\n");
 			break;
 		}
+		if (adaptive_compr)
+			printf("\tcompr mode:   adaptive\n");
 		printf("\tkeyhash:      %s\n", (c->key_hash == key_r5_hash) ?
 						"r5" : "test");
 		printf("\tfanout:       %d\n", c->fanout);
+		printf("\tjobs:         %d\n", jobs);
+		if (compr_cache_path)
+			printf("\tcompr cache:  %s\n", compr_cache_path);
 		printf("\torph_lebs:    %d\n", c->orph_lebs);
 		printf("\tspace_fixup:  %d\n", c->space_fixup);
 		printf("\tselinux file: %s\n", context);
@@ -1004,9 +1110,45 @@ static void set_lprops(int lnum, int offs, int flags)
 	}
 }
 
+/**
+ * idx_entry_at - get an index entry by its position in the index array.
+ * @pos: position of the entry
+ */
+static inline struct idx_entry *idx_entry_at(size_t pos)
+{
+	return idx_chunks[pos >> IDX_CHUNK_SHIFT] +
+	       (pos & (IDX_CHUNK_ENTRIES - 1)) * idx_entry_sz;
+}
+
+/**
+ * store_name - copy a name to the name chunks.
+ * @name: the name
+ * @name_len: length of the name
+ */
+static char *store_name(const char *name, int name_len)
+{
+	char *p;
+
+	if (!name_chunk || name_chunk_used + name_len > NAME_CHUNK_SIZE) {
+		name_chunk = xmalloc(NAME_CHUNK_SIZE);
+		name_chunk_used = 0;
+		name_chunks = xrealloc(name_chunks, (name_chunks_cnt + 1) *
+				       sizeof(void *));
+		name_chunks[name_chunks_cnt++] = name_chunk;
+		idx_mem += NAME_CHUNK_SIZE;
+	}
+
+	p = name_chunk + name_chunk_used;
+	memcpy(p, name, name_len);
+	name_chunk_used += name_len;
+	return p;
+}
+
 /**
  * add_to_index - add a node key and position to the index.
  * @key: node key
+ * @name: directory entry name, it is freed by this function
+ * @name_len: length of @name
  * @lnum: node LEB number
  * @offs: node offset
  * @len: node length
@@ -1018,26 +1160,53 @@ static int add_to_index(union ubifs_key *key, char *name, int name_len,
 	struct idx_entry *e;
 
 	pr_debug("LEB %d offs %d len %d\n", lnum, offs, len);
-	e = xmalloc(sizeof(struct idx_entry));
-	e->next = NULL;
-	e->prev = idx_list_last;
+	if (!(idx_cnt & (IDX_CHUNK_ENTRIES - 1))) {
+		idx_entry_sz = ALIGN(sizeof(struct idx_entry) + c->hash_len,
+				     sizeof(void *));
+		idx_chunks = xrealloc(idx_chunks, (idx_chunks_cnt + 1) *
+				      sizeof(void *));
+		idx_chunks[idx_chunks_cnt++] =
+				xmalloc(IDX_CHUNK_ENTRIES * idx_entry_sz);
+		idx_mem += IDX_CHUNK_ENTRIES * idx_entry_sz;
+	}
+
+	e = idx_entry_at(idx_cnt);
 	e->key = *key;
-	e->name = name;
+	e->name = NULL;
 	e->name_len = name_len;
+	if (name) {
+		e->name = store_name(name, name_len);
+		free(name);
+	}
 	e->lnum = lnum;
 	e->offs = offs;
 	e->len = len;
 	memcpy(e->hash, hash, c->hash_len);
 
-	if (!idx_list_first)
-		idx_list_first = e;
-	if (idx_list_last)
-		idx_list_last->next = e;
-	idx_list_last = e;
 	idx_cnt += 1;
 	return 0;
 }
 
+/**
+ * free_index - free the index array and the names.
+ */
+static void free_index(void)
+{
+	size_t i;
+
+	for (i = 0; i < idx_chunks_cnt; i++)
+		free(idx_chunks[i]);
+	free(idx_chunks);
+	for (i = 0; i < name_chunks_cnt; i++)
+		free(name_chunks[i]);
+	free(name_chunks);
+	idx_chunks = NULL;
+	name_chunks = NULL;
+	idx_chunks_cnt = name_chunks_cnt = 0;
+	name_chunk = NULL;
+	idx_cnt = 0;
+}
+
 /**
  * flush_nodes - write the current head and move the head to the next LEB.
  */
@@ -1239,14 +1408,59 @@ static int create_inum_attr(ino_t inum, const char *name)
 	return ret;
 }
 
+static int add_host_xattr(struct ubifs_ino_node *host_ino,
+			  const char *path_name, struct stat *st, ino_t inum,
+			  char *name, const void *data, ssize_t attrsize)
+{
+	if (!strcmp(name, "user.image-inode-number")) {
+		ino_t inum_from_xattr;
+
+		inum_from_xattr = strtoull(data, NULL, 10);
+		if (inum != inum_from_xattr) {
+			errno = EINVAL;
+			sys_errmsg("calculated inum (%llu) doesn't match inum from xattr (%llu) size (%zd) on %s",
+				    (unsigned long long)inum,
+				    (unsigned long long)inum_from_xattr,
+				    attrsize,
+				    path_name);
+			return -1;
+		}
+
+		return 0;
+	}
+
+#ifdef WITH_SELINUX
+	/*
+	  Ignore selinux attributes if we have a label file, they are
+	  instead provided by inode_add_selinux_xattr.
+	 */
+	if (!strcmp(name, XATTR_NAME_SELINUX) && context && sehnd)
+		return 0;
+#endif
+
+	return add_xattr(host_ino, st, inum, name, data, attrsize);
+}
+
 static int inode_add_xattr(struct ubifs_ino_node *host_ino,
 			   const char *path_name, struct stat *st, ino_t inum)
 {
-	int ret;
+	int ret, i;
 	void *buf = NULL;
 	ssize_t len;
 	ssize_t pos = 0;
 
+	if (cur_entry) {
+		for (i = 0; i < cur_entry->nr_xattrs; i++) {
+			struct host_xattr *x = &cur_entry->xattrs[i];
+
+			ret = add_host_xattr(host_ino, path_name, st, inum,
+					     x->name, x->value, x->size);
+			if (ret < 0)
+				return -1;
+		}
+		return 0;
+	}
+
 	len = llistxattr(path_name, NULL, 0);
 	if (len < 0) {
 		if (errno == ENOENT || errno == EOPNOTSUPP)
@@ -1282,33 +1496,8 @@ static int inode_add_xattr(struct ubifs_ino_node *host_ino,
 			goto out_free;
 		}
 
-		if (!strcmp(name, "user.image-inode-number")) {
-			ino_t inum_from_xattr;
-
-			inum_from_xattr = strtoull(attrbuf, NULL, 10);
-			if (inum != inum_from_xattr) {
-				errno = EINVAL;
-				sys_errmsg("calculated inum (%llu) doesn't match inum from xattr (%llu) size (%zd) on %s",
-					    (unsigned long long)inum,
-					    (unsigned long long)inum_from_xattr,
-					    attrsize,
-					    path_name);
-				goto out_free;
-			}
-
-			continue;
-		}
-
-#ifdef WITH_SELINUX
-		/*
-		  Ignore selinux attributes if we have a label file, they are
-		  instead provided by inode_add_selinux_xattr.
-		 */
-		if (!strcmp(name, XATTR_NAME_SELINUX) && context && sehnd)
-			continue;
-#endif
-
-		ret = add_xattr(host_ino, st, inum, name, attrbuf, attrsize);
+		ret = add_host_xattr(host_ino, path_name, st, inum, name,
+				     attrbuf, attrsize);
 		if (ret < 0)
 			goto out_free;
 	}
@@ -1552,7 +1741,9 @@ static int add_dir_inode(const char *path_name, DIR *dir, ino_t inum, loff_t siz
 	st->st_size = size;
 	st->st_nlink = nlink;
 
-	if (dir) {
+	if (cur_entry) {
+		flags = cur_entry->flags;
+	} else if (dir) {
 		fd = dirfd(dir);
 		if (fd == -1)
 			return sys_errmsg("dirfd failed");
@@ -1590,6 +1781,10 @@ static int add_symlink_inode(const char *path_name, struct stat *st, ino_t inum,
 	char buf[UBIFS_MAX_INO_DATA + 2];
 	ssize_t len;
 
+	if (cur_entry && cur_entry->link)
+		return add_inode(st, inum, cur_entry->link, cur_entry->link_len,
+				 flags, path_name, fctx);
+
 	/* Take the symlink as is */
 	len = readlink(path_name, buf, UBIFS_MAX_INO_DATA + 1);
 	if (len <= 0)
@@ -1722,93 +1917,330 @@ static int all_zero(void *buf, int len)
 	return 1;
 }
 
+/**
+ * struct data_block - a file data block on its way to the output.
+ * @buf: raw block data read from the source file
+ * @dn: the data node made of @buf, large enough for the worst case
+ *      compression
+ * @key: key of the data node
+ * @block_no: block number in the file
+ * @len: amount of raw data in @buf
+ * @out_len: length of the (possibly compressed) data in @dn
+ */
+struct data_block {
+	void *buf;
+	struct ubifs_data_node *dn;
+	union ubifs_key key;
+	unsigned int block_no;
+	int len;
+	size_t out_len;
+};
+
+/**
+ * struct data_batch - a batch of data blocks of one file.
+ * @blks: the data blocks
+ * @cnt: count of data blocks in the batch
+ * @inum: target inode number of the file
+ * @use_compr: compressor to use for the file
+ */
+struct data_batch {
+	struct data_block *blks;
+	int cnt;
+	ino_t inum;
+	int use_compr;
+};
+
+/**
+ * make_data_node - compress a data block into its data node.
+ * @arg: the data batch
+ * @idx: index of the data block in the batch
+ *
+ * This function only touches the data block and the per-thread compressor
+ * state, so the blocks of a batch may be processed in parallel. The nodes are
+ * added to the file system afterwards in block order, which keeps the output
+ * identical no matter how many threads are used.
+ */
+static void make_data_node(void *arg, int idx)
+{
+	struct data_batch *batch = arg;
+	struct data_block *blk = &batch->blks[idx];
+	struct ubifs_data_node *dn = blk->dn;
+	int compr_type;
+
+	memset(dn, 0, UBIFS_DATA_NODE_SZ);
+	data_key_init(c, &blk->key, batch->inum, blk->block_no);
+	dn->ch.node_type = UBIFS_DATA_NODE;
+	key_write(c, &blk->key, &dn->key);
+	blk->out_len = NODE_BUFFER_SIZE - UBIFS_DATA_NODE_SZ;
+	compr_type = compr_cache_compress(blk->buf, blk->len, &dn->data,
+					  &blk->out_len, batch->use_compr);
+	dn->compr_type = cpu_to_le16(compr_type);
+	dn->size = cpu_to_le32(blk->len);
+}
+
+/**
+ * read_block - read the next data block of a file.
+ * @fd: file descriptor to read from
+ * @buf: buffer of %UBIFS_BLOCK_SIZE bytes to read to
+ * @eof: set to %1 when the end of file is reached
+ *
+ * Returns the count of bytes read or %-1 in case of failure.
+ */
+static ssize_t read_block(int fd, void *buf, int *eof)
+{
+	ssize_t ret, bytes_read = 0;
+
+	do {
+		ret = read(fd, buf + bytes_read, UBIFS_BLOCK_SIZE - bytes_read);
+		if (ret == -1)
+			return -1;
+		bytes_read += ret;
+	} while (ret != 0 && bytes_read != UBIFS_BLOCK_SIZE);
+	if (ret == 0)
+		*eof = 1;
+
+	return bytes_read;
+}
+
+/*
+ * Signatures of formats which are compressed already: gzip, bzip2, xz, zstd,
+ * lz4, zip, 7z, jpeg, png, and squashfs.
+ */
+static const struct {
+	const char *magic;
+	int len;
+} compressed_magics[] = {
+	{ "\x1f\x8b", 2 },
+	{ "BZh", 3 },
+	{ "\xfd" "7zXZ\0", 6 },
+	{ "\x28\xb5\x2f\xfd", 4 },
+	{ "\x04\x22\x4d\x18", 4 },
+	{ "PK\x03\x04", 4 },
+	{ "7z\xbc\xaf\x27\x1c", 6 },
+	{ "\xff\xd8\xff", 3 },
+	{ "\x89PNG\r\n\x1a\n", 8 },
+	{ "hsqs", 4 },
+};
+
+/* Compressors in the order of preference, i.e. decompression speed */
+static const int adaptive_comprs[] = {
+#ifdef WITH_LZO
+	UBIFS_COMPR_LZO,
+#endif
+#ifdef WITH_ZSTD
+	UBIFS_COMPR_ZSTD,
+#endif
+#ifdef WITH_ZLIB
+	UBIFS_COMPR_ZLIB,
+#endif
+};
+
+/**
+ * calc_entropy - estimate the entropy of data.
+ * @buf: the data
+ * @len: length of the data
+ *
+ * Returns the Shannon entropy of the byte distribution in bits per byte.
+ */
+static double calc_entropy(const unsigned char *buf, size_t len)
+{
+	unsigned int count[256] = { };
+	double entropy = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		count[buf[i]] += 1;
+	for (i = 0; i < 256; i++) {
+		double p = (double)count[i] / len;
+
+		if (count[i])
+			entropy -= p * log2(p);
+	}
+	return entropy;
+}
+
+/**
+ * choose_compr - pick the compressor for a file in adaptive mode.
+ * @fd: file descriptor of the file
+ * @path_name: source path name
+ * @st: source inode stat information
+ *
+ * This function samples the first %ADAPT_SAMPLE_BLOCKS blocks of the file and
+ * returns the compressor to use for it. Files which look compressed already
+ * are not compressed. For larger files, the sample is compressed with every
+ * available compressor and the first one in %adaptive_comprs whose result is
+ * at most @c->favor_percent percent worse than the best one is chosen.
+ */
+static int choose_compr(int fd, const char *path_name, struct stat *st)
+{
+	size_t sample_len = ADAPT_SAMPLE_BLOCKS * UBIFS_BLOCK_SIZE;
+	size_t lens[ARRAY_SIZE(adaptive_comprs) + 1];
+	size_t best, in_len, out_len, off;
+	unsigned char *sample;
+	void *out;
+	ssize_t ret;
+	int i, type = c->default_compr;
+
+	if (!ARRAY_SIZE(adaptive_comprs))
+		return UBIFS_COMPR_NONE;
+
+	sample = xmalloc(sample_len);
+	ret = pread(fd, sample, sample_len, 0);
+	if (ret <= 0) {
+		if (ret < 0)
+			sys_errmsg("failed to read file '%s'", path_name);
+		goto out;
+	}
+	in_len = ret;
+
+	for (i = 0; i < (int)ARRAY_SIZE(compressed_magics); i++) {
+		if (in_len >= (size_t)compressed_magics[i].len &&
+		    !memcmp(sample, compressed_magics[i].magic,
+			    compressed_magics[i].len)) {
+			type = UBIFS_COMPR_NONE;
+			goto out;
+		}
+	}
+
+	if (calc_entropy(sample, in_len) > ADAPT_MAX_ENTROPY) {
+		type = UBIFS_COMPR_NONE;
+		goto out;
+	}
+
+	/* Not worth trying all compressors for small files */
+	if (st->st_size < 2 * (off_t)sample_len)
+		goto out;
+
+	out = xmalloc(UBIFS_BLOCK_SIZE * WORST_COMPR_FACTOR);
+	best = in_len;
+	for (i = 0; i < (int)ARRAY_SIZE(adaptive_comprs); i++) {
+		lens[i] = 0;
+		for (off = 0; off < in_len; off += UBIFS_BLOCK_SIZE) {
+			size_t len = min_t(size_t, in_len - off,
+					   UBIFS_BLOCK_SIZE);
+
+			out_len = UBIFS_BLOCK_SIZE * WORST_COMPR_FACTOR;
+			compress_data(sample + off, len, out, &out_len,
+				      adaptive_comprs[i]);
+			lens[i] += out_len;
+		}
+		if (lens[i] < best)
+			best = lens[i];
+	}
+	free(out);
+
+	if (best * 100 > in_len * (100 - ADAPT_MIN_SAVING)) {
+		type = UBIFS_COMPR_NONE;
+		goto out;
+	}
+	for (i = 0; i < (int)ARRAY_SIZE(adaptive_comprs); i++) {
+		if (lens[i] * (100 - c->favor_percent) <= best * 100) {
+			type = adaptive_comprs[i];
+			break;
+		}
+	}
+
+out:
+	free(sample);
+	if (type == UBIFS_COMPR_NONE)
+		pr_debug("not compressing '%s'\n", path_name);
+	return type;
+}
+
 /**
  * add_file - write the data of a file and its inode to the output file.
  * @path_name: source path name
  * @st: source inode stat information
  * @inum: target inode number
  * @flags: source inode flags
+ *
+ * The file is processed in batches of up to @data_blocks_cnt blocks. Each
+ * batch is compressed by the compression thread pool, then the resulting data
+ * nodes are added one by one in block order.
  */
 static int add_file(const char *path_name, struct stat *st, ino_t inum,
 		    int flags, struct fscrypt_context *fctx)
 {
-	struct ubifs_data_node *dn = node_buf;
-	void *buf = block_buf;
+	struct data_batch batch;
 	loff_t file_size = 0;
 	ssize_t ret, bytes_read;
-	union ubifs_key key;
-	int fd, dn_len, err, compr_type, use_compr;
+	int fd, i, dn_len, err, eof = 0;
 	unsigned int block_no = 0;
 	size_t out_len;
 
+	batch.blks = data_blocks;
+	batch.inum = inum;
+	if (c->default_compr == UBIFS_COMPR_NONE &&
+	    !c->encrypted && (flags & FS_COMPR_FL))
+#ifdef WITH_LZO
+		batch.use_compr = UBIFS_COMPR_LZO;
+#elif defined(WITH_ZLIB)
+		batch.use_compr = UBIFS_COMPR_ZLIB;
+#else
+		batch.use_compr = UBIFS_COMPR_NONE;
+#endif
+	else
+		batch.use_compr = c->default_compr;
+
 	fd = open(path_name, O_RDONLY | O_LARGEFILE);
 	if (fd == -1)
 		return sys_errmsg("failed to open file '%s'", path_name);
-	do {
-		/* Read next block */
-		bytes_read = 0;
-		do {
-			ret = read(fd, buf + bytes_read,
-				   UBIFS_BLOCK_SIZE - bytes_read);
-			if (ret == -1) {
+	if (adaptive_compr) {
+		batch.use_compr = choose_compr(fd, path_name, st);
+		adaptive_files[batch.use_compr] += 1;
+	}
+	while (!eof) {
+		/* Read next batch of blocks */
+		batch.cnt = 0;
+		while (!eof && batch.cnt < data_blocks_cnt) {
+			struct data_block *blk = &data_blocks[batch.cnt];
+
+			bytes_read = read_block(fd, blk->buf, &eof);
+			if (bytes_read == -1) {
 				sys_errmsg("failed to read file '%s'",
 					    path_name);
 				close(fd);
 				return 1;
 			}
-			bytes_read += ret;
-		} while (ret != 0 && bytes_read != UBIFS_BLOCK_SIZE);
-		if (bytes_read == 0)
-			break;
-		file_size += bytes_read;
-		/* Skip holes */
-		if (all_zero(buf, bytes_read)) {
-			block_no += 1;
-			continue;
+			if (bytes_read == 0)
+				break;
+			file_size += bytes_read;
+			/* Skip holes */
+			if (all_zero(blk->buf, bytes_read)) {
+				block_no += 1;
+				continue;
+			}
+			blk->block_no = block_no++;
+			blk->len = bytes_read;
+			batch.cnt += 1;
 		}
-		/* Make data node */
-		memset(dn, 0, UBIFS_DATA_NODE_SZ);
-		data_key_init(c, &key, inum, block_no);
-		dn->ch.node_type = UBIFS_DATA_NODE;
-		key_write(c, &key, &dn->key);
-		out_len = NODE_BUFFER_SIZE - UBIFS_DATA_NODE_SZ;
-		if (c->default_compr == UBIFS_COMPR_NONE &&
-		    !c->encrypted && (flags & FS_COMPR_FL))
-#ifdef WITH_LZO
-			use_compr = UBIFS_COMPR_LZO;
-#elif defined(WITH_ZLIB)
-			use_compr = UBIFS_COMPR_ZLIB;
-#else
-			use_compr = UBIFS_COMPR_NONE;
-#endif
-		else
-			use_compr = c->default_compr;
-		compr_type = compress_data(buf, bytes_read, &dn->data,
-					   &out_len, use_compr);
-		dn->compr_type = cpu_to_le16(compr_type);
-		dn->size = cpu_to_le32(bytes_read);
 
-		if (!fctx) {
-			dn->compr_size = 0;
-		} else {
-			ret = encrypt_data_node(fctx, block_no, dn, out_len);
-			if (ret < 0) {
-				close(fd);
-				return ret;
+		/* Make data nodes */
+		thread_pool_run(compr_pool, make_data_node, &batch, batch.cnt);
+
+		for (i = 0; i < batch.cnt; i++) {
+			struct data_block *blk = &data_blocks[i];
+
+			out_len = blk->out_len;
+			if (fctx) {
+				ret = encrypt_data_node(fctx, blk->block_no,
+							blk->dn, out_len);
+				if (ret < 0) {
+					close(fd);
+					return ret;
+				}
+				out_len = ret;
 			}
-			out_len = ret;
-		}
 
-		dn_len = UBIFS_DATA_NODE_SZ + out_len;
-		/* Add data node to file system */
-		err = add_node(&key, NULL, 0, dn, dn_len);
-		if (err) {
-			close(fd);
-			return err;
+			dn_len = UBIFS_DATA_NODE_SZ + out_len;
+			/* Add data node to file system */
+			err = add_node(&blk->key, NULL, 0, blk->dn, dn_len);
+			if (err) {
+				close(fd);
+				return err;
+			}
 		}
-
-		block_no++;
-	} while (ret != 0);
+	}
 
 	if (close(fd) == -1)
 		return sys_errmsg("failed to close file '%s'", path_name);
@@ -1836,7 +2268,11 @@ static int add_non_dir(const char *path_name, ino_t *inum, unsigned int nlink,
 
 	pr_debug("%s\n", path_name);
 
-	if (S_ISREG(st->st_mode)) {
+	if (S_ISREG(st->st_mode) && cur_entry &&
+	    S_ISREG(cur_entry->st.mode)) {
+		flags = cur_entry->flags;
+		*type = UBIFS_ITYPE_REG;
+	} else if (S_ISREG(st->st_mode)) {
 		fd = open(path_name, O_RDONLY);
 		if (fd == -1)
 			return sys_errmsg("failed to open file '%s'",
@@ -1879,6 +2315,7 @@ static int add_non_dir(const char *path_name, ino_t *inum, unsigned int nlink,
 			im->use_nlink = 1;
 			im->path_name = xmalloc(strlen(path_name) + 1);
 			strcpy(im->path_name, path_name);
+			im->entry = cur_entry;
 		} else {
 			/* Existing entry */
 			*inum = im->use_inum;
@@ -1918,13 +2355,20 @@ static int add_non_dir(const char *path_name, ino_t *inum, unsigned int nlink,
  * @existing: zero if this function is called for a directory which
  *            does not exist on the host file-system and it is being
  *            created because it is defined in the device table file.
+ * @he: metadata of the directory read ahead, %NULL if there is none
+ *
+ * If the directory was listed ahead, its entries are taken from @he in the
+ * order 'readdir()' returned them, and the system calls are only made for the
+ * entries which could not be read ahead.
  */
 static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
-			 int existing, struct fscrypt_context *fctx)
+			 int existing, struct fscrypt_context *fctx,
+			 struct host_entry *he)
 {
 	struct dirent *entry;
 	DIR *dir = NULL;
-	int kname_len, err = 0;
+	int kname_len, err = 0, i;
+	const char *d_name;
 	loff_t size = UBIFS_INO_NODE_SZ;
 	char *name = NULL;
 	unsigned int nlink = 2;
@@ -1936,7 +2380,9 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 	unsigned long long dir_creat_sqnum = ++c->max_sqnum;
 
 	pr_debug("%s\n", dir_name);
-	if (existing) {
+	if (he && !he->listed)
+		he = NULL;
+	if (existing && !he) {
 		dir = opendir(dir_name);
 		if (dir == NULL)
 			return sys_errmsg("cannot open directory '%s'",
@@ -1954,22 +2400,32 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 	 * Before adding the directory itself, we have to iterate over all the
 	 * entries the device table adds to this directory and create them.
 	 */
-	for (; existing;) {
+	for (i = 0; existing; i++) {
 		struct stat dent_st;
 		struct fscrypt_context *new_fctx = NULL;
+		struct host_entry *child = NULL;
 
-		errno = 0;
-		entry = readdir(dir);
-		if (!entry) {
-			if (errno == 0)
+		if (he) {
+			if (i == he->nr_children)
 				break;
-			sys_errmsg("error reading directory '%s'", dir_name);
-			goto out_free;
+			child = &he->children[i];
+			d_name = child->name;
+		} else {
+			errno = 0;
+			entry = readdir(dir);
+			if (!entry) {
+				if (errno == 0)
+					break;
+				sys_errmsg("error reading directory '%s'",
+					   dir_name);
+				goto out_free;
+			}
+			d_name = entry->d_name;
 		}
 
-		if (strcmp(".", entry->d_name) == 0)
+		if (strcmp(".", d_name) == 0)
 			continue;
-		if (strcmp("..", entry->d_name) == 0)
+		if (strcmp("..", d_name) == 0)
 			continue;
 
 		if (ph_elt)
@@ -1978,7 +2434,7 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 			 * file. Check if this directory entry is referred at
 			 * too.
 			 */
-			nh_elt = devtbl_find_name(ph_elt, entry->d_name);
+			nh_elt = devtbl_find_name(ph_elt, d_name);
 
 		/*
 		 * We are going to create the file corresponding to this
@@ -1988,8 +2444,10 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 		 * for this file from the UBIFS rootfs on the host.
 		 */
 		free(name);
-		name = make_path(dir_name, entry->d_name);
-		if (lstat(name, &dent_st) == -1) {
+		name = make_path(dir_name, d_name);
+		if (child && child->valid) {
+			host_entry_stat(child, &dent_st);
+		} else if (lstat(name, &dent_st) == -1) {
 			sys_errmsg("lstat failed for file '%s'", name);
 			goto out_free;
 		}
@@ -2015,7 +2473,8 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 			new_fctx = inherit_fscrypt_context(fctx);
 
 		if (S_ISDIR(dent_st.st_mode)) {
-			err = add_directory(name, inum, &dent_st, 1, new_fctx);
+			err = add_directory(name, inum, &dent_st, 1, new_fctx,
+					    child);
 			if (err) {
 				free_fscrypt_context(new_fctx);
 				goto out_free;
@@ -2023,8 +2482,10 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 			nlink += 1;
 			type = UBIFS_ITYPE_DIR;
 		} else {
+			cur_entry = child && child->valid ? child : NULL;
 			err = add_non_dir(name, &inum, 0, &type,
 					  &dent_st, new_fctx);
+			cur_entry = NULL;
 			if (err) {
 				free_fscrypt_context(new_fctx);
 				goto out_free;
@@ -2037,7 +2498,7 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 			goto out_free;
 		}
 
-		err = add_dent_node(dir_inum, entry->d_name, inum, type, fctx,
+		err = add_dent_node(dir_inum, d_name, inum, type, fctx,
 				    &kname_len);
 		if (err) {
 			free_fscrypt_context(new_fctx);
@@ -2086,7 +2547,8 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 		new_fctx = inherit_fscrypt_context(fctx);
 
 		if (S_ISDIR(nh_elt->mode)) {
-			err = add_directory(name, inum, &fake_st, 0, new_fctx);
+			err = add_directory(name, inum, &fake_st, 0, new_fctx,
+					    NULL);
 			if (err) {
 				free_fscrypt_context(new_fctx);
 				goto out_free;
@@ -2124,13 +2586,15 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 
 	creat_sqnum = dir_creat_sqnum;
 
-	err = add_dir_inode(dir ? dir_name : NULL, dir, dir_inum, size,
+	cur_entry = he && he->valid ? he : NULL;
+	err = add_dir_inode(existing ? dir_name : NULL, dir, dir_inum, size,
 			    nlink, st, fctx);
+	cur_entry = NULL;
 	if (err)
 		goto out_free;
 
 	free(name);
-	if (existing && closedir(dir) == -1)
+	if (dir && closedir(dir) == -1)
 		return sys_errmsg("error closing directory '%s'", dir_name);
 
 	return 0;
@@ -2138,7 +2602,7 @@ static int add_directory(const char *dir_name, ino_t dir_inum, struct stat *st,
 out_free:
 	free(itr);
 	free(name);
-	if (existing)
+	if (dir)
 		closedir(dir);
 	return -1;
 }
@@ -2156,8 +2620,10 @@ static int add_multi_linked_files(void)
 
 		for (im = hash_table[i]; im; im = im->next) {
 			pr_debug("%s\n", im->path_name);
+			cur_entry = im->entry;
 			err = add_non_dir(im->path_name, &im->use_inum,
 					  im->use_nlink, &type, &im->st, NULL);
+			cur_entry = NULL;
 			if (err)
 				return err;
 		}
@@ -2171,6 +2637,7 @@ static int add_multi_linked_files(void)
 static int write_data(void)
 {
 	int err;
+	struct host_entry *tree = NULL;
 	mode_t mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
 	struct path_htbl_element *ph_elt;
 	struct name_htbl_element *nh_elt;
@@ -2205,10 +2672,14 @@ static int write_data(void)
 	if (err)
 		return err;
 
-	err = add_directory(root, UBIFS_ROOT_INO, &root_st, !!root, root_fctx);
-	if (err)
-		return err;
-	err = add_multi_linked_files();
+	if (root && jobs > 1)
+		tree = host_tree_read(root, compr_pool);
+
+	err = add_directory(root, UBIFS_ROOT_INO, &root_st, !!root, root_fctx,
+			    tree);
+	if (!err)
+		err = add_multi_linked_files();
+	host_tree_free(tree);
 	if (err)
 		return err;
 	return flush_nodes();
@@ -2226,16 +2697,85 @@ static int namecmp(const struct idx_entry *e1, const struct idx_entry *e2)
 	return (len1 < len2) ? -1 : 1;
 }
 
-static int cmp_idx(const void *a, const void *b)
+/**
+ * sort_index - sort the index entries.
+ *
+ * This function returns an array of @idx_cnt sort records ordered the same
+ * way as 'keys_cmp()' and then 'namecmp()' order the index entries. The
+ * 64-bit keys are sorted by a least significant digit radix sort, skipping
+ * the digits which are the same for all keys, then the runs of colliding keys
+ * are sorted by name.
+ */
+static struct idx_sort_entry *sort_index(void)
 {
-	const struct idx_entry *e1 = *(const struct idx_entry **)a;
-	const struct idx_entry *e2 = *(const struct idx_entry **)b;
-	int cmp;
+	struct idx_sort_entry *a, *b, *tmp;
+	size_t i, j, run, *count;
+	uint64_t diff = 0;
+	int shift;
+
+	if (idx_cnt > SIZE_MAX / sizeof(struct idx_sort_entry)) {
+		errmsg("index is too big (%zu entries)", idx_cnt);
+		return NULL;
+	}
 
-	cmp = keys_cmp(c, &e1->key, &e2->key);
-	if (cmp)
-		return cmp;
-	return namecmp(e1, e2);
+	a = xmalloc(idx_cnt * sizeof(struct idx_sort_entry));
+	b = xmalloc(idx_cnt * sizeof(struct idx_sort_entry));
+	count = xmalloc(0x10000 * sizeof(size_t));
+	idx_mem += 2 * idx_cnt * sizeof(struct idx_sort_entry);
+
+	for (i = 0; i < idx_cnt; i++) {
+		const struct idx_entry *e = idx_entry_at(i);
+
+		a[i].key = (uint64_t)e->key.u32[0] << 32 | e->key.u32[1];
+		a[i].pos = i;
+		diff |= a[i].key ^ a[0].key;
+	}
+
+	for (shift = 0; shift < 64; shift += 16) {
+		size_t sum = 0;
+
+		if (!((diff >> shift) & 0xFFFF))
+			continue;
+
+		memset(count, 0, 0x10000 * sizeof(size_t));
+		for (i = 0; i < idx_cnt; i++)
+			count[(a[i].key >> shift) & 0xFFFF] += 1;
+		for (i = 0; i < 0x10000; i++) {
+			size_t n = count[i];
+
+			count[i] = sum;
+			sum += n;
+		}
+		for (i = 0; i < idx_cnt; i++)
+			b[count[(a[i].key >> shift) & 0xFFFF]++] = a[i];
+
+		tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	/* Sort colliding keys by name, there are very few of them */
+	for (i = 0; i < idx_cnt; i = run) {
+		for (run = i + 1; run < idx_cnt; run++)
+			if (a[run].key != a[i].key)
+				break;
+
+		for (j = i + 1; j < run; j++) {
+			struct idx_sort_entry se = a[j];
+			size_t k = j;
+
+			while (k > i && namecmp(idx_entry_at(a[k - 1].pos),
+						idx_entry_at(se.pos)) > 0) {
+				a[k] = a[k - 1];
+				k -= 1;
+			}
+			a[k] = se;
+		}
+	}
+
+	free(count);
+	free(b);
+	return a;
 }
 
 /**
@@ -2276,13 +2816,15 @@ static int add_idx_node(void *node, int child_cnt)
  */
 static int write_index(void)
 {
-	size_t sz, i, cnt, idx_sz, pstep, bcnt;
-	struct idx_entry **idx_ptr, **p;
+	size_t i, cnt, idx_sz, pstep, bcnt, p;
+	struct idx_sort_entry *idx_sorted;
 	struct ubifs_idx_node *idx;
 	struct ubifs_branch *br;
 	int child_cnt = 0, j, level, blnum, boffs, blen, blast_len, err;
 	uint8_t *hashes;
+	struct timespec start, end;
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	pr_debug("leaf node count: %zd\n", idx_cnt);
 
 	/* Reset the head for the index */
@@ -2290,17 +2832,12 @@ static int write_index(void)
 	/* Allocate index node */
 	idx_sz = ubifs_idx_node_sz(c, c->fanout);
 	idx = xmalloc(idx_sz);
-	/* Make an array of pointers to sort the index list */
-	sz = idx_cnt * sizeof(struct idx_entry *);
-	if (sz / sizeof(struct idx_entry *) != idx_cnt) {
+	/* Sort the index array */
+	idx_sorted = sort_index();
+	if (!idx_sorted) {
 		free(idx);
-		return errmsg("index is too big (%zu entries)", idx_cnt);
+		return -1;
 	}
-	idx_ptr = xmalloc(sz);
-	idx_ptr[0] = idx_list_first;
-	for (i = 1; i < idx_cnt; i++)
-		idx_ptr[i] = idx_ptr[i - 1]->next;
-	qsort(idx_ptr, idx_cnt, sizeof(struct idx_entry *), cmp_idx);
 	/* Write level 0 index nodes */
 	cnt = idx_cnt / c->fanout;
 	if (idx_cnt % c->fanout)
@@ -2308,7 +2845,7 @@ static int write_index(void)
 
 	hashes = xmalloc(c->hash_len * cnt);
 
-	p = idx_ptr;
+	p = 0;
 	blnum = head_lnum;
 	boffs = head_offs;
 	for (i = 0; i < cnt; i++) {
@@ -2327,12 +2864,14 @@ static int write_index(void)
 		idx->child_cnt = cpu_to_le16(child_cnt);
 		idx->level = cpu_to_le16(0);
 		for (j = 0; j < child_cnt; j++, p++) {
+			const struct idx_entry *e = idx_entry_at(idx_sorted[p].pos);
+
 			br = ubifs_idx_branch(c, idx, j);
-			key_write_idx(c, &(*p)->key, &br->key);
-			br->lnum = cpu_to_le32((*p)->lnum);
-			br->offs = cpu_to_le32((*p)->offs);
-			br->len = cpu_to_le32((*p)->len);
-			memcpy(ubifs_branch_hash(c, br), (*p)->hash, c->hash_len);
+			key_write_idx(c, &e->key, &br->key);
+			br->lnum = cpu_to_le32(e->lnum);
+			br->offs = cpu_to_le32(e->offs);
+			br->len = cpu_to_le32(e->len);
+			memcpy(ubifs_branch_hash(c, br), e->hash, c->hash_len);
 		}
 		add_idx_node(idx, child_cnt);
 
@@ -2359,7 +2898,7 @@ static int write_index(void)
 		 * child. Thus we can get the key by stepping along the bottom
 		 * level 'p' with an increasing large step 'pstep'.
 		 */
-		p = idx_ptr;
+		p = 0;
 		pstep *= c->fanout;
 		for (i = 0; i < cnt; i++) {
 			/*
@@ -2403,7 +2942,9 @@ static int write_index(void)
 				 * of the index node from the level below.
 				 */
 				br = ubifs_idx_branch(c, idx, j);
-				key_write_idx(c, &(*p)->key, &br->key);
+				key_write_idx(c,
+					&idx_entry_at(idx_sorted[p].pos)->key,
+					&br->key);
 				br->lnum = cpu_to_le32(blnum);
 				br->offs = cpu_to_le32(boffs);
 				br->len = cpu_to_le32(blen);
@@ -2425,12 +2966,22 @@ static int write_index(void)
 
 	memcpy(c->root_idx_hash, hashes, c->hash_len);
 
-	/* Free stuff */
-	for (i = 0; i < idx_cnt; i++) {
-		free(idx_ptr[i]->name);
-		free(idx_ptr[i]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (verbose) {
+		struct rusage ru;
+
+		getrusage(RUSAGE_SELF, &ru);
+		printf("\tidx entries:  %zu\n", idx_cnt);
+		printf("\tidx memory:   %zu KiB\n", idx_mem >> 10);
+		printf("\tidx time:     %.3f s\n",
+		       (end.tv_sec - start.tv_sec) +
+		       (end.tv_nsec - start.tv_nsec) / 1e9);
+		printf("\tpeak RSS:     %ld KiB\n", ru.ru_maxrss);
 	}
-	free(idx_ptr);
+
+	/* Free stuff */
+	free(idx_sorted);
+	free_index();
 	free(idx);
 
 	pr_debug("zroot is at %d:%d len %d\n", c->zroot.lnum, c->zroot.offs,
@@ -2710,7 +3261,7 @@ static int write_orphan_area(void)
  */
 static int init(void)
 {
-	int err, main_lebs, big_lpt = 0, sz;
+	int err, main_lebs, big_lpt = 0, sz, i;
 
 	c->highest_inum = UBIFS_FIRST_INO;
 
@@ -2739,7 +3290,6 @@ static int init(void)
 
 	leb_buf = xmalloc(c->leb_size);
 	node_buf = xmalloc(NODE_BUFFER_SIZE);
-	block_buf = xmalloc(UBIFS_BLOCK_SIZE);
 
 	sz = sizeof(struct inum_mapping *) * HASH_TABLE_SIZE;
 	hash_table = xzalloc(sz);
@@ -2748,6 +3298,27 @@ static int init(void)
 	if (err)
 		return err;
 
+	if (compr_cache_path) {
+		err = compr_cache_open(compr_cache_path);
+		if (err)
+			return err;
+	}
+
+	data_blocks_cnt = jobs > 1 ? jobs * DATA_BLOCKS_PER_JOB : 1;
+	data_blocks = xcalloc(data_blocks_cnt, sizeof(struct data_block));
+	for (i = 0; i < data_blocks_cnt; i++) {
+		data_blocks[i].buf = xmalloc(UBIFS_BLOCK_SIZE);
+		data_blocks[i].dn = xmalloc(NODE_BUFFER_SIZE);
+	}
+
+	if (jobs > 1) {
+		compr_pool = thread_pool_create(jobs - 1,
+						init_compression_thread,
+						destroy_compression_thread);
+		if (!compr_pool)
+			return errmsg("cannot start compression threads");
+	}
+
 #ifdef WITH_SELINUX
 	if (context) {
 		struct selinux_opt seopts[] = {
@@ -2784,6 +3355,7 @@ static void destroy_hash_table(void)
  */
 static void deinit(void)
 {
+	int i;
 
 #ifdef WITH_SELINUX
 	if (sehnd)
@@ -2793,9 +3365,27 @@ static void deinit(void)
 	free(c->lpt);
 	free(leb_buf);
 	free(node_buf);
-	free(block_buf);
+	free_index();
 	destroy_hash_table();
 	free(hash_table);
+	thread_pool_destroy(compr_pool);
+	if (verbose && adaptive_compr)
+		printf("\tadaptive:     %llu none, %llu lzo, %llu zlib, %llu zstd files\n",
+		       adaptive_files[UBIFS_COMPR_NONE],
+		       adaptive_files[UBIFS_COMPR_LZO],
+		       adaptive_files[UBIFS_COMPR_ZLIB],
+		       adaptive_files[UBIFS_COMPR_ZSTD]);
+	if (verbose)
+		compr_cache_print_stats();
+	compr_cache_close();
+	free(compr_cache_path);
+	if (data_blocks) {
+		for (i = 0; i < data_blocks_cnt; i++) {
+			free(data_blocks[i].buf);
+			free(data_blocks[i].dn);
+		}
+		free(data_blocks);
+	}
 	destroy_compression();
 	free_devtable_info();
 	ubifs_exit_authentication(c);